@@ -7,10 +7,12 @@
 #include <set>
 #include <string>
 #include <utility>
+#include <vector>
 #include <cassert>
 #include <csignal>
 #include <cstdlib>
 #include <getopt.h>
+#include <mapidefs.h>
 #include <mapitags.h>
 #include <kopano/ECConfig.h>
 #include <kopano/ECLogger.h>
@@ -64,6 +66,7 @@ class da_exec final : private ECThreadPool {
 	ECRESULT DoSelect(const std::string &q, DB_RESULT *r) { return m_db.DoSelect(q, r); }
 	ECRESULT DoUpdate(const std::string &q, unsigned int *a = nullptr) { return m_db.DoUpdate(q, a); }
 	ECRESULT DoDelete(const std::string &q, unsigned int *a = nullptr) { return m_db.DoDelete(q, a); }
+	kd_trans Begin(ECRESULT &r) { return m_db.Begin(r); }
 
 	private:
 	std::atomic<ECRESULT> m_retcode{erSuccess};
@@ -558,6 +561,117 @@ static ECRESULT kc_2888(fancydb db)
 	return erSuccess;
 }
 
+/*
+ * Recompute a store size the way kopano-server maintains it: the sum of
+ * PR_MESSAGE_SIZE over all messages directly in a folder of the store
+ * which are not soft-deleted. The folder tree is walked one level at a
+ * time, leaving out soft-deleted folders.
+ */
+static ECRESULT store_size_sum(fancydb db, unsigned int store_id, long long &actual)
+{
+	DB_RESULT result;
+	auto parents = stringify(store_id);
+	actual = 0;
+	while (!parents.empty()) {
+		/* Contents of soft-deleted folders do not count either */
+		auto ret = db->DoSelect("SELECT id FROM hierarchy WHERE parent IN (" + parents +
+		           ") AND type=" + stringify(MAPI_FOLDER) +
+		           " AND (flags&" + stringify(MSGFLAG_DELETED) + ")=0", &result);
+		if (ret != erSuccess)
+			return ret;
+		parents.clear();
+		while (auto row = result.fetch_row()) {
+			if (row[0] == nullptr)
+				continue;
+			if (!parents.empty())
+				parents += ",";
+			parents += row[0];
+		}
+		if (parents.empty())
+			break;
+		ret = db->DoSelect("SELECT SUM(p.val_ulong) FROM hierarchy AS h "
+		      "JOIN properties AS p ON p.hierarchyid=h.id"
+		      " AND p.tag=" + stringify(PROP_ID(PR_MESSAGE_SIZE)) +
+		      " AND p.type=" + stringify(PROP_TYPE(PR_MESSAGE_SIZE)) +
+		      " WHERE h.parent IN (" + parents + ") AND h.type=" + stringify(MAPI_MESSAGE) +
+		      " AND (h.flags&" + stringify(MSGFLAG_DELETED) + ")=0", &result);
+		if (ret != erSuccess)
+			return ret;
+		auto row = result.fetch_row();
+		if (row != nullptr && row[0] != nullptr)
+			actual += strtoll(row[0], nullptr, 0);
+	}
+	return erSuccess;
+}
+
+/*
+ * The server applies size changes as increments to the store's
+ * PR_MESSAGE_SIZE_EXTENDED row, in the same transaction as the change
+ * itself. For repair, each store is recomputed in a transaction that
+ * first locks that row: changes committed before are in the sum, and
+ * changes still in progress wait for the lock and then add onto the
+ * rewritten value.
+ */
+static ECRESULT store_size(fancydb db, bool repair)
+{
+	DB_RESULT result;
+	auto ret = db->DoSelect("SELECT hierarchy_id, user_name FROM stores", &result);
+	if (ret != erSuccess)
+		return ret;
+	std::vector<std::pair<unsigned int, std::string>> stores;
+	while (auto row = result.fetch_row()) {
+		if (row[0] == nullptr)
+			continue;
+		stores.emplace_back(strtoul(row[0], nullptr, 0), row[1] != nullptr ? row[1] : "");
+	}
+
+	unsigned int n_wrong = 0;
+	for (size_t i = 0; i < stores.size() && !adm_quit; ++i) {
+		auto store_id = stores[i].first;
+		kd_trans dtx;
+		if (repair) {
+			dtx = db->Begin(ret);
+			if (ret != erSuccess)
+				return ret;
+		}
+		ret = db->DoSelect("SELECT val_longint FROM properties WHERE hierarchyid=" +
+		      stringify(store_id) + " AND tag=" + stringify(PROP_ID(PR_MESSAGE_SIZE_EXTENDED)) +
+		      " AND type=" + stringify(PROP_TYPE(PR_MESSAGE_SIZE_EXTENDED)) +
+		      (repair ? " FOR UPDATE" : ""), &result);
+		if (ret != erSuccess)
+			return ret;
+		auto row = result.fetch_row();
+		std::string recorded = row != nullptr && row[0] != nullptr ? row[0] : "";
+		long long actual = 0;
+		ret = store_size_sum(db, store_id, actual);
+		if (ret != erSuccess)
+			return ret;
+		if (!recorded.empty() && strtoll(recorded.c_str(), nullptr, 0) == actual)
+			continue;
+		++n_wrong;
+		ec_log_notice("store-size: store %u (%s): recorded %s, actual %lld",
+			store_id, stores[i].second.c_str(),
+			recorded.empty() ? "none" : recorded.c_str(), actual);
+		if (!repair)
+			continue;
+		ret = db->DoUpdate("REPLACE INTO properties (hierarchyid, tag, type, val_longint) VALUES (" +
+		      stringify(store_id) + "," + stringify(PROP_ID(PR_MESSAGE_SIZE_EXTENDED)) + "," +
+		      stringify(PROP_TYPE(PR_MESSAGE_SIZE_EXTENDED)) + "," + stringify_int64(actual) + ")");
+		if (ret != erSuccess)
+			return ret;
+		ret = dtx.commit();
+		if (ret != erSuccess)
+			return ret;
+	}
+	if (adm_quit) {
+		ec_log_notice("store-size: stopped (safely) after user request to exit.");
+		return erSuccess;
+	}
+	ec_log_notice("store-size: %zu stores checked, %u %s.", stores.size(),
+		n_wrong, repair ? "repaired" : "with a wrong size");
+	return erSuccess;
+}
+
 static ECRESULT usmp_shrink_columns(fancydb db)
 {
 	unsigned int aff = 0;
@@ -784,6 +898,10 @@ int main(int argc, char **argv) try
 			ret = usmp(db);
 		else if (strcmp(argv[i], "populate") == 0)
 			ret = db_populate(cfg);
+		else if (strcmp(argv[i], "store-size-check") == 0)
+			ret = store_size(db, false);
+		else if (strcmp(argv[i], "store-size-repair") == 0)
+			ret = store_size(db, true);
 		if (ret == KCERR_NOT_FOUND) {
 			ec_log_err("dbadm: unknown action \"%s\"", argv[i]);
 			return EXIT_FAILURE;
@@ -3,6 +3,7 @@
  * Copyright 2005 - 2016 Zarafa and its licensors
  */
 #include <kopano/platform.h>
+#include <algorithm>
 #include <cerrno>
 #include <cstring>
 #include <iterator>
@@ -41,6 +42,28 @@ using namespace std::string_literals;
 
 #define QUOTA_CONFIG_MSG "Kopano.Quota"
 
+/**
+ * Sends the quota mail for one over-quota user. Queued on the monitor's
+ * thread pool, so that slow stores and mail delivery do not hold up the
+ * scan of the remaining users.
+ */
+class quota_notify_task final : public ECWaitableTask {
+	public:
+	quota_notify_task(ECQuotaMonitor *mon, ECUSER *user, ECCOMPANY *company,
+	    const ECQUOTASTATUS &status) :
+		m_mon(mon), m_user(user), m_company(company), m_status(status)
+	{}
+
+	protected:
+	void run() override { m_mon->NotifyUser(m_user, m_company, m_status); }
+
+	private:
+	ECQuotaMonitor *m_mon;
+	ECUSER *m_user;
+	ECCOMPANY *m_company;
+	ECQUOTASTATUS m_status;
+};
+
 /**
  * Takes an extra reference to the passed MAPI objects which have refcounting.
  */
@@ -49,6 +72,8 @@ ECQuotaMonitor::ECQuotaMonitor(ECTHREADMONITOR *lpThreadMonitor,
 	m_lpThreadMonitor(lpThreadMonitor),
 	m_lpMAPIAdminSession(lpMAPIAdminSession), m_lpMDBAdmin(lpMDBAdmin)
 {
+	auto threads = atoui(lpThreadMonitor->lpConfig->GetSetting("quota_threads"));
+	m_pool.reset(new ECThreadPool("quota", std::max(threads, 1U)));
 }
 
 /** Creates ECQuotaMonitor object and calls
@@ -93,13 +118,13 @@ void* ECQuotaMonitor::Create(void* lpVoid)
 	if(hr != hrSuccess)
 		kc_perror("Quota monitor failed", hr);
 	else
-		ec_log_info("Quota monitor done in %lu seconds. Processed: %u, Failed: %u", tmEnd - tmStart, lpecQuotaMonitor->m_ulProcessed, lpecQuotaMonitor->m_ulFailed);
+		ec_log_info("Quota monitor done in %lu seconds. Processed: %u, Failed: %u", tmEnd - tmStart, lpecQuotaMonitor->m_ulProcessed.load(), lpecQuotaMonitor->m_ulFailed.load());
 	return NULL;
 }
 
 /** Gets a list of companies and checks the quota. Then it calls
- * ECQuotaMonitor::CheckCompanyQuota() to check quota of the users
- * in the company. If the server is not running in hosted mode,
+ * ECQuotaMonitor::CheckUserQuota() to check quota of the users
+ * in all companies. If the server is not running in hosted mode,
  * the default company 0 will be used.
  *
  * @return hrSuccess or any MAPI error code.
@@ -152,19 +177,19 @@ HRESULT ECQuotaMonitor::CheckQuota()
 				hr_lerr(hr, "Unable to get quota information for company \"%s\"",
 					reinterpret_cast<const char *>(lpsCompanyList[i].lpszCompanyname));
 				++m_ulFailed;
-				goto check_stores;
+				continue;
 			}
 			hr = OpenUserStore(lpsCompanyList[i].lpszCompanyname, CONTAINER_COMPANY, &~lpMsgStore);
 			if (hr != hrSuccess) {
 				++m_ulFailed;
-				goto check_stores;
+				continue;
 			}
 			hr = Util::HrGetQuotaStatus(lpMsgStore, lpsQuota, &~lpsQuotaStatus);
 			if (hr != hrSuccess) {
 				hr_lerr(hr, "Unable to get quotastatus for company \"%s\"",
 					reinterpret_cast<const char *>(lpsCompanyList[i].lpszCompanyname));
 				++m_ulFailed;
-				goto check_stores;
+				continue;
 			}
 
 			if (lpsQuotaStatus->quotaStatus != QUOTA_OK) {
@@ -173,34 +198,31 @@ HRESULT ECQuotaMonitor::CheckQuota()
 				Notify(NULL, &lpsCompanyList[i], lpsQuotaStatus, lpMsgStore);
 			}
 		}
-
-check_stores:
-		/* Whatever the status of the company quota, we should also check the quota of the users */
-		CheckCompanyQuota(&lpsCompanyList[i]);
 	}
-	return hrSuccess;
+	/* Whatever the status of the company quota, we should also check the quota of the users */
+	return CheckUserQuota(cCompanies, lpsCompanyList);
 }
 
-/** Uses the ECServiceAdmin to get a list of all users within a
- * given company and groups those per kopano-server instance. Per
+/** Uses the ECServiceAdmin to get a list of all users within the
+ * given companies and groups those per kopano-server instance. Per
  * server it calls ECQuotaMonitor::CheckServerQuota().
  *
- * @param[in] company lpecCompany ECCompany struct
+ * @param[in]	cCompanies	number of companies in lpCompanies
+ * @param[in]	lpCompanies	companies whose users are to be checked
  * @return hrSuccess or any MAPI error code.
  */
-HRESULT ECQuotaMonitor::CheckCompanyQuota(ECCOMPANY *lpecCompany)
+HRESULT ECQuotaMonitor::CheckUserQuota(ULONG cCompanies, ECCOMPANY *lpCompanies)
 {
 	/* Service object */
 	object_ptr<IECServiceAdmin> lpServiceAdmin;
 	memory_ptr<SPropValue> lpsObject;
-	/* Userlist */
-	memory_ptr<ECUSER> lpsUserList;
-	ULONG				cUsers = 0;
+	/* Userlists, one per company, referenced by users */
+	std::vector<memory_ptr<ECUSER>> vUserLists;
+	user_map users;
 	std::set<std::string> setServers;
 	std::set<std::string, strcasecmp_comparison> setServersConfig;
 	memory_ptr<char> lpszConnection;
 	bool bIsPeer = false;
-	ec_log_info("Checking quota for company \"%s\"", reinterpret_cast<const char *>(lpecCompany->lpszCompanyname));
 
 	/* Obtain Service object */
 	auto hr = HrGetOneProp(m_lpMDBAdmin, PR_EC_OBJECT, &~lpsObject);
@@ -209,18 +231,32 @@ HRESULT ECQuotaMonitor::CheckCompanyQuota(ECCOMPANY *lpecCompany)
 	hr = reinterpret_cast<IUnknown *>(lpsObject->Value.lpszA)->QueryInterface(IID_IECServiceAdmin, &~lpServiceAdmin);
 	if (hr != hrSuccess)
 		return kc_perror("Unable to get service admin", hr);
-	/* Get userlist */
-	hr = lpServiceAdmin->GetUserList(lpecCompany->sCompanyId.cb, (LPENTRYID)lpecCompany->sCompanyId.lpb, 0, &cUsers, &~lpsUserList);
-	if (hr != hrSuccess)
-		return hr_lerr(hr, "Unable to get userlist for company \"%s\"",
-		       reinterpret_cast<const char *>(lpecCompany->lpszCompanyname));
-	for (ULONG i = 0; i < cUsers; ++i)
-		if (lpsUserList[i].lpszServername && lpsUserList[i].lpszServername[0] != '\0')
-			setServers.emplace(reinterpret_cast<const char *>(lpsUserList[i].lpszServername));
+
+	for (ULONG c = 0; c < cCompanies; ++c) {
+		auto lpecCompany = &lpCompanies[c];
+		memory_ptr<ECUSER> lpsUserList;
+		ULONG cUsers = 0;
+
+		ec_log_info("Checking quota for company \"%s\"", reinterpret_cast<const char *>(lpecCompany->lpszCompanyname));
+		/* Get userlist */
+		hr = lpServiceAdmin->GetUserList(lpecCompany->sCompanyId.cb, (LPENTRYID)lpecCompany->sCompanyId.lpb, 0, &cUsers, &~lpsUserList);
+		if (hr != hrSuccess) {
+			hr_lerr(hr, "Unable to get userlist for company \"%s\"",
+				reinterpret_cast<const char *>(lpecCompany->lpszCompanyname));
+			continue;
+		}
+		for (ULONG i = 0; i < cUsers; ++i) {
+			users.emplace(reinterpret_cast<const char *>(lpsUserList[i].lpszUsername),
+				std::make_pair(&lpsUserList[i], lpecCompany));
+			if (lpsUserList[i].lpszServername && lpsUserList[i].lpszServername[0] != '\0')
+				setServers.emplace(reinterpret_cast<const char *>(lpsUserList[i].lpszServername));
+		}
+		vUserLists.emplace_back(std::move(lpsUserList));
+	}
 
 	if (setServers.empty()) {
 		// call server function with current lpMDBAdmin / lpServiceAdmin
-		hr = CheckServerQuota(cUsers, lpsUserList, lpecCompany, m_lpMDBAdmin);
+		hr = CheckServerQuota(users, m_lpMDBAdmin);
 		if (hr != hrSuccess)
 			return kc_perror("Unable to check server quota", hr);
 		return hrSuccess;
@@ -277,7 +313,7 @@ HRESULT ECQuotaMonitor::CheckCompanyQuota(ECCOMPANY *lpecCompany)
 			}
 		}
 
-		hr = CheckServerQuota(cUsers, lpsUserList, lpecCompany, lpAdminStore);
+		hr = CheckServerQuota(users, lpAdminStore);
 		if (hr != hrSuccess) {
 			hr_lerr(hr, "Unable to check quota on server \"%s\"", lpszConnection.get());
 			++m_ulFailed;
@@ -288,25 +324,24 @@ HRESULT ECQuotaMonitor::CheckCompanyQuota(ECCOMPANY *lpecCompany)
 
 /**
  * Checks in the ECStatsTable PR_EC_STATSTABLE_USERS for quota
- * information per connected server given in lpAdminStore.
+ * information per connected server given in lpAdminStore. The table
+ * holds all users of that server, with their store size, quota limits
+ * and (on newer servers) quota status, so one pass over it suffices.
+ * Mails for users who are over quota are sent from the thread pool.
  *
- * @param[in]	cUsers		number of users in lpsUserList
- * @param[in]	lpsUserList	array of ECUser struct, containing all Kopano from all companies, on any server
- * @param[in]	lpecCompany	same company struct as in ECQuotaMonitor::CheckCompanyQuota()
+ * @param[in]	users		all users from all companies, on any server
  * @param[in]	lpAdminStore IMsgStore of SYSTEM user on a specific server instance.
  * @return hrSuccess or any MAPI error code.
  */
-HRESULT ECQuotaMonitor::CheckServerQuota(ULONG cUsers, ECUSER *lpsUserList,
-    ECCOMPANY *lpecCompany, LPMDB lpAdminStore)
+HRESULT ECQuotaMonitor::CheckServerQuota(const user_map &users, LPMDB lpAdminStore)
 {
-	SPropValue sRestrictProp;
 	object_ptr<IMAPITable> lpTable;
 	ECQUOTASTATUS sQuotaStatus;
-	ULONG i, u;
-	static constexpr SizedSPropTagArray(5, sCols) =
-		{5, {PR_EC_USERNAME_A, PR_MESSAGE_SIZE_EXTENDED,
+	std::vector<std::unique_ptr<quota_notify_task>> tasks;
+	static constexpr SizedSPropTagArray(6, sCols) =
+		{6, {PR_EC_USERNAME_A, PR_MESSAGE_SIZE_EXTENDED,
 		PR_QUOTA_WARNING_THRESHOLD, PR_QUOTA_SEND_THRESHOLD,
-		PR_QUOTA_RECEIVE_THRESHOLD}};
+		PR_QUOTA_RECEIVE_THRESHOLD, PR_EC_QUOTA_STATUS}};
 
 	auto hr = lpAdminStore->OpenProperty(PR_EC_STATSTABLE_USERS, &IID_IMAPITable, 0, 0, &~lpTable);
 	if (hr != hrSuccess)
@@ -315,36 +350,23 @@ HRESULT ECQuotaMonitor::CheckServerQuota(ULONG cUsers, ECUSER *lpsUserList,
 	if (hr != hrSuccess)
 		return kc_perror("Unable to set columns on stats table for quota sizes", hr);
 
-	if (lpecCompany->sCompanyId.cb != 0 && lpecCompany->sCompanyId.lpb != NULL) {
-		sRestrictProp.ulPropTag = PR_EC_COMPANY_NAME_A;
-		sRestrictProp.Value.lpszA = reinterpret_cast<char *>(const_cast<wchar_t *>(lpecCompany->lpszCompanyname));
-
-		memory_ptr<SRestriction> lpsRestriction;
-		hr = ECOrRestriction(
-			ECNotRestriction(ECExistRestriction(PR_EC_COMPANY_NAME_A)) +
-			ECPropertyRestriction(RELOP_EQ, PR_EC_COMPANY_NAME_A, &sRestrictProp, ECRestriction::Cheap)
-		).CreateMAPIRestriction(&~lpsRestriction, ECRestriction::Cheap);
-		if (hr != hrSuccess)
-			return hr;
-		hr = lpTable->Restrict(lpsRestriction, MAPI_DEFERRED_ERRORS);
-		if (hr != hrSuccess)
-			return kc_perror("Unable to restrict stats table", hr);
-	}
-
 	while (true) {
 		rowset_ptr lpRowSet;
-		hr = lpTable->QueryRows(50, 0, &~lpRowSet);
-		if (hr != hrSuccess)
-			return kc_perror("Unable to receive stats table data", hr);
+		hr = lpTable->QueryRows(500, 0, &~lpRowSet);
+		if (hr != hrSuccess) {
+			kc_perror("Unable to receive stats table data", hr);
+			break;
+		}
 		if (lpRowSet->cRows == 0)
 			break;
 
-		for (i = 0; i < lpRowSet->cRows; ++i) {
+		for (ULONG i = 0; i < lpRowSet->cRows; ++i) {
 			auto lpUsername  = lpRowSet[i].cfind(PR_EC_USERNAME_A);
 			auto lpStoreSize = lpRowSet[i].cfind(PR_MESSAGE_SIZE_EXTENDED);
 			auto lpQuotaWarn = lpRowSet[i].cfind(PR_QUOTA_WARNING_THRESHOLD);
 			auto lpQuotaSoft = lpRowSet[i].cfind(PR_QUOTA_SEND_THRESHOLD);
 			auto lpQuotaHard = lpRowSet[i].cfind(PR_QUOTA_RECEIVE_THRESHOLD);
+			auto lpStatus    = lpRowSet[i].cfind(PR_EC_QUOTA_STATUS);
 
 			if (!lpUsername || !lpStoreSize)
 				continue;		// don't log error: could be for several valid reasons (contacts, other server, etc)
@@ -354,7 +376,10 @@ HRESULT ECQuotaMonitor::CheckServerQuota(ULONG cUsers, ECUSER *lpsUserList,
 			memset(&sQuotaStatus, 0, sizeof(ECQUOTASTATUS));
 			sQuotaStatus.llStoreSize = lpStoreSize->Value.li.QuadPart;
 			sQuotaStatus.quotaStatus = QUOTA_OK;
-			if (lpQuotaHard && lpQuotaHard->Value.ul > 0 && lpStoreSize->Value.li.QuadPart > ((long long)lpQuotaHard->Value.ul * 1024))
+			if (lpStatus != nullptr)
+				sQuotaStatus.quotaStatus = static_cast<eQuotaStatus>(lpStatus->Value.ul);
+			/* Servers without PR_EC_QUOTA_STATUS */
+			else if (lpQuotaHard && lpQuotaHard->Value.ul > 0 && lpStoreSize->Value.li.QuadPart > ((long long)lpQuotaHard->Value.ul * 1024))
 				sQuotaStatus.quotaStatus = QUOTA_HARDLIMIT;
 			else if (lpQuotaSoft && lpQuotaSoft->Value.ul > 0 && lpStoreSize->Value.li.QuadPart > ((long long)lpQuotaSoft->Value.ul * 1024))
 				sQuotaStatus.quotaStatus = QUOTA_SOFTLIMIT;
@@ -365,25 +390,37 @@ HRESULT ECQuotaMonitor::CheckServerQuota(ULONG cUsers, ECUSER *lpsUserList,
 
 			ec_log_err("Mailbox of user \"%s\" has exceeded its %s limit", lpUsername->Value.lpszA, sQuotaStatus.quotaStatus == QUOTA_WARN ? "warning" : sQuotaStatus.quotaStatus == QUOTA_SOFTLIMIT ? "soft" : "hard");
 			// find the user in the full users list
-			for (u = 0; u < cUsers; ++u)
-				if (strcmp(reinterpret_cast<const char *>(lpsUserList[u].lpszUsername),
-				    lpUsername->Value.lpszA) == 0)
-					break;
-			if (u == cUsers) {
+			auto iter = users.find(lpUsername->Value.lpszA);
+			if (iter == users.cend()) {
 				ec_log_err("Unable to find user \"%s\" in userlist", lpUsername->Value.lpszA);
 				++m_ulFailed;
 				continue;
 			}
-			object_ptr<IMsgStore> ptrStore;
-			hr = OpenUserStore(lpsUserList[u].lpszUsername, ACTIVE_USER, &~ptrStore);
-			if (hr != hrSuccess)
-				continue;
-			hr = Notify(&lpsUserList[u], lpecCompany, &sQuotaStatus, ptrStore);
-			if (hr != hrSuccess)
-				++m_ulFailed;
+			tasks.emplace_back(new quota_notify_task(this, iter->second.first, iter->second.second, sQuotaStatus));
+			m_pool->enqueue(tasks.back().get());
 		}
 	}
-	return hrSuccess;
+	for (const auto &task : tasks)
+		task->wait();
+	return hr;
+}
+
+/**
+ * Opens the store of an over-quota user and sends the quota mail.
+ * Runs on the thread pool.
+ *
+ * @param[in]	lpecUser	The Kopano user who is over quota
+ * @param[in]	lpecCompany	The Kopano company of the lpecUser
+ * @param[in]	sQuotaStatus	The quota status values of lpecUser
+ */
+void ECQuotaMonitor::NotifyUser(ECUSER *lpecUser, ECCOMPANY *lpecCompany,
+    ECQUOTASTATUS sQuotaStatus)
+{
+	object_ptr<IMsgStore> ptrStore;
+	if (OpenUserStore(lpecUser->lpszUsername, ACTIVE_USER, &~ptrStore) != hrSuccess)
+		return;
+	if (Notify(lpecUser, lpecCompany, &sQuotaStatus, ptrStore) != hrSuccess)
+		++m_ulFailed;
 }
 
 /**
@@ -3,8 +3,13 @@
  * Copyright 2005 - 2016 Zarafa and its licensors
  */
 #pragma once
+#include <atomic>
+#include <map>
+#include <memory>
 #include <string>
+#include <utility>
 #include <kopano/ECDefs.h>
+#include <kopano/ECThreadPool.h>
 #include <kopano/memory.hpp>
 #define TEMPLATE_LINE_LENGTH		1024
 
@@ -20,10 +25,14 @@ private:
 	ECQuotaMonitor(ECTHREADMONITOR *lpThreadMonitor, LPMAPISESSION lpMAPIAdminSession, LPMDB lpMDBAdmin);
 
 public:
+	/* login name -> user and its company */
+	typedef std::map<std::string, std::pair<KC::ECUSER *, KC::ECCOMPANY *>> user_map;
+
 	static void* Create(void* lpVoid);
 	HRESULT	CheckQuota();
-	HRESULT CheckCompanyQuota(KC::ECCOMPANY *);
-	HRESULT CheckServerQuota(ULONG cUsers, KC::ECUSER *userlist, KC::ECCOMPANY *, LPMDB lpAdminStore);
+	HRESULT CheckUserQuota(ULONG ncompanies, KC::ECCOMPANY *);
+	HRESULT CheckServerQuota(const user_map &, LPMDB lpAdminStore);
+	void NotifyUser(KC::ECUSER *, KC::ECCOMPANY *, KC::ECQUOTASTATUS);
 
 private:
 	HRESULT CreateMailFromTemplate(TemplateVariables *lpVars, std::string *lpstrSubject, std::string *lpstrBody);
@@ -39,5 +48,6 @@ private:
 	ECTHREADMONITOR *m_lpThreadMonitor;
 	KC::object_ptr<IMAPISession> m_lpMAPIAdminSession;
 	KC::object_ptr<IMsgStore> m_lpMDBAdmin;
-	ULONG m_ulProcessed = 0, m_ulFailed = 0;
+	std::unique_ptr<KC::ECThreadPool> m_pool;
+	std::atomic<unsigned int> m_ulProcessed{0}, m_ulFailed{0};
 };
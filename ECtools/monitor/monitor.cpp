@@ -133,6 +133,7 @@ static ECRESULT main2(int argc, char **argv)
 		{ "sslkey_file", "" },
 		{ "sslkey_pass", "", CONFIGSETTING_EXACT },
 		{ "quota_check_interval", "15" },
+		{"quota_threads", "4"},
 		{ "mailquota_resend_interval", "1", CONFIGSETTING_RELOADABLE },
 		{ "userquota_warning_template", "/etc/kopano/quotamail/userwarning.mail", CONFIGSETTING_RELOADABLE },
 		{ "userquota_soft_template", "/etc/kopano/quotamail/usersoft.mail", CONFIGSETTING_RELOADABLE },
@@ -38,7 +38,7 @@ using std::cerr;
 using std::cout;
 using std::endl;
 
-enum eTableType { INVALID_STATS = -1, SYSTEM_STATS, SESSION_STATS, USER_STATS, COMPANY_STATS, SERVER_STATS, SESSION_TOP, OPTION_HOST, OPTION_USER, OPTION_DUMP };
+enum eTableType { INVALID_STATS = -1, SYSTEM_STATS, SESSION_STATS, USER_STATS, COMPANY_STATS, SERVER_STATS, LATENCY_STATS, SESSION_TOP, OPTION_HOST, OPTION_USER, OPTION_DUMP };
 
 static const struct option long_options[] = {
 		{ "system", 0, NULL, SYSTEM_STATS },
@@ -46,6 +46,7 @@ static const struct option long_options[] = {
 		{ "users", 0, NULL, USER_STATS },
 		{ "company", 0, NULL, COMPANY_STATS },
 		{ "servers", 0, NULL, SERVER_STATS },
+		{"latency", 0, nullptr, LATENCY_STATS},
 		{ "top", 0, NULL, SESSION_TOP },
 		{ "host", 1, NULL, OPTION_HOST },
 		{ "user", 1, NULL, OPTION_USER },
@@ -74,13 +75,16 @@ static constexpr SizedSSortOrderSet(1, tableSortCompany) =
 	{1, 0, 0, {{PR_EC_COMPANY_NAME, TABLE_SORT_ASCEND}}};
 static constexpr SizedSSortOrderSet(1, tableSortServers) =
 	{1, 0, 0, {{PR_EC_STATS_SERVER_NAME, TABLE_SORT_ASCEND}}};
+static constexpr SizedSSortOrderSet(1, tableSortLatency) =
+	{1, 0, 0, {{PR_EC_STATS_LATENCY_COUNT, TABLE_SORT_DESCEND}}};
 static const SSortOrderSet *const sortorders[] = {
 	tableSortSystem, tableSortSession,
-	tableSortUser, tableSortCompany, tableSortServers
+	tableSortUser, tableSortCompany, tableSortServers, tableSortLatency
 };
 static const ULONG ulTableProps[] = {
 	PR_EC_STATSTABLE_SYSTEM, PR_EC_STATSTABLE_SESSIONS,
-	PR_EC_STATSTABLE_USERS, PR_EC_STATSTABLE_COMPANY, PR_EC_STATSTABLE_SERVERS
+	PR_EC_STATSTABLE_USERS, PR_EC_STATSTABLE_COMPANY, PR_EC_STATSTABLE_SERVERS,
+	PR_EC_STATSTABLE_LATENCY
 };
 
 struct TIMES {
@@ -521,6 +525,16 @@ static std::string getMapiPropertyString(ULONG ulPropTag)
 	PROP_TO_STRING(PR_EC_STATS_SESSION_CLIENT_APPLICATION_VERSION);
 	PROP_TO_STRING(PR_EC_STATS_SESSION_CLIENT_APPLICATION_MISC);
 
+	PROP_TO_STRING(PR_EC_STATS_LATENCY_COUNT);
+	PROP_TO_STRING(PR_EC_STATS_LATENCY_AVG);
+	PROP_TO_STRING(PR_EC_STATS_LATENCY_P50);
+	PROP_TO_STRING(PR_EC_STATS_LATENCY_P90);
+	PROP_TO_STRING(PR_EC_STATS_LATENCY_P99);
+	PROP_TO_STRING(PR_EC_STATS_LATENCY_MAX);
+	PROP_TO_STRING(PR_EC_STATS_LATENCY_DB);
+	PROP_TO_STRING(PR_EC_STATS_LATENCY_ATTACH);
+	PROP_TO_STRING(PR_EC_STATS_LATENCY_SEND);
+
 	PROP_TO_STRING(PR_SMTP_ADDRESS);
 	PROP_TO_STRING(PR_EC_NONACTIVE);
 	PROP_TO_STRING(PR_EC_ADMINISTRATOR);
@@ -610,6 +624,7 @@ static void print_help(const char *name)
 	cout << "  --users" << "\tGives information about users, store sizes and quotas" << endl;
 	cout << "  --company" << "\tGives information about companies, company sizes and quotas" << endl;
 	cout << "  --servers" << "\tGives information about cluster nodes" << endl;
+	cout << "  --latency" << "\tGives latency percentiles of SOAP calls, in milliseconds" << endl;
 	cout << "  --top" << "\t\tShows top-like information about sessions" << endl;
 	cout << "Options:" << endl;
 	cout << "  --user, -u <user>" << "\tUse specified username to logon" << endl;
@@ -658,6 +673,7 @@ int main(int argc, char **argv)
 		case USER_STATS:
 		case COMPANY_STATS:
 		case SERVER_STATS:
+		case LATENCY_STATS:
 		case SESSION_TOP:
 			eTable = (eTableType)c;
 			break;
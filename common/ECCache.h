@@ -5,6 +5,7 @@
 #pragma once
 #include <kopano/zcdefs.h>
 #include <algorithm>
+#include <functional>
 #include <list>
 #include <string>
 #include <vector>
@@ -122,7 +123,8 @@ public:
 		auto iter = m_map.find(key);
 		if (iter == m_map.end())
 			return KCERR_NOT_FOUND;
-
+		if (on_remove)
+			on_remove(iter->first, iter->second);
 		m_ulSize -= GetCacheAdditionalSize(iter->second);
 		m_ulSize -= GetCacheAdditionalSize(key);
 		m_map.erase(iter);
@@ -164,7 +166,7 @@ public:
 			if ((long)(tNow - iter->second.ulLastAccess) >= MaxAge())
 				dl.emplace_back(iter->first);
 		for (const auto &i : dl)
-			m_map.erase(i);
+			RemoveCacheItem(i);
 		IncrementHitCount();
 		return KCERR_NOT_FOUND;
 	}
@@ -228,6 +230,12 @@ public:
 	}
 #endif
 
+	/*
+	 * Called for every entry that is removed, expires or is evicted (but
+	 * not on ClearCache), for owners that keep data derived from entries.
+	 */
+	std::function<void(const key_type &, const mapped_type &)> on_remove;
+
 	// Used in ECCacheManager::SetCell, where the content of a cache item is modified.
 	void AddToSize(int64_t ulSize)
 	{
@@ -257,6 +265,8 @@ private:
 		 * until the size constraint is met.
 		 */
 		for (auto iterMap : lstEntries) {
+			if (on_remove)
+				on_remove(iterMap->first, iterMap->second);
 			m_ulSize -= GetCacheAdditionalSize(iterMap->second);
 			m_ulSize -= GetCacheAdditionalSize(iterMap->first);
 			m_map.erase(iterMap);
@@ -9,14 +9,22 @@
 #	define _GNU_SOURCE
 #endif
 #include <kopano/platform.h>
+#include <array>
 #include <map>
 #include <set>
 #include <string>
+#include <type_traits>
 #include <vector>
 #include <utility>
+#include <cassert>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <cwctype>
 #include <pthread.h>
+#ifdef __SSE2__
+#	include <emmintrin.h>
+#endif
 #include "HtmlToTextParser.h"
 #include "HtmlEntity.h"
 #include <kopano/charset/convert.h>
@@ -24,45 +32,252 @@
 
 namespace KC {
 
-CHtmlToTextParser::CHtmlToTextParser()
+namespace {
+
+/*
+ * Input comes either as wchar_t or as UTF-8. The UTF-8 form has been
+ * validated by Parse, so the helpers below need not check it again.
+ */
+inline unsigned int u8_len(unsigned char c)
+{
+	return c < 0x80 ? 1 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+}
+
+inline wchar_t next_char(const wchar_t *&p)
+{
+	return *p++;
+}
+
+inline wchar_t next_char(const char *&p)
+{
+	auto u = reinterpret_cast<const unsigned char *>(p);
+	switch (u8_len(u[0])) {
+	case 1:
+		p += 1;
+		return u[0];
+	case 2:
+		p += 2;
+		return ((u[0] & 0x1F) << 6) | (u[1] & 0x3F);
+	case 3:
+		p += 3;
+		return ((u[0] & 0x0F) << 12) | ((u[1] & 0x3F) << 6) | (u[2] & 0x3F);
+	default:
+		p += 4;
+		return ((u[0] & 0x07) << 18) | ((u[1] & 0x3F) << 12) |
+		       ((u[2] & 0x3F) << 6) | (u[3] & 0x3F);
+	}
+}
+
+/* Length of the well-formed, non-NUL UTF-8 sequence at @u, or 0 */
+size_t u8_valid(const unsigned char *u, size_t n)
+{
+	if (u[0] < 0x80)
+		return u[0] != 0;
+	if (u[0] < 0xC2)
+		return 0;
+	auto len = u8_len(u[0]);
+	if (u[0] >= 0xF5 || n < len)
+		return 0;
+	for (unsigned int i = 1; i < len; ++i)
+		if ((u[i] & 0xC0) != 0x80)
+			return 0;
+	if (len == 3) {
+		unsigned int cp = ((u[0] & 0x0F) << 12) | ((u[1] & 0x3F) << 6);
+		if (cp < 0x800 || (cp >= 0xD800 && cp < 0xE000))
+			return 0;
+	} else if (len == 4) {
+		unsigned int cp = ((u[0] & 0x07) << 18) | ((u[1] & 0x3F) << 12);
+		if (cp < 0x10000 || cp > 0x10FFFF)
+			return 0;
+	}
+	return len;
+}
+
+/* Length of the leading run of non-NUL ASCII at @u */
+size_t ascii_prefix(const unsigned char *u, size_t n)
+{
+	static constexpr uint64_t ones = 0x0101010101010101ULL, highs = ones << 7;
+	size_t i = 0;
+	for (; n - i >= 8; i += 8) {
+		uint64_t v;
+		memcpy(&v, u + i, sizeof(v));
+		if (((v | ((v - ones) & ~v)) & highs) != 0)
+			break;
+	}
+	return i;
+}
+
+std::wstring widen(std::wstring &&s, bool lower)
+{
+	if (lower)
+		for (auto &c : s)
+			c = towlower(c);
+	return std::move(s);
+}
+
+std::wstring widen(std::string &&s, bool lower)
+{
+	std::wstring r;
+	r.reserve(s.size());
+	for (const char *p = s.c_str(), *end = p + s.size(); p < end; ) {
+		auto c = next_char(p);
+		r.push_back(lower ? towlower(c) : c);
+	}
+	return r;
+}
+
+void append_text(std::wstring &out, const wchar_t *p, const wchar_t *end)
+{
+	out.append(p, end - p);
+}
+
+void append_text(std::wstring &out, const char *p, const char *end)
+{
+	auto n = out.size();
+	out.resize(n + (end - p));
+	auto d = &out[n];
+	while (p < end)
+		if (static_cast<unsigned char>(*p) < 0x80)
+			*d++ = *p++;
+		else
+			*d++ = next_char(p);
+	out.resize(d - out.data());
+}
+
+/*
+ * Units that end a run of ordinary text in ll_parse: NUL, '<', '&' (only
+ * of interest where text is shown) and, outside of <pre>, the whitespace
+ * that gets folded. All of these are below 0x3D, so blocks without any
+ * unit that small are passed over as a whole.
+ */
+template<typename C> inline bool is_delim(C c, bool pre, bool amp)
+{
+	switch (c) {
+	case 0:
+	case '<':
+		return true;
+	case '&':
+		return amp;
+	case ' ':
+	case '\t':
+	case '\n':
+	case '\r':
+		return !pre;
+	default:
+		return false;
+	}
+}
+
+#ifdef __SSE2__
+inline bool any_below_3d(__m128i v, const char *)
+{
+	/* unsigned compare: UTF-8 lead and trail bytes are >= 0x80 */
+	auto lim = _mm_set1_epi8(0x3D);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, lim), v)) != 0xFFFF;
+}
+
+inline bool any_below_3d(__m128i v, const wchar_t *)
 {
-	tagMap[L"head"] = tagParser(false, &CHtmlToTextParser::parseTagHEAD);
-	tagMap[L"/head"] = tagParser(false, &CHtmlToTextParser::parseTagBHEAD);
-	tagMap[L"style"] = tagParser(false, &CHtmlToTextParser::parseTagSTYLE);
-	tagMap[L"/style"] = tagParser(false, &CHtmlToTextParser::parseTagBSTYLE);
-	tagMap[L"script"] = tagParser(false, &CHtmlToTextParser::parseTagSCRIPT);
-	tagMap[L"/script"] = tagParser(false, &CHtmlToTextParser::parseTagBSCRIPT);
-	tagMap[L"pre"] = tagParser(false, &CHtmlToTextParser::parseTagPRE);
-	tagMap[L"/pre"] = tagParser(false, &CHtmlToTextParser::parseTagBPRE);
-	tagMap[L"p"] = tagParser(false, &CHtmlToTextParser::parseTagP);
-	tagMap[L"/p"] = tagParser(false, &CHtmlToTextParser::parseTagBP);
-	tagMap[L"a"] = tagParser(true, &CHtmlToTextParser::parseTagA);
-	tagMap[L"/a"] = tagParser(false, &CHtmlToTextParser::parseTagBA);
-	tagMap[L"br"] = tagParser(false, &CHtmlToTextParser::parseTagBR);
-	tagMap[L"tr"] = tagParser(false, &CHtmlToTextParser::parseTagTR);
-	tagMap[L"/tr"] = tagParser(false, &CHtmlToTextParser::parseTagBTR);
-	tagMap[L"td"] = tagParser(false, &CHtmlToTextParser::parseTagTDTH);
-	tagMap[L"th"] = tagParser(false, &CHtmlToTextParser::parseTagTDTH);
-	tagMap[L"img"] = tagParser(true, &CHtmlToTextParser::parseTagIMG);
-	tagMap[L"div"] = tagParser(false, &CHtmlToTextParser::parseTagNewLine);
-	tagMap[L"/div"] = tagParser(false, &CHtmlToTextParser::parseTagNewLine);
-	tagMap[L"hr"] = tagParser(false, &CHtmlToTextParser::parseTagHR);
-	tagMap[L"h1"] = tagParser(false, &CHtmlToTextParser::parseTagHeading);
-	tagMap[L"h2"] = tagParser(false, &CHtmlToTextParser::parseTagHeading);
-	tagMap[L"h3"] = tagParser(false, &CHtmlToTextParser::parseTagHeading);
-	tagMap[L"h4"] = tagParser(false, &CHtmlToTextParser::parseTagHeading);
-	tagMap[L"h5"] = tagParser(false, &CHtmlToTextParser::parseTagHeading);
-	tagMap[L"h6"] = tagParser(false, &CHtmlToTextParser::parseTagHeading);
-	tagMap[L"ol"] = tagParser(false, &CHtmlToTextParser::parseTagOL);
-	tagMap[L"/ol"] = tagParser(false, &CHtmlToTextParser::parseTagPopList);
-	tagMap[L"ul"] = tagParser(false, &CHtmlToTextParser::parseTagUL);
-	tagMap[L"/ul"] = tagParser(false, &CHtmlToTextParser::parseTagPopList);
-	tagMap[L"li"] = tagParser(false, &CHtmlToTextParser::parseTagLI);
-	tagMap[L"/dl"] = tagParser(false, &CHtmlToTextParser::parseTagPopList);
-	tagMap[L"dt"] = tagParser(false, &CHtmlToTextParser::parseTagDT);
-	tagMap[L"dd"] = tagParser(false, &CHtmlToTextParser::parseTagDD);
-	tagMap[L"dl"] = tagParser(false, &CHtmlToTextParser::parseTagDL);
-	// @todo check span
+	return _mm_movemask_epi8(_mm_cmplt_epi32(v, _mm_set1_epi32(0x3D))) != 0;
+}
+#endif
+
+template<typename C> const C *find_delim(const C *p, const C *end, bool pre, bool amp)
+{
+#ifdef __SSE2__
+	static constexpr ptrdiff_t step = sizeof(__m128i) / sizeof(C);
+	while (end - p >= step) {
+		auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+		if (any_below_3d(v, p))
+			for (ptrdiff_t i = 0; i < step; ++i)
+				if (is_delim(p[i], pre, amp))
+					return p + i;
+		p += step;
+	}
+#endif
+	for (; p < end; ++p)
+		if (is_delim(*p, pre, amp))
+			return p;
+	return end;
+}
+
+inline unsigned int tag_hash(const char *s, size_t len)
+{
+	unsigned int c0 = static_cast<unsigned char>(s[0]);
+	unsigned int c1 = len > 1 ? static_cast<unsigned char>(s[1]) : 0;
+	unsigned int cl = static_cast<unsigned char>(s[len-1]);
+	return (3 * c0 + 7 * c1 + 8 * cl) % 128;
+}
+
+} /* anon namespace */
+
+CHtmlToTextParser::CHtmlToTextParser() = default;
+
+/**
+ * Look up the handler for a (lowercased) tag name.
+ *
+ * The hash is perfect over the set of names below, so a single compare
+ * decides. When adding a tag, make sure it still is (the table setup
+ * asserts it).
+ */
+const CHtmlToTextParser::tagParser *
+CHtmlToTextParser::findTag(const char *name, size_t len)
+{
+	static const tagParser tags[] = {
+		{"head", false, &CHtmlToTextParser::parseTagHEAD},
+		{"/head", false, &CHtmlToTextParser::parseTagBHEAD},
+		{"style", false, &CHtmlToTextParser::parseTagSTYLE},
+		{"/style", false, &CHtmlToTextParser::parseTagBSTYLE},
+		{"script", false, &CHtmlToTextParser::parseTagSCRIPT},
+		{"/script", false, &CHtmlToTextParser::parseTagBSCRIPT},
+		{"pre", false, &CHtmlToTextParser::parseTagPRE},
+		{"/pre", false, &CHtmlToTextParser::parseTagBPRE},
+		{"p", false, &CHtmlToTextParser::parseTagP},
+		{"/p", false, &CHtmlToTextParser::parseTagBP},
+		{"a", true, &CHtmlToTextParser::parseTagA},
+		{"/a", false, &CHtmlToTextParser::parseTagBA},
+		{"br", false, &CHtmlToTextParser::parseTagBR},
+		{"tr", false, &CHtmlToTextParser::parseTagTR},
+		{"/tr", false, &CHtmlToTextParser::parseTagBTR},
+		{"td", false, &CHtmlToTextParser::parseTagTDTH},
+		{"th", false, &CHtmlToTextParser::parseTagTDTH},
+		{"img", true, &CHtmlToTextParser::parseTagIMG},
+		{"div", false, &CHtmlToTextParser::parseTagNewLine},
+		{"/div", false, &CHtmlToTextParser::parseTagNewLine},
+		{"hr", false, &CHtmlToTextParser::parseTagHR},
+		{"h1", false, &CHtmlToTextParser::parseTagHeading},
+		{"h2", false, &CHtmlToTextParser::parseTagHeading},
+		{"h3", false, &CHtmlToTextParser::parseTagHeading},
+		{"h4", false, &CHtmlToTextParser::parseTagHeading},
+		{"h5", false, &CHtmlToTextParser::parseTagHeading},
+		{"h6", false, &CHtmlToTextParser::parseTagHeading},
+		{"ol", false, &CHtmlToTextParser::parseTagOL},
+		{"/ol", false, &CHtmlToTextParser::parseTagPopList},
+		{"ul", false, &CHtmlToTextParser::parseTagUL},
+		{"/ul", false, &CHtmlToTextParser::parseTagPopList},
+		{"li", false, &CHtmlToTextParser::parseTagLI},
+		{"/dl", false, &CHtmlToTextParser::parseTagPopList},
+		{"dt", false, &CHtmlToTextParser::parseTagDT},
+		{"dd", false, &CHtmlToTextParser::parseTagDD},
+		{"dl", false, &CHtmlToTextParser::parseTagDL},
+		// @todo check span
+	};
+	static const auto table = [] {
+		std::array<const tagParser *, 128> t{};
+		for (const auto &e : tags) {
+			auto &slot = t[tag_hash(e.name, strlen(e.name))];
+			assert(slot == nullptr);
+			slot = &e;
+		}
+		return t;
+	}();
+
+	if (len == 0 || len > 7)
+		return nullptr;
+	auto e = table[tag_hash(name, len)];
+	if (e == nullptr || strlen(e->name) != len || memcmp(e->name, name, len) != 0)
+		return nullptr;
+	return e;
 }
 
 void CHtmlToTextParser::Init()
@@ -76,14 +291,57 @@ void CHtmlToTextParser::Init()
 	fTextMode = false;
 	fAddSpace = false;
 	strText.clear();
+	stackTableRow = {};
+	stackAttrs = {};
+	listInfoStack = {};
 }
 
 bool CHtmlToTextParser::Parse(const wchar_t *lpwHTML)
 {
-	return ll_parse(lpwHTML);
+	return ll_parse(lpwHTML, lpwHTML + wcslen(lpwHTML));
 }
 
-bool CHtmlToTextParser::ll_parse(const wchar_t *lpwHTML)
+/**
+ * Parse UTF-8 input without going through wchar_t first. NUL bytes and
+ * malformed sequences are dropped a byte at a time, which gives the same
+ * text as converting with //IGNORE and stripping NULs would.
+ */
+bool CHtmlToTextParser::Parse(const std::string &utf8)
+{
+	auto u = reinterpret_cast<const unsigned char *>(utf8.c_str());
+	size_t len = utf8.size(), i = 0, n;
+
+	for (;;) {
+		i += ascii_prefix(u + i, len - i);
+		if (i == len || (n = u8_valid(u + i, len - i)) == 0)
+			break;
+		i += n;
+	}
+	if (i == len)
+		return ll_parse(utf8.c_str(), utf8.c_str() + len);
+
+	std::string clean(utf8, 0, i);
+	while (i < len) {
+		n = u8_valid(u + i, len - i);
+		if (n == 0) {
+			++i;
+			continue;
+		}
+		clean.append(utf8, i, n);
+		i += n;
+	}
+	return ll_parse(clean.c_str(), clean.c_str() + clean.size());
+}
+
+/**
+ * @end:	the terminating NUL of @lpwHTML
+ *
+ * Runs of ordinary text are located with find_delim and appended in one
+ * go; the per-character state changes in between are the same for every
+ * character of such a run.
+ */
+template<typename C>
+bool CHtmlToTextParser::ll_parse(const C *lpwHTML, const C *end)
 {
 	Init();
 
@@ -96,7 +354,7 @@ bool CHtmlToTextParser::ll_parse(const wchar_t *lpwHTML)
 				fAddSpace = false;
 			++lpwHTML;
 			continue;
-		} else if(*lpwHTML == '<' && *lpwHTML+1 != ' ') { // The next char can not be a space!
+		} else if (*lpwHTML == '<') {
 			++lpwHTML;
 			parseTag(lpwHTML);
 			continue;
@@ -111,13 +369,20 @@ bool CHtmlToTextParser::ll_parse(const wchar_t *lpwHTML)
 		fAddSpace = false;
 		fTextMode = true;
 
-		// if (skippable and not parsed)
-		if (!(fScriptMode || fHeadMode || fStyleMode)) {
-			if (parseEntity(lpwHTML))
-				continue;
-			addChar(*lpwHTML);
+		if (fScriptMode || fHeadMode || fStyleMode) {
+			/* not shown; entities need no decoding either */
+			lpwHTML = find_delim(lpwHTML + 1, end, fPreMode, false);
+			continue;
 		}
-		++lpwHTML;
+		if (*lpwHTML == '&') {
+			parseEntity(lpwHTML);
+			continue;
+		}
+		auto next = find_delim(lpwHTML + 1, end, fPreMode, true);
+		append_text(strText, lpwHTML, next);
+		cNewlines = 0;
+		fTDTHMode = false;
+		lpwHTML = next;
 	}
 
 	return true;
@@ -174,14 +439,12 @@ void CHtmlToTextParser::addSpace(bool force) {
 /**
  * @todo validate the entity!!
  */
-bool CHtmlToTextParser::parseEntity(const wchar_t *&lpwHTML)
+template<typename C> void CHtmlToTextParser::parseEntity(const C *&lpwHTML)
 {
-	std::wstring entity;
-
-	if(*lpwHTML != '&')
-		return false;
-	++lpwHTML;
+	wchar_t entity[11];
+	unsigned int n = 0;
 
+	++lpwHTML; /* & */
 	if (*lpwHTML == '#') {
 		int base = 10;
 
@@ -190,31 +453,30 @@ bool CHtmlToTextParser::parseEntity(const wchar_t *&lpwHTML)
 			++lpwHTML;
 			base = 16;
 		}
-		for (int i = 0; iswxdigit(*lpwHTML) && *lpwHTML != ';' && i < 10; ++i) {
-			entity += *lpwHTML;
-			++lpwHTML;
-		}
-		strText.push_back(wcstoul(entity.c_str(), nullptr, base));
+		for (; n < 10 && iswxdigit(static_cast<std::make_unsigned_t<C>>(*lpwHTML)); ++lpwHTML)
+			entity[n++] = *lpwHTML;
+		entity[n] = L'\0';
+		strText.push_back(wcstoul(entity, nullptr, base));
 	} else {
-		for (int i = 0; *lpwHTML != ';' && *lpwHTML != 0 && i < 10; ++i) {
-			entity += *lpwHTML;
-			++lpwHTML;
-		}
-		auto code = CHtmlEntity::toChar(entity.c_str());
+		while (n < 10 && *lpwHTML != ';' && *lpwHTML != 0)
+			entity[n++] = next_char(lpwHTML);
+		entity[n] = L'\0';
+		auto code = CHtmlEntity::toChar(entity);
 		if (code > 0)
 			strText.push_back(code);
 	}
 
 	if(*lpwHTML == ';')
 		++lpwHTML;
-	return true;
 }
 
-void CHtmlToTextParser::parseTag(const wchar_t *&lpwHTML)
+template<typename C> void CHtmlToTextParser::parseTag(const C *&lpwHTML)
 {
 	bool bTagName = true, bTagEnd = false, bParseAttrs = false;
-	decltype(tagMap)::const_iterator iterTag;
-	std::wstring tagName;
+	const tagParser *tag = nullptr;
+	/* Only ASCII names up to 7 long can match; 8 marks "no match" */
+	char tagName[8];
+	size_t nameLen = 0;
 
 	while (*lpwHTML != 0 && !bTagEnd)
 	{
@@ -243,9 +505,10 @@ void CHtmlToTextParser::parseTag(const wchar_t *&lpwHTML)
 				}
 				++lpwHTML;
 			}
+			return; /* unterminated, do not step over the NUL */
 		} else if (*lpwHTML == '>') {
 			if(!bTagEnd){
-				iterTag = tagMap.find(tagName);
+				tag = findTag(tagName, nameLen);
 				bTagEnd = true;
 				bTagName = false;
 			}
@@ -254,11 +517,16 @@ void CHtmlToTextParser::parseTag(const wchar_t *&lpwHTML)
 		} else if (bTagName) {
 			if (*lpwHTML == ' ') {
 				bTagName = false;
-				iterTag = tagMap.find(tagName);
-				if (iterTag != tagMap.cend())
-					bParseAttrs = iterTag->second.bParseAttrs;
+				tag = findTag(tagName, nameLen);
+				if (tag != nullptr)
+					bParseAttrs = tag->bParseAttrs;
 			} else {
-				tagName.push_back(towlower(*lpwHTML));
+				auto c = towlower(next_char(lpwHTML));
+				if (nameLen < sizeof(tagName) && c < 0x80)
+					tagName[nameLen++] = c;
+				else
+					nameLen = sizeof(tagName);
+				continue;
 			}
 		} else if (bParseAttrs) {
 			parseAttributes(lpwHTML);
@@ -269,18 +537,18 @@ void CHtmlToTextParser::parseTag(const wchar_t *&lpwHTML)
 	}
 
 	// Parse tag
-	if (!bTagName && iterTag != tagMap.cend()) {
-		(this->*iterTag->second.parserMethod)();
+	if (!bTagName && tag != nullptr) {
+		(this->*tag->parserMethod)();
 		fTextMode = false;
 	}
 }
 
-void CHtmlToTextParser::parseAttributes(const wchar_t *&lpwHTML)
+template<typename C> void CHtmlToTextParser::parseAttributes(const C *&lpwHTML)
 {
-	std::wstring attrName, attrValue;
+	std::basic_string<C> attrName, attrValue;
 	bool bAttrName = true, bAttrValue = false, bEndTag = false;
 	MapAttrs mapAttrs;
-	wchar_t firstQuote = 0;
+	C firstQuote = 0;
 
 	while(*lpwHTML != 0 && !bEndTag) {
 		if(*lpwHTML == '>' && bAttrValue) {
@@ -308,11 +576,11 @@ void CHtmlToTextParser::parseAttributes(const wchar_t *&lpwHTML)
 			if(bAttrValue)
 				attrValue.push_back(*lpwHTML);
 		} else if (bAttrName) {
-			attrName.push_back(towlower(*lpwHTML));
+			attrName.push_back(*lpwHTML);
 		}
 
 		if(!bAttrName && !bAttrValue) {
-			mapAttrs[std::move(attrName)] = std::move(attrValue);
+			mapAttrs[widen(std::move(attrName), true)] = widen(std::move(attrValue), false);
 			firstQuote = 0;
 			bAttrName = true;
 			bAttrValue = false;
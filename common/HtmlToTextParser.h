@@ -15,14 +15,16 @@ class KC_EXPORT CHtmlToTextParser KC_FINAL {
 public:
 	CHtmlToTextParser();
 	bool Parse(const wchar_t *lpwHTML);
+	/* Same as Parse, but for UTF-8 input; saves the conversion to wchar_t */
+	bool Parse(const std::string &utf8);
 	std::wstring& GetText();
 
 protected:
 	KC_HIDDEN void Init();
-	KC_HIDDEN bool ll_parse(const wchar_t *);
-	KC_HIDDEN void parseTag(const wchar_t *&);
-	KC_HIDDEN bool parseEntity(const wchar_t *&);
-	KC_HIDDEN void parseAttributes(const wchar_t *&);
+	template<typename C> KC_HIDDEN bool ll_parse(const C *, const C *end);
+	template<typename C> KC_HIDDEN void parseTag(const C *&);
+	template<typename C> KC_HIDDEN void parseEntity(const C *&);
+	template<typename C> KC_HIDDEN void parseAttributes(const C *&);
 	KC_HIDDEN void addChar(wchar_t);
 	KC_HIDDEN void addNewLine(bool force_line);
 	KC_HIDDEN bool addURLAttribute(const wchar_t *attr, bool spaces = false);
@@ -70,13 +72,11 @@ protected:
 	typedef void ( CHtmlToTextParser::*ParseMethodType )( void );
 
 	struct KC_HIDDEN tagParser {
-		tagParser() = default;
-		tagParser(bool pa, ParseMethodType mt) :
-			bParseAttrs(pa), parserMethod(mt)
-		{}
-		bool bParseAttrs = false;
-		ParseMethodType parserMethod = nullptr;
+		const char *name;
+		bool bParseAttrs;
+		ParseMethodType parserMethod;
 	};
+	KC_HIDDEN static const tagParser *findTag(const char *name, size_t len);
 
 	struct TableRow {
 		bool bFirstCol;
@@ -90,7 +90,6 @@ protected:
 
 	typedef std::map<std::wstring, std::wstring>	MapAttrs;
 	std::stack<TableRow> stackTableRow;
-	std::map<std::wstring, tagParser> tagMap;
 	std::stack<MapAttrs> stackAttrs;
 	ListInfo 		listInfo;
 	std::stack<ListInfo> listInfoStack;
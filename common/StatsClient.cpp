@@ -7,12 +7,18 @@
 #endif
 #include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <locale>
 #include <memory>
 #include <mutex>
+#include <sstream>
 #include <string>
 #include <utility>
+#include <poll.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/utsname.h>
 #ifdef HAVE_CURL_CURL_H
 #	include <curl/curl.h>
@@ -21,6 +27,7 @@
 #include <libHX/map.h>
 #include <libHX/option.h>
 #include <kopano/platform.h>
+#include <kopano/ECChannel.h>
 #include <kopano/ECConfig.h>
 #include <kopano/ECLogger.h>
 #include <kopano/ecversion.h>
@@ -33,6 +40,9 @@ using namespace std::string_literals;
 
 namespace KC {
 
+/* How often on-demand stats are refreshed while metrics are served */
+static constexpr std::chrono::seconds metrics_odm_interval{15};
+
 static void *submitThread(void *p)
 {
 	kcsrv_blocksigs();
@@ -40,15 +50,29 @@ static void *submitThread(void *p)
 	return NULL;
 }
 
+static void *metricsThread(void *p)
+{
+	kcsrv_blocksigs();
+	static_cast<StatsClient *>(p)->metrics_loop();
+	return nullptr;
+}
+
 void ECStatsCollector::stop()
 {
-	if (!m_thread_running)
+	if (!m_thread_running && !m_metrics_running)
 		return;
 	terminate = true;
 	m_exitsig.notify_one();
 	void *dummy = nullptr;
-	pthread_join(countsSubmitThread, &dummy);
-	m_thread_running = false;
+	if (m_thread_running)
+		pthread_join(countsSubmitThread, &dummy);
+	/* The metrics thread polls in 1s steps and sees @terminate by itself */
+	if (m_metrics_running)
+		pthread_join(m_metrics_thread, &dummy);
+	for (auto fd : m_metrics_fd)
+		close(fd);
+	m_metrics_fd.clear();
+	m_thread_running = m_metrics_running = false;
 	terminate = false;
 }
 
@@ -95,6 +119,30 @@ static void sc_proxy_from_sysconfig(CURL *ch, const char *url)
 }
 #endif
 
+/* Read a stat without blocking its writers (except for strings) */
+static ECStat2 sc_snapshot(const ECStat &st)
+{
+	ECStat2 r{st.description, {}, st.type};
+	switch (st.type) {
+	case SCT_REAL:
+	case SCT_REALGAUGE:
+		r.data.f = st.f.load(std::memory_order_relaxed);
+		break;
+	case SCT_TIME:
+		r.data.ts = st.ll.load(std::memory_order_relaxed);
+		break;
+	case SCT_STRING: {
+		scoped_lock lk(st.lock);
+		r.strdata = st.strdata;
+		break;
+	}
+	default:
+		r.data.ll = st.ll.load(std::memory_order_relaxed);
+		break;
+	}
+	return r;
+}
+
 template<typename T> static void setleaf(Json::Value &leaf, const T &elem)
 {
 	switch (elem.type) {
@@ -137,11 +185,10 @@ std::string ECStatsCollector::stats_as_text()
 	Json::Value root;
 	root["version"] = 2;
 
-	for (auto &i : m_StatData) {
-		scoped_lock lk(i.second.lock);
+	for (const auto &i : m_StatData) {
 		Json::Value leaf;
 		leaf["desc"] = i.second.description;
-		setleaf(leaf, i.second);
+		setleaf(leaf, sc_snapshot(i.second));
 		root["stats"][i.second.name] = leaf;
 	}
 	std::unique_lock<std::mutex> lk(m_odm_lock);
@@ -166,10 +213,9 @@ std::string ECStatsCollector::survey_as_text()
 		auto i = m_StatData.find(key);
 		if (i == m_StatData.cend())
 			continue;
-		scoped_lock lk(i->second.lock);
 		Json::Value leaf;
 		leaf["desc"] = i->second.description;
-		setleaf(leaf, i->second);
+		setleaf(leaf, sc_snapshot(i->second));
 		root["stats"][i->second.name] = leaf;
 	}
 	std::unique_lock<std::mutex> lk(m_odm_lock);
@@ -231,8 +277,7 @@ void ECStatsCollector::submit(std::string &&url, std::string &&text, bool sslver
 
 void ECStatsCollector::mainloop()
 {
-#ifdef HAVE_CURL_CURL_H
-	KC::time_point next_sc, next_sv;
+	KC::time_point next_sc, next_sv, next_odm;
 	std::mutex mtx;
 	do {
 		auto zsc_url = m_config->GetSetting("statsclient_url");
@@ -246,8 +291,17 @@ void ECStatsCollector::mainloop()
 		auto do_sv = zsv_url != nullptr && sv_int > 0 && now > next_sv;
 		auto next_wk = now + std::chrono::seconds(60); /* basic config reeval interval */
 
-		if (do_sc || do_sv)
+		/*
+		 * The metrics endpoint serves the on-demand values gathered
+		 * here, so that scrapes never run fill_odm themselves.
+		 */
+		if (m_metrics_running && now > next_odm) {
 			fill_odm();
+			next_odm = now + metrics_odm_interval;
+			next_wk = std::min(next_wk, next_odm);
+		} else if (do_sc || do_sv) {
+			fill_odm();
+		}
 		if (do_sc) {
 			ec_log_debug("Submtting statistics data to %s", zsc_url);
 			submit(zsc_url, stats_as_text(), parseBool(m_config->GetSetting("statsclient_ssl_verify")));
@@ -264,7 +318,6 @@ void ECStatsCollector::mainloop()
 		if (m_exitsig.wait_until(blah, next_wk) != std::cv_status::timeout)
 			break;
 	} while (!terminate);
-#endif
 }
 
 ECStatsCollector::ECStatsCollector(std::shared_ptr<ECConfig> config) :
@@ -296,6 +349,8 @@ ECStatsCollector::ECStatsCollector(std::shared_ptr<ECConfig> config) :
 void ECStatsCollector::start()
 {
 	ec_log_info("Starting statscollector");
+	if (!m_metrics_running)
+		metrics_listen();
 	if (m_thread_running)
 		return;
 	auto ret = pthread_create(&countsSubmitThread, nullptr, submitThread, this);
@@ -310,7 +365,8 @@ void ECStatsCollector::AddStat(SCName index, SCType type, const char *name,
 {
 	ECStat &newStat = m_StatData[index];
 
-	newStat.data.ll = 0;		// reset largest data var in union
+	newStat.ll = 0;
+	newStat.f = 0;
 	newStat.avginc = 1;
 	newStat.type = type;
 	newStat.name = name;
@@ -323,8 +379,10 @@ void ECStatsCollector::inc(SCName name, double inc)
 	if (iSD == m_StatData.cend())
 		return;
 	assert(iSD->second.type == SCT_REAL || iSD->second.type == SCT_REALGAUGE);
-	scoped_lock lk(iSD->second.lock);
-	iSD->second.data.f += inc;
+	auto &f = iSD->second.f;
+	auto old = f.load(std::memory_order_relaxed);
+	while (!f.compare_exchange_weak(old, old + inc, std::memory_order_relaxed))
+		/* retry */;
 }
 
 void ECStatsCollector::inc(SCName name, int v)
@@ -338,8 +396,7 @@ void ECStatsCollector::inc(SCName name, LONGLONG inc)
 	if (iSD == m_StatData.cend())
 		return;
 	assert(iSD->second.type == SCT_INTEGER || iSD->second.type == SCT_INTGAUGE);
-	scoped_lock lk(iSD->second.lock);
-	iSD->second.data.ll += inc;
+	iSD->second.ll.fetch_add(inc, std::memory_order_relaxed);
 }
 
 void ECStatsCollector::set_dbl(enum SCName name, double set)
@@ -348,8 +405,7 @@ void ECStatsCollector::set_dbl(enum SCName name, double set)
 	if (iSD == m_StatData.cend())
 		return;
 	assert(iSD->second.type == SCT_REAL || iSD->second.type == SCT_REALGAUGE);
-	scoped_lock lk(iSD->second.lock);
-	iSD->second.data.f = set;
+	iSD->second.f.store(set, std::memory_order_relaxed);
 }
 
 void ECStatsCollector::set(enum SCName name, LONGLONG set)
@@ -358,8 +414,7 @@ void ECStatsCollector::set(enum SCName name, LONGLONG set)
 	if (iSD == m_StatData.cend())
 		return;
 	assert(iSD->second.type == SCT_INTEGER || iSD->second.type == SCT_INTGAUGE);
-	scoped_lock lk(iSD->second.lock);
-	iSD->second.data.ll = set;
+	iSD->second.ll.store(set, std::memory_order_relaxed);
 }
 
 void ECStatsCollector::SetTime(enum SCName name, time_t set)
@@ -368,8 +423,7 @@ void ECStatsCollector::SetTime(enum SCName name, time_t set)
 	if (iSD == m_StatData.cend())
 		return;
 	assert(iSD->second.type == SCT_TIME);
-	scoped_lock lk(iSD->second.lock);
-	iSD->second.data.ts = set;
+	iSD->second.ll.store(set, std::memory_order_relaxed);
 }
 
 void ECStatsCollector::set(SCName name, const std::string &s)
@@ -388,9 +442,10 @@ void ECStatsCollector::Max(SCName name, LONGLONG max)
 	if (iSD == m_StatData.cend())
 		return;
 	assert(iSD->second.type == SCT_INTEGER || iSD->second.type == SCT_INTGAUGE);
-	scoped_lock lk(iSD->second.lock);
-	if (iSD->second.data.ll < max)
-		iSD->second.data.ll = max;
+	auto &ll = iSD->second.ll;
+	auto old = ll.load(std::memory_order_relaxed);
+	while (old < max && !ll.compare_exchange_weak(old, max, std::memory_order_relaxed))
+		/* retry */;
 }
 
 void ECStatsCollector::avg_dbl(SCName name, double add)
@@ -400,7 +455,8 @@ void ECStatsCollector::avg_dbl(SCName name, double add)
 		return;
 	assert(iSD->second.type == SCT_REALGAUGE);
 	scoped_lock lk(iSD->second.lock);
-	iSD->second.data.f = ((add - iSD->second.data.f) / iSD->second.avginc) + iSD->second.data.f;
+	auto f = iSD->second.f.load(std::memory_order_relaxed);
+	iSD->second.f.store((add - f) / iSD->second.avginc + f, std::memory_order_relaxed);
 	++iSD->second.avginc;
 	if (iSD->second.avginc == 0)
 		iSD->second.avginc = 1;
@@ -413,7 +469,8 @@ void ECStatsCollector::avg(SCName name, LONGLONG add)
 		return;
 	assert(iSD->second.type == SCT_INTGAUGE);
 	scoped_lock lk(iSD->second.lock);
-	iSD->second.data.ll = ((add - iSD->second.data.ll) / iSD->second.avginc) + iSD->second.data.ll;
+	auto ll = iSD->second.ll.load(std::memory_order_relaxed);
+	iSD->second.ll.store((add - ll) / iSD->second.avginc + ll, std::memory_order_relaxed);
 	++iSD->second.avginc;
 	if (iSD->second.avginc == 0)
 		iSD->second.avginc = 1;
@@ -421,25 +478,7 @@ void ECStatsCollector::avg(SCName name, LONGLONG add)
 
 std::string ECStatsCollector::GetValue(const SCMap::const_iterator::value_type &iSD)
 {
-	switch (iSD.second.type) {
-	case SCT_REAL:
-	case SCT_REALGAUGE:
-		return stringify_double(iSD.second.data.f);
-	case SCT_INTEGER:
-	case SCT_INTGAUGE:
-		return stringify_int64(iSD.second.data.ll);
-	case SCT_TIME: {
-		if (iSD.second.data.ts <= 0)
-			break;
-		char timestamp[128]{};
-		struct tm *tm = localtime(&iSD.second.data.ts);
-		strftime(timestamp, sizeof timestamp, "%a %b %e %T %Y", tm);
-		return timestamp;
-	}
-	case SCT_STRING:
-		return iSD.second.strdata;
-	}
-	return "";
+	return GetValue(sc_snapshot(iSD.second));
 }
 
 std::string ECStatsCollector::GetValue(const ECStat2 &i)
@@ -475,10 +514,8 @@ std::string ECStatsCollector::GetValue(const SCName &name)
 
 void ECStatsCollector::ForEachStat(void(callback)(const std::string &, const std::string &, const std::string &, void *), void *obj)
 {
-	for (auto &i : m_StatData) {
-		scoped_lock lk(i.second.lock);
+	for (const auto &i : m_StatData)
 		callback(i.second.name, i.second.description, GetValue(i), obj);
-	}
 	std::lock_guard<std::mutex> lk(m_odm_lock);
 	for (const auto &i : m_ondemand)
 		callback(i.first, i.second.desc, GetValue(i.second), obj);
@@ -539,4 +576,356 @@ void ECStatsCollector::set(const std::string &name, const std::string &desc,
 	i->second.strdata = v;
 }
 
+thread_local struct rq_phase_clocks rq_phase_tls;
+
+latency_histogram::latency_histogram(const std::string &d,
+    std::vector<std::string> &&parts) :
+	desc(d), part_names(std::move(parts))
+{
+	if (!part_names.empty())
+		m_parts.reset(new std::atomic<uint64_t>[part_names.size()]());
+}
+
+unsigned int latency_histogram::bucket_of(uint64_t v)
+{
+	if (v < (1U << SUBBITS))
+		return v;
+	if (v >= 1ULL << MAXBITS)
+		v = (1ULL << MAXBITS) - 1;
+	unsigned int e = 63 - __builtin_clzll(v);
+	return ((e - SUBBITS + 1) << SUBBITS) |
+	       ((v >> (e - SUBBITS)) & ((1U << SUBBITS) - 1));
+}
+
+uint64_t latency_histogram::bucket_upper(unsigned int i)
+{
+	if (i < (1U << SUBBITS))
+		return i;
+	unsigned int shift = (i >> SUBBITS) - 1;
+	uint64_t low = static_cast<uint64_t>((1U << SUBBITS) | (i & ((1U << SUBBITS) - 1))) << shift;
+	return low + (1ULL << shift) - 1;
+}
+
+void latency_histogram::record(uint64_t usec, const uint64_t *parts_usec)
+{
+	m_buckets[bucket_of(usec)].fetch_add(1, std::memory_order_relaxed);
+	m_count.fetch_add(1, std::memory_order_relaxed);
+	m_sum.fetch_add(usec, std::memory_order_relaxed);
+	auto max = m_max.load(std::memory_order_relaxed);
+	while (usec > max && !m_max.compare_exchange_weak(max, usec, std::memory_order_relaxed))
+		/* retry */;
+	if (parts_usec != nullptr)
+		for (size_t i = 0; i < part_names.size(); ++i)
+			m_parts[i].fetch_add(parts_usec[i], std::memory_order_relaxed);
+}
+
+latency_histogram::snapshot latency_histogram::get() const
+{
+	snapshot s;
+	s.buckets.resize(NBUCKETS);
+	for (unsigned int i = 0; i < NBUCKETS; ++i) {
+		s.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+		s.count += s.buckets[i];
+	}
+	/*
+	 * Writers are not stopped, so count/sum/parts may be a few records
+	 * ahead of the buckets. The bucket total is used as the count to
+	 * keep quantiles consistent.
+	 */
+	s.sum = m_sum.load(std::memory_order_relaxed);
+	s.max = m_max.load(std::memory_order_relaxed);
+	for (size_t i = 0; i < part_names.size(); ++i)
+		s.parts.push_back(m_parts[i].load(std::memory_order_relaxed));
+	return s;
+}
+
+uint64_t latency_histogram::snapshot::quantile(double q) const
+{
+	if (count == 0)
+		return 0;
+	auto rank = std::max<uint64_t>(1, std::ceil(q * count));
+	uint64_t seen = 0;
+	for (unsigned int i = 0; i < buckets.size(); ++i) {
+		seen += buckets[i];
+		if (seen >= rank)
+			return std::min(bucket_upper(i), max);
+	}
+	return max;
+}
+
+latency_histogram *ECStatsCollector::histogram(const std::string &name,
+    const std::string &desc, std::vector<std::string> &&parts)
+{
+	scoped_lock lk(m_histo_lock);
+	auto &h = m_histograms[name];
+	if (h == nullptr)
+		h.reset(new latency_histogram(desc, std::move(parts)));
+	return h.get();
+}
+
+void ECStatsCollector::ForEachHistogram(void (*cb)(const std::string &, const latency_histogram &, void *), void *obj)
+{
+	scoped_lock lk(m_histo_lock);
+	for (const auto &i : m_histograms)
+		cb(i.first, *i.second, obj);
+}
+
+/*
+ * OpenMetrics exposition. Names get a "kopano_" prefix and anything that is
+ * not valid in a metric name is turned into an underscore.
+ */
+static std::string om_name(const std::string &name)
+{
+	auto r = "kopano_" + name;
+	for (auto &c : r)
+		if (!isalnum(static_cast<unsigned char>(c)) && c != '_')
+			c = '_';
+	return r;
+}
+
+static std::string om_escape(const std::string &s)
+{
+	std::string r;
+	for (auto c : s) {
+		if (c == '\n')
+			r += "\\n";
+		else if (c == '\\' || c == '"')
+			r += "\\"s + c;
+		else
+			r += c;
+	}
+	return r;
+}
+
+/* Not printf: the daemons run with LC_ALL set, which could give 0,5 */
+static std::string om_double(double v)
+{
+	if (std::isnan(v))
+		return "NaN";
+	if (std::isinf(v))
+		return v > 0 ? "+Inf" : "-Inf";
+	std::ostringstream s;
+	s.imbue(std::locale::classic());
+	s.precision(15);
+	s << v;
+	return s.str();
+}
+
+static void om_header(std::string &out, const std::string &fam,
+    const char *type, const std::string &desc)
+{
+	out += "# TYPE " + fam + " " + type + "\n";
+	if (!desc.empty())
+		out += "# HELP " + fam + " " + om_escape(desc) + "\n";
+}
+
+static void om_stat(std::string &out, const std::string &name, const ECStat2 &st)
+{
+	auto fam = om_name(name);
+	switch (st.type) {
+	case SCT_INTEGER:
+		om_header(out, fam, "counter", st.desc);
+		out += fam + "_total " + std::to_string(st.data.ll) + "\n";
+		break;
+	case SCT_INTGAUGE:
+		om_header(out, fam, "gauge", st.desc);
+		out += fam + " " + std::to_string(st.data.ll) + "\n";
+		break;
+	case SCT_REAL:
+		om_header(out, fam, "counter", st.desc);
+		out += fam + "_total " + om_double(st.data.f) + "\n";
+		break;
+	case SCT_REALGAUGE:
+		om_header(out, fam, "gauge", st.desc);
+		out += fam + " " + om_double(st.data.f) + "\n";
+		break;
+	case SCT_TIME:
+		om_header(out, fam, "gauge", st.desc);
+		out += fam + " " + std::to_string(static_cast<int64_t>(st.data.ts)) + "\n";
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Histograms are exported in seconds. Only the power-of-two bucket edges up
+ * to 2^28 usec (about 4.5 minutes) are used as "le" bounds, which keeps the
+ * number of series per histogram fixed and small.
+ */
+static void om_histogram(std::string &out, const std::string &name,
+    const latency_histogram &h)
+{
+	auto s = h.get();
+	if (s.count == 0)
+		return;
+	auto fam = om_name(name) + "_seconds";
+	om_header(out, fam, "histogram", h.desc);
+	uint64_t cum = 0;
+	for (unsigned int i = 0; i < s.buckets.size(); ++i) {
+		cum += s.buckets[i];
+		auto edge = latency_histogram::bucket_upper(i) + 1;
+		if (edge > 1U << 28)
+			break;
+		if (edge < (1U << latency_histogram::SUBBITS) || (edge & (edge - 1)) != 0)
+			continue;
+		out += fam + "_bucket{le=\"" + om_double(edge / 1e6) + "\"} " + std::to_string(cum) + "\n";
+	}
+	out += fam + "_bucket{le=\"+Inf\"} " + std::to_string(s.count) + "\n";
+	out += fam + "_count " + std::to_string(s.count) + "\n";
+	out += fam + "_sum " + om_double(s.sum / 1e6) + "\n";
+	if (h.part_names.empty())
+		return;
+	fam = om_name(name) + "_part_seconds";
+	om_header(out, fam, "counter", "Time spent in parts of " + name);
+	for (size_t i = 0; i < h.part_names.size(); ++i)
+		out += fam + "_total{part=\"" + om_escape(h.part_names[i]) + "\"} " + om_double(s.parts[i] / 1e6) + "\n";
+}
+
+/*
+ * The on-demand stats are the ones the submit thread last gathered (at most
+ * metrics_odm_interval old); gathering them takes locks that the request
+ * path uses, and the server's runs a database query.
+ */
+std::string ECStatsCollector::metrics_as_text()
+{
+	std::string out, program, version;
+	for (const auto &i : m_StatData) {
+		auto st = sc_snapshot(i.second);
+		if (i.first == SCN_PROGRAM_NAME)
+			program = std::move(st.strdata);
+		else if (i.first == SCN_PROGRAM_VERSION)
+			version = std::move(st.strdata);
+		else
+			om_stat(out, i.second.name, st);
+	}
+	std::unique_lock<std::mutex> lk(m_odm_lock);
+	for (const auto &i : m_ondemand)
+		om_stat(out, i.first, i.second);
+	lk.unlock();
+	/*
+	 * m_histo_lock is only taken when a histogram is registered; the
+	 * recording side works on the histogram's atomics.
+	 */
+	lk = std::unique_lock<std::mutex>(m_histo_lock);
+	for (const auto &i : m_histograms)
+		om_histogram(out, i.first, *i.second);
+	lk.unlock();
+	out += "# TYPE kopano_build info\n";
+	out += "kopano_build_info{program=\"" + om_escape(program) +
+	       "\",version=\"" + om_escape(version) + "\"} 1\n";
+	out += "# EOF\n";
+	return out;
+}
+
+void ECStatsCollector::metrics_listen()
+{
+	if (m_config == nullptr)
+		return;
+	auto spec = m_config->GetSetting("metrics_listen");
+	if (spec == nullptr || *spec == '\0')
+		return;
+	std::vector<int> used_fds;
+	auto info = ec_bindspec_to_sockets(tokenize(spec, ' ', true), S_IRWUG,
+	            nullptr, nullptr, used_fds);
+	for (auto &sk : info.second) {
+		if (sk.m_fd < 0)
+			continue;
+		ec_log_info("Serving metrics on %s", sk.m_spec.c_str());
+		m_metrics_fd.push_back(sk.m_fd);
+		sk.m_fd = -1;
+	}
+	if (info.first < 0)
+		ec_log_err("Could not listen on all metrics_listen sockets: %s", strerror(-info.first));
+	if (m_metrics_fd.empty())
+		return;
+	auto ret = pthread_create(&m_metrics_thread, nullptr, metricsThread, this);
+	if (ret != 0) {
+		ec_log_err("Could not create metrics thread: %s", strerror(ret));
+		return;
+	}
+	m_metrics_running = true;
+	set_thread_name(m_metrics_thread, "metrics");
+}
+
+void ECStatsCollector::metrics_loop()
+{
+	std::vector<struct pollfd> pfd(m_metrics_fd.size());
+	for (size_t i = 0; i < pfd.size(); ++i) {
+		pfd[i].fd = m_metrics_fd[i];
+		pfd[i].events = POLLIN;
+	}
+	while (!terminate) {
+		if (poll(pfd.data(), pfd.size(), 1000) <= 0)
+			continue;
+		for (const auto &p : pfd) {
+			if (!(p.revents & POLLIN))
+				continue;
+			auto fd = accept(p.fd, nullptr, nullptr);
+			if (fd < 0)
+				continue;
+			metrics_reply(fd);
+			close(fd);
+		}
+	}
+}
+
+/*
+ * Minimal HTTP/1.x responder: one request per connection, GET or HEAD
+ * of /metrics. Scrapes are rare, so they are served one at a time.
+ */
+void ECStatsCollector::metrics_reply(int fd)
+{
+	static constexpr size_t maxreq = 8192;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	std::string req;
+	char buf[1024];
+	while (req.find("\r\n\r\n") == std::string::npos &&
+	    req.find("\n\n") == std::string::npos) {
+		auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+		struct pollfd p{fd, POLLIN};
+		if (req.size() >= maxreq || left <= 0 || poll(&p, 1, left) <= 0)
+			return;
+		auto n = read(fd, buf, sizeof(buf));
+		if (n <= 0)
+			return;
+		req.append(buf, n);
+	}
+
+	req.erase(std::min(req.find_first_of("\r\n"), req.size()));
+	auto parts = tokenize(req, ' ', true);
+	std::string status = "200 OK", extra, body;
+	bool head = parts.size() > 0 && parts[0] == "HEAD";
+	if (parts.size() != 3 || strncmp(parts[2].c_str(), "HTTP/1.", 7) != 0) {
+		status = "400 Bad Request";
+	} else if (parts[0] != "GET" && !head) {
+		status = "405 Method Not Allowed";
+		extra = "Allow: GET, HEAD\r\n";
+	} else if (parts[1].substr(0, parts[1].find('?')) != "/metrics") {
+		status = "404 Not Found";
+	} else {
+		extra = "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n";
+		body = metrics_as_text();
+	}
+	auto rsp = "HTTP/1.1 " + status + "\r\n" + extra +
+	           "Content-Length: " + std::to_string(body.size()) + "\r\n" +
+	           "Connection: close\r\n\r\n";
+	if (!head)
+		rsp += body;
+	/* A client that stops reading must not hold up the thread (and stop()) */
+	deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	for (size_t done = 0; done < rsp.size(); ) {
+		auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+		struct pollfd p{fd, POLLOUT};
+		if (left <= 0 || poll(&p, 1, left) <= 0)
+			return;
+		auto n = send(fd, rsp.data() + done, rsp.size() - done, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+			continue;
+		if (n <= 0)
+			return;
+		done += n;
+	}
+}
+
 } /* namespace */
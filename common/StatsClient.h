@@ -5,12 +5,14 @@
 #pragma once
 #include <kopano/zcdefs.h>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <unordered_map>
+#include <vector>
 #include <cstdint>
 #include <pthread.h>
 
@@ -34,10 +36,16 @@ enum SCName {
 	SCN_SESSIONS_CREATED, SCN_SESSIONS_DELETED, SCN_SESSIONS_TIMEOUT, SCN_SESSIONS_INTERNAL_CREATED, SCN_SESSIONS_INTERNAL_DELETED,
 	/* system session group stats */
 	SCN_SESSIONGROUPS_CREATED, SCN_SESSIONGROUPS_DELETED,
+	/* user management stats */
+	SCN_GROUP_CLOSURE_BUILDS,
+	/* softdelete purge stats */
+	SCN_SOFTDELETE_RUNNING, SCN_SOFTDELETE_PENDING, SCN_SOFTDELETE_BATCHES,
+	SCN_SOFTDELETE_STORES, SCN_SOFTDELETE_FOLDERS, SCN_SOFTDELETE_MESSAGES,
 	/* LDAP stats */
 	SCN_LDAP_CONNECTS, SCN_LDAP_RECONNECTS, SCN_LDAP_CONNECT_FAILED, SCN_LDAP_CONNECT_TIME, SCN_LDAP_CONNECT_TIME_MAX,
 	SCN_LDAP_AUTH_LOGINS, SCN_LDAP_AUTH_DENIED, SCN_LDAP_AUTH_TIME, SCN_LDAP_AUTH_TIME_MAX, SCN_LDAP_AUTH_TIME_AVG,
 	SCN_LDAP_SEARCH, SCN_LDAP_SEARCH_FAILED, SCN_LDAP_SEARCH_TIME, SCN_LDAP_SEARCH_TIME_MAX,
+	SCN_LDAP_MEMBERSHIP_CACHE_HIT, SCN_LDAP_MEMBERSHIP_CACHE_MISS, SCN_LDAP_NEGATIVE_CACHE_HIT,
 	/* indexer stats */
 	SCN_INDEXER_SEARCH_ERRORS, SCN_INDEXER_SEARCH_MAX, SCN_INDEXER_SEARCH_AVG, SCN_INDEXED_SEARCHES, SCN_DATABASE_SEARCHES,
 
@@ -77,6 +85,8 @@ enum SCName {
 	SCN_LMTP_UNKNOWN_COMMAND,
 	SCN_RULES_TIME,
 	SCN_RULES_BOUNCE,
+	SCN_RULES_CACHE_HIT,
+	SCN_RULES_CACHE_MISS,
 	SCN_RULES_COPYMOVE,
 	SCN_RULES_DEFER,
 	SCN_RULES_DELEGATE,
@@ -88,6 +98,7 @@ enum SCName {
 	SCN_RULES_NACTIONS,
 	SCN_RULES_NRULES,
 	SCN_RULES_REPLY_AND_OOF,
+	SCN_RULES_SHARED_PRED,
 	SCN_RULES_TAG,
 	SCN_SPOOLER_ABNORM_TERM,
 	SCN_SPOOLER_BATCH_COUNT,
@@ -96,6 +107,9 @@ enum SCName {
 	SCN_SPOOLER_SEND_FAILED,
 	SCN_SPOOLER_SENT,
 	SCN_SPOOLER_SIGKILLED,
+	SCN_GATEWAY_POP3_CONNECTIONS, SCN_GATEWAY_POP3S_CONNECTIONS,
+	SCN_GATEWAY_IMAP_CONNECTIONS, SCN_GATEWAY_IMAPS_CONNECTIONS,
+	SCN_GATEWAY_WORKER_FAILED,
 	SCN_MACHINE_ID, SCN_UTSNAME, SCN_OSRELEASE,
 	SCN_PROGRAM_NAME, SCN_PROGRAM_VERSION, SCN_SERVER_GUID,
 	SCN_SERVER_USERDB_BACKEND, SCN_SERVER_ATTACH_BACKEND,
@@ -117,12 +131,18 @@ enum SCType {
 	SCT_STRING,
 };
 
+/*
+ * Numeric values are kept in atomics, so that updates and readers (like the
+ * metrics endpoint) need no lock. The lock only serializes string updates
+ * and the running averages.
+ */
 struct ECStat {
 	const char *name, *description;
-	SCData data;
-	LONGLONG avginc;
+	std::atomic<int64_t> ll{0}; /* SCT_INTEGER, SCT_INTGAUGE, SCT_TIME */
+	std::atomic<double> f{0};
+	LONGLONG avginc = 1;
 	SCType type;
-	std::mutex lock;
+	mutable std::mutex lock;
 	std::string strdata;
 };
 
@@ -134,6 +154,84 @@ struct ECStat2 {
 
 typedef std::map<SCName, ECStat> SCMap;
 
+/*
+ * Latency histogram with log-linear buckets, like HdrHistogram: every power
+ * of two of microseconds is split into 8 buckets, so quantiles are within
+ * 12.5% of the real value. Besides the total, a histogram can sum up the
+ * time spent in named parts of the measured operation.
+ *
+ * record() only does relaxed atomic adds, so it is cheap enough for hot
+ * paths; get() copies the counters without stopping writers.
+ */
+class KC_EXPORT latency_histogram final {
+	public:
+	static constexpr unsigned int SUBBITS = 3, MAXBITS = 36;
+	static constexpr unsigned int NBUCKETS = (MAXBITS - SUBBITS + 1) << SUBBITS;
+
+	struct snapshot {
+		/* Upper bound of the bucket holding quantile @q, in usec */
+		uint64_t quantile(double q) const;
+
+		uint64_t count = 0, sum = 0, max = 0;
+		std::vector<uint64_t> buckets, parts;
+	};
+
+	latency_histogram(const std::string &desc, std::vector<std::string> &&parts = {});
+	void record(uint64_t usec, const uint64_t *parts_usec = nullptr);
+	snapshot get() const;
+	/* Largest value that falls into bucket @i */
+	static uint64_t bucket_upper(unsigned int i);
+
+	const std::string desc;
+	const std::vector<std::string> part_names;
+
+	private:
+	static unsigned int bucket_of(uint64_t usec);
+
+	std::atomic<uint64_t> m_buckets[NBUCKETS]{}, m_count{0}, m_sum{0}, m_max{0};
+	std::unique_ptr<std::atomic<uint64_t>[]> m_parts;
+};
+
+/*
+ * Phases of a server request, the parts of the SOAP latency histograms.
+ * The request dispatcher resets the current thread's phase clocks before a
+ * request and reads them afterwards.
+ */
+enum rq_phase {
+	RQP_DB, RQP_ATTACH, RQP_SEND, RQP_MAX,
+};
+
+struct rq_phase_clocks {
+	uint64_t ns[RQP_MAX];
+	unsigned int depth[RQP_MAX];
+};
+
+extern KC_EXPORT thread_local struct rq_phase_clocks rq_phase_tls;
+
+/*
+ * Adds its own lifetime to a phase clock of the current thread. Nested
+ * timers for the same phase only count once.
+ */
+class rq_phase_timer final {
+	public:
+	rq_phase_timer(enum rq_phase p) : m_phase(p)
+	{
+		if (rq_phase_tls.depth[p]++ == 0)
+			m_start = std::chrono::steady_clock::now();
+	}
+	~rq_phase_timer()
+	{
+		if (--rq_phase_tls.depth[m_phase] == 0)
+			rq_phase_tls.ns[m_phase] += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count();
+	}
+	rq_phase_timer(const rq_phase_timer &) = delete;
+	void operator=(const rq_phase_timer &) = delete;
+
+	private:
+	enum rq_phase m_phase;
+	std::chrono::steady_clock::time_point m_start;
+};
+
 class KC_EXPORT ECStatsCollector {
 	public:
 	ECStatsCollector(std::shared_ptr<Config>);
@@ -142,6 +240,7 @@ class KC_EXPORT ECStatsCollector {
 	virtual void start();
 	virtual void stop();
 	void mainloop();
+	void metrics_loop();
 	void submit(std::string &&url, std::string &&data, bool sslverify = true);
 	void inc(enum SCName, double inc);
 	void inc(enum SCName, int inc = 1);
@@ -157,11 +256,19 @@ class KC_EXPORT ECStatsCollector {
 	void Max(SCName name, LONGLONG max);
 	void avg_dbl(enum SCName, double add);
 	void avg(enum SCName, LONGLONG add);
+	/*
+	 * Histograms are created on first use and live as long as the
+	 * collector, so callers may keep the pointer.
+	 */
+	latency_histogram *histogram(const std::string &name, const std::string &desc, std::vector<std::string> &&parts = {});
+	void ForEachHistogram(void (*cb)(const std::string &, const latency_histogram &, void *), void *obj);
 
 	/* strings are separate, used by ECSerial */
 	std::string GetValue(const SCMap::const_iterator::value_type &);
 	std::string GetValue(const SCName &name);
 	void ForEachStat(void (*cb)(const std::string &, const std::string &, const std::string &, void *), void *obj);
+	/* All numeric stats and histograms in OpenMetrics text format */
+	std::string metrics_as_text();
 
 	protected:
 	/*
@@ -176,11 +283,17 @@ class KC_EXPORT ECStatsCollector {
 	private:
 	std::string stats_as_text();
 	std::string survey_as_text();
+	void metrics_listen();
+	void metrics_reply(int fd);
 
 	SCMap m_StatData;
 	std::unordered_map<std::string, ECStat2> m_ondemand;
+	std::map<std::string, std::unique_ptr<latency_histogram>> m_histograms;
+	std::mutex m_histo_lock;
 	std::atomic<bool> terminate{false};
-	pthread_t countsSubmitThread{};
+	pthread_t countsSubmitThread{}, m_metrics_thread{};
+	std::vector<int> m_metrics_fd;
+	bool m_metrics_running = false;
 	std::shared_ptr<Config> m_config;
 	std::condition_variable m_exitsig;
 	std::mutex m_odm_lock;
@@ -6,12 +6,18 @@
 #include <kopano/charset/convert.h>
 #include <mapicode.h>
 #include <numeric>
+#include <unordered_map>
 #include <vector>
 #include <stdexcept>
 #include <string>
 #include <kopano/stringutil.h>
 #include <cerrno>
+#include <cstdint>
 #include <cstring>
+#include <langinfo.h>
+#ifdef __SSE2__
+#	include <emmintrin.h>
+#endif
 #define BUFSIZE 4096
 
 using namespace std::string_literals;
@@ -54,6 +60,381 @@ private:
 	const char** m_ptr;
 };
 
+/*
+ * Conversions between the Unicode encodings (and ASCII) are done without
+ * iconv. Most strings are pure ASCII or mostly so, which is handled 16 bytes
+ * at a time; other code points are decoded/encoded one by one. Anything
+ * that is not well-formed (or not representable in the target) ends the
+ * fast path, and iconv then continues at that spot with its usual
+ * //IGNORE/TRANSLIT/HTMLENTITIES handling. This is exact as long as the
+ * involved encodings are stateless, which they all are.
+ */
+enum {
+	UC_NONE, UC_ASCII, UC_UTF8, UC_UTF16, UC_UTF32, UC_MAX,
+};
+
+template<unsigned int K> struct uc_unit { typedef uint8_t type; };
+template<> struct uc_unit<UC_UTF16> { typedef uint16_t type; };
+template<> struct uc_unit<UC_UTF32> { typedef uint32_t type; };
+
+template<typename U> static inline U uc_load(const char *p)
+{
+	U v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+template<typename U> static inline void uc_store(char *p, U v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+/**
+ * Copy the run of ASCII characters at @s to @d, converting the code unit
+ * width as needed, and advance both pointers.
+ */
+template<unsigned int F, unsigned int T> static inline void
+uc_ascii(const char *&s, const char *se, char *&d, const char *de)
+{
+	typedef typename uc_unit<F>::type from_unit;
+	typedef typename uc_unit<T>::type to_unit;
+	constexpr size_t fw = sizeof(from_unit), tw = sizeof(to_unit);
+
+#ifdef __SSE2__
+	auto z = _mm_setzero_si128();
+	if (fw == 1) {
+		while (se - s >= 16 && de - d >= static_cast<ptrdiff_t>(16 * tw)) {
+			auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s));
+			if (_mm_movemask_epi8(v) != 0)
+				break;
+			auto o = reinterpret_cast<__m128i *>(d);
+			if (tw == 1) {
+				_mm_storeu_si128(o, v);
+			} else {
+				auto lo = _mm_unpacklo_epi8(v, z), hi = _mm_unpackhi_epi8(v, z);
+				if (tw == 2) {
+					_mm_storeu_si128(o, lo);
+					_mm_storeu_si128(o + 1, hi);
+				} else {
+					_mm_storeu_si128(o, _mm_unpacklo_epi16(lo, z));
+					_mm_storeu_si128(o + 1, _mm_unpackhi_epi16(lo, z));
+					_mm_storeu_si128(o + 2, _mm_unpacklo_epi16(hi, z));
+					_mm_storeu_si128(o + 3, _mm_unpackhi_epi16(hi, z));
+				}
+			}
+			s += 16;
+			d += 16 * tw;
+		}
+	} else if (tw == 1) {
+		while (se - s >= static_cast<ptrdiff_t>(16 * fw) && de - d >= 16) {
+			auto i = reinterpret_cast<const __m128i *>(s);
+			__m128i r;
+			if (fw == 2) {
+				auto a = _mm_loadu_si128(i), b = _mm_loadu_si128(i + 1);
+				auto hi = _mm_and_si128(_mm_or_si128(a, b), _mm_set1_epi16(~0x7F));
+				if (_mm_movemask_epi8(_mm_cmpeq_epi16(hi, z)) != 0xFFFF)
+					break;
+				r = _mm_packus_epi16(a, b);
+			} else {
+				auto a = _mm_loadu_si128(i), b = _mm_loadu_si128(i + 1);
+				auto c = _mm_loadu_si128(i + 2), e = _mm_loadu_si128(i + 3);
+				auto hi = _mm_and_si128(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, e)), _mm_set1_epi32(~0x7F));
+				if (_mm_movemask_epi8(_mm_cmpeq_epi32(hi, z)) != 0xFFFF)
+					break;
+				r = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, e));
+			}
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(d), r);
+			s += 16 * fw;
+			d += 16;
+		}
+	}
+#else
+	if (fw == 1 && tw == 1) {
+		/* Eight at a time */
+		while (se - s >= 8 && de - d >= 8) {
+			auto v = uc_load<uint64_t>(s);
+			if (v & 0x8080808080808080ULL)
+				break;
+			uc_store<uint64_t>(d, v);
+			s += 8;
+			d += 8;
+		}
+	}
+#endif
+	while (se - s >= static_cast<ptrdiff_t>(fw) && de - d >= static_cast<ptrdiff_t>(tw)) {
+		auto c = uc_load<from_unit>(s);
+		if (c >= 0x80)
+			break;
+		uc_store<to_unit>(d, c);
+		s += fw;
+		d += tw;
+	}
+}
+
+/**
+ * Decode one code point. Returns the number of bytes used, or 0 when the
+ * input is not well-formed (including truncated).
+ */
+template<unsigned int K> static size_t uc_decode(const char *, size_t, char32_t &);
+
+template<> inline size_t uc_decode<UC_ASCII>(const char *s, size_t n, char32_t &cp)
+{
+	if (n < 1 || static_cast<uint8_t>(*s) >= 0x80)
+		return 0;
+	cp = *s;
+	return 1;
+}
+
+template<> inline size_t uc_decode<UC_UTF8>(const char *s, size_t n, char32_t &cp)
+{
+	auto u = reinterpret_cast<const uint8_t *>(s);
+	if (n < 1)
+		return 0;
+	if (u[0] < 0x80) {
+		cp = u[0];
+		return 1;
+	} else if (u[0] < 0xC2) {
+		return 0; /* continuation byte or overlong */
+	} else if (u[0] < 0xE0) {
+		if (n < 2 || (u[1] & 0xC0) != 0x80)
+			return 0;
+		cp = ((u[0] & 0x1F) << 6) | (u[1] & 0x3F);
+		return 2;
+	} else if (u[0] < 0xF0) {
+		if (n < 3 || (u[1] & 0xC0) != 0x80 || (u[2] & 0xC0) != 0x80)
+			return 0;
+		cp = ((u[0] & 0x0F) << 12) | ((u[1] & 0x3F) << 6) | (u[2] & 0x3F);
+		if (cp < 0x800 || (cp >= 0xD800 && cp < 0xE000))
+			return 0;
+		return 3;
+	} else if (u[0] < 0xF5) {
+		if (n < 4 || (u[1] & 0xC0) != 0x80 || (u[2] & 0xC0) != 0x80 ||
+		    (u[3] & 0xC0) != 0x80)
+			return 0;
+		cp = ((u[0] & 0x07) << 18) | ((u[1] & 0x3F) << 12) |
+		     ((u[2] & 0x3F) << 6) | (u[3] & 0x3F);
+		if (cp < 0x10000 || cp > 0x10FFFF)
+			return 0;
+		return 4;
+	}
+	return 0;
+}
+
+template<> inline size_t uc_decode<UC_UTF16>(const char *s, size_t n, char32_t &cp)
+{
+	if (n < 2)
+		return 0;
+	auto w = uc_load<uint16_t>(s);
+	if (w < 0xD800 || w >= 0xE000) {
+		cp = w;
+		return 2;
+	}
+	if (w >= 0xDC00 || n < 4)
+		return 0;
+	auto w2 = uc_load<uint16_t>(s + 2);
+	if (w2 < 0xDC00 || w2 >= 0xE000)
+		return 0;
+	cp = 0x10000 + ((w - 0xD800) << 10) + (w2 - 0xDC00);
+	return 4;
+}
+
+template<> inline size_t uc_decode<UC_UTF32>(const char *s, size_t n, char32_t &cp)
+{
+	if (n < 4)
+		return 0;
+	cp = uc_load<uint32_t>(s);
+	if (cp > 0x10FFFF || (cp >= 0xD800 && cp < 0xE000))
+		return 0;
+	return 4;
+}
+
+/**
+ * Encode one code point (of at most 4 bytes). Returns the number of bytes
+ * written, or 0 if the target cannot represent it.
+ */
+template<unsigned int K> static size_t uc_encode(char32_t, char *);
+
+template<> inline size_t uc_encode<UC_ASCII>(char32_t cp, char *d)
+{
+	if (cp >= 0x80)
+		return 0;
+	*d = cp;
+	return 1;
+}
+
+template<> inline size_t uc_encode<UC_UTF8>(char32_t cp, char *d)
+{
+	if (cp < 0x80) {
+		d[0] = cp;
+		return 1;
+	} else if (cp < 0x800) {
+		d[0] = 0xC0 | (cp >> 6);
+		d[1] = 0x80 | (cp & 0x3F);
+		return 2;
+	} else if (cp < 0x10000) {
+		d[0] = 0xE0 | (cp >> 12);
+		d[1] = 0x80 | ((cp >> 6) & 0x3F);
+		d[2] = 0x80 | (cp & 0x3F);
+		return 3;
+	}
+	d[0] = 0xF0 | (cp >> 18);
+	d[1] = 0x80 | ((cp >> 12) & 0x3F);
+	d[2] = 0x80 | ((cp >> 6) & 0x3F);
+	d[3] = 0x80 | (cp & 0x3F);
+	return 4;
+}
+
+template<> inline size_t uc_encode<UC_UTF16>(char32_t cp, char *d)
+{
+	if (cp < 0x10000) {
+		uc_store<uint16_t>(d, cp);
+		return 2;
+	}
+	cp -= 0x10000;
+	uc_store<uint16_t>(d, 0xD800 + (cp >> 10));
+	uc_store<uint16_t>(d + 2, 0xDC00 + (cp & 0x3FF));
+	return 4;
+}
+
+template<> inline size_t uc_encode<UC_UTF32>(char32_t cp, char *d)
+{
+	uc_store<uint32_t>(d, cp);
+	return 4;
+}
+
+/**
+ * Convert as much of @src as is possible without iconv and fits into @dst.
+ * @src and @srclen are advanced past the consumed input; the number of
+ * bytes written is returned. A return value of 0 (with input left) means
+ * the next sequence needs iconv.
+ */
+template<unsigned int F, unsigned int T> static size_t
+uc_fast(const char *&src, size_t &srclen, char *dst, size_t dstlen)
+{
+	auto s = src, se = src + srclen;
+	auto d = dst;
+	const char *de = dst + dstlen;
+
+	while (s < se) {
+		uc_ascii<F, T>(s, se, d, de);
+		if (s == se || de - d < 4)
+			break;
+		char32_t cp;
+		auto r = uc_decode<F>(s, se - s, cp);
+		if (r == 0)
+			break;
+		auto w = uc_encode<T>(cp, d);
+		if (w == 0)
+			break;
+		s += r;
+		d += w;
+	}
+	srclen -= s - src;
+	src = s;
+	return d - dst;
+}
+
+/**
+ * Map an iconv charset name (without //options) to one of the encodings
+ * that uc_fast can do. Only native byte order is handled, and only names
+ * that produce no BOM.
+ */
+static unsigned int uc_kind(const char *name)
+{
+	if (*name == '\0')
+		/* iconv_open uses the locale's charset for "" */
+		name = nl_langinfo(CODESET);
+	std::string n;
+	for (; *name != '\0'; ++name)
+		if (*name != '-' && *name != '_')
+			n += toupper(static_cast<unsigned char>(*name));
+	if (n == "UTF8")
+		return UC_UTF8;
+	if (n == "ASCII" || n == "USASCII" || n == "ANSIX3.41968")
+		return UC_ASCII;
+	if (n == "WCHART")
+		return sizeof(wchar_t) == 4 ? UC_UTF32 : UC_NONE;
+#ifdef KC_BIGENDIAN
+	if (n == "UTF32BE")
+		return UC_UTF32;
+	if (n == "UTF16BE")
+		return UC_UTF16;
+#else
+	if (n == "UTF32LE")
+		return UC_UTF32;
+	if (n == "UTF16LE")
+		return UC_UTF16;
+#endif
+	return UC_NONE;
+}
+
+template<unsigned int F> static size_t (*uc_select(unsigned int to))(const char *&, size_t &, char *, size_t)
+{
+	switch (to) {
+	case UC_ASCII: return uc_fast<F, UC_ASCII>;
+	case UC_UTF8:  return uc_fast<F, UC_UTF8>;
+	case UC_UTF16: return uc_fast<F, UC_UTF16>;
+	case UC_UTF32: return uc_fast<F, UC_UTF32>;
+	default:       return nullptr;
+	}
+}
+
+/*
+ * Open iconv descriptors (together with the parsed options) are kept around
+ * per thread once their iconv_context is gone, so that the next context for
+ * the same tocode/fromcode does not need iconv_open. Being thread-local, the
+ * pool needs no locking.
+ */
+struct iconv_pool_ent {
+	iconv_t cd;
+	size_t (*fast)(const char *&, size_t &, char *, size_t);
+	bool force, html, translit_run;
+	unsigned int translit_adv;
+};
+
+class iconv_pool KC_FINAL {
+	public:
+	~iconv_pool();
+	bool get(const std::string &key, iconv_pool_ent &);
+	void put(std::string &&key, const iconv_pool_ent &);
+
+	private:
+	static constexpr size_t max_idle = 32;
+	std::unordered_multimap<std::string, iconv_pool_ent> m_idle;
+};
+
+static thread_local iconv_pool tls_iconv_pool;
+/* Set once tls_iconv_pool is destroyed (contexts may outlive it at exit) */
+static thread_local bool tls_iconv_pool_gone;
+
+iconv_pool::~iconv_pool()
+{
+	for (auto &e : m_idle)
+		iconv_close(e.second.cd);
+	tls_iconv_pool_gone = true;
+}
+
+bool iconv_pool::get(const std::string &key, iconv_pool_ent &ent)
+{
+	auto i = m_idle.find(key);
+	if (i == m_idle.end())
+		return false;
+	ent = i->second;
+	m_idle.erase(i);
+	return true;
+}
+
+void iconv_pool::put(std::string &&key, const iconv_pool_ent &ent)
+{
+	if (m_idle.size() >= max_idle) {
+		iconv_close(ent.cd);
+		return;
+	}
+	/* Drop shift state and the like */
+	iconv(ent.cd, nullptr, nullptr, nullptr, nullptr);
+	m_idle.emplace(std::move(key), ent);
+}
+
 /**
  * The conversion context for iconv charset conversions takes a fromcode and a tocode,
  * which are the source and destination charsets, respectively. The 'tocode' may take
@@ -83,8 +464,22 @@ private:
  * @param tocode Destination charset
  * @param fromcode Source charset
  */
-iconv_context_base::iconv_context_base(const char *tocode, const char *fromorig)
+iconv_context_base::iconv_context_base(const char *tocode, const char *fromorig) :
+	m_key(tocode)
 {
+	m_key += '\0';
+	m_key += fromorig;
+	iconv_pool_ent ent;
+	if (!tls_iconv_pool_gone && tls_iconv_pool.get(m_key, ent)) {
+		m_cd = ent.cd;
+		m_fast = ent.fast;
+		m_bForce = ent.force;
+		m_bHTML = ent.html;
+		m_translit_run = ent.translit_run;
+		m_translit_adv = ent.translit_adv;
+		return;
+	}
+
 	std::string strfrom = fromorig;
 	auto pos = strfrom.find("//");
 	if (pos != strfrom.npos)
@@ -115,6 +510,14 @@ iconv_context_base::iconv_context_base(const char *tocode, const char *fromorig)
 		}
 	}
 
+	auto to = uc_kind(strto.c_str());
+	switch (uc_kind(strfrom.c_str())) {
+	case UC_ASCII: m_fast = uc_select<UC_ASCII>(to); break;
+	case UC_UTF8:  m_fast = uc_select<UC_UTF8>(to); break;
+	case UC_UTF16: m_fast = uc_select<UC_UTF16>(to); break;
+	case UC_UTF32: m_fast = uc_select<UC_UTF32>(to); break;
+	}
+
 	if (m_translit_run) {
 		m_cd = iconv_open((strto + "//TRANSLIT").c_str(), strfrom.c_str());
 		if (m_cd != (iconv_t)(-1)) {
@@ -143,8 +546,14 @@ iconv_context_base::iconv_context_base(const char *tocode, const char *fromorig)
 
 iconv_context_base::~iconv_context_base()
 {
-	if (m_cd != (iconv_t)(-1))
+	if (m_cd == (iconv_t)(-1))
+		return;
+	if (tls_iconv_pool_gone) {
 		iconv_close(m_cd);
+		return;
+	}
+	tls_iconv_pool.put(std::move(m_key), {m_cd, m_fast, m_bForce, m_bHTML,
+		m_translit_run, m_translit_adv});
 }
 
 void iconv_context_base::doconvert(const char *lpFrom, size_t cbFrom)
@@ -158,6 +567,13 @@ void iconv_context_base::doconvert(const char *lpFrom, size_t cbFrom)
 	lpSrc = lpFrom;
 	cbSrc = cbFrom;
 
+	while (m_fast != nullptr && cbSrc > 0) {
+		auto out = m_fast(lpSrc, cbSrc, buf, sizeof(buf));
+		if (out == 0)
+			/* Leave the rest to iconv */
+			break;
+		append(buf, out);
+	}
 	while (cbSrc) {
 		lpDst = buf;
 		cbDst = sizeof(buf);
@@ -245,16 +661,60 @@ void convert_context::persist_code(context_key &key, unsigned flags)
 	}
 }
 
+char *convert_context::persist_alloc(size_t size, size_t align)
+{
+	static constexpr size_t block_size = 4096;
+	auto pad = -reinterpret_cast<uintptr_t>(m_arena_ptr) & (align - 1);
+	if (m_arena_ptr == nullptr || m_arena_left < pad + size) {
+		if (size > block_size / 4) {
+			/* Big strings get a block of their own */
+			m_arena.emplace_back(new char[size]);
+			return m_arena.back().get();
+		}
+		m_arena.emplace_back(new char[block_size]);
+		m_arena_ptr = m_arena.back().get();
+		m_arena_left = block_size;
+		pad = 0;
+	}
+	auto p = m_arena_ptr + pad;
+	m_arena_ptr += pad + size;
+	m_arena_left -= pad + size;
+	return p;
+}
+
 char* convert_context::persist_string(const std::string &strValue)
 {
-	m_lstStrings.emplace_back(strValue);
-	return const_cast<char*>(m_lstStrings.back().c_str());
+	auto size = strValue.size() + 1;
+	auto p = persist_alloc(size, 1);
+	memcpy(p, strValue.c_str(), size);
+	return p;
 }
 
 wchar_t* convert_context::persist_string(const std::wstring &wstrValue)
 {
-	m_lstWstrings.emplace_back(wstrValue);
-	return const_cast<wchar_t*>(m_lstWstrings.back().c_str());
+	auto size = (wstrValue.size() + 1) * sizeof(wchar_t);
+	auto p = persist_alloc(size, alignof(wchar_t));
+	memcpy(p, wstrValue.c_str(), size);
+	return reinterpret_cast<wchar_t *>(p);
+}
+
+/**
+ * Decode @srclen bytes of UTF-8 into @dst without iconv and without an
+ * intermediate string. @dst must have room for @srclen wide characters
+ * (no sequence yields more than one); no terminator is written. Returns
+ * the number of characters stored, or SIZE_MAX if @src is not well-formed
+ * UTF-8, in which case the caller should use convert_to for the error
+ * handling of its choice.
+ */
+size_t utf8_to_wcs(const char *src, size_t srclen, wchar_t *dst)
+{
+	static_assert(sizeof(wchar_t) == sizeof(uint32_t), "wchar_t is expected to be UTF-32");
+	auto len = srclen;
+	auto w = uc_fast<UC_UTF8, UC_UTF32>(src, len,
+	         reinterpret_cast<char *>(dst), srclen * sizeof(wchar_t));
+	if (len != 0)
+		return SIZE_MAX;
+	return w / sizeof(wchar_t);
 }
 
 } /* namespace */
@@ -7,7 +7,9 @@
 #include <map>
 #include <set>
 #include <list>
+#include <memory>
 #include <string>
+#include <vector>
 #include <stdexcept>
 #include <iconv.h>
 #include <kopano/charset/traits.h>
@@ -86,7 +88,15 @@ class KC_EXPORT iconv_context_base {
 	 */
 	KC_HIDDEN virtual void append(const char *buf, size_t bufsize) = 0;
 
+	/* tocode and fromcode as passed, for returning m_cd to the thread's pool */
+	std::string m_key;
 	iconv_t	m_cd = reinterpret_cast<iconv_t>(-1);
+	/*
+	 * Converter for UTF-8/16/32 and ASCII pairs which bypasses iconv.
+	 * It stops at the first sequence it cannot handle, and iconv takes
+	 * over from there.
+	 */
+	size_t (*m_fast)(const char *&, size_t &, char *, size_t) = nullptr;
 	bool m_bForce = true; /* Ignore illegal sequences by default. */
 	bool m_bHTML = false, m_translit_run = false;
 	unsigned int m_translit_adv = 1;
@@ -138,7 +148,7 @@ class KC_EXPORT_DYCAST iconv_context KC_FINAL :
 	{
 		m_to.clear();
 		doconvert(lpRaw, cbRaw);
-		return m_to;
+		return std::move(m_to);
 	}
 
 	/**
@@ -184,9 +194,9 @@ class KC_EXPORT_DYCAST iconv_context KC_FINAL :
  * @param[in] _from			The string that is to be converted to another charset.
  * @return					The converted string.
  *
- * @note	Since this method needs to create an iconv object internally
- *			it is better to use a convert_context when multiple conversions
- *			need to be performed.
+ * @note	iconv descriptors are kept in a per-thread pool, so repeated
+ *			calls do not reopen them. A convert_context still saves
+ *			the lookup when multiple conversions need to be performed.
  */
 template<typename To_Type, typename From_Type>
 inline To_Type convert_to(const From_Type &from)
@@ -592,10 +602,17 @@ private:
 	 */
 	wchar_t *persist_string(const std::wstring &wstrValue);
 
+	/**
+	 * Reserve space for persisted strings. Strings are packed into
+	 * blocks that live as long as the convert_context.
+	 */
+	char *persist_alloc(size_t, size_t align);
+
 	code_set	m_codes;
 	context_map	m_contexts;
-	std::list<std::string>	m_lstStrings;
-	std::list<std::wstring>	m_lstWstrings;
+	std::vector<std::unique_ptr<char[]>> m_arena;
+	char *m_arena_ptr = nullptr;
+	size_t m_arena_left = 0;
 
 // a convert_context is not supposed to be copyable.
 	convert_context(const convert_context &) = delete;
@@ -636,6 +653,8 @@ private:
 #define TO_UTF8_DEF(ptr) TO_UTF8(converter, (ptr), ulFlags)
 
 extern KC_EXPORT HRESULT HrFromException(const convert_exception &);
+/* iconv-free UTF-8 to wchar_t; SIZE_MAX on malformed input */
+extern KC_EXPORT size_t utf8_to_wcs(const char *, size_t, wchar_t *);
 
 /*
  * Even if the definition of TCHAR is different between ASCII and Unicode
@@ -53,4 +53,9 @@ extern KC_EXPORT int compareSortKeys(const std::string &, const std::string &);
 extern KC_EXPORT std::string createSortKeyData(const char *s, int ncap, const ECLocale &);
 extern KC_EXPORT std::string createSortKeyData(const wchar_t *s, int ncap, const ECLocale &);
 
+// Prepared strings for repeated substring searches
+extern KC_EXPORT bool str_search_form(const char *, bool icase, U_ICU_NAMESPACE::UnicodeString &);
+extern KC_EXPORT bool wcs_search_form(const wchar_t *, bool icase, U_ICU_NAMESPACE::UnicodeString &);
+extern KC_EXPORT bool search_form_contains(const U_ICU_NAMESPACE::UnicodeString &haystack, const U_ICU_NAMESPACE::UnicodeString &needle);
+
 } /* namespace */
@@ -269,6 +269,28 @@ int str_icompare(const char *s1, const char *s2, const ECLocale &locale)
 	return ptrCollator->compare(a,b,status);
 }
 
+/**
+ * Bring @s in the form that the *_contains functions search in: NFD, and
+ * case-folded if @icase is set.
+ */
+static bool search_form_int(UnicodeString &&s, bool icase, UnicodeString &out)
+{
+	UErrorCode err = U_ZERO_ERROR;
+#ifdef HAVE_NORMALIZER2
+	auto nfd = Normalizer2::getNFDInstance(err);
+	if (U_FAILURE(err))
+		return false;
+	nfd->normalize(std::move(s), out, err);
+#else
+	Normalizer::normalize(std::move(s), UNORM_NFD, 0, out, err);
+#endif
+	if (U_FAILURE(err))
+		return false;
+	if (icase)
+		out.foldCase();
+	return true;
+}
+
 /**
  * Find a string in another string.
  *
@@ -288,31 +310,50 @@ int str_icompare(const char *s1, const char *s2, const ECLocale &locale)
  */
 static bool str_contains_int(UnicodeString &&text, UnicodeString &&needle, bool icase = false)
 {
-	UErrorCode err = U_ZERO_ERROR;
 	UnicodeString rt, rn;
-#ifdef HAVE_NORMALIZER2
-	auto nfd = Normalizer2::getNFDInstance(err);
-	if (U_FAILURE(err))
-		return false;
-	nfd->normalize(std::move(text), rt, err);
-	if (U_FAILURE(err))
-		return false;
-	nfd->normalize(std::move(needle), rn, err);
-#else
-	Normalizer::normalize(std::move(text), UNORM_NFD, 0, rt, err);
-	if (U_FAILURE(err))
-		return false;
-	Normalizer::normalize(std::move(needle), UNORM_NFD, 0, rn, err);
-#endif
-	if (U_FAILURE(err))
+	if (!search_form_int(std::move(text), icase, rt) ||
+	    !search_form_int(std::move(needle), icase, rn))
 		return false;
-	if (icase) {
-		rt.foldCase();
-		rn.foldCase();
-	}
 	return u_strstr(rt.getTerminatedBuffer(), rn.getTerminatedBuffer());
 }
 
+/**
+ * Prepare a string for repeated use with search_form_contains(). The
+ * result of str_contains(h, n) equals that of search_form_contains() on
+ * the prepared h and n, but the conversion and normalization is done only
+ * once per string.
+ *
+ * @param[in]	s	String in the current locale's charset
+ * @param[in]	icase	Prepare for case-insensitive comparison
+ * @param[out]	out	The prepared string
+ *
+ * @return	false if @s could not be normalized
+ */
+bool str_search_form(const char *s, bool icase, UnicodeString &out)
+{
+	assert(s != nullptr);
+	return search_form_int(StringToUnicode(s), icase, out);
+}
+
+/**
+ * Wide character version of str_search_form().
+ */
+bool wcs_search_form(const wchar_t *s, bool icase, UnicodeString &out)
+{
+	assert(s != nullptr);
+	return search_form_int(WCHARToUnicode(s), icase, out);
+}
+
+/**
+ * Find a needle in a haystack, both prepared with {str,wcs}_search_form()
+ * using the same case sensitivity.
+ */
+bool search_form_contains(const UnicodeString &haystack, const UnicodeString &needle)
+{
+	return u_strFindFirst(haystack.getBuffer(), haystack.length(),
+	       needle.getBuffer(), needle.length()) != nullptr;
+}
+
 bool str_contains(const char *haystack, const char *needle, const ECLocale &locale)
 {
 	assert(haystack != nullptr);
@@ -44,6 +44,7 @@
 #include "IMAP.h"
 #include <kopano/ecversion.h>
 #include "SSLUtil.h"
+#include "StatsClient.h"
 #include <kopano/fileutil.hpp>
 #include <kopano/UnixUtil.h>
 #include <unicode/uclean.h>
@@ -73,6 +74,28 @@ static const char *szPath;
 static std::shared_ptr<ECLogger> g_lpLogger;
 static std::shared_ptr<ECConfig> g_lpConfig;
 static std::atomic<int> nChildren{0};
+
+class gateway_stats final : public StatsClient {
+	public:
+	gateway_stats(std::shared_ptr<ECConfig>);
+	virtual void fill_odm() override;
+};
+
+gateway_stats::gateway_stats(std::shared_ptr<ECConfig> cfg) :
+	StatsClient(std::move(cfg))
+{
+	set(SCN_PROGRAM_NAME, "kopano-gateway");
+	AddStat(SCN_GATEWAY_POP3_CONNECTIONS, SCT_INTEGER, "gateway_pop3_conn", "Number of accepted POP3 connections");
+	AddStat(SCN_GATEWAY_POP3S_CONNECTIONS, SCT_INTEGER, "gateway_pop3s_conn", "Number of accepted POP3s connections");
+	AddStat(SCN_GATEWAY_IMAP_CONNECTIONS, SCT_INTEGER, "gateway_imap_conn", "Number of accepted IMAP connections");
+	AddStat(SCN_GATEWAY_IMAPS_CONNECTIONS, SCT_INTEGER, "gateway_imaps_conn", "Number of accepted IMAPs connections");
+	AddStat(SCN_GATEWAY_WORKER_FAILED, SCT_INTEGER, "gateway_worker_fail", "Number of connections dropped because no worker could be started");
+}
+
+void gateway_stats::fill_odm()
+{
+	setg("gateway_workers", "Number of worker threads or processes", nChildren);
+}
 static std::string g_strHostString;
 static struct socks g_socks;
 
@@ -344,6 +367,7 @@ int main(int argc, char *argv[]) {
 		{ "log_buffer_size", "0" },
 		{ "tmp_path", "/tmp" },
 		{"bypass_auth", "no"},
+		{"metrics_listen", ""},
 		{"html_safety_filter", "ignored", CONFIGSETTING_OBSOLETE},
 		{ NULL, NULL },
 	};
@@ -525,7 +549,7 @@ static HRESULT gw_listen(ECConfig *cfg)
 	return hrSuccess;
 }
 
-static HRESULT handler_client(size_t i)
+static HRESULT handler_client(size_t i, gateway_stats &sc)
 {
 	// One socket has signalled a new incoming connection
 	auto lpHandlerArgs = make_unique_nt<HandlerArgs>();
@@ -544,6 +568,10 @@ static HRESULT handler_client(size_t i)
 	auto hr = HrAccept(g_socks.pollfd[i].fd, &unique_tie(lpHandlerArgs->lpChannel));
 	if (hr != hrSuccess)
 		return hr_lerr(hr, "Unable to accept %s socket connection", method);
+	if (lpHandlerArgs->type == ST_POP3)
+		sc.inc(lpHandlerArgs->bUseSSL ? SCN_GATEWAY_POP3S_CONNECTIONS : SCN_GATEWAY_POP3_CONNECTIONS);
+	else
+		sc.inc(lpHandlerArgs->bUseSSL ? SCN_GATEWAY_IMAPS_CONNECTIONS : SCN_GATEWAY_IMAP_CONNECTIONS);
 
 	pthread_t tid;
 	ec_log_notice("Starting worker %s for %s request", model, method);
@@ -553,6 +581,7 @@ static HRESULT handler_client(size_t i)
 		    g_socks.linfd.data()) < 0) {
 			ec_log_err("Could not create %s %s: %s", method, model, strerror(errno));
 			--nChildren;
+			sc.inc(SCN_GATEWAY_WORKER_FAILED);
 			return MAPI_E_CALL_FAILED;
 		}
 		return hrSuccess;
@@ -574,6 +603,7 @@ static HRESULT handler_client(size_t i)
 	pthread_attr_destroy(&attr);
 	if (err != 0) {
 		ec_log_err("Could not create %s %s: %s", method, model, strerror(err));
+		sc.inc(SCN_GATEWAY_WORKER_FAILED);
 		return MAPI_E_CALL_FAILED;
 	}
 	set_thread_name(tid, "net/" + strToLower(method));
@@ -640,6 +670,13 @@ static HRESULT running_service(char **argv)
 		return hr;
 	}
 
+	/*
+	 * Not a static: forked workers leave through exit(), which must not
+	 * tear down the collector threads of the parent.
+	 */
+	auto sc = std::make_shared<gateway_stats>(g_lpConfig);
+	sc->start();
+
 	// Mainloop
 	while (!quit) {
 		if (g_sighup_flag)
@@ -661,11 +698,12 @@ static HRESULT running_service(char **argv)
 			if (!(g_socks.pollfd[i].revents & POLLIN))
 				/* OS might set more bits than requested */
 				continue;
-			handler_client(i);
+			handler_client(i, *sc);
 		}
 	}
 
 	ec_log_always("POP3/IMAP Gateway will now exit");
+	sc->stop();
 	// in forked mode, send all children the exit signal
 	if (!bThreads) {
 		signal(SIGTERM, SIG_IGN);
@@ -5,7 +5,10 @@
 #include <kopano/platform.h>
 #include <pthread.h>
 #include <mapix.h>
+#include <cerrno>
 #include <ctime>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <kopano/timeutil.hpp>
 #include "ECMapiUtils.h"
 
@@ -151,6 +154,49 @@ size_t inputStreamMAPIAdapter::skip(size_t count)
 	return ulSize.QuadPart;
 }
 
+inputStreamFILEAdapter::inputStreamFILEAdapter(FILE *fp)
+{
+	struct stat sb;
+
+	/* Data written through stdio must be visible to pread */
+	if (fp == nullptr || fflush(fp) != 0)
+		return;
+	m_fd = fileno(fp);
+	if (m_fd < 0 || fstat(m_fd, &sb) != 0 || !S_ISREG(sb.st_mode))
+		return;
+	m_size = sb.st_size;
+	m_seekable = true;
+}
+
+size_t inputStreamFILEAdapter::read(vmime::byte_t *data, size_t count)
+{
+	if (!m_seekable || m_pos >= m_size)
+		return 0;
+	if (count > m_size - m_pos)
+		count = m_size - m_pos;
+	size_t done = 0;
+	while (done < count) {
+		auto ret = pread(m_fd, data + done, count - done, m_pos + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+	m_pos += done;
+	return done;
+}
+
+size_t inputStreamFILEAdapter::skip(size_t count)
+{
+	if (m_pos >= m_size)
+		return 0;
+	if (count > m_size - m_pos)
+		count = m_size - m_pos;
+	m_pos += count;
+	return count;
+}
+
 outputStreamMAPIAdapter::outputStreamMAPIAdapter(IStream *s) :
 	lpStream(s)
 {}
@@ -3,9 +3,11 @@
  * Copyright 2005 - 2016 Zarafa and its licensors
  */
 #pragma once
+#include <cstdio>
 #include <sys/types.h>
 #include <vmime/dateTime.hpp>
 #include <vmime/utility/inputStream.hpp>
+#include <vmime/utility/seekableInputStream.hpp>
 #include <vmime/utility/outputStream.hpp>
 #include <mapidefs.h>
 #include <kopano/memory.hpp>
@@ -25,6 +27,30 @@ class inputStreamMAPIAdapter final : public vmime::utility::inputStream {
 	object_ptr<IStream> lpStream;
 };
 
+/**
+ * Seekable vmime view of a (temporary) file. Reads go through pread(2), so
+ * the FILE position is not disturbed and vmime body contents can keep
+ * referring to regions of the file instead of copies in memory.
+ */
+class inputStreamFILEAdapter final : public vmime::utility::seekableInputStream {
+	public:
+	inputStreamFILEAdapter(FILE *);
+	virtual size_t read(vmime::byte_t *, size_t) override;
+	virtual size_t skip(size_t) override;
+	virtual void reset() override { m_pos = 0; }
+	virtual bool eof() const override { return m_pos >= m_size; }
+	virtual size_t getPosition() const override { return m_pos; }
+	virtual void seek(size_t pos) override { m_pos = pos; }
+	/* Returns false if the file cannot be read at arbitrary offsets */
+	bool seekable() const { return m_seekable; }
+	size_t size() const { return m_size; }
+
+	private:
+	int m_fd = -1;
+	size_t m_pos = 0, m_size = 0;
+	bool m_seekable = false;
+};
+
 class outputStreamMAPIAdapter final : public vmime::utility::outputStream {
 	public:
 	outputStreamMAPIAdapter(IStream *);
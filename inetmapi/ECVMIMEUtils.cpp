@@ -4,11 +4,14 @@
  */
 #include <kopano/platform.h>
 #include <exception>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <sstream>
 #include <string>
 #include <climits>
+#include <ctime>
 #include "ECVMIMEUtils.h"
 #include "MAPISMTPTransport.h"
 #include <kopano/CommonUtil.h>
@@ -16,6 +19,7 @@
 #include <kopano/ECRestriction.h>
 #include <kopano/MAPIErrors.h>
 #include <kopano/memory.hpp>
+#include <kopano/scope.hpp>
 #include <kopano/charset/convert.h>
 #include <kopano/stringutil.h>
 #include <mapi.h>
@@ -54,6 +58,123 @@ public:
 	};
 };
 
+/**
+ * Connections to the smarthost are kept open between messages, so that
+ * a busy spooler does not pay for connection setup, TLS, EHLO and AUTH
+ * on every message. Each connection is used by one sender at a time.
+ */
+class smtp_pool final {
+	public:
+	struct conn {
+		vmime::shared_ptr<vmime::net::session> ses;
+		vmime::shared_ptr<vmime::net::transport> tp;
+		time_t last_used = 0;
+	};
+
+	bool get(const std::string &key, conn &);
+	void put(const std::string &key, conn &&);
+	void configure(unsigned int max_idle, unsigned int timeout);
+	void flush();
+
+	private:
+	static void close(std::vector<conn> &);
+
+	std::mutex m_lock;
+	std::multimap<std::string, conn> m_idle;
+	unsigned int m_max_idle = 0, m_timeout = 30;
+};
+
+static smtp_pool g_smtp_pool;
+
+void smtp_pool::close(std::vector<conn> &list)
+{
+	for (auto &c : list) {
+		try {
+			if (c.tp->isConnected())
+				c.tp->disconnect();
+		} catch (const vmime::exception &) {
+		}
+	}
+	list.clear();
+}
+
+bool smtp_pool::get(const std::string &key, conn &out)
+{
+	std::vector<conn> expired;
+	auto now = time(nullptr);
+	bool found = false;
+	std::unique_lock<std::mutex> lk(m_lock);
+	auto range = m_idle.equal_range(key);
+	for (auto i = range.first; i != range.second; ) {
+		if (now - i->second.last_used > static_cast<time_t>(m_timeout)) {
+			expired.emplace_back(std::move(i->second));
+			i = m_idle.erase(i);
+		} else if (!found) {
+			out = std::move(i->second);
+			found = true;
+			i = m_idle.erase(i);
+		} else {
+			++i;
+		}
+	}
+	lk.unlock();
+	close(expired);
+	return found;
+}
+
+void smtp_pool::put(const std::string &key, conn &&c)
+{
+	std::vector<conn> drop;
+	c.last_used = time(nullptr);
+	std::unique_lock<std::mutex> lk(m_lock);
+	if (m_idle.count(key) < m_max_idle)
+		m_idle.emplace(key, std::move(c));
+	else
+		drop.emplace_back(std::move(c));
+	lk.unlock();
+	close(drop);
+}
+
+void smtp_pool::configure(unsigned int max_idle, unsigned int timeout)
+{
+	std::unique_lock<std::mutex> lk(m_lock);
+	m_max_idle = max_idle;
+	m_timeout = timeout;
+	lk.unlock();
+	if (max_idle == 0)
+		flush();
+}
+
+void smtp_pool::flush()
+{
+	std::vector<conn> list;
+	std::unique_lock<std::mutex> lk(m_lock);
+	for (auto &e : m_idle)
+		list.emplace_back(std::move(e.second));
+	m_idle.clear();
+	lk.unlock();
+	close(list);
+}
+
+/**
+ * Keep up to @max_idle connections per SMTP server open between messages,
+ * for at most @timeout seconds. 0 disables reuse. Until this is called,
+ * the pool keeps nothing; kopano-spooler calls it with its
+ * smtp_idle_connections setting (default 5) in threaded mode.
+ */
+void smtp_pool_configure(unsigned int max_idle, unsigned int timeout)
+{
+	g_smtp_pool.configure(max_idle, timeout);
+}
+
+/**
+ * Close all idle SMTP connections.
+ */
+void smtp_pool_flush()
+{
+	g_smtp_pool.flush();
+}
+
 ECVMIMESender::ECVMIMESender(const std::string &host, int port) :
     ECSender(host, port)
 {
@@ -269,18 +390,6 @@ HRESULT ECVMIMESender::sendMail(LPADRBOOK lpAdrBook, LPMESSAGE lpMessage,
 	error.clear();
 
 	try {
-		// Session initialization (global properties)
-		auto vmSession = vmime::net::session::create();
-
-		// set the server address and port, plus type of service by use of url
-		// and get our special mapismtp mailer
-		vmime::utility::url url("mapismtp", smtphost, smtpport);
-		auto vmTransport = vmSession->getTransport(url);
-		vmTransport->setTimeoutHandlerFactory(vmime::make_shared<mapiTimeoutHandlerFactory>());
-
-		/* cast to access interface extras */
-		auto mapiTransport = vmime::dynamicCast<MAPISMTPTransport>(vmTransport);
-
 		// get expeditor for 'mail from:' smtp command
 		if (vmMessage->getHeader()->hasField(vmime::fields::FROM))
 			expeditor = *vmime::dynamicCast<vmime::mailbox>(vmMessage->getHeader()->findField(vmime::fields::FROM)->getValue());
@@ -310,13 +419,6 @@ HRESULT ECVMIMESender::sendMail(LPADRBOOK lpAdrBook, LPMESSAGE lpMessage,
 			vmMessage->getHeader()->removeField(bcc);
 		}
 
-		// Delivery report request
-		memory_ptr<SPropValue> ptrDeliveryReport;
-		if (mapiTransport != nullptr &&
-		    HrGetOneProp(lpMessage, PR_ORIGINATOR_DELIVERY_REPORT_REQUESTED, &~ptrDeliveryReport) == hrSuccess &&
-		    ptrDeliveryReport->Value.b)
-			mapiTransport->requestDSN(true, "");
-
 		// Generate the message, "stream" it and delegate the sending
 		// to the generic send() function.
 		std::ostringstream oss;
@@ -329,19 +431,56 @@ HRESULT ECVMIMESender::sendMail(LPADRBOOK lpAdrBook, LPMESSAGE lpMessage,
 		const std::string &str(oss.str()); // copy?
 		vmime::utility::inputStreamStringAdapter isAdapter(str); // direct oss.str() ?
 
+		// Reuse an idle connection if there is one that is still alive
+		auto pool_key = smtphost + ":" + std::to_string(smtpport);
+		smtp_pool::conn conn;
+		bool reused = g_smtp_pool.get(pool_key, conn);
+		if (reused) {
+			try {
+				conn.tp->noop();
+				ec_log_debug("SMTP: reusing connection to %s", pool_key.c_str());
+			} catch (const vmime::exception &e) {
+				ec_log_debug("SMTP: idle connection to %s went away: %s", pool_key.c_str(), e.what());
+				reused = false;
+			}
+		}
+		if (!reused) {
+			// Session initialization (global properties)
+			conn.ses = vmime::net::session::create();
+			// set the server address and port, plus type of service by use of url
+			// and get our special mapismtp mailer
+			vmime::utility::url url("mapismtp", smtphost, smtpport);
+			conn.tp = conn.ses->getTransport(url);
+			conn.tp->setTimeoutHandlerFactory(vmime::make_shared<mapiTimeoutHandlerFactory>());
+		}
+		auto vmTransport = conn.tp;
+		/* cast to access interface extras */
+		auto mapiTransport = vmime::dynamicCast<MAPISMTPTransport>(vmTransport);
+
+		// Delivery report request
+		memory_ptr<SPropValue> ptrDeliveryReport;
+		if (mapiTransport != nullptr)
+			mapiTransport->requestDSN(HrGetOneProp(lpMessage, PR_ORIGINATOR_DELIVERY_REPORT_REQUESTED, &~ptrDeliveryReport) == hrSuccess &&
+				ptrDeliveryReport->Value.b, "");
+
 		// send the email already!
 		bool ok = false;
-		try {
-			vmTransport->connect();
-		} catch (const vmime::exception &e) {
-			// special error, smtp server not respoding, so try later again
-			ec_log_err("Connect to SMTP: %s. E-Mail will be tried again later.", e.what());
-			return MAPI_W_NO_SERVICE;
+		auto keep_conn = make_scope_exit([&]() {
+			if (ok && vmTransport->isConnected())
+				g_smtp_pool.put(pool_key, std::move(conn));
+		});
+		if (!reused) {
+			try {
+				vmTransport->connect();
+			} catch (const vmime::exception &e) {
+				// special error, smtp server not respoding, so try later again
+				ec_log_err("Connect to SMTP: %s. E-Mail will be tried again later.", e.what());
+				return MAPI_W_NO_SERVICE;
+			}
 		}
 
 		try {
 			vmTransport->send(expeditor, recipients, isAdapter, str.length(), NULL);
-			vmTransport->disconnect();
 			ok = true;
 		} catch (const vmime::exceptions::command_error &e) {
 			if (mapiTransport != NULL) {
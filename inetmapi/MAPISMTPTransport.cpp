@@ -437,9 +437,59 @@ void MAPISMTPTransport::noop()
 		throw exceptions::command_error("NOOP", resp->getText());
 }
 
+/**
+ * Record the outcome of a RCPT command in the failed-recipient lists.
+ * Returns false if the server gave up on the session (421).
+ */
+bool MAPISMTPTransport::rcptResponse(const mailbox &mbox, const SMTPResponse &resp)
+{
+	auto code = resp.getCode();
+	sFailedRecip entry;
+	auto recip_name = mbox.getName().getConvertedText(charset(CHARSET_WCHAR));
+	entry.strRecipName.assign(reinterpret_cast<const wchar_t *>(recip_name.c_str()), recip_name.length() / sizeof(wchar_t));
+	entry.strRecipEmail = mbox.getEmail().toString();
+	entry.ulSMTPcode = code;
+	entry.strSMTPResponse = resp.getText();
+
+	if (code / 10 == 25) {
+		return true;
+	} else if (code == 421) {
+		/* 421 4.7.0 localhorse.lh Error: too many errors */
+		ec_log_err("RCPT line gave SMTP error: %d %s. (and now?)",
+			code, resp.getText().c_str());
+		return false;
+	} else if (code / 100 == 5) {
+		/*
+		 * Example Postfix codes:
+		 * 501 5.1.3 Bad recipient address syntax  (RCPT TO: <with spaces>)
+		 * 550 5.1.1 <fox>: Recipient address rejected: User unknown in virtual mailbox table
+		 * 550 5.7.1 REJECT action without code by means of e.g. /etc/postfix/header_checks
+		 */
+		mPermanentFailedRecipients.emplace_back(std::move(entry));
+		ec_log_err("RCPT line gave SMTP error %d %s. (no retry)",
+			code, resp.getText().c_str());
+		return true;
+	} else if (code / 100 != 4) {
+		mPermanentFailedRecipients.emplace_back(std::move(entry));
+		ec_log_err("RCPT line gave unexpected SMTP reply %d %s. (no retry)",
+			code, resp.getText().c_str());
+		return true;
+	}
+
+	/* Other 4xx codes (disk full, ... ?) */
+	mTemporaryFailedRecipients.emplace_back(std::move(entry));
+	ec_log_err("RCPT line gave SMTP error: %d %s. (will be retried)",
+		code, resp.getText().c_str());
+	return true;
+}
+
 //
 // Only this function is altered, to return per recipient failure.
 //
+// The connection stays open after a successful send, so that it can be
+// used for the next message. When the server announced PIPELINING
+// (RFC 2920), the envelope goes out in one write.
+//
 void MAPISMTPTransport::send(const mailbox &expeditor,
     const mailboxList &recipients, utility::inputStream &is, size_t size,
     utility::progressListener *progress, const mailbox &sender)
@@ -466,7 +516,28 @@ void MAPISMTPTransport::send(const mailbox &expeditor,
 			strSend += " ENVID=" + m_strDSNTrackid;
 	}
 
-	sendRequest(strSend);
+	std::vector<std::string> rcpt_cmds;
+	for (size_t i = 0; i < recipients.getMailboxCount(); ++i) {
+		auto cmd = "RCPT TO: <" + recipients.getMailboxAt(i)->getEmail().toString() + ">";
+		if (bDSN)
+			cmd += " NOTIFY=SUCCESS,DELAY";
+		rcpt_cmds.emplace_back(std::move(cmd));
+	}
+
+	bool pipelined = m_extensions.find("PIPELINING") != m_extensions.end();
+	if (pipelined) {
+		std::string batch = strSend + "\r\n";
+		ec_log_debug("< %s", strSend.c_str());
+		for (const auto &cmd : rcpt_cmds) {
+			ec_log_debug("< %s", cmd.c_str());
+			batch += cmd + "\r\n";
+		}
+		ec_log_debug("< DATA");
+		batch += "DATA\r\n";
+		m_socket->send(batch);
+	} else {
+		sendRequest(strSend);
+	}
 	auto resp = readResponse();
 	if (resp->getCode() / 10 != 25) {
 		internalDisconnect();
@@ -477,57 +548,22 @@ void MAPISMTPTransport::send(const mailbox &expeditor,
 	mTemporaryFailedRecipients.clear();
 	mPermanentFailedRecipients.clear();
 	for (size_t i = 0 ; i < recipients.getMailboxCount(); ++i) {
-		const mailbox& mbox = *recipients.getMailboxAt(i);
-		unsigned int code;
-
-		strSend = "RCPT TO: <" + mbox.getEmail().toString() + ">";
-		if (bDSN)
-			 strSend += " NOTIFY=SUCCESS,DELAY";
-
-		sendRequest(strSend);
+		if (!pipelined)
+			sendRequest(rcpt_cmds[i]);
 		resp = readResponse();
-		code = resp->getCode();
-
-		sFailedRecip entry;
-		auto recip_name = mbox.getName().getConvertedText(charset(CHARSET_WCHAR));
-		entry.strRecipName.assign(reinterpret_cast<const wchar_t *>(recip_name.c_str()), recip_name.length() / sizeof(wchar_t));
-		entry.strRecipEmail = mbox.getEmail().toString();
-		entry.ulSMTPcode = code;
-		entry.strSMTPResponse = resp->getText();
-
-		if (code / 10 == 25) {
-			continue;
-		} else if (code == 421) {
-			/* 421 4.7.0 localhorse.lh Error: too many errors */
-			ec_log_err("RCPT line gave SMTP error: %d %s. (and now?)",
-				resp->getCode(), resp->getText().c_str());
-			break;
-		} else if (code / 100 == 5) {
-			/*
-			 * Example Postfix codes:
-			 * 501 5.1.3 Bad recipient address syntax  (RCPT TO: <with spaces>)
-			 * 550 5.1.1 <fox>: Recipient address rejected: User unknown in virtual mailbox table
-			 * 550 5.7.1 REJECT action without code by means of e.g. /etc/postfix/header_checks
-			 */
-			mPermanentFailedRecipients.emplace_back(std::move(entry));
-			ec_log_err("RCPT line gave SMTP error %d %s. (no retry)",
-				resp->getCode(), resp->getText().c_str());
-			continue;
-		} else if (code / 100 != 4) {
-			mPermanentFailedRecipients.emplace_back(std::move(entry));
-			ec_log_err("RCPT line gave unexpected SMTP reply %d %s. (no retry)",
-				resp->getCode(), resp->getText().c_str());
+		if (rcptResponse(*recipients.getMailboxAt(i), *resp))
 			continue;
+		if (pipelined) {
+			/* The remaining replies will not come anymore. */
+			internalDisconnect();
+			throw exceptions::connection_error(format("%d %s", resp->getCode(), resp->getText().c_str()));
 		}
-
-		/* Other 4xx codes (disk full, ... ?) */
-		mTemporaryFailedRecipients.emplace_back(std::move(entry));
-		ec_log_err("RCPT line gave SMTP error: %d %s. (will be retried)",
-			resp->getCode(), resp->getText().c_str());
+		break;
 	}
 
 	// Send the message data
-	sendRequest("DATA");
+	if (!pipelined)
+		sendRequest("DATA");
 
 	// we also stop here if all recipients failed before
 	resp = readResponse();
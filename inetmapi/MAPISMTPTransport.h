@@ -67,6 +67,7 @@ public:
 private:
 	void sendRequest(const std::string &buffer, const bool end = true);
 	vmime::shared_ptr<vmime::net::smtp::SMTPResponse> readResponse();
+	bool rcptResponse(const vmime::mailbox &, const vmime::net::smtp::SMTPResponse &);
 	void internalDisconnect();
 	void helo();
 	void authenticate();
@@ -30,6 +30,7 @@
 #include <vmime/platforms/posix/posixHandler.hpp>
 #include <vmime/contentTypeField.hpp>
 #include <vmime/contentDispositionField.hpp>
+#include <vmime/utility/streamUtils.hpp>
 #include <libxml/HTMLparser.h>
 #include <mapi.h>
 #include <mapix.h>
@@ -43,6 +44,7 @@
 #include <kopano/Util.h>
 #include <kopano/CommonUtil.h>
 #include <kopano/MAPIErrors.h>
+#include <kopano/fileutil.hpp>
 #include <kopano/namedprops.h>
 #include <kopano/charset/convert.h>
 #include <kopano/stringutil.h>
@@ -71,7 +73,7 @@ enum {
 static vmime::charset vtm_upgrade_charset(vmime::charset cset, const char *ascii_upgrade = nullptr);
 static int getCharsetFromHTML(const std::string &, vmime::charset *);
 static HRESULT postWriteFixups(IMessage *);
-static size_t countBodyLines(const std::string &, size_t, size_t);
+static size_t countBodyLines(vmime::utility::seekableInputStream &, size_t, size_t);
 static std::string parameterizedFieldToStructure(vmime::shared_ptr<vmime::parameterizedHeaderField>);
 static void vtm_hide_attachment(IMessage *);
 
@@ -180,25 +182,52 @@ HRESULT VMIMEToMAPI::createIMAPProperties(const std::string &input, std::string
 {
 	auto vmMessage = vmime::make_shared<vmime::message>();
 	vmMessage->parse(m_parsectx, input);
-	if (lpBody || lpBodyStructure)
-		messagePartToStructure(input, vmMessage, lpBody, lpBodyStructure);
+	if (lpBody || lpBodyStructure) {
+		vmime::utility::inputStreamStringAdapter in(input);
+		messagePartToStructure(in, vmMessage, lpBody, lpBodyStructure);
+	}
 	if (lpEnvelope)
 		*lpEnvelope = createIMAPEnvelope(vmMessage);
 	return hrSuccess;
 }
 
-static size_t extract_headers_raw(IMessage *msg, const std::string &input)
+/**
+ * Locate the end of the first header block, reading no further into the
+ * stream than needed, and store it as PR_TRANSPORT_MESSAGE_HEADERS.
+ *
+ * Returns the offset of the empty line, or std::string::npos.
+ */
+static size_t extract_headers_raw(IMessage *msg,
+    vmime::utility::seekableInputStream &input)
 {
-	auto end = input.find("\r\n\r\n");
+	static constexpr size_t CHUNK = 4096;
+	std::string headers;
+	vmime::byte_t buf[CHUNK];
+	auto end = std::string::npos;
 	bool lfonly = false;
-	if (end == std::string::npos) {
-		/* Input was not RFC compliant, try Unix enters */
-		end = input.find("\n\n");
-		lfonly = true;
+
+	input.reset();
+	while (!input.eof()) {
+		auto rd = input.read(buf, sizeof(buf));
+		if (rd == 0)
+			break;
+		/* Rescan the tail of the previous chunk: a separator may straddle */
+		auto from = headers.size() < 3 ? 0 : headers.size() - 3;
+		headers.append(x2s(buf), rd);
+		end = headers.find("\r\n\r\n", from);
+		/* Input may not be RFC compliant and use Unix enters */
+		auto lf = headers.find("\n\n", from);
+		if (lf != std::string::npos && lf < end) {
+			end = lf;
+			lfonly = true;
+		}
+		if (end != std::string::npos)
+			break;
 	}
+	input.reset();
 	if (end == std::string::npos)
 		return end;
-	auto headers = input.substr(0, end);
+	headers.resize(end);
 	KPropbuffer<1> prop;
 	if (lfonly)
 		StringLFtoCRLF(headers);
@@ -210,23 +239,59 @@ static size_t extract_headers_raw(IMessage *msg, const std::string &input)
 /**
  * Entry point for the conversion from RFC 2822 mail to IMessage MAPI object.
  *
+ * @param[in]	input	std::string containing the RFC 2822 mail.
+ * @param[out]	lpMessage	Pointer to a message which was already created on a IMAPIFolder.
+ * @return		MAPI error code.
+ */
+HRESULT VMIMEToMAPI::convertVMIMEToMAPI(const std::string &input, IMessage *lpMessage)
+{
+	return convert_stream(vmime::make_shared<vmime::utility::inputStreamStringAdapter>(input),
+	       input.size(), lpMessage);
+}
+
+/**
+ * Streaming variant of the conversion: the mail is parsed straight from
+ * @input, and body parts and attachments are copied from the file into
+ * their MAPI streams when they are processed, so the message is never held
+ * in memory in its entirety. Non-seekable input (pipes) is read into
+ * memory and converted the classic way.
+ *
+ * @param[in]	input	file containing the RFC 2822 mail.
+ * @param[out]	lpMessage	Pointer to a message which was already created on a IMAPIFolder.
+ * @return		MAPI error code.
+ */
+HRESULT VMIMEToMAPI::convertVMIMEToMAPI(FILE *input, IMessage *lpMessage)
+{
+	auto in = vmime::make_shared<inputStreamFILEAdapter>(input);
+	if (in->seekable())
+		return convert_stream(in, in->size(), lpMessage);
+
+	std::string buffer;
+	auto hr = HrMapFileToString(input, &buffer);
+	if (hr != hrSuccess)
+		return hr;
+	return convertVMIMEToMAPI(buffer, lpMessage);
+}
+
+/**
  * Finds the first block of headers to place in the
  * PR_TRANSPORT_MESSAGE_HEADERS property. Then it lets libvmime parse
  * the email and starts the main conversion function
  * fillMAPIMail. Afterwards it may handle signed messages, and set an
  * extra flag when all attachments were marked hidden.
  *
- * @param[in]	input	std::string containing the RFC 2822 mail.
- * @param[out]	lpMessage	Pointer to a message which was already created on a IMAPIFolder.
- * @return		MAPI error code.
+ * Since libvmime is given a seekable stream rather than a buffer, body
+ * contents stay references into @input until they are extracted.
+ *
  * @retval		MAPI_E_CALL_FAILED	Caught an exception, which breaks the conversion.
  */
-HRESULT VMIMEToMAPI::convertVMIMEToMAPI(const std::string &input, IMessage *lpMessage)
+HRESULT VMIMEToMAPI::convert_stream(const vmime::shared_ptr<vmime::utility::seekableInputStream> &input,
+    size_t length, IMessage *lpMessage)
 {
 	try {
 		if (m_mailState.ulMsgInMsg == 0)
 			m_mailState = sMailState();
-		auto hdr_end = extract_headers_raw(lpMessage, input);
+		auto hdr_end = extract_headers_raw(lpMessage, *input);
 		/*
 		 * Add PR_MESSAGE_SIZE initially to the size of the RFC2822
 		 * part. PR_MESSAGE_SIZE is needed for rule processing; if this
@@ -238,12 +303,12 @@ HRESULT VMIMEToMAPI::convertVMIMEToMAPI(const std::string &input, IMessage *lpMe
 		*/
 		SPropValue sMessageSize;
 		sMessageSize.ulPropTag = PR_MESSAGE_SIZE;
-		sMessageSize.Value.ul = input.length();
+		sMessageSize.Value.ul = length;
 		lpMessage->SetProps(1, &sMessageSize, nullptr);
 
-		// turn buffer into a message
+		// turn stream into a message
 		auto vmMessage = vmime::make_shared<vmime::message>();
-		vmMessage->parse(m_parsectx, input);
+		vmMessage->parse(m_parsectx, input, 0, length);
 		if (m_dopt.header_strict_rfc) {
 			auto vmHeader = vmMessage->getHeader();
 			if (!vmHeader->hasField(vmime::fields::FROM) && !vmHeader->hasField(vmime::fields::DATE))
@@ -252,13 +317,13 @@ HRESULT VMIMEToMAPI::convertVMIMEToMAPI(const std::string &input, IMessage *lpMe
 
 		// save imap data first, seems vmMessage may be altered in the rest of the code.
 		if (m_dopt.add_imap_data)
-			createIMAPBody(input, vmMessage, lpMessage);
+			createIMAPBody(*input, length, vmMessage, lpMessage);
 		auto hr = fillMAPIMail(vmMessage, lpMessage);
 		if (hr != hrSuccess)
 			return hr;
 
 		if (m_mailState.bAttachSignature && !m_dopt.parse_smime_signed) {
-			hr = save_raw_smime(input, hdr_end, vmMessage->getHeader(), lpMessage);
+			hr = save_raw_smime(*input, hdr_end, length, vmMessage->getHeader(), lpMessage);
 			if (hr != hrSuccess)
 				return hr;
 		}
@@ -278,7 +343,8 @@ HRESULT VMIMEToMAPI::convertVMIMEToMAPI(const std::string &input, IMessage *lpMe
 	return hrSuccess;
 }
 
-HRESULT VMIMEToMAPI::save_raw_smime(const std::string &input, size_t posHeaderEnd,
+HRESULT VMIMEToMAPI::save_raw_smime(vmime::utility::seekableInputStream &input,
+    size_t posHeaderEnd, size_t length,
     const vmime::shared_ptr<vmime::header> &vmHeader, IMessage *lpMessage)
 {
 	static constexpr SizedSPropTagArray(2, sptaAttach) =
@@ -319,8 +385,8 @@ HRESULT VMIMEToMAPI::save_raw_smime(const std::string &input, size_t posHeaderEn
 	vmHeader->ContentType()->generate(m_genctx, os);
 	// find the original received body
 	// vmime re-generates different headers and spacings, so we can't use this.
-	if (posHeaderEnd != input.npos)
-		os.write(input.c_str() + posHeaderEnd, input.size() - posHeaderEnd);
+	if (posHeaderEnd != std::string::npos)
+		vmime::utility::bufferedStreamCopyRange(input, os, posHeaderEnd, length - posHeaderEnd);
 	hr = lpStream->Commit(0);
 	if (hr != hrSuccess)
 		return hr;
@@ -3190,8 +3256,9 @@ HRESULT VMIMEToMAPI::createIMAPBody(const std::string &input,
 {
 	KPropbuffer<4> sProps;
 	std::string strBody, strBodyStructure;
+	vmime::utility::inputStreamStringAdapter in(input);
 
-	messagePartToStructure(input, vmMessage, &strBody, &strBodyStructure);
+	messagePartToStructure(in, vmMessage, &strBody, &strBodyStructure);
 
 	sProps[0].ulPropTag = PR_EC_IMAP_EMAIL_SIZE;
 	sProps[0].Value.ul = input.length();
@@ -3203,6 +3270,35 @@ HRESULT VMIMEToMAPI::createIMAPBody(const std::string &input,
 	return lpMessage->SetProps(4, sProps.get(), nullptr);
 }
 
+/**
+ * Same as above, but the raw email is copied from @input into the
+ * PR_EC_IMAP_EMAIL stream in chunks instead of from a memory buffer.
+ */
+HRESULT VMIMEToMAPI::createIMAPBody(vmime::utility::seekableInputStream &input,
+    size_t length, vmime::shared_ptr<vmime::message> vmMessage,
+    IMessage *lpMessage)
+{
+	KPropbuffer<3> sProps;
+	std::string strBody, strBodyStructure;
+	object_ptr<IStream> lpStream;
+
+	messagePartToStructure(input, vmMessage, &strBody, &strBodyStructure);
+	sProps[0].ulPropTag = PR_EC_IMAP_EMAIL_SIZE;
+	sProps[0].Value.ul = length;
+	sProps.set(1, PR_EC_IMAP_BODY, std::move(strBody));
+	sProps.set(2, PR_EC_IMAP_BODYSTRUCTURE, std::move(strBodyStructure));
+	auto hr = lpMessage->SetProps(3, sProps.get(), nullptr);
+	if (hr != hrSuccess)
+		return hr;
+	hr = lpMessage->OpenProperty(PR_EC_IMAP_EMAIL, &IID_IStream,
+	     STGM_WRITE | STGM_TRANSACTED, MAPI_CREATE | MAPI_MODIFY, &~lpStream);
+	if (hr != hrSuccess)
+		return hr;
+	outputStreamMAPIAdapter os(lpStream);
+	vmime::utility::bufferedStreamCopyRange(input, os, 0, length);
+	return lpStream->Commit(0);
+}
+
 /**
  * Convert a vmime message to a
  *
@@ -3213,7 +3309,7 @@ HRESULT VMIMEToMAPI::createIMAPBody(const std::string &input,
  *
  * @return always success
  */
-HRESULT VMIMEToMAPI::messagePartToStructure(const std::string &input,
+HRESULT VMIMEToMAPI::messagePartToStructure(vmime::utility::seekableInputStream &input,
     vmime::shared_ptr<vmime::bodyPart> vmBodyPart, std::string *lpSimple,
     std::string *lpExtended)
 {
@@ -3291,7 +3387,7 @@ HRESULT VMIMEToMAPI::messagePartToStructure(const std::string &input,
  *
  * @return always success
  */
-HRESULT VMIMEToMAPI::bodyPartToStructure(const std::string &input,
+HRESULT VMIMEToMAPI::bodyPartToStructure(vmime::utility::seekableInputStream &input,
     vmime::shared_ptr<vmime::bodyPart> vmBodyPart, std::string *lpSimple,
     std::string *lpExtended)
 {
@@ -3371,12 +3467,13 @@ HRESULT VMIMEToMAPI::bodyPartToStructure(const std::string &input,
 		lBodyStructure.emplace_back("(" + createIMAPEnvelope(subMessage) + ")");
 
 		// recurse message-in-message
-		messagePartToStructure(buffer, subMessage, &strSubSingle, &strSubExtended);
+		vmime::utility::inputStreamStringAdapter subInput(buffer);
+		messagePartToStructure(subInput, subMessage, &strSubSingle, &strSubExtended);
 		lBody.emplace_back(std::move(strSubSingle));
 		lBodyStructure.emplace_back(std::move(strSubExtended));
 
 		// dus hier nog de line count van vmBodyPart->getBody buffer?
-		lBody.emplace_back(stringify(countBodyLines(buffer, 0, buffer.length())));
+		lBody.emplace_back(stringify(countBodyLines(subInput, 0, buffer.length())));
 	}
 
 nil:
@@ -3458,27 +3555,29 @@ static std::string parameterizedFieldToStructure(vmime::shared_ptr<vmime::parame
 }
 
 /**
- * Return the number of lines in a string, with defined start and
+ * Return the number of lines in a stream, with defined start and
  * length.
  *
- * @param[in] input count number of \n chars in this string
+ * @param[in] input count number of \n chars in this stream
  * @param[in] start start from this point in input
  * @param[in] length until the end, but no further than this length
  *
  * @return number of lines
  */
-static size_t countBodyLines(const std::string &input, size_t start, size_t length)
+static size_t countBodyLines(vmime::utility::seekableInputStream &input,
+    size_t start, size_t length)
 {
-	size_t lines = 0, pos = start;
+	vmime::byte_t buf[4096];
+	size_t lines = 0, left = length + 1;
 
-	while (true) {
-		pos = input.find_first_of('\n', pos);
-		if (pos == input.npos || pos > start + length)
+	input.seek(start);
+	while (left > 0 && !input.eof()) {
+		auto rd = input.read(buf, std::min(left, sizeof(buf)));
+		if (rd == 0)
 			break;
-		++pos;
-		++lines;
+		lines += std::count(buf, buf + rd, '\n');
+		left -= rd;
 	}
-
 	return lines;
 }
 
@@ -3,6 +3,7 @@
  * Copyright 2005 - 2016 Zarafa and its licensors
  */
 #pragma once
+#include <cstdio>
 #include <string>
 #include <vector>
 #include <vmime/vmime.hpp>
@@ -42,6 +43,7 @@ public:
 	VMIMEToMAPI();
 	VMIMEToMAPI(IAddrBook *, delivery_options &&);
 	HRESULT convertVMIMEToMAPI(const std::string &input, IMessage *lpMessage);
+	HRESULT convertVMIMEToMAPI(FILE *input, IMessage *lpMessage);
 	HRESULT createIMAPProperties(const std::string &input, std::string *envelope, std::string *body, std::string *bodystruct);
 	HRESULT createIMAPBody(const std::string &input, vmime::shared_ptr<vmime::message>, IMessage *);
 	HRESULT createIMAPEnvelope(vmime::shared_ptr<vmime::message>, IMessage *);
@@ -56,6 +58,8 @@ public:
 	sMailState m_mailState;
 	convert_context m_converter;
 
+	HRESULT convert_stream(const vmime::shared_ptr<vmime::utility::seekableInputStream> &, size_t length, IMessage *);
+	HRESULT createIMAPBody(vmime::utility::seekableInputStream &, size_t length, vmime::shared_ptr<vmime::message>, IMessage *);
 	HRESULT fillMAPIMail(vmime::shared_ptr<vmime::message>, IMessage *lpMessage);
 	HRESULT dissect_body(vmime::shared_ptr<vmime::header>, vmime::shared_ptr<vmime::body>, IMessage *lpMessage, unsigned int flags = 0);
 	void dissect_message(vmime::shared_ptr<vmime::body>, IMessage *);
@@ -75,10 +79,10 @@ public:
 	HRESULT handleMessageToMeProps(IMessage *lpMessage, LPADRLIST lpRecipients);
 	std::wstring getWideFromVmimeText(const vmime::text &vmText);
 	std::string createIMAPEnvelope(vmime::shared_ptr<vmime::message>);
-	HRESULT messagePartToStructure(const std::string &input, vmime::shared_ptr<vmime::bodyPart>, std::string *simple, std::string *extended);
-	HRESULT bodyPartToStructure(const std::string &input, vmime::shared_ptr<vmime::bodyPart>, std::string *simple, std::string *extended);
+	HRESULT messagePartToStructure(vmime::utility::seekableInputStream &input, vmime::shared_ptr<vmime::bodyPart>, std::string *simple, std::string *extended);
+	HRESULT bodyPartToStructure(vmime::utility::seekableInputStream &input, vmime::shared_ptr<vmime::bodyPart>, std::string *simple, std::string *extended);
 	std::string getStructureExtendedFields(vmime::shared_ptr<vmime::header> part);
-	HRESULT save_raw_smime(const std::string &input, size_t hdr_end, const vmime::shared_ptr<vmime::header> &in, IMessage *out);
+	HRESULT save_raw_smime(vmime::utility::seekableInputStream &input, size_t hdr_end, size_t length, const vmime::shared_ptr<vmime::header> &in, IMessage *out);
 };
 
 } /* namespace */
@@ -7,6 +7,7 @@
 #include <kopano/zcdefs.h>
 #include <mapix.h>
 #include <mapidefs.h>
+#include <cstdio>
 #include <ostream>
 #include <string>
 #include <vector>
@@ -43,9 +44,14 @@ public:
 
 /* c wrapper to create object */
 extern KC_EXPORT ECSender *CreateSender(const std::string &smtphost, int port);
+/* Reuse of SMTP connections between messages (0 idle connections: off) */
+extern KC_EXPORT void smtp_pool_configure(unsigned int max_idle, unsigned int timeout);
+extern KC_EXPORT void smtp_pool_flush();
 
 // Read char Buffer and set properties on open lpMessage object
 extern KC_EXPORT HRESULT IMToMAPI(IMAPISession *, IMsgStore *, IAddrBook *, IMessage *, const std::string &input, delivery_options dopt);
+// Same, but parse from a file; attachment data is streamed from it rather than buffered
+extern KC_EXPORT HRESULT IMToMAPI(IMAPISession *, IMsgStore *, IAddrBook *, IMessage *, FILE *input, delivery_options dopt);
 
 // Read properties from lpMessage object and fill a buffer with internet rfc822 format message
 // Use this one for retrieving messages not in outgoing que, they already have PR_SENDER_EMAIL/NAME
@@ -134,10 +134,7 @@ static bool vtm_ascii_compatible(const char *s)
 	return mappable && memcmp(in, out, sizeof(in)) == 0;
 }
 
-// parse rfc822 input, and set props in lpMessage
-HRESULT IMToMAPI(IMAPISession *lpSession, IMsgStore *lpMsgStore,
-    IAddrBook *lpAddrBook, IMessage *lpMessage, const std::string &input,
-    delivery_options dopt)
+static void IMToMAPI_prepare(delivery_options &dopt)
 {
 	// Sanitize options
 	if (dopt.ascii_upgrade == nullptr || *dopt.ascii_upgrade == '\0') {
@@ -163,11 +160,27 @@ HRESULT IMToMAPI(IMAPISession *lpSession, IMsgStore *lpMsgStore,
 			ec_log_notice("K-1243: Detected old libvmime that "
 			"is unable to parse multi-address Reply-To (KC-434).");
 	}
+}
 
+// parse rfc822 input, and set props in lpMessage
+HRESULT IMToMAPI(IMAPISession *lpSession, IMsgStore *lpMsgStore,
+    IAddrBook *lpAddrBook, IMessage *lpMessage, const std::string &input,
+    delivery_options dopt)
+{
+	IMToMAPI_prepare(dopt);
 	// fill mapi object from buffer
 	return VMIMEToMAPI(lpAddrBook, std::move(dopt)).convertVMIMEToMAPI(input, lpMessage);
 }
 
+// parse rfc822 input from a file without loading it completely
+HRESULT IMToMAPI(IMAPISession *lpSession, IMsgStore *lpMsgStore,
+    IAddrBook *lpAddrBook, IMessage *lpMessage, FILE *input,
+    delivery_options dopt)
+{
+	IMToMAPI_prepare(dopt);
+	return VMIMEToMAPI(lpAddrBook, std::move(dopt)).convertVMIMEToMAPI(input, lpMessage);
+}
+
 // Read properties from lpMessage object and fill a buffer with internet rfc822 format message
 HRESULT IMToINet(IMAPISession *lpSession, IAddrBook *lpAddrBook,
     IMessage *lpMessage, char **lppbuf, sending_options sopt)
@@ -108,6 +108,15 @@ static bool PropTagInPropList(ULONG ulPropTag, const SPropTagArray *lpPropList)
  * @param[in]		ulFlags		TNEF_DECODE
  * @param[in,out]	lpMessage	TNEF properties will be saved to this message, and attachments will be create under this message.
  * @param[in]		lpStream	IStream object to the TNEF data
+ *
+ * Attachment data does not get an extra copy in ECTNEF. When decoding,
+ * it is copied into the attachment as the TNEF stream is read, but every
+ * attachment stays open (in lstAttachments, holding its data) until
+ * Finish() saves it, so the decoded attachments of one message are in
+ * memory together. When encoding, attachment data is copied from the
+ * attachment into the TNEF stream in Finish(); lpStream must then be
+ * seekable, since the size of a block is only filled in after its data
+ * was written.
  */
 ECTNEF::ECTNEF(ULONG f, IMessage *lpMessage, IStream *lpStream) :
 	m_lpStream(lpStream), m_lpMessage(lpMessage), ulFlags(f)
@@ -177,6 +186,37 @@ static HRESULT StreamToPropValue(IStream *lpStream, ULONG ulPropTag,
 	return hrSuccess;
 }
 
+/**
+ * Make a placeholder property for the binary data in lpStream: it only
+ * records the size, the data itself is read again when the property is
+ * written to the TNEF stream.
+ *
+ * @param[in]	lpStream	Stream on the property
+ * @param[in]	ulPropTag	Tag of the property, of type PT_BINARY or PT_OBJECT
+ * @param[out]	lppPropValue	Placeholder property, with a NULL Value.bin.lpb
+ * @return	MAPI error code
+ */
+static HRESULT StreamToPlaceholder(IStream *lpStream, ULONG ulPropTag,
+    LPSPropValue *lppPropValue)
+{
+	memory_ptr<SPropValue> lpPropValue;
+	STATSTG sStatstg;
+
+	auto hr = lpStream->Stat(&sStatstg, STATFLAG_NONAME);
+	if (hr != hrSuccess)
+		return hr;
+	if (sStatstg.cbSize.QuadPart > UINT32_MAX)
+		return MAPI_E_TOO_BIG;
+	hr = MAPIAllocateBuffer(sizeof(SPropValue), &~lpPropValue);
+	if (hr != hrSuccess)
+		return hr;
+	lpPropValue->ulPropTag = ulPropTag;
+	lpPropValue->Value.bin.cb = sStatstg.cbSize.QuadPart;
+	lpPropValue->Value.bin.lpb = nullptr;
+	*lppPropValue = lpPropValue.release();
+	return hrSuccess;
+}
+
 /**
  * Adds the requested properties from the message into the pending
  * TNEF stream. String properties in lpPropList must be in
@@ -229,7 +269,11 @@ HRESULT ECTNEF::AddProps(ULONG flags, const SPropTagArray *lpPropList)
 		if (hr == MAPI_W_ERRORS_RETURNED && lpPropValue != NULL &&
 		    lpPropValue->Value.err == MAPI_E_NOT_ENOUGH_MEMORY &&
 		    m_lpMessage->OpenProperty(lpPropListMessage->aulPropTag[i], &IID_IStream, 0, 0, &~lpStream) == hrSuccess) {
-			hr = StreamToPropValue(lpStream, lpPropListMessage->aulPropTag[i], &~lpStreamValue);
+			if (PROP_TYPE(lpPropListMessage->aulPropTag[i]) == PT_BINARY)
+				/* Copied straight from the message in Finish() */
+				hr = StreamToPlaceholder(lpStream, lpPropListMessage->aulPropTag[i], &~lpStreamValue);
+			else
+				hr = StreamToPropValue(lpStream, lpPropListMessage->aulPropTag[i], &~lpStreamValue);
 			if (hr == hrSuccess) {
 				lstProps.emplace_back(std::move(lpStreamValue));
 				lpStreamValue = NULL;
@@ -251,7 +295,7 @@ HRESULT ECTNEF::AddProps(ULONG flags, const SPropTagArray *lpPropList)
  */
 HRESULT ECTNEF::ExtractProps(ULONG flags, SPropTagArray *lpPropList)
 {
-	ULONG ulSignature = 0, ulType = 0, ulSize = 0;
+	ULONG ulSignature = 0, ulType = 0, ulSize = 0, ulAttachNum = 0;
 	unsigned short ulChecksum = 0, ulKey = 0;
 	unsigned char ulComponent = 0;
 	memory_ptr<char> lpBuffer;
@@ -291,10 +335,35 @@ HRESULT ECTNEF::ExtractProps(ULONG flags, SPropTagArray *lpPropList)
 			goto exit;
 		}
 
-		hr = MAPIAllocateBuffer(ulSize, &~lpBuffer);
-		if(hr != hrSuccess)
-			goto exit;
-		hr = HrReadData(m_lpStream, lpBuffer, ulSize);
+
+		switch (ulType) {
+		case ATT_ATTACH_DATA:
+			// PR_ATTACH_DATA_BIN, copied to the attachment as it is read
+			if (!lpTnefAtt) {
+				hr = MAPI_E_CORRUPT_DATA;
+				goto exit;
+			}
+			hr = HrReadAttachData(lpTnefAtt->lpAttach, ulSize);
+			if (hr == hrSuccess)
+				lpTnefAtt->has_data = true;
+			break;
+		case ATT_MAPI_PROPS:
+		case ATT_MESSAGE_CLASS:
+		case 0x00050008:
+		case ATT_REQUEST_RES:
+		case ATT_ATTACH_REND_DATA:
+		case ATT_ATTACH_TITLE:
+		case ATT_ATTACH_META_FILE:
+		case ATT_ATTACHMENT:
+			hr = MAPIAllocateBuffer(ulSize, &~lpBuffer);
+			if (hr == hrSuccess)
+				hr = HrReadData(m_lpStream, lpBuffer, ulSize);
+			break;
+		default:
+			// Not used, so do not bother to load it
+			hr = HrSkipData(m_lpStream, ulSize);
+			break;
+		}
 		if(hr != hrSuccess)
 			goto exit;
 		hr = HrReadWord(m_lpStream, &ulChecksum);
@@ -357,7 +426,7 @@ HRESULT ECTNEF::ExtractProps(ULONG flags, SPropTagArray *lpPropList)
 		    if(ulSize == sizeof(struct AttachRendData) && lpBuffer) {
 				auto lpData = reinterpret_cast<AttachRendData *>(lpBuffer.get());
 
-				if (lpTnefAtt != nullptr && (lpTnefAtt->data != nullptr || !lpTnefAtt->lstProps.empty()))
+				if (lpTnefAtt != nullptr && (lpTnefAtt->has_data || !lpTnefAtt->lstProps.empty()))
 					/* end marker previous attachment */
 					lstAttachments.emplace_back(std::move(lpTnefAtt));
 
@@ -367,6 +436,13 @@ HRESULT ECTNEF::ExtractProps(ULONG flags, SPropTagArray *lpPropList)
 					goto exit;
 				}
                 lpTnefAtt->rdata = *lpData;
+				/*
+				 * Created now so that the data can be written to it;
+				 * an attachment that ends up empty is never saved.
+				 */
+				hr = m_lpMessage->CreateAttach(nullptr, 0, &ulAttachNum, &~lpTnefAtt->lpAttach);
+				if (hr != hrSuccess)
+					goto exit;
             }
 			break;
 
@@ -404,18 +480,6 @@ HRESULT ECTNEF::ExtractProps(ULONG flags, SPropTagArray *lpPropList)
 			lpTnefAtt->lstProps.emplace_back(std::move(lpProp));
 			break;
 
-		case ATT_ATTACH_DATA:
-			// PR_ATTACH_DATA_BIN, will be set via OpenProperty() in ECTNEF::Finish()
-			if (!lpTnefAtt) {
-				hr = MAPI_E_CORRUPT_DATA;
-				goto exit;
-			}
-			lpTnefAtt->size = ulSize;
-			hr = KAllocCopy(lpBuffer, ulSize, &~lpTnefAtt->data);
-			if (hr != hrSuccess)
-				goto exit;
-			break;
-
 		case ATT_ATTACHMENT: // Attachment property stream
 			if (!lpTnefAtt) {
 				hr = MAPI_E_CORRUPT_DATA;
@@ -433,7 +497,7 @@ HRESULT ECTNEF::ExtractProps(ULONG flags, SPropTagArray *lpPropList)
 	}
 
 exit:
-	if (lpTnefAtt != nullptr && (lpTnefAtt->data != nullptr || !lpTnefAtt->lstProps.empty()))
+	if (lpTnefAtt != nullptr && (lpTnefAtt->has_data || !lpTnefAtt->lstProps.empty()))
 		/* attachment should be complete before adding */
 		lstAttachments.emplace_back(std::move(lpTnefAtt));
 	return hr;
@@ -444,16 +508,18 @@ exit:
  *
  * @param[in,out]	lpStream	The TNEF stream to write to
  * @param[in]		proplist	std::list of properties to write in the stream.
+ * @param[in]		lpSource	Object to read the data of placeholder properties from
  * @return MAPI error code
  */
-HRESULT ECTNEF::HrWritePropStream(IStream *lpStream, std::list<memory_ptr<SPropValue> > &proplist)
+HRESULT ECTNEF::HrWritePropStream(IStream *lpStream,
+    std::list<memory_ptr<SPropValue>> &proplist, IMAPIProp *lpSource)
 {
 	auto hr = HrWriteDWord(lpStream, proplist.size());
 	if(hr != hrSuccess)
 		return hr;
 
 	for (const auto &p : proplist) {
-		hr = HrWriteSingleProp(lpStream, p);
+		hr = HrWriteSingleProp(lpStream, p, lpSource);
 		if (hr != hrSuccess)
 			return hr;
 	}
@@ -465,9 +531,11 @@ HRESULT ECTNEF::HrWritePropStream(IStream *lpStream, std::list<memory_ptr<SPropV
  *
  * @param[in,out]	lpStream	The TNEF stream to write to
  * @param[in]		lpProp		MAPI property to write to the TNEF stream
+ * @param[in]		lpSource	Object to read the data from if lpProp is a placeholder
  * @return MAPI error code
  */
-HRESULT ECTNEF::HrWriteSingleProp(IStream *lpStream, LPSPropValue lpProp)
+HRESULT ECTNEF::HrWriteSingleProp(IStream *lpStream, LPSPropValue lpProp,
+    IMAPIProp *lpSource)
 {
 	ULONG cNames = 0, ulLen = 0, ulMVProp = 0, ulCount = 0;
 	memory_ptr<MAPINAMEID *> lppNames;
@@ -743,7 +811,10 @@ HRESULT ECTNEF::HrWriteSingleProp(IStream *lpStream, LPSPropValue lpProp)
 					return hr;
                 if(PROP_TYPE(lpProp->ulPropTag) == PT_OBJECT)
 					HrWriteData(lpStream, &IID_IStorage, sizeof(GUID));
-				hr = HrWriteData(lpStream, lpProp->Value.bin.lpb, ulLen);
+				if (lpProp->Value.bin.lpb == nullptr && ulLen > 0)
+					hr = HrWritePropData(lpStream, lpSource, lpProp->ulPropTag, ulLen);
+				else
+					hr = HrWriteData(lpStream, lpProp->Value.bin.lpb, ulLen);
 			}
 			if (hr != hrSuccess)
 				return hr;
@@ -1279,21 +1350,19 @@ HRESULT ECTNEF::FinishComponent(ULONG flags, ULONG ulComponentID,
         // Other properties
         if(PROP_TYPE(lpProps[i].ulPropTag) == PT_ERROR)
             continue;
-		hr = MAPIAllocateBuffer(sizeof(SPropValue), &~lpsNewProp);
-        if(hr != hrSuccess)
-			return hr;
-
         if(PROP_TYPE(lpProps[i].ulPropTag) == PT_OBJECT) {
-            // PT_OBJECT requested, open object as stream and read the data
+            // PT_OBJECT requested, open object as stream; the data
+            // is copied from it in Finish() the same way as PT_BINARY
             hr = lpAttach->OpenProperty(lpProps[i].ulPropTag, &IID_IStream, 0, 0, &~lpStream);
             if(hr != hrSuccess)
 				return hr;
-            // We save the actual data same way as PT_BINARY
-            hr = HrReadStream(lpStream, lpsNewProp, &lpsNewProp->Value.bin.lpb, &lpsNewProp->Value.bin.cb);
+			hr = StreamToPlaceholder(lpStream, lpProps[i].ulPropTag, &~lpsNewProp);
             if(hr != hrSuccess)
 				return hr;
-            lpsNewProp->ulPropTag = lpProps[i].ulPropTag;
         } else {
+			hr = MAPIAllocateBuffer(sizeof(SPropValue), &~lpsNewProp);
+			if (hr != hrSuccess)
+				return hr;
             hr = Util::HrCopyProperty(lpsNewProp, &lpProps[i], lpsNewProp);
             if(hr != hrSuccess)
 			return hr;
@@ -1302,8 +1371,7 @@ HRESULT ECTNEF::FinishComponent(ULONG flags, ULONG ulComponentID,
     }
 
     sTnefAttach->rdata = sData;
-    sTnefAttach->data = NULL;
-    sTnefAttach->size = 0;
+	sTnefAttach->lpAttach = std::move(lpAttach);
     lstAttachments.emplace_back(std::move(sTnefAttach));
     return hrSuccess;
 }
@@ -1327,8 +1395,6 @@ static inline bool is_embedded_msg(const std::list<memory_ptr<SPropValue>> &prop
  */
 HRESULT ECTNEF::Finish()
 {
-	STATSTG sStat;
-	ULONG ulChecksum, ulAttachNum;
 	// attachment vars
 	object_ptr<IMessage> lpAttMessage;
 	SPropValue sProp;
@@ -1346,12 +1412,22 @@ HRESULT ECTNEF::Finish()
 		}
 		// Add all found attachments to message
 		for (const auto &att : lstAttachments) {
-			object_ptr<IAttach> lpAttach;
-			bool has_obj = false;
-
-			auto hr = m_lpMessage->CreateAttach(nullptr, 0, &ulAttachNum, &~lpAttach);
-			if (hr != hrSuccess)
-				return hr;
+			// Created and given its data by ExtractProps()
+			auto &lpAttach = att->lpAttach;
+			HRESULT hr;
+			/*
+			 * The object takes precedence over the plain data.
+			 * PR_ATTACH_DATA_BIN and PR_ATTACH_DATA_OBJ share their
+			 * property id, so the streamed data has to go before
+			 * the object is written, not afterwards.
+			 */
+			auto drop_data = [&]() -> HRESULT {
+				if (!att->has_data)
+					return hrSuccess;
+				static constexpr SizedSPropTagArray(1, sptaData) = {1, {PR_ATTACH_DATA_BIN}};
+				att->has_data = false;
+				return lpAttach->DeleteProps(sptaData, nullptr);
+			};
 
 			sProp.ulPropTag = PR_ATTACH_METHOD;
 			if (att->rdata.usType == AttachTypeOle)
@@ -1377,7 +1453,11 @@ HRESULT ECTNEF::Finish()
 					if (hr != hrSuccess)
 						return hr;
 					continue;
-				} else if (att->rdata.usType == AttachTypeOle) {
+				}
+				hr = drop_data();
+				if (hr != hrSuccess)
+					return hr;
+				if (att->rdata.usType == AttachTypeOle) {
 					// message in PT_OBJECT, was saved in Value.bin
 					object_ptr<IStream> lpSubStream;
 					hr = lpAttach->OpenProperty(p->ulPropTag, &IID_IStream, 0, MAPI_CREATE | MAPI_MODIFY, &~lpSubStream);
@@ -1389,7 +1469,6 @@ HRESULT ECTNEF::Finish()
 					hr = lpSubStream->Commit(0);
 					if (hr != hrSuccess)
 						return hr;
-					has_obj = true;
 					continue;
 				}
 
@@ -1417,20 +1496,6 @@ HRESULT ECTNEF::Finish()
 				hr = lpAttMessage->SaveChanges(0);
 				if (hr != hrSuccess)
 					return hr;
-				has_obj = true;
-			}
-			if (!has_obj && att->data != NULL) {
-				object_ptr<IStream> lpAttStream;
-
-				hr = lpAttach->OpenProperty(PR_ATTACH_DATA_BIN, &IID_IStream, STGM_WRITE | STGM_TRANSACTED, MAPI_CREATE | MAPI_MODIFY, &~lpAttStream);
-				if (hr != hrSuccess)
-					return hr;
-				hr = lpAttStream->Write(att->data, att->size,NULL);
-				if (hr != hrSuccess)
-					return hr;
-				hr = lpAttStream->Commit(0);
-				if (hr != hrSuccess)
-					return hr;
 			}
 
 			hr = lpAttach->SaveChanges(0);
@@ -1449,63 +1514,31 @@ HRESULT ECTNEF::Finish()
 	hr = HrWriteWord(m_lpStream, 0); // Write Key
 	if (hr != hrSuccess)
 		return hr;
-	hr = HrWriteByte(m_lpStream, 1); // Write component (always 1 ?)
-	if (hr != hrSuccess)
-		return hr;
-	object_ptr<IStream> lpPropStream;
-	hr = CreateStreamOnHGlobal(nullptr, true, &~lpPropStream);
-	if (hr != hrSuccess)
-		return hr;
-	hr = HrWritePropStream(lpPropStream, lstProps);
-	if (hr != hrSuccess)
-		return hr;
-	hr = lpPropStream->Stat(&sStat, STATFLAG_NONAME);
-	if (hr != hrSuccess)
-		return hr;
-	hr = HrWriteDWord(m_lpStream, 0x00069003);
+	ULARGE_INTEGER pos;
+	hr = HrStartBlock(m_lpStream, ATT_MAPI_PROPS, 1, &pos); // component (always 1 ?)
 	if (hr != hrSuccess)
 		return hr;
-	hr = HrWriteDWord(m_lpStream, sStat.cbSize.LowPart); // Write size
+	hr = HrWritePropStream(m_lpStream, lstProps, m_lpMessage);
 	if (hr != hrSuccess)
 		return hr;
-	hr = lpPropStream->Seek(large_int_zero, STREAM_SEEK_SET, nullptr);
-	if (hr != hrSuccess)
-		return hr;
-	hr = lpPropStream->CopyTo(m_lpStream, sStat.cbSize, NULL, NULL); // Write data
-	if (hr != hrSuccess)
-		return hr;
-	hr = lpPropStream->Seek(large_int_zero, STREAM_SEEK_SET, nullptr);
-	if (hr != hrSuccess)
-		return hr;
-	hr = HrGetChecksum(lpPropStream, &ulChecksum);
-	if (hr != hrSuccess)
-		return hr;
-	hr = HrWriteWord(m_lpStream, (unsigned short)ulChecksum); // Write checksum
+	hr = HrEndBlock(m_lpStream, pos);
 	if (hr != hrSuccess)
 		return hr;
 
 	// Write attachments
 	for (const auto &att : lstAttachments) {
 		/* Write attachment start block */
-		hr = HrWriteBlock(m_lpStream, reinterpret_cast<char *>(&att->rdata), sizeof(AttachRendData), 0x00069002, 2);
+		hr = HrWriteBlock(m_lpStream, reinterpret_cast<char *>(&att->rdata), sizeof(AttachRendData), ATT_ATTACH_REND_DATA, 2);
 		if (hr != hrSuccess)
 			return hr;
-
-		// Write attachment data block if available
-		if (att->data != NULL) {
-			hr = HrWriteBlock(m_lpStream, reinterpret_cast<char *>(att->data.get()), att->size, 0x0006800f, 2);
-			if (hr != hrSuccess)
-				return hr;
-		}
-
-		// Write property block
-		hr = lpPropStream->SetSize(ularge_int_zero);
+		// Write property block, PT_OBJECT data comes straight from the attachment
+		hr = HrStartBlock(m_lpStream, ATT_ATTACHMENT, 2, &pos);
 		if (hr != hrSuccess)
 			return hr;
-		hr = HrWritePropStream(lpPropStream, att->lstProps);
+		hr = HrWritePropStream(m_lpStream, att->lstProps, att->lpAttach);
 		if (hr != hrSuccess)
-				return hr;
-		hr = HrWriteBlock(m_lpStream, lpPropStream, 0x00069005, 2);
+			return hr;
+		hr = HrEndBlock(m_lpStream, pos);
 		if (hr != hrSuccess)
 			return hr;
 		// Note that we don't write any other blocks like PR_ATTACH_FILENAME since this information is also in the property block
@@ -1610,14 +1643,8 @@ HRESULT ECTNEF::HrReadData(IStream *lpStream, void *data, size_t ulLen)
  */
 HRESULT ECTNEF::HrWriteDWord(IStream *lpStream, uint32_t value)
 {
-	ULONG ulWritten = 0;
 	value = cpu_to_le32(value);
-	auto hr = lpStream->Write(&value, sizeof(value), &ulWritten);
-	if(hr != hrSuccess)
-		return hr;
-	if (ulWritten != sizeof(unsigned int))
-		return MAPI_E_NOT_FOUND;
-	return hrSuccess;
+	return HrWriteData(lpStream, &value, sizeof(value));
 }
 
 /**
@@ -1630,14 +1657,8 @@ HRESULT ECTNEF::HrWriteDWord(IStream *lpStream, uint32_t value)
  */
 HRESULT ECTNEF::HrWriteWord(IStream *lpStream, uint16_t value)
 {
-	ULONG ulWritten = 0;
 	value = cpu_to_le16(value);
-	auto hr = lpStream->Write(&value, sizeof(value), &ulWritten);
-	if(hr != hrSuccess)
-		return hr;
-	if (ulWritten != sizeof(unsigned short))
-		return MAPI_E_NOT_FOUND;
-	return hrSuccess;
+	return HrWriteData(lpStream, &value, sizeof(value));
 }
 
 /**
@@ -1650,31 +1671,35 @@ HRESULT ECTNEF::HrWriteWord(IStream *lpStream, uint16_t value)
  */
 HRESULT ECTNEF::HrWriteByte(IStream *lpStream, unsigned char ulData)
 {
-	ULONG ulWritten = 0;
-	auto hr = lpStream->Write(&ulData, 1, &ulWritten);
-	if(hr != hrSuccess)
-		return hr;
-	if (ulWritten != 1)
-		return MAPI_E_NOT_FOUND;
-	return hrSuccess;
+	return HrWriteData(lpStream, &ulData, 1);
 }
 
 /**
- * Write a block of data of given size to output stream
+ * Write a block of data of given size to output stream. The bytes are
+ * added to the checksum of the current block.
  *
  * @param[in,out]	lpStream	stream to write one unsigned char to, stream automatically moves current cursor.
  * @param[in]		ulData		unsigned char value to write in lpStream
+ * @retval MAPI_E_NOT_FOUND if stream did not take any bytes, other MAPI error code
  * @return MAPI error code
  */
 HRESULT ECTNEF::HrWriteData(IStream *lpStream, const void *vdata, size_t ulLen)
 {
-	auto data = static_cast<const char *>(vdata);
+	auto data = static_cast<const unsigned char *>(vdata);
 	ULONG ulWritten = 0;
 
+	/*
+	 * TNEF uses the rather stupid checksum of adding all the bytes in the
+	 * stream. Was TNEF coded by an intern or something ??
+	 */
+	for (size_t i = 0; i < ulLen; ++i)
+		m_ulChecksum += data[i];
 	while(ulLen > 0) {
-		auto hr = lpStream->Write(data, std::min(ulLen, static_cast<size_t>(4096)), &ulWritten);
+		auto hr = lpStream->Write(data, std::min(ulLen, static_cast<size_t>(65536)), &ulWritten);
 		if(hr != hrSuccess)
 			return hr;
+		if (ulWritten == 0)
+			return MAPI_E_NOT_FOUND;
 		ulLen -= ulWritten;
 		data += ulWritten;
 	}
@@ -1682,78 +1707,152 @@ HRESULT ECTNEF::HrWriteData(IStream *lpStream, const void *vdata, size_t ulLen)
 }
 
 /**
- * TNEF uses the rather stupid checksum of adding all the bytes in the stream.
- * Was TNEF coded by an intern or something ??
+ * Skip over data in the input stream.
  *
- * @param[in]	lpStream		Input TNEF stream, this object will be unmodified
- * @param[out]	lpulChecksum	"Checksum" of the TNEF data
+ * @param[in]	lpStream	input stream, cursor is moved ulSize bytes forward
+ * @param[in]	ulSize		number of bytes to skip
  * @return MAPI error code
  */
-HRESULT ECTNEF::HrGetChecksum(IStream *lpStream, ULONG *lpulChecksum)
+HRESULT ECTNEF::HrSkipData(IStream *lpStream, ULONG ulSize)
 {
-	ULONG ulChecksum = 0;
-	object_ptr<IStream> lpClone;
-	ULONG ulRead = 0;
-	static constexpr size_t BUFSIZE = 4096;
-	auto buffer = std::make_unique<unsigned char[]>(BUFSIZE);
-	unsigned int i = 0;
+	LARGE_INTEGER off;
+	off.QuadPart = ulSize;
+	return lpStream->Seek(off, STREAM_SEEK_CUR, nullptr);
+}
 
-	auto hr = lpStream->Clone(&~lpClone);
-	if(hr != hrSuccess)
-		return hr;
-	hr = lpClone->Seek(large_int_zero, STREAM_SEEK_SET, nullptr);
-	if(hr != hrSuccess)
+/**
+ * Copy the data of an attAttachData block from the TNEF stream to
+ * PR_ATTACH_DATA_BIN, in pieces, so that the attachment is never held in
+ * memory by us.
+ *
+ * @param[in]	lpAttach	attachment to write to
+ * @param[in]	ulSize		size of the block data
+ * @retval MAPI_E_NOT_FOUND if stream was too short, other MAPI error code
+ * @return MAPI error code
+ */
+HRESULT ECTNEF::HrReadAttachData(IAttach *lpAttach, ULONG ulSize)
+{
+	static constexpr size_t BUFSIZE = 65536;
+	object_ptr<IStream> lpAttStream;
+	auto hr = lpAttach->OpenProperty(PR_ATTACH_DATA_BIN, &IID_IStream, STGM_WRITE | STGM_TRANSACTED, MAPI_CREATE | MAPI_MODIFY, &~lpAttStream);
+	if (hr != hrSuccess)
 		return hr;
-
-	while (true) {
-		hr = lpClone->Read(buffer.get(), BUFSIZE, &ulRead);
-		if(hr != hrSuccess)
+	auto buffer = make_unique_nt<char[]>(std::min(static_cast<size_t>(ulSize), BUFSIZE));
+	if (buffer == nullptr)
+		return MAPI_E_NOT_ENOUGH_MEMORY;
+	while (ulSize > 0) {
+		ULONG ulLen = std::min(static_cast<size_t>(ulSize), BUFSIZE);
+		hr = HrReadData(m_lpStream, buffer.get(), ulLen);
+		if (hr != hrSuccess)
 			return hr;
-		if(ulRead == 0)
-			break;
-		for (i = 0; i < ulRead; ++i)
-			ulChecksum += buffer[i];
+		hr = HrWriteData(lpAttStream, buffer.get(), ulLen);
+		if (hr != hrSuccess)
+			return hr;
+		ulSize -= ulLen;
 	}
+	return lpAttStream->Commit(0);
+}
+
+/**
+ * Copy the data of a placeholder property into the TNEF stream.
+ *
+ * @param[in,out] lpStream TNEF stream to write to
+ * @param[in] lpSource Object holding the property
+ * @param[in] ulPropTag Property to copy, of type PT_BINARY or PT_OBJECT
+ * @param[in] ulLen Size of the property, as recorded in the placeholder
+ *
+ * @retval MAPI_E_CORRUPT_DATA the property no longer has ulLen bytes
+ * @return MAPI error code
+ */
+HRESULT ECTNEF::HrWritePropData(IStream *lpStream, IMAPIProp *lpSource,
+    ULONG ulPropTag, ULONG ulLen)
+{
+	static constexpr size_t BUFSIZE = 65536;
+	object_ptr<IStream> lpSrcStream;
+	ULONG ulRead = 0;
 
-	*lpulChecksum = ulChecksum;
+	if (lpSource == nullptr)
+		return MAPI_E_INVALID_PARAMETER;
+	auto hr = lpSource->OpenProperty(ulPropTag, &IID_IStream, 0, 0, &~lpSrcStream);
+	if (hr != hrSuccess)
+		return hr;
+	auto buffer = make_unique_nt<char[]>(std::min(static_cast<size_t>(ulLen), BUFSIZE));
+	if (buffer == nullptr)
+		return MAPI_E_NOT_ENOUGH_MEMORY;
+	while (ulLen > 0) {
+		hr = lpSrcStream->Read(buffer.get(), std::min(static_cast<size_t>(ulLen), BUFSIZE), &ulRead);
+		if (hr != hrSuccess)
+			return hr;
+		if (ulRead == 0)
+			return MAPI_E_CORRUPT_DATA;
+		hr = HrWriteData(lpStream, buffer.get(), ulRead);
+		if (hr != hrSuccess)
+			return hr;
+		ulLen -= ulRead;
+	}
 	return hrSuccess;
 }
 
 /**
- * Copy stream data to another stream with given TNEF block id and level number.
+ * Start a TNEF block of yet unknown size. Its data can then be written
+ * with the HrWrite functions, and HrEndBlock() completes it.
  *
- * @param[in,out] lpDestStream Stream to write data to
- * @param[in] lpSourceStream Stream to read data from
+ * @param[in,out] lpDestStream Stream to write the block to, must be seekable
  * @param[in] ulBlockID TNEF block id number
  * @param[in] ulLevel TNEF level number
+ * @param[out] lpPos Position of the size field, for HrEndBlock()
  *
  * @return MAPI error code
  */
-HRESULT ECTNEF::HrWriteBlock(IStream *lpDestStream, IStream *lpSourceStream, ULONG ulBlockID, ULONG ulLevel)
+HRESULT ECTNEF::HrStartBlock(IStream *lpDestStream, ULONG ulBlockID,
+    ULONG ulLevel, ULARGE_INTEGER *lpPos)
 {
-    ULONG ulChecksum = 0;
-    STATSTG         sStat;
-
 	auto hr = HrWriteByte(lpDestStream, ulLevel);
-    if(hr != hrSuccess)
+	if (hr != hrSuccess)
 		return hr;
-    hr = HrGetChecksum(lpSourceStream, &ulChecksum);
-    if(hr != hrSuccess)
+	hr = HrWriteDWord(lpDestStream, ulBlockID);
+	if (hr != hrSuccess)
 		return hr;
-	hr = lpSourceStream->Seek(large_int_zero, STREAM_SEEK_SET, nullptr);
-    if(hr != hrSuccess)
+	hr = lpDestStream->Seek(large_int_zero, STREAM_SEEK_CUR, lpPos);
+	if (hr != hrSuccess)
 		return hr;
-    hr = HrWriteDWord(lpDestStream, ulBlockID);
-    if(hr != hrSuccess)
+	hr = HrWriteDWord(lpDestStream, 0); // Size, filled in by HrEndBlock
+	if (hr != hrSuccess)
 		return hr;
-    hr = lpSourceStream->Stat(&sStat, STATFLAG_NONAME);
-    if(hr != hrSuccess)
+	m_ulChecksum = 0;
+	return hrSuccess;
+}
+
+/**
+ * Complete a block started by HrStartBlock(): fill in its size and
+ * append the checksum.
+ *
+ * @param[in,out] lpDestStream Stream the block was written to
+ * @param[in] pos Position returned by HrStartBlock()
+ *
+ * @return MAPI error code
+ */
+HRESULT ECTNEF::HrEndBlock(IStream *lpDestStream, const ULARGE_INTEGER &pos)
+{
+	ULONG ulChecksum = m_ulChecksum;
+	ULARGE_INTEGER end;
+	LARGE_INTEGER seek;
+
+	auto hr = lpDestStream->Seek(large_int_zero, STREAM_SEEK_CUR, &end);
+	if (hr != hrSuccess)
 		return hr;
-    hr = HrWriteDWord(lpDestStream, sStat.cbSize.QuadPart);
-    if(hr != hrSuccess)
+	if (end.QuadPart - pos.QuadPart - sizeof(uint32_t) > UINT32_MAX)
+		return MAPI_E_TOO_BIG;
+	seek.QuadPart = pos.QuadPart;
+	hr = lpDestStream->Seek(seek, STREAM_SEEK_SET, nullptr);
+	if (hr != hrSuccess)
 		return hr;
-    hr = lpSourceStream->CopyTo(lpDestStream, sStat.cbSize, NULL, NULL);
-    if(hr != hrSuccess)
+	hr = HrWriteDWord(lpDestStream, end.QuadPart - pos.QuadPart - sizeof(uint32_t));
+	if (hr != hrSuccess)
+		return hr;
+	seek.QuadPart = end.QuadPart;
+	hr = lpDestStream->Seek(seek, STREAM_SEEK_SET, nullptr);
+	if (hr != hrSuccess)
 		return hr;
 	return HrWriteWord(lpDestStream, ulChecksum);
 }
@@ -1772,53 +1871,20 @@ HRESULT ECTNEF::HrWriteBlock(IStream *lpDestStream, IStream *lpSourceStream, ULO
 HRESULT ECTNEF::HrWriteBlock(IStream *lpDestStream, const char *lpData,
     unsigned int ulLen, ULONG ulBlockID, ULONG ulLevel)
 {
-	object_ptr<IStream> lpStream;
-	auto hr = CreateStreamOnHGlobal(nullptr, true, &~lpStream);
-    if (hr != hrSuccess)
+	auto hr = HrWriteByte(lpDestStream, ulLevel);
+	if (hr != hrSuccess)
 		return hr;
-    hr = lpStream->Write(lpData, ulLen, NULL);
-    if (hr != hrSuccess)
+	hr = HrWriteDWord(lpDestStream, ulBlockID);
+	if (hr != hrSuccess)
 		return hr;
-	return HrWriteBlock(lpDestStream, lpStream, ulBlockID, ulLevel);
-}
-
-/**
- * Read a complete stream into a buffer. (Don't we have this function somewhere in common/ ?)
- *
- * @param[in] lpStream stream to read into buffer and return as BYTE array, cursor will be at the end on return
- * @param[in] lpBase pointer to use with MAPIAllocateMore, cannot be NULL
- * @param[out] lppData New allocated (more) buffer with contents of stream
- * @param[out] lpulSize size of *lppData buffer
- *
- * @return MAPI error code
- */
-HRESULT ECTNEF::HrReadStream(IStream *lpStream, void *lpBase, BYTE **lppData, ULONG *lpulSize)
-{
-    STATSTG sStat;
-	BYTE *lpBuffer = nullptr;
-	ULONG ulSize = 0, ulRead = 0;
-
-	if (lpStream == NULL || lpBase == NULL || lppData == NULL || lpulSize == NULL)
-		return MAPI_E_INVALID_PARAMETER;
-	auto hr = lpStream->Stat(&sStat, STATFLAG_NONAME);
-    if(hr != hrSuccess)
+	hr = HrWriteDWord(lpDestStream, ulLen);
+	if (hr != hrSuccess)
 		return hr;
-	hr = MAPIAllocateMore(sStat.cbSize.QuadPart, lpBase, reinterpret_cast<void **>(&lpBuffer));
-    if(hr != hrSuccess)
+	m_ulChecksum = 0;
+	hr = HrWriteData(lpDestStream, lpData, ulLen);
+	if (hr != hrSuccess)
 		return hr;
-	auto lpWrite = lpBuffer;
-    while(sStat.cbSize.QuadPart > 0) {
-        hr = lpStream->Read(lpWrite, sStat.cbSize.QuadPart, &ulRead);
-        if(hr != hrSuccess)
-			return hr;
-        lpWrite += ulRead;
-        ulSize += ulRead;
-        sStat.cbSize.QuadPart -= ulRead;
-    }
-
-    *lppData = lpBuffer;
-    *lpulSize = ulSize;
-    return hrSuccess;
+	return HrWriteWord(lpDestStream, m_ulChecksum);
 }
 
 } /* namespace */
@@ -56,26 +56,35 @@ private:
 	HRESULT HrWriteWord(IStream *, uint16_t value);
 	HRESULT HrWriteByte(IStream *lpStream, unsigned char ulData);
 	HRESULT HrWriteData(IStream *, const void *, size_t);
-	HRESULT HrWritePropStream(IStream *lpStream, std::list<memory_ptr<SPropValue>> &proplist);
-	HRESULT HrWriteSingleProp(IStream *lpStream, LPSPropValue lpProp);
+	HRESULT HrWritePropStream(IStream *lpStream, std::list<memory_ptr<SPropValue>> &proplist, IMAPIProp *lpSource);
+	HRESULT HrWriteSingleProp(IStream *lpStream, LPSPropValue lpProp, IMAPIProp *lpSource);
+	HRESULT HrWritePropData(IStream *lpStream, IMAPIProp *lpSource, ULONG ulPropTag, ULONG ulLen);
 	HRESULT HrReadPropStream(const char *buf, ULONG size, std::list<memory_ptr<SPropValue>> &proplist);
 	HRESULT HrReadSingleProp(const char *buf, ULONG size, ULONG *have_read, LPSPropValue *out);
-	HRESULT HrGetChecksum(IStream *lpStream, ULONG *lpulChecksum);
-	HRESULT HrWriteBlock(IStream *lpDest, IStream *lpSrc, ULONG ulBlockID, ULONG ulLevel);
+	HRESULT HrReadAttachData(IAttach *lpAttach, ULONG ulSize);
+	HRESULT HrSkipData(IStream *lpStream, ULONG ulSize);
+	HRESULT HrStartBlock(IStream *lpDest, ULONG ulBlockID, ULONG ulLevel, ULARGE_INTEGER *lpPos);
+	HRESULT HrEndBlock(IStream *lpDest, const ULARGE_INTEGER &pos);
 	HRESULT HrWriteBlock(IStream *lpDest, const char *buf, unsigned int len, ULONG block_id, ULONG level);
-    HRESULT HrReadStream(IStream *lpStream, void *lpBase, BYTE **lppData, ULONG *lpulSize);
 
 	IStream *m_lpStream;
 	IMessage *m_lpMessage;
 	ULONG ulFlags;
+	/* Sum of the bytes written since the last HrStartBlock */
+	ULONG m_ulChecksum = 0;
 
 	// Accumulator for properties from AddProps and SetProps
 	std::list<memory_ptr<SPropValue>> lstProps;
 
+	/*
+	 * Binary properties with a NULL lpb and a nonzero cb are placeholders:
+	 * their data is copied from the attachment (or from m_lpMessage for
+	 * lstProps) directly into the TNEF stream in Finish().
+	 */
 	struct tnefattachment {
 		std::list<memory_ptr<SPropValue>> lstProps;
-		ULONG size = 0;
-		memory_ptr<unsigned char> data;
+		object_ptr<IAttach> lpAttach;
+		bool has_data = false; /* PR_ATTACH_DATA_BIN was written while decoding */
 		AttachRendData rdata;
 	};
 	std::list<std::unique_ptr<tnefattachment>> lstAttachments;
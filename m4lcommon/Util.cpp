@@ -39,21 +39,6 @@ using namespace std::string_literals;
 
 namespace KC {
 
-// HACK: prototypes may differ depending on the compiler and/or system (the
-// second parameter may or may not be 'const'). This redeclaration is a hack
-// to have a common prototype "iconv_cast".
-class iconv_HACK final {
-public:
-	iconv_HACK(const char** ptr) : m_ptr(ptr) { }
-
-	// the compiler will choose the right operator
-	operator const char **() const { return m_ptr; }
-	operator char**() { return const_cast <char**>(m_ptr); }
-
-private:
-	const char** m_ptr;
-};
-
 static HRESULT HrCopyActions(ACTIONS *, const ACTIONS *, void *);
 static HRESULT HrCopyAction(ACTION *, const ACTION *, void *);
 
@@ -1242,25 +1227,118 @@ unsigned int Util::PropSize(const SPropValue *lpProp)
 	}
 }
 
+#define BUFSIZE 65536
+
+namespace {
+
+/**
+ * Output side of the streaming body converters. Converted data is gathered
+ * and written to the stream in BUFSIZE pieces. With a limit set, content
+ * beyond @limit bytes is dropped (in whole units, so that no escape
+ * sequence is cut), and full() signals the producer to stop reading.
+ * Headers and footers bypass the limit so the result stays well-formed.
+ */
+class body_sink final {
+	public:
+	body_sink(IStream *s, size_t limit) : m_stream(s), m_limit(limit) {}
+	~body_sink() { flush(); }
+	bool full() const { return m_full; }
+
+	void put(const char *s, size_t n)
+	{
+		if (m_limit != 0 && m_total + n > m_limit) {
+			m_full = true;
+			return;
+		}
+		m_total += n;
+		put_raw(s, n);
+	}
+
+	void put(char c) { put(&c, 1); }
+
+	void put_raw(const char *s, size_t n)
+	{
+		m_buf.append(s, n);
+		if (m_buf.size() >= BUFSIZE)
+			flush();
+	}
+
+	HRESULT flush()
+	{
+		if (m_hr == hrSuccess && !m_buf.empty())
+			m_hr = m_stream->Write(m_buf.data(), m_buf.size(), nullptr);
+		m_buf.clear();
+		if (m_hr != hrSuccess)
+			m_full = true;
+		return m_hr;
+	}
+
+	private:
+	IStream *m_stream;
+	std::string m_buf;
+	size_t m_limit, m_total = 0;
+	HRESULT m_hr = hrSuccess;
+	bool m_full = false;
+};
+
+}
+
+/**
+ * Escape plain text for HTML, appending to @out. Printable ASCII without
+ * an entity name (which is most text) is copied without consulting the
+ * entity table. Stops before @out would grow past @max characters; returns
+ * false in that case.
+ */
+static bool text_to_html_esc(const wchar_t *text, size_t len,
+    std::wstring &out, size_t max = std::wstring::npos)
+{
+	std::wstring ent;
+
+	for (size_t i = 0; i < len; ++i) {
+		auto c = text[i];
+		const wchar_t *esc;
+		size_t esc_len;
+		if (c == ' ' && i + 1 < len && text[i+1] == ' ') {
+			esc = L"&nbsp;";
+			esc_len = 6;
+		} else if (c >= ' ' && c < 0x7F && c != '"' && c != '&' &&
+		    c != '<' && c != '>') {
+			esc = &text[i];
+			esc_len = 1;
+		} else {
+			ent.clear();
+			CHtmlEntity::CharToHtmlEntity(c, ent);
+			esc = ent.c_str();
+			esc_len = ent.size();
+		}
+		if (out.size() + esc_len > max)
+			return false;
+		out.append(esc, esc_len);
+	}
+	return true;
+}
+
 /**
  * Convert plaintext to HTML using streams.
  *
  * Converts the text stream to HTML, and writes in the html stream.
- * Both streams will be at the end on return.  This function does no
- * error checking.  If a character in the text cannot be represented
- * in the given codepage, it will make a unicode HTML entity instead.
+ * Both streams will be at the end on return. If a character in the text
+ * cannot be represented in the given codepage, it will make a unicode
+ * HTML entity instead.
  *
  * @param[in]	text	IStream object as plain text input, must be PT_UNICODE
  * @param[out]	html	IStream object for HTML output
  * @param[in]	ulCodePage Codepage to convert HTML stream to
+ * @param[in]	max_out	Stop after about this many characters of HTML
+ *			body (the header and footer are always written);
+ *			0 for no limit
  *
  * @return		HRESULT				Mapi error code, from IMemStream
  * @retval		MAPI_E_NOT_FOUND	No suitable charset found for given ulCodepage
  * @retval		MAPI_E_BAD_CHARWIDTH Iconv error
  */
-// @todo please optimize function, quite slow. (mostly due to HtmlEntityFromChar)
-#define BUFSIZE 65536
-HRESULT Util::HrTextToHtml(IStream *text, IStream *html, ULONG ulCodepage)
+HRESULT Util::HrTextToHtml(IStream *text, IStream *html, ULONG ulCodepage,
+    size_t max_out)
 {
 	ULONG cRead;
 	std::wstring strHtml;
@@ -1284,8 +1362,6 @@ HRESULT Util::HrTextToHtml(IStream *text, IStream *html, ULONG ulCodepage)
 	                             "\n"
 	                             "</BODY>"
 	                             "</HTML>";
-	const char	*readBuffer = NULL;
-	std::unique_ptr<char[]> writeBuffer;
 	const char *lpszCharset;
 
 	auto hr = HrGetCharsetByCP(ulCodepage, &lpszCharset);
@@ -1293,89 +1369,42 @@ HRESULT Util::HrTextToHtml(IStream *text, IStream *html, ULONG ulCodepage)
 		// client actually should have set the PR_INTERNET_CPID to the correct value
 		lpszCharset = "us-ascii";
 
-	auto cd = iconv_open(lpszCharset, CHARSET_WCHAR);
-	if (cd == reinterpret_cast<iconv_t>(-1))
+	/* Unrepresentable characters become &#NNNN; (see iconv_context_base) */
+	std::unique_ptr<iconv_context<std::string, std::wstring>> conv;
+	try {
+		conv.reset(new iconv_context<std::string, std::wstring>((lpszCharset + "//HTMLENTITIES"s).c_str(), CHARSET_WCHAR));
+	} catch (const convert_exception &) {
 		return MAPI_E_BAD_CHARWIDTH;
-	writeBuffer.reset(new(std::nothrow) char[BUFSIZE * 2]);
-	if (writeBuffer == nullptr) {
-		hr = MAPI_E_NOT_ENOUGH_MEMORY;
-		goto exit;
 	}
 
+	body_sink out(html, 0);
 	// @todo, run this through iconv as well?
-	hr = html->Write(header1, strlen(header1), NULL);
-	if (hr != hrSuccess)
-		goto exit;
-
-	hr = html->Write(lpszCharset, strlen(lpszCharset), NULL);
-	if (hr != hrSuccess)
-		goto exit;
+	out.put_raw(header1, strlen(header1));
+	out.put_raw(lpszCharset, strlen(lpszCharset));
+	out.put_raw(header2, strlen(header2));
 
-	hr = html->Write(header2, strlen(header2), NULL);
-	if (hr != hrSuccess)
-		goto exit;
-
-	while (1) {
-		strHtml.clear();
+	size_t total = 0;
+	while (!out.full() && (max_out == 0 || total < max_out)) {
 		hr = text->Read(lpBuffer.get(), BUFSIZE * sizeof(wchar_t), &cRead);
 		if (hr != hrSuccess)
-			goto exit;
-
+			return hr;
 		if (cRead == 0)
 			break;
 		cRead /= sizeof(wchar_t);
 		// escape some characters in HTML
-		for (unsigned int i = 0; i < cRead; ++i) {
-			if (lpBuffer[i] != ' ') {
-				std::wstring str;
-				CHtmlEntity::CharToHtmlEntity(lpBuffer[i], str);
-				strHtml += str;
-				continue;
-			}
-			if ((i + 1) < cRead && lpBuffer[i+1] == ' ')
-				strHtml += L"&nbsp;";
-			else
-				strHtml += L" ";
-		}
-
+		strHtml.clear();
+		if (!text_to_html_esc(lpBuffer.get(), cRead, strHtml,
+		    max_out == 0 ? std::wstring::npos : max_out - total))
+			total = max_out;
+		else
+			total += strHtml.size();
 		/* Convert WCHAR to wanted (8-bit) charset */
-		readBuffer = (const char*)strHtml.c_str();
-		auto stRead = strHtml.size() * sizeof(wchar_t);
-
-		while (stRead > 0) {
-			auto wPtr = writeBuffer.get();
-			size_t stWrite = BUFSIZE * 2;
-			auto err = iconv(cd, iconv_HACK(&readBuffer), &stRead, &wPtr, &stWrite);
-			size_t stWritten = (BUFSIZE * 2) - stWrite;
-			// write to stream
-			hr = html->Write(writeBuffer.get(), stWritten, NULL);
-			if (hr != hrSuccess)
-				goto exit;
-
-			if (err != static_cast<size_t>(-1))
-				continue;
-			if (stRead < sizeof(wchar_t))
-				break;
-			// make html number from WCHAR entry
-			wchar_t c;
-			memcpy(&c, readBuffer, sizeof(c));
-			auto strHTMLUnicode = "&#" + stringify(c) + ";";
-			hr = html->Write(strHTMLUnicode.c_str(), strHTMLUnicode.length(), NULL);
-			if (hr != hrSuccess)
-				goto exit;
-
-			// skip unknown character
-			readBuffer += sizeof(wchar_t);
-			stRead -= sizeof(wchar_t);
-		}
+		auto conv_out = conv->convert(strHtml);
+		out.put_raw(conv_out.c_str(), conv_out.size());
 	}
 	// @todo, run through iconv?
-	hr = html->Write(footer, strlen(footer), NULL);
-
-exit:
-	if (cd != (iconv_t)-1)
-		iconv_close(cd);
-	return hr;
+	out.put_raw(footer, strlen(footer));
+	return out.flush();
 }
 
 /** 
@@ -1401,19 +1430,7 @@ HRESULT Util::HrTextToHtml(const wchar_t *text, std::string &strHTML, ULONG ulCo
 	}
 
 	// escape some characters in HTML
-	for (ULONG i = 0; text[i] != '\0'; ++i) {
-		if (text[i] != ' ') {
-			std::wstring str;
-			CHtmlEntity::CharToHtmlEntity(text[i], str);
-			wHTML += str;
-			continue;
-		}
-		if (text[i+1] == ' ')
-			wHTML += L"&nbsp;";
-		else
-			wHTML += L" ";
-	}
-
+	text_to_html_esc(text, wcslen(text), wHTML);
 	try {
 		strHTML += convert_to<std::string>(lpszCharset, wHTML, rawsize(wHTML), CHARSET_WCHAR);
 	} catch (const convert_exception &) {
@@ -1426,16 +1443,17 @@ HRESULT Util::HrTextToHtml(const wchar_t *text, std::string &strHTML, ULONG ulCo
  * Convert plaintext to uncompressed RTF using streams.
  *
  * Converts the text stream to RTF, and writes in the rtf stream.
- * Both streams will be at the end on return.  This function does no
- * error checking.
+ * Both streams will be at the end on return.
  *
  * @param[in]	text	IStream object as plain text input, must be PT_UNICODE
  * @param[out]	rtf		IStream object for RTF output
+ * @param[in]	max_out	Stop after this many bytes of RTF body text (the
+ *			header and the closing brace are always written);
+ *			0 for no limit
  *
- * @return		HRESULT		hrSuccess
+ * @return		HRESULT		hrSuccess, or the error from writing to @rtf
  */
-// @todo: remove this shizzle ?
-HRESULT Util::HrTextToRtf(IStream *text, IStream *rtf)
+HRESULT Util::HrTextToRtf(IStream *text, IStream *rtf, size_t max_out)
 {
 	ULONG cRead;
 	auto c = std::make_unique<wchar_t[]>(BUFSIZE);
@@ -1447,63 +1465,62 @@ HRESULT Util::HrTextToRtf(IStream *text, IStream *rtf)
 	                             "{\\colortbl\\red0\\green0\\blue0;\\red0\\green0\\blue255;}\n"
 	                             "\\uc1\\pard\\plain\\deftab360 \\f0\\fs20 ";
 	static const char footer[] = "}";
+	body_sink out(rtf, max_out);
 
-	rtf->Write(header, strlen(header), NULL);
-
-	while(1) {
+	out.put_raw(header, strlen(header));
+	while (!out.full()) {
 		auto ret = text->Read(c.get(), BUFSIZE * sizeof(wchar_t), &cRead);
 		if (ret != hrSuccess || cRead == 0)
 			break;
 		cRead /= sizeof(wchar_t);
-		for (unsigned int i = 0; i < cRead; ++i) {
+		for (unsigned int i = 0; i < cRead && !out.full(); ++i) {
 			switch (c[i]) {
 			case 0:
 				break;
 			case '\r':
 				break;
 			case '\n':
-				rtf->Write("\\line\n", 6, nullptr);
+				out.put("\\line\n", 6);
 				break;
 
 			case '\\':
-				rtf->Write("\\\\",2,NULL);
+				out.put("\\\\", 2);
 				break;
 
 			case '{':
-				rtf->Write("\\{",2,NULL);
+				out.put("\\{", 2);
 				break;
 
 			case '}':
-				rtf->Write("\\}",2,NULL);
+				out.put("\\}", 2);
 				break;
 
 			case '\t':
-				rtf->Write("\\tab ",5,NULL);
+				out.put("\\tab ", 5);
 				break;
 
 			case '\f':			// formfeed, ^L
-				rtf->Write("\\page\n",6,NULL);
+				out.put("\\page\n", 6);
 				break;
 			default:
 				if (c[i] < ' ' || (c[i] > 127 && c[i] <= 255)) {
 					char hex[16];
 					snprintf(hex, 16, "\\'%X", c[i]);
-					rtf->Write(hex, strlen(hex), NULL);
+					out.put(hex, strlen(hex));
 				} else if (c[i] > 255) {
 					// make a unicode char. in signed short
 					char hex[16];
 					snprintf(hex, 16, "\\u%hd ?", (signed short)c[i]); // %hd is signed short (h is the inverse of l modifier)
-					rtf->Write(hex, strlen(hex), NULL);
+					out.put(hex, strlen(hex));
 				} else {
-					rtf->Write(&c[i], 1, NULL);
+					out.put(static_cast<char>(c[i]));
 				}
 			}
 		}
 	}
 
-	rtf->Write(footer, strlen(footer), NULL);
-
-	return hrSuccess;
+	out.put_raw(footer, strlen(footer));
+	return out.flush();
 }
 
 /** 
@@ -1740,6 +1757,28 @@ HRESULT Util::HrStreamToString(IStream *sInput, std::wstring &strOutput) {
 	return hr;
 }
 
+/**
+ * Convert bytes in ulCodepage to WCHAR.
+ *
+ * @param[in]	data		input
+ * @param[in]	ulCodepage	codepage of input
+ * @param[out]	wstrOutput	output in WCHAR
+ * @return MAPI error code
+ */
+static HRESULT HrConvertToWString(const std::string &data, ULONG ulCodepage,
+    std::wstring *wstrOutput)
+{
+	const char *lpszCharset;
+	if (HrGetCharsetByCP(ulCodepage, &lpszCharset) != hrSuccess)
+		lpszCharset = "us-ascii";
+	try {
+		wstrOutput->assign(convert_to<std::wstring>(CHARSET_WCHAR"//IGNORE", data, rawsize(data), lpszCharset));
+	} catch (const std::exception &) {
+		return MAPI_E_INVALID_PARAMETER;
+	}
+	return hrSuccess;
+}
+
 /**
  * Convert a byte stream from ulCodepage to WCHAR.
  *
@@ -1750,52 +1789,96 @@ HRESULT Util::HrStreamToString(IStream *sInput, std::wstring &strOutput) {
  */
 static HRESULT HrConvertStreamToWString(IStream *sInput, ULONG ulCodepage, std::wstring *wstrOutput)
 {
-	const char *lpszCharset;
-	convert_context converter;
 	std::string data;
-	auto hr = HrGetCharsetByCP(ulCodepage, &lpszCharset);
-	if (hr != hrSuccess)
-		lpszCharset = "us-ascii";
-	hr = Util::HrStreamToString(sInput, data);
+	auto hr = Util::HrStreamToString(sInput, data);
 	if (hr != hrSuccess)
 		return hr;
+	return HrConvertToWString(data, ulCodepage, wstrOutput);
+}
 
-	try {
-		wstrOutput->assign(converter.convert_to<std::wstring>(CHARSET_WCHAR"//IGNORE", data, rawsize(data), lpszCharset));
-	} catch (const std::exception &) {
-		return MAPI_E_INVALID_PARAMETER;
-	}
-	return hrSuccess;
+static void string_strip_nuls(std::wstring &s)
+{
+	s.erase(std::remove(s.begin(), s.end(), L'\0'), s.end());
 }
 
-static std::wstring string_strip_nuls(const std::wstring &i)
+/**
+ * Run @parser over HTML in codepage @cp. UTF-8 is handed to the parser as
+ * is; everything else is converted to WCHAR first.
+ */
+static HRESULT html_parse(CHtmlToTextParser &parser, const std::string &data,
+    ULONG cp)
 {
-	std::wstring o;
-	o.reserve(i.size());
-	std::copy_if(i.cbegin(), i.cend(), std::back_inserter(o),
-		[](wchar_t c) { return c != L'\0'; });
-	return o;
+	if (cp == 65001)
+		return parser.Parse(data) ? hrSuccess : MAPI_E_CORRUPT_DATA;
+	std::wstring wide;
+	auto hr = HrConvertToWString(data, cp, &wide);
+	if (hr != hrSuccess)
+		return hr;
+	string_strip_nuls(wide);
+	return parser.Parse(wide.c_str()) ? hrSuccess : MAPI_E_CORRUPT_DATA;
 }
 
 /**
  * Converts HTML (PT_BINARY, with specified codepage) to plain text (PT_UNICODE)
  *
+ * With @max_out, the HTML is read and parsed in growing portions, until
+ * enough text for @max_out characters came out or the input is exhausted,
+ * so that a preview of a large message does not cost a full conversion.
+ *
  * @param[in]	html	IStream to PR_HTML
  * @param[out]	text	IStream to PR_BODY_W
  * @param[in]	ulCodepage	codepage of html stream
+ * @param[in]	max_out	maximum number of characters to produce, 0 for all
  * @return		HRESULT	MAPI error code
  */
-HRESULT Util::HrHtmlToText(IStream *html, IStream *text, ULONG ulCodepage)
+HRESULT Util::HrHtmlToText(IStream *html, IStream *text, ULONG ulCodepage,
+    size_t max_out)
 {
-	std::wstring wstrHTML;
-	CHtmlToTextParser	parser;
-	auto hr = HrConvertStreamToWString(html, ulCodepage, &wstrHTML);
-	if(hr != hrSuccess)
+	std::wstring strText;
+
+	if (max_out == 0) {
+		CHtmlToTextParser parser;
+		std::string data;
+		auto hr = HrStreamToString(html, data);
+		if (hr == hrSuccess)
+			hr = html_parse(parser, data, ulCodepage);
+		if (hr != hrSuccess)
+			return hr;
+		auto &full = parser.GetText();
+		return text->Write(full.data(), (full.size() + 1) * sizeof(wchar_t), nullptr);
+	}
+
+	auto hr = html->Seek(large_int_zero, STREAM_SEEK_SET, nullptr);
+	if (hr != hrSuccess)
 		return hr;
-	if (!parser.Parse(string_strip_nuls(wstrHTML).c_str()))
-		return MAPI_E_CORRUPT_DATA;
+	std::string data;
+	/* Markup usually outweighs the text; start with a few times the limit */
+	size_t want = std::max<size_t>(max_out * 4, BUFSIZE);
+	bool eof = false;
+	while (true) {
+		while (!eof && data.size() < want) {
+			ULONG read = 0;
+			auto old = data.size();
+			data.resize(want);
+			hr = html->Read(&data[old], want - old, &read);
+			data.resize(old + read);
+			if (hr != hrSuccess)
+				return hr;
+			eof = read == 0;
+		}
+		CHtmlToTextParser partial;
+		hr = html_parse(partial, data, ulCodepage);
+		if (hr != hrSuccess)
+			return hr;
+		if (eof || partial.GetText().size() >= max_out) {
+			strText = std::move(partial.GetText());
+			break;
+		}
+		want *= 4;
+	}
 
-	std::wstring &strText = parser.GetText();
+	if (strText.size() > max_out)
+		strText.resize(max_out);
 	return text->Write(strText.data(), (strText.size() + 1) * sizeof(wchar_t), nullptr);
 }
 
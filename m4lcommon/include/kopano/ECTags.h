@@ -71,6 +71,8 @@
 #define PR_EC_PARENT_HIERARCHYID		PROP_TAG(PT_LONG, 0x6715)
 
 #define PR_EC_QUOTA_MAIL_TIME			PROP_TAG(PT_SYSTIME, 0x6720)
+/* eQuotaStatus of a user's store, column of PR_EC_STATSTABLE_USERS */
+#define PR_EC_QUOTA_STATUS			PROP_TAG(PT_LONG, 0x6726)
 //NOTE:	The properties PR_QUOTA_WARNING_THRESHOLD, PR_QUOTA_SEND_THRESHOLD, PR_QUOTA_RECEIVE_THRESHOLD
 //		are in the range of 0x6700+0x21 to 0x6700+0x23
 
@@ -79,6 +81,7 @@
 #define PR_EC_STATSTABLE_USERS			PROP_TAG(PT_OBJECT, 0x6732)
 #define PR_EC_STATSTABLE_COMPANY		PROP_TAG(PT_OBJECT, 0x6733)
 #define PR_EC_STATSTABLE_SERVERS		PROP_TAG(PT_OBJECT, 0x6734)
+#define PR_EC_STATSTABLE_LATENCY		PROP_TAG(PT_OBJECT, 0x6735)
 
 /* system stats */
 #define PR_EC_STATS_SYSTEM_DESCRIPTION		PROP_TAG(PT_STRING8, 0x6740)
@@ -111,6 +114,16 @@
 #define PR_EC_STATS_SESSION_PROXY		PROP_TAG(PT_STRING8, 0x6753)
 #define PR_EC_STATS_SESSION_CLIENT_APPLICATION_VERSION	PROP_TAG(PT_STRING8, 0x6754)
 #define PR_EC_STATS_SESSION_CLIENT_APPLICATION_MISC	PROP_TAG(PT_STRING8, 0x6755)
+/* latency stats, times in milliseconds; DB/ATTACH/SEND are averages per call */
+#define PR_EC_STATS_LATENCY_COUNT		PROP_TAG(PT_LONG, 0x6756)
+#define PR_EC_STATS_LATENCY_AVG			PROP_TAG(PT_DOUBLE, 0x6757)
+#define PR_EC_STATS_LATENCY_P50			PROP_TAG(PT_DOUBLE, 0x6758)
+#define PR_EC_STATS_LATENCY_P90			PROP_TAG(PT_DOUBLE, 0x6759)
+#define PR_EC_STATS_LATENCY_P99			PROP_TAG(PT_DOUBLE, 0x675A)
+#define PR_EC_STATS_LATENCY_MAX			PROP_TAG(PT_DOUBLE, 0x675B)
+#define PR_EC_STATS_LATENCY_DB			PROP_TAG(PT_DOUBLE, 0x675C)
+#define PR_EC_STATS_LATENCY_ATTACH		PROP_TAG(PT_DOUBLE, 0x675D)
+#define PR_EC_STATS_LATENCY_SEND		PROP_TAG(PT_DOUBLE, 0x675E)
 
 #define PR_EC_OUTOFOFFICE			PROP_TAG(PT_BOOLEAN, 0x6760)
 #define PR_EC_OUTOFOFFICE_MSG			PROP_TAG(PT_TSTRING, 0x6761)
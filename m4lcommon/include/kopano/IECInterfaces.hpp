@@ -188,6 +188,9 @@ class IECServiceAdmin : public virtual IECSecSvcAdm_base {
 	/* Archive store function(s) */
 	virtual HRESULT GetArchiveStoreEntryID(LPCTSTR lpszUserName, LPCTSTR lpszServerName, ULONG ulFlags, ULONG *lpcbStoreID, LPENTRYID *lppStoreID) = 0;
 	virtual HRESULT ResetFolderCount(ULONG eid_size, const ENTRYID *eid, ULONG *nupdates) = 0;
+
+	/* Delivery */
+	virtual HRESULT DeliverCopies(ULONG eid_size, const ENTRYID *msg_eid, const ENTRYLIST *folders, ULONG flags, ENTRYLIST **new_eids) = 0;
 };
 
 class IECSingleInstance : public virtual IUnknown {
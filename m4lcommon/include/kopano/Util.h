@@ -39,10 +39,10 @@ extern unsigned int PropSize(const SPropValue *);
 extern KC_EXPORT int FindPropInArray(const SPropTagArray *proptags, unsigned int tag);
 extern KC_EXPORT HRESULT HrStreamToString(IStream *in, std::string &out);
 extern KC_EXPORT HRESULT HrStreamToString(IStream *in, std::wstring &out);
-extern KC_EXPORT HRESULT HrTextToRtf(IStream *text, IStream *rtf);
-extern KC_EXPORT HRESULT HrTextToHtml(IStream *text, IStream *html, unsigned int codepage);
+extern KC_EXPORT HRESULT HrTextToRtf(IStream *text, IStream *rtf, size_t max_out = 0);
+extern KC_EXPORT HRESULT HrTextToHtml(IStream *text, IStream *html, unsigned int codepage, size_t max_out = 0);
 extern KC_EXPORT HRESULT HrTextToHtml(const wchar_t *text, std::string &html, unsigned int codepage);
-extern KC_EXPORT HRESULT HrHtmlToText(IStream *html, IStream *text, unsigned int codepage);
+extern KC_EXPORT HRESULT HrHtmlToText(IStream *html, IStream *text, unsigned int codepage, size_t max_out = 0);
 extern KC_EXPORT HRESULT HrHtmlToRtf(IStream *html, IStream *rtf, unsigned int codepage);
 extern HRESULT HrHtmlToRtf(const wchar_t *whtml, std::string &rtf);
 extern unsigned int GetBestBody(const SPropValue *body, const SPropValue *html, const SPropValue *rtfcomp, const SPropValue *rtfinsync, unsigned int flags);
@@ -105,47 +105,58 @@ HRESULT HrAllocAdviseSink(NOTIFCALLBACK *lpFunction, void *lpContext,
 
 // rtf functions
 
+static HRESULT write_all(IStream *stream, const char *data, size_t len)
+{
+	while (len > 0) {
+		ULONG written = 0;
+		auto hr = stream->Write(data, std::min(len, static_cast<size_t>(16384)), &written);
+		if (hr != hrSuccess)
+			return hr;
+		if (written == 0)
+			return MAPI_E_CALL_FAILED;
+		data += written;
+		len -= written;
+	}
+	return hrSuccess;
+}
+
 // This is called when a user calls Commit() on a wrapped (uncompressed) RTF Stream
 static HRESULT RTFCommitFunc(IStream *lpUncompressedStream, void *lpData)
 {
 	auto lpCompressedStream = static_cast<IStream *>(lpData);
-	STATSTG sStatStg;
-	unsigned int ulRead = 0, ulWritten = 0, ulCompressedSize;
-	std::unique_ptr<char, cstdlib_deleter> lpCompressed;
-
-	auto hr = lpUncompressedStream->Stat(&sStatStg, STATFLAG_NONAME);
-	if(hr != hrSuccess)
-		return hr;
-	auto lpUncompressed = make_unique_nt<char[]>(sStatStg.cbSize.LowPart);
-	if (lpUncompressed == nullptr)
-		return MAPI_E_NOT_ENOUGH_MEMORY;
-	auto lpReadPtr = lpUncompressed.get();
-	while(1) {
-		hr = lpUncompressedStream->Read(lpReadPtr, 1024, &ulRead);
-
-		if(hr != hrSuccess || ulRead == 0)
-			break;
-
-		lpReadPtr += ulRead;
-	}
+	char buf[16384], hdr[RTF_HEADER_SIZE]{};
+	ULONG ulRead = 0;
+	rtf_encoder enc;
+	std::string out;
 
-	// We now have the complete uncompressed data in lpUncompressed
-	if (rtf_compress(&unique_tie(lpCompressed), &ulCompressedSize, lpUncompressed.get(), sStatStg.cbSize.LowPart) != 0)
-		return MAPI_E_CALL_FAILED;
-	// lpCompressed is the compressed RTF stream, write it to lpCompressedStream
-	lpReadPtr = lpCompressed.get();
 	lpCompressedStream->SetSize(ularge_int_zero);
 	if (lpCompressedStream->Seek(large_int_zero, STREAM_SEEK_SET, nullptr) != hrSuccess)
 		/* ignore */;
-
-	while(ulCompressedSize) {
-		hr = lpCompressedStream->Write(lpReadPtr, std::min(ulCompressedSize, 16384U), &ulWritten);
-		if(hr != hrSuccess)
+	// The header only is known at the end; leave room for it
+	auto hr = write_all(lpCompressedStream, hdr, sizeof(hdr));
+	if (hr != hrSuccess)
+		return hr;
+	while (true) {
+		hr = lpUncompressedStream->Read(buf, sizeof(buf), &ulRead);
+		if (hr != hrSuccess || ulRead == 0)
+			break;
+		enc.add(buf, ulRead, out);
+		hr = write_all(lpCompressedStream, out.data(), out.size());
+		if (hr != hrSuccess)
 			return hr;
-		lpReadPtr += ulWritten;
-		ulCompressedSize -= ulWritten;
+		out.clear();
 	}
-	return hrSuccess;
+	enc.finish(out, hdr);
+	hr = write_all(lpCompressedStream, out.data(), out.size());
+	if (hr != hrSuccess)
+		return hr;
+	hr = lpCompressedStream->Seek(large_int_zero, STREAM_SEEK_SET, nullptr);
+	if (hr != hrSuccess)
+		return hr;
+	hr = write_all(lpCompressedStream, hdr, sizeof(hdr));
+	if (hr != hrSuccess)
+		return hr;
+	return lpCompressedStream->Seek(large_int_zero, STREAM_SEEK_END, nullptr);
 }
 
 HRESULT WrapCompressedRTFStream(IStream *lpCompressedRTFStream,
@@ -156,11 +167,11 @@ HRESULT WrapCompressedRTFStream(IStream *lpCompressedRTFStream,
 	// Uncompressed stream. This is usually not a problem, as the whole
 	// stream is read out in one go anyway.
 	//
-	// Also, not much streaming is done on the input data, the function
-	// therefore is quite memory-hungry.
+	// The compressed data is decoded as it is read, so only the
+	// uncompressed form is held in memory as a whole.
 
 	STATSTG sStatStg;
-	std::unique_ptr<char[]> lpCompressed, lpUncompressed;
+	std::unique_ptr<char[]> lpUncompressed;
 	unsigned int ulRead = 0, ulUncompressedLen = 0;
 	object_ptr<ECMemStream> lpUncompressedStream;
 	
@@ -169,29 +180,37 @@ HRESULT WrapCompressedRTFStream(IStream *lpCompressedRTFStream,
 		return hr;
 
 	if(sStatStg.cbSize.LowPart > 0) {
-		lpCompressed.reset(new(std::nothrow) char[sStatStg.cbSize.LowPart]);
-		if (lpCompressed == nullptr)
-			return MAPI_E_NOT_ENOUGH_MEMORY;
-
-		// Read in the whole compressed data buffer
-		auto lpReadPtr = lpCompressed.get();
-		while (1) {
-			hr = lpCompressedRTFStream->Read(lpReadPtr, 1024, &ulRead);
+		rtf_decoder dec;
+		char buf[16384];
+		unsigned int room = 0;
+
+		while (!dec.done()) {
+			hr = lpCompressedRTFStream->Read(buf, sizeof(buf), &ulRead);
 			if (hr != hrSuccess)
 				return hr;
 			if (ulRead == 0)
 				break;
-			lpReadPtr += ulRead;
+			const char *in = buf;
+			size_t in_len = ulRead;
+			while (in_len > 0 && !dec.done()) {
+				if (dec.have_header() && lpUncompressed == nullptr) {
+					room = std::min(dec.raw_size(), UINT_MAX - 1);
+					lpUncompressed.reset(new(std::nothrow) char[room]);
+					if (lpUncompressed == nullptr)
+						return MAPI_E_NOT_ENOUGH_MEMORY;
+				}
+				auto left = in_len;
+				auto n = dec.decode(in, in_len,
+				         lpUncompressed.get() + ulUncompressedLen,
+				         room - ulUncompressedLen);
+				if (n == 0 && in_len == left)
+					break;
+				ulUncompressedLen += n;
+			}
 		}
-		ulUncompressedLen = rtf_get_uncompressed_length(lpCompressed.get(), sStatStg.cbSize.LowPart);
-		lpUncompressed.reset(new(std::nothrow) char[ulUncompressedLen]);
-		if (lpUncompressed == nullptr)
-			return MAPI_E_NOT_ENOUGH_MEMORY;
-		memset(lpUncompressed.get(), 0, ulUncompressedLen);
-		ulUncompressedLen = rtf_decompress(lpUncompressed.get(), lpCompressed.get(), sStatStg.cbSize.LowPart);
-		if (ulUncompressedLen == UINT_MAX)
+		if (!dec.have_header() || dec.invalid())
 			return MAPI_E_INVALID_PARAMETER;
-        	// We now have the uncompressed data, create a stream and write the uncompressed data into it
+		// We now have the uncompressed data, create a stream and write the uncompressed data into it
 	}
 	
 	hr = ECMemStream::Create(lpUncompressed.get(), ulUncompressedLen,
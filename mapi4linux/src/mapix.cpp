@@ -3,6 +3,7 @@
  * Copyright 2005 - 2016 Zarafa and its licensors
  */
 #include <kopano/platform.h>
+#include <algorithm>
 #include <exception>
 #include <list>
 #include <memory>
@@ -14,6 +15,7 @@
 #include <cerrno>
 #include <climits>
 #include <cstddef>
+#include <cstdlib>
 #include <cstring>
 #include <kopano/ECLogger.h>
 #include <kopano/ECUnknown.h>
@@ -81,9 +83,19 @@ struct alignas(::max_align_t) mapiext_head {
 	alignas(::max_align_t) char data[];
 };
 
+/*
+ * MAPIAllocateMore carves small allocations out of arena blocks that
+ * grow geometrically from arena_first to arena_max bytes; a request
+ * bigger than arena_big gets a block of its own. All blocks hang off
+ * mapibuf_head::child, so MAPIFreeBuffer is the same either way.
+ */
+static constexpr size_t arena_first = 512, arena_max = 65536, arena_big = 8192;
+
 struct alignas(::max_align_t) mapibuf_head {
 	std::mutex mtx;
 	struct mapiext_head *child; /* singly-linked list */
+	char *arena_ptr, *arena_end; /* free space in the newest arena block */
+	size_t arena_next; /* size of the next arena block; 0: arena not used */
 #if MAPI_MEM_MORE_DEBUG
 	enum mapibuf_ident ident;
 #endif
@@ -1796,6 +1808,16 @@ HRESULT M4LAddrBook::QueryInterface(const IID &refiid, void **lppInterface)
 	return MAPI_E_INTERFACE_NOT_SUPPORTED;
 }
 
+/**
+ * Whether MAPIAllocateMore uses arena blocks. Setting MAPI_NO_ARENA in the
+ * environment selects one malloc per allocation, to compare against.
+ */
+static bool mapi_use_arena()
+{
+	static const bool use = getenv("MAPI_NO_ARENA") == nullptr;
+	return use;
+}
+
 /**
  * Allocate a new buffer. Must be freed with MAPIFreeBuffer.
  *
@@ -1818,6 +1840,8 @@ SCODE MAPIAllocateBuffer(ULONG cbSize, LPVOID *lppBuffer)
 	try {
 		new(bfr) struct mapibuf_head; /* init mutex */
 		bfr->child = nullptr;
+		bfr->arena_ptr = bfr->arena_end = nullptr;
+		bfr->arena_next = mapi_use_arena() ? arena_first : 0;
 	} catch (const std::exception &e) {
 		fprintf(stderr, "MAPIAllocateBuffer: %s\n", e.what());
 		free(bfr);
@@ -1843,22 +1867,42 @@ SCODE MAPIAllocateMore(ULONG cbSize, LPVOID lpObject, LPVOID *lppBuffer)
 		return MAPI_E_INVALID_PARAMETER;
 	if (!lpObject)
 		return MAPIAllocateBuffer(cbSize, lppBuffer);
-	cbSize += sizeof(struct mapiext_head);
-	auto bfr = static_cast<struct mapiext_head *>(malloc(cbSize));
-	if (bfr == nullptr) {
-		ec_log_crit("MAPIAllocateMore(): %s", strerror(errno));
-		return MAKE_MAPI_E(1);
-	}
 
 	auto head = container_of(lpObject, struct mapibuf_head, data);
 #if MAPI_MEM_MORE_DEBUG
 	if (head->ident != MAPIBUF_BASE)
 		assert("AllocateMore on something that was not allocated with MAPIAllocateBuffer!\n" == nullptr);
 #endif
+	/*
+	 * Keep every piece aligned like malloc would. A zero-size request
+	 * still takes one unit, so that it yields a unique, non-null pointer
+	 * (and not the end of an arena, or nullptr with no arena yet).
+	 */
+	size_t len = (static_cast<size_t>(cbSize) + alignof(::max_align_t) - 1) &
+	             ~(alignof(::max_align_t) - 1);
+	if (len == 0)
+		len = alignof(::max_align_t);
 	scoped_lock lock(head->mtx);
+	if (head->arena_next != 0 && len <= static_cast<size_t>(head->arena_end - head->arena_ptr)) {
+		*lppBuffer = head->arena_ptr;
+		head->arena_ptr += len;
+		return hrSuccess;
+	}
+	bool new_arena = head->arena_next != 0 && len <= arena_big;
+	size_t blksize = new_arena ? std::max(head->arena_next, len) : len;
+	auto bfr = static_cast<struct mapiext_head *>(malloc(sizeof(struct mapiext_head) + blksize));
+	if (bfr == nullptr) {
+		ec_log_crit("MAPIAllocateMore(): %s", strerror(errno));
+		return MAKE_MAPI_E(1);
+	}
 	bfr->child = head->child;
 	head->child = bfr;
 	*lppBuffer = bfr->data;
+	if (new_arena) {
+		head->arena_ptr = bfr->data + len;
+		head->arena_end = bfr->data + blksize;
+		head->arena_next = std::min(head->arena_next * 2, arena_max);
+	}
 #if MAPI_MEM_DEBUG
 	fprintf(stderr, "Extra buffer: %p on %p\n", *lppBuffer, lpObject);
 #endif
@@ -4,9 +4,11 @@
  */
 #include <algorithm>
 #include <memory>
+#include <string>
 #include <climits>
 #include <cstring>
 #include <cstdlib>
+#include <zlib.h>
 #include <kopano/platform.h>
 #include "rtf.h"
 
@@ -17,8 +19,13 @@ static const char lpPrebuf[] =
 	"{\\rtf1\\ansi\\mac\\deff0\\deftab720{\\fonttbl;}"
 	"{\\f0\\fnil \\froman \\fswiss \\fmodern \\fscript "
 	"\\fdecor MS Sans SerifSymbolArialTimes New RomanCourier"
-	"{\\colortbl\\red0\\green0\\blue0\n\r\\par "
+	"{\\colortbl\\red0\\green0\\blue0\r\n\\par "
 	"\\pard\\plain\\f0\\fs20\\b\\i\\u\\tab\\tx";
+static constexpr unsigned int prebuf_size = sizeof(lpPrebuf) - 1;
+static constexpr uint32_t RTF_MAGIC_LZFU = 0x75465a4c, RTF_MAGIC_MELA = 0x414c454d;
+/* Longest reference (4 bits + 2), and how many candidates to try */
+static constexpr unsigned int LZFU_MAX_MATCH = 17, LZFU_MAX_CHAIN = 32;
+static constexpr uint32_t LZFU_NONE = UINT32_MAX;
 
 struct RTFHeader {
 	unsigned int ulCompressedSize;
@@ -31,13 +38,13 @@ unsigned int rtf_get_uncompressed_length(const char *lpData,
     unsigned int ulSize)
 {
 	// Check if we have a full header
-	if(ulSize < sizeof(RTFHeader)) 
+	if(ulSize < sizeof(RTFHeader))
 		return 0;
-	
+
 	// Return the size
 	RTFHeader h;
 	memcpy(&h, lpData, sizeof(h));
-	return le16_to_cpu(h.ulUncompressedSize);
+	return le32_to_cpu(h.ulUncompressedSize);
 }
 
 /*
@@ -50,98 +57,369 @@ unsigned int rtf_get_uncompressed_length(const char *lpData,
 unsigned int rtf_decompress(char *lpDest, const char *lpSrc,
     unsigned int ulBufSize)
 {
-	auto lpHeader = reinterpret_cast<const struct RTFHeader *>(lpSrc);
-	auto lpStart = lpSrc;
-	unsigned char c1 = 0, c2 = 0;
-	unsigned int ulFlags = 0, ulFlagNr = 0;
-	unsigned int ulOffset = 0, ulSize = 0;
-	const unsigned int prebufSize = strlen(lpPrebuf);
-
 	// Check if we have a full header
-	if(ulBufSize < sizeof(RTFHeader)) 
+	if(ulBufSize < sizeof(RTFHeader))
 		return UINT_MAX;
-	
-	unsigned int uncomp_size = le32_to_cpu(lpHeader->ulUncompressedSize);
+
+	unsigned int uncomp_size = rtf_get_uncompressed_length(lpSrc, ulBufSize);
 	if (uncomp_size == UINT_MAX)
 		/*
 		 * Put a slight cap on the data size, since we will (ab)use
 		 * UINT_MAX to indicate an error.
 		 */
 		--uncomp_size;
-	lpSrc += sizeof(struct RTFHeader);
-	
-	if (le32_to_cpu(lpHeader->ulMagic) == 0x414c454d) {
-		// Uncompressed RTF
-		auto len = std::min(static_cast<size_t>(uncomp_size), ulBufSize - sizeof(RTFHeader));
-		memcpy(lpDest, lpSrc, len);
-		return len;
-	} else if (le32_to_cpu(lpHeader->ulMagic) != 0x75465a4c) {
+	rtf_decoder dec;
+	size_t len = ulBufSize;
+	dec.decode(lpSrc, len, lpDest, uncomp_size);
+	if (dec.invalid())
 		return UINT_MAX;
-	}
-	// Allocate a buffer to decompress into (uncompressed size plus prebuffered data)
-	auto lpBuffer = std::make_unique<char[]>(uncomp_size + prebufSize);
-	memcpy(lpBuffer.get(), lpPrebuf, prebufSize);
-
-	// Start writing just after the prebuffered data
-	char *lpWrite = lpBuffer.get() + prebufSize;
-	while (lpWrite < lpBuffer.get() + uncomp_size + prebufSize) {
-		// Get next bit from flags
-		ulFlags = ulFlagNr++ % 8 == 0 ? *lpSrc++ : ulFlags >> 1;
-
-		if (lpSrc >= lpStart + ulBufSize)
-			// Reached the end of the input buffer somehow. We currently return OK
-			// and the decoded data up to now.
-			break;
-		if (!(ulFlags & 1)) {
-			*lpWrite++ = *lpSrc++;
-			if (lpSrc >= lpStart + ulBufSize)
-				break;
-			continue;
-		}
-		if (lpSrc + 2 >= lpStart + ulBufSize)
-			break;
-		// Reference to existing data
-		c1 = *lpSrc++;
-		c2 = *lpSrc++;
-
-		// Offset is first 12 bits
-		ulOffset = (((unsigned int)c1) << 4) | (c2 >> 4);
-		// Size is last 4 bits, plus 2 (0 and 1 are impossible, because 1 would be a literal (i.e. ulFlags & 1 == 0)
-		ulSize = (c2 & 0xf) + 2;
-
-		// We now have offset and size within our current 4k window. If the offset is after the
-		// write pointer, then go back one window. (due to wrapping buffer)
-		ulOffset = ((lpWrite - lpBuffer.get()) / 4096) * 4096 + ulOffset;
-		if (ulOffset > (unsigned int)(lpWrite - lpBuffer.get()))
-			ulOffset -= 4096;
-		while (ulSize && lpWrite < &lpBuffer[uncomp_size+prebufSize] && ulOffset < uncomp_size + prebufSize) {
-			*lpWrite++ = lpBuffer[ulOffset++];
-			--ulSize;
-		}
-	}
-	// Copy back the data without the prebuffer
-	auto len = lpWrite - (lpBuffer.get() + prebufSize);
-	memcpy(lpDest, &lpBuffer[prebufSize], len);
-	return len;
+	/*
+	 * Truncated input is not an error; what could be decoded up to
+	 * there is returned.
+	 */
+	return dec.decode(lpSrc, len, lpDest, uncomp_size);
 }
 
 /**
- * rtf_compress - put RTF uncompressed into the "MELA" format
+ * rtf_compress - put RTF into the LZFu format
  */
 unsigned int rtf_compress(char **dstp, unsigned int *dst_size,
     const char *src, unsigned int src_size)
 {
-	*dst_size = src_size + sizeof(RTFHeader);
+	rtf_encoder enc;
+	std::string body;
+	char hdr[RTF_HEADER_SIZE];
+
+	enc.add(src, src_size, body);
+	enc.finish(body, hdr);
+	*dst_size = sizeof(hdr) + body.size();
 	char *dst = *dstp = reinterpret_cast<char *>(malloc(*dst_size));
 	if (dst == nullptr)
 		return 1;
-	auto hdr = reinterpret_cast<RTFHeader *>(dst);
-	hdr->ulUncompressedSize = src_size;
-	hdr->ulCompressedSize = *dst_size;
-	memcpy(&hdr->ulMagic, "MELA", 4);
-	hdr->ulChecksum = 0;
-	memcpy(&dst[sizeof(*hdr)], src, src_size);
+	memcpy(dst, hdr, sizeof(hdr));
+	memcpy(dst + sizeof(hdr), body.data(), body.size());
 	return 0;
 }
 
+uint32_t rtf_crc32(uint32_t crc, const void *data, size_t len)
+{
+	/*
+	 * The polynomial is the one of zlib's crc32() (not CRC-32C, so
+	 * the SSE 4.2 crc32 instruction is of no use); zlib brings the
+	 * fastest variant for the machine. LZFu leaves out the inversion
+	 * before and after.
+	 */
+	auto p = static_cast<const Bytef *>(data);
+	crc = ~crc;
+	while (len > 0) {
+		auto n = std::min(len, static_cast<size_t>(UINT_MAX));
+		crc = crc32(crc, p, n);
+		p += n;
+		len -= n;
+	}
+	return ~crc;
+}
+
+static inline unsigned int lzfu_hash(const char *p)
+{
+	auto u = reinterpret_cast<const unsigned char *>(p);
+	return ((u[0] | (u[1] << 8) | (u[2] << 16)) * 2654435761U) >> 20;
+}
+
+/*
+ * The dictionary of [MS-OXRTFCP] is a 4K ring that starts out with the
+ * prebuffer. The encoder keeps it as a linear history instead: the
+ * prebuffer at absolute position 0, then all input; the dictionary
+ * offset of a position is its lower 12 bits. Matches are found through
+ * hash chains over 3-byte prefixes.
+ */
+rtf_encoder::rtf_encoder() :
+	m_hist(lpPrebuf, prebuf_size), m_pos(prebuf_size)
+{
+	std::fill(std::begin(m_head), std::end(m_head), LZFU_NONE);
+	m_grp[0] = 0;
+	for (uint32_t i = 0; i + 3 <= prebuf_size; ++i)
+		insert(i);
+}
+
+void rtf_encoder::insert(uint32_t pos)
+{
+	auto h = lzfu_hash(&m_hist[pos - m_base]);
+	m_prev[pos & 0xFFF] = m_head[h];
+	m_head[h] = pos;
+}
+
+/* Queue a token; a group of 8 is written out behind its control byte */
+void rtf_encoder::token(bool ref, unsigned int v, std::string &out)
+{
+	if (ref) {
+		m_grp[0] |= 1 << m_grp_tokens;
+		m_grp[m_grp_len++] = v >> 8;
+	}
+	m_grp[m_grp_len++] = v;
+	if (++m_grp_tokens < 8)
+		return;
+	out.append(reinterpret_cast<const char *>(m_grp), m_grp_len);
+	m_crc = rtf_crc32(m_crc, m_grp, m_grp_len);
+	m_comp_size += m_grp_len;
+	m_grp[0] = 0;
+	m_grp_len = 1;
+	m_grp_tokens = 0;
+}
+
+/* Encode all positions before @end */
+void rtf_encoder::run(size_t end, std::string &out)
+{
+	size_t avail = m_base + m_hist.size();
+	auto buf = m_hist.data();
+
+	while (m_pos < end) {
+		auto max = std::min(static_cast<size_t>(LZFU_MAX_MATCH), avail - m_pos);
+		auto cur = buf + (m_pos - m_base);
+		unsigned int best = 0;
+		uint32_t best_pos = 0;
+
+		/*
+		 * The distance must stay below 4096: a reference to the
+		 * write position itself is the end marker.
+		 */
+		if (max >= 3)
+			for (uint32_t cand = m_head[lzfu_hash(cur)], depth = 0;
+			     cand != LZFU_NONE && m_pos - cand < 4096 &&
+			     depth < LZFU_MAX_CHAIN; ++depth) {
+				auto c = buf + (cand - m_base);
+				unsigned int n = 0;
+				while (n < max && c[n] == cur[n])
+					++n;
+				if (n > best) {
+					best = n;
+					best_pos = cand;
+					if (n == max)
+						break;
+				}
+				auto next = m_prev[cand & 0xFFF];
+				if (next >= cand)
+					break;
+				cand = next;
+			}
+		if (best < 2) {
+			token(false, static_cast<unsigned char>(*cur), out);
+			best = 1;
+		} else {
+			token(true, ((best_pos & 0xFFF) << 4) | (best - 2), out);
+		}
+		for (; best > 0; --best, ++m_pos)
+			if (m_pos + 3 <= avail)
+				insert(m_pos);
+	}
+}
+
+void rtf_encoder::add(const char *data, size_t len, std::string &out)
+{
+	while (len > 0) {
+		auto n = std::min(len, static_cast<size_t>(65536));
+		m_hist.append(data, n);
+		data += n;
+		len -= n;
+		/*
+		 * Keep enough lookahead for a full match, and for hashing
+		 * the last position covered by it.
+		 */
+		size_t avail = m_base + m_hist.size();
+		if (avail - m_pos > LZFU_MAX_MATCH + 2)
+			run(avail - LZFU_MAX_MATCH - 2, out);
+		if (m_pos - m_base > 2 * 4096) {
+			auto drop = m_pos - m_base - 4096;
+			m_hist.erase(0, drop);
+			m_base += drop;
+		}
+	}
+}
+
+void rtf_encoder::finish(std::string &out, char (&hdr)[RTF_HEADER_SIZE])
+{
+	run(m_base + m_hist.size(), out);
+	token(true, (m_pos & 0xFFF) << 4, out);
+	if (m_grp_tokens > 0) {
+		out.append(reinterpret_cast<const char *>(m_grp), m_grp_len);
+		m_crc = rtf_crc32(m_crc, m_grp, m_grp_len);
+		m_comp_size += m_grp_len;
+	}
+	RTFHeader h;
+	h.ulCompressedSize = cpu_to_le32(m_comp_size + 12);
+	h.ulUncompressedSize = cpu_to_le32(m_pos - prebuf_size);
+	h.ulMagic = cpu_to_le32(RTF_MAGIC_LZFU);
+	h.ulChecksum = cpu_to_le32(m_crc);
+	memcpy(hdr, &h, sizeof(h));
+}
+
+rtf_decoder::rtf_decoder() : m_wp(prebuf_size)
+{
+	memcpy(m_dict, lpPrebuf, prebuf_size);
+	memset(m_dict + prebuf_size, 0, sizeof(m_dict) - prebuf_size);
+}
+
+bool rtf_decoder::header(const char *&in, size_t &in_len)
+{
+	auto n = std::min(in_len, RTF_HEADER_SIZE - m_hdr_len);
+	memcpy(m_hdr + m_hdr_len, in, n);
+	m_hdr_len += n;
+	in += n;
+	in_len -= n;
+	if (m_hdr_len < RTF_HEADER_SIZE)
+		return false;
+
+	RTFHeader h;
+	memcpy(&h, m_hdr, sizeof(h));
+	auto comp_size = le32_to_cpu(h.ulCompressedSize);
+	m_raw_size = m_raw_left = le32_to_cpu(h.ulUncompressedSize);
+	m_body_left = comp_size > 12 ? comp_size - 12 : 0;
+	m_crc_want = le32_to_cpu(h.ulChecksum);
+	auto magic = le32_to_cpu(h.ulMagic);
+	if (magic == RTF_MAGIC_LZFU)
+		m_lzfu = true;
+	else if (magic != RTF_MAGIC_MELA)
+		m_invalid = m_done = true;
+	return true;
+}
+
+/**
+ * Returns the number of bytes placed in @out. Having completed the header,
+ * decode() returns, so that the caller can size its buffer by raw_size().
+ */
+size_t rtf_decoder::decode(const char *&in, size_t &in_len, char *out,
+    size_t out_len)
+{
+	if (!have_header()) {
+		header(in, in_len);
+		return 0;
+	}
+	if (m_done)
+		return 0;
+
+	auto start = in;
+	size_t n;
+	if (m_lzfu) {
+		n = lzfu(in, in_len, out, out_len);
+	} else {
+		n = std::min({in_len, out_len, static_cast<size_t>(m_raw_left)});
+		memcpy(out, in, n);
+		in += n;
+		in_len -= n;
+		m_raw_left -= n;
+		m_done = m_raw_left == 0;
+	}
+	auto used = std::min(static_cast<size_t>(in - start), static_cast<size_t>(m_body_left));
+	m_crc = rtf_crc32(m_crc, start, used);
+	m_body_left -= used;
+	return n;
+}
+
+bool rtf_decoder::crc_ok() const
+{
+	/* MELA has no checksum */
+	return !m_lzfu || (m_body_left == 0 && m_crc == m_crc_want);
+}
+
+/*
+ * Output beyond the size from the header is dropped, but the input is
+ * still read up to the end marker, so that all of it counts for the CRC.
+ */
+size_t rtf_decoder::lzfu(const char *&in, size_t &in_len, char *out,
+    size_t out_len)
+{
+	auto ip = reinterpret_cast<const unsigned char *>(in), ie = ip + in_len;
+	bool capped = m_raw_left <= out_len;
+	auto op = out, oe = out + (capped ? m_raw_left : out_len);
+	auto dict = m_dict;
+	unsigned int wp = m_wp;
+
+	while (true) {
+		/* Rest of a reference that did not fit last time */
+		for (; m_copy_len > 0; --m_copy_len) {
+			if (op == oe && !capped)
+				goto leave;
+			auto c = dict[m_copy_off];
+			m_copy_off = (m_copy_off + 1) & 0xFFF;
+			dict[wp] = c;
+			wp = (wp + 1) & 0xFFF;
+			if (op < oe)
+				*op++ = c;
+		}
+		/* A whole group at hand and room for it: no checks needed */
+		while (m_bits == 0 && ie - ip >= 17 && oe - op >= 8 * LZFU_MAX_MATCH) {
+			unsigned int ctrl = *ip++;
+			for (unsigned int b = 0; b < 8; ++b, ctrl >>= 1) {
+				if (!(ctrl & 1)) {
+					dict[wp] = *op++ = *ip++;
+					wp = (wp + 1) & 0xFFF;
+					continue;
+				}
+				unsigned int v = (ip[0] << 8) | ip[1];
+				unsigned int off = v >> 4, len = (v & 0xF) + 2;
+				ip += 2;
+				if (off == wp) {
+					m_done = true;
+					goto leave;
+				}
+				/* Neither end wraps, no run-length style overlap */
+				if (off + len <= 4096 && wp + len <= 4096 &&
+				    ((wp - off) & 0xFFF) >= len) {
+					memcpy(op, dict + off, len);
+					memmove(dict + wp, dict + off, len);
+					op += len;
+					wp = (wp + len) & 0xFFF;
+					continue;
+				}
+				for (; len > 0; --len) {
+					dict[wp] = *op++ = dict[off];
+					off = (off + 1) & 0xFFF;
+					wp = (wp + 1) & 0xFFF;
+				}
+			}
+		}
+		if (m_bits == 0) {
+			if (ip == ie)
+				break;
+			m_ctrl = *ip++;
+			m_bits = 8;
+		}
+		if (m_ctrl & 1) {
+			if (m_half < 0) {
+				if (ip == ie)
+					break;
+				m_half = *ip++;
+			}
+			if (ip == ie)
+				break;
+			unsigned int v = (m_half << 8) | *ip++;
+			m_half = -1;
+			m_ctrl >>= 1;
+			--m_bits;
+			if (v >> 4 == wp) {
+				m_done = true;
+				break;
+			}
+			m_copy_off = v >> 4;
+			m_copy_len = (v & 0xF) + 2;
+			continue;
+		}
+		if (ip == ie || (op == oe && !capped))
+			break;
+		dict[wp] = *ip;
+		wp = (wp + 1) & 0xFFF;
+		if (op < oe)
+			*op++ = *ip;
+		++ip;
+		m_ctrl >>= 1;
+		--m_bits;
+	}
+ leave:
+	m_wp = wp;
+	in_len -= reinterpret_cast<const char *>(ip) - in;
+	in = reinterpret_cast<const char *>(ip);
+	m_raw_left -= op - out;
+	return op - out;
+}
+
 } /* namespace KC */
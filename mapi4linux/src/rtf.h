@@ -3,12 +3,77 @@
  * Copyright 2005 - 2016 Zarafa and its licensors
  */
 #pragma once
+#include <string>
+#include <cstddef>
+#include <cstdint>
 #include <kopano/zcdefs.h>
 
 namespace KC {
 
+/* Size of the PR_RTF_COMPRESSED header ([MS-OXRTFCP] 2.1.3.1.1) */
+static constexpr size_t RTF_HEADER_SIZE = 16;
+
 extern KC_EXPORT unsigned int rtf_get_uncompressed_length(const char *data, unsigned int size);
 extern KC_EXPORT unsigned int rtf_decompress(char *dst, const char *src, unsigned int src_size);
 extern KC_EXPORT unsigned int rtf_compress(char **dst, unsigned int *dst_size, const char *src, unsigned int src_size);
+/* CRC as used in the header: CRC-32, but starting at 0 and not inverted */
+extern KC_EXPORT uint32_t rtf_crc32(uint32_t crc, const void *data, size_t len);
+
+/**
+ * Incremental LZFu compressor. Input can be given in pieces of any size;
+ * compressed data is appended to @out as it becomes final. The header
+ * goes in front of all of that and is only known after finish().
+ */
+class KC_EXPORT rtf_encoder KC_FINAL {
+	public:
+	rtf_encoder();
+	void add(const char *data, size_t len, std::string &out);
+	void finish(std::string &out, char (&hdr)[RTF_HEADER_SIZE]);
+
+	private:
+	KC_HIDDEN void run(size_t end, std::string &out);
+	KC_HIDDEN void insert(uint32_t pos);
+	KC_HIDDEN void token(bool ref, unsigned int v, std::string &out);
+
+	std::string m_hist; /* window plus pending input */
+	uint32_t m_base = 0, m_pos = 0; /* absolute position of m_hist[0], next byte */
+	uint32_t m_head[4096], m_prev[4096];
+	unsigned char m_grp[17];
+	unsigned int m_grp_len = 1, m_grp_tokens = 0;
+	uint32_t m_crc = 0, m_comp_size = 0;
+};
+
+/**
+ * Incremental decompressor for compressed RTF, both the LZFu and the
+ * uncompressed ("MELA") form. decode() consumes what it can from @in,
+ * writes at most @out_len bytes and can be called again with more input
+ * and/or room.
+ */
+class KC_EXPORT rtf_decoder KC_FINAL {
+	public:
+	rtf_decoder();
+	size_t decode(const char *&in, size_t &in_len, char *out, size_t out_len);
+	/* The header is complete; raw_size() is valid */
+	bool have_header() const { return m_hdr_len == RTF_HEADER_SIZE; }
+	/* The header is not one of the known forms */
+	bool invalid() const { return m_invalid; }
+	/* End marker or the announced size was reached */
+	bool done() const { return m_done; }
+	bool crc_ok() const;
+	uint32_t raw_size() const { return m_raw_size; }
+
+	private:
+	KC_HIDDEN bool header(const char *&in, size_t &in_len);
+	KC_HIDDEN size_t lzfu(const char *&in, size_t &in_len, char *out, size_t out_len);
+
+	unsigned char m_dict[4096];
+	char m_hdr[RTF_HEADER_SIZE];
+	unsigned int m_hdr_len = 0, m_wp = 0, m_ctrl = 0, m_bits = 0;
+	unsigned int m_copy_off = 0, m_copy_len = 0;
+	int m_half = -1; /* first byte of a split reference */
+	uint32_t m_raw_size = 0, m_raw_left = 0, m_body_left = 0;
+	uint32_t m_crc = 0, m_crc_want = 0;
+	bool m_lzfu = false, m_done = false, m_invalid = false;
+};
 
 }
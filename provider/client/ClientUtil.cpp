@@ -754,3 +754,40 @@ soap_lock_guard::~soap_lock_guard()
 {
 	unlock();
 }
+
+soap_lease::soap_lease(WSTransport &tp) : m_tp(tp)
+{
+	if (tp.m_hDataLock.try_lock()) {
+		m_main.reset(new soap_lock_guard(tp));
+		tp.m_hDataLock.unlock();
+		m_soap = &tp;
+		return;
+	}
+	m_pooled = tp.pool_get(&m_gen);
+	if (m_pooled != nullptr) {
+		m_soap = m_pooled.get();
+		return;
+	}
+	m_main.reset(new soap_lock_guard(tp));
+	m_soap = &tp;
+}
+
+void soap_lease::unlock()
+{
+	if (m_main != nullptr) {
+		m_main->unlock();
+		return;
+	}
+	if (m_pooled == nullptr)
+		return;
+	if (m_pooled->m_lpCmd != nullptr && m_pooled->m_lpCmd->soap != nullptr) {
+		soap_destroy(m_pooled->m_lpCmd->soap);
+		soap_end(m_pooled->m_lpCmd->soap);
+	}
+	m_tp.pool_put(std::move(m_pooled), m_gen);
+}
+
+soap_lease::~soap_lease()
+{
+	unlock();
+}
@@ -50,6 +50,30 @@ class soap_lock_guard {
 	bool m_done = false;
 };
 
+/**
+ * Exclusive use of one connection of a transport's session for one call.
+ * That is the main connection, as with soap_lock_guard, when it is free.
+ * When another thread is using it, a connection from the transport's pool
+ * (see WSTransport::pool_get) is taken instead, so that independent calls
+ * from several threads are in flight at the same time.
+ */
+class soap_lease KC_FINAL {
+	public:
+	soap_lease(WSTransport &);
+	soap_lease(const soap_lease &) = delete;
+	~soap_lease();
+	void operator=(const soap_lease &) = delete;
+	WSSoap *operator->() const { return m_soap; }
+	void unlock();
+
+	private:
+	WSTransport &m_tp;
+	WSSoap *m_soap = nullptr;
+	std::unique_ptr<soap_lock_guard> m_main;
+	std::unique_ptr<WSSoap> m_pooled;
+	unsigned int m_gen = 0;
+};
+
 extern HRESULT HrCreateEntryId(const GUID &store_guid, unsigned int obj_type, ULONG *eid_size, ENTRYID **eid);
 extern HRESULT HrGetServerURLFromStoreEntryId(ULONG eid_size, const ENTRYID *eid, std::string &srv_path, bool *pseudo);
 HRESULT HrResolvePseudoUrl(WSTransport *lpTransport, const char *lpszUrl, std::string& serverPath, bool *lpbIsPeer);
@@ -2,7 +2,10 @@
  * SPDX-License-Identifier: AGPL-3.0-only
  * Copyright 2005 - 2016 Zarafa and its licensors
  */
+#include <algorithm>
 #include <string>
+#include <system_error>
+#include <cstdlib>
 #include <kopano/platform.h>
 #include <mapicode.h>
 #include <mapidefs.h>
@@ -14,17 +17,62 @@
 #include <kopano/ECGuid.h>
 #include <kopano/Util.h>
 #include <kopano/memory.hpp>
+#include <kopano/stringutil.h>
 
 using namespace KC;
 
+/*
+ * Sits between ECNotifyClient and the caller's advise sink, so that the
+ * table learns about changes and drops rows it has read ahead.
+ */
+class ECTableAdviseSink KC_FINAL_OPG : public ECUnknown, public IMAPIAdviseSink {
+	public:
+	ECTableAdviseSink(IMAPIAdviseSink *sink, std::shared_ptr<std::atomic<unsigned int>> gen) :
+		m_sink(sink), m_gen(std::move(gen))
+	{}
+	virtual ULONG OnNotify(ULONG n, NOTIFICATION *notif) override
+	{
+		++*m_gen;
+		return m_sink->OnNotify(n, notif);
+	}
+	virtual HRESULT QueryInterface(const IID &refiid, void **lppInterface) override
+	{
+		REGISTER_INTERFACE2(IMAPIAdviseSink, this);
+		REGISTER_INTERFACE2(IUnknown, this);
+		return MAPI_E_INTERFACE_NOT_SUPPORTED;
+	}
+
+	private:
+	object_ptr<IMAPIAdviseSink> m_sink;
+	std::shared_ptr<std::atomic<unsigned int>> m_gen;
+};
+
+/*
+ * Upper bound for the number of rows fetched in advance, from
+ * $KOPANO_TABLE_READAHEAD; 0 turns read-ahead off.
+ */
+static unsigned int readahead_max()
+{
+	static const unsigned int max = []() {
+		auto s = getenv("KOPANO_TABLE_READAHEAD");
+		return s != nullptr ? atoui(s) : 500;
+	}();
+	return max;
+}
+
 ECMAPITable::ECMAPITable(const std::string &strName, ECNotifyClient *nc,
     ULONG f) :
-	lpNotifyClient(nc), m_strName(strName)
+	lpNotifyClient(nc), m_strName(strName),
+	m_notif_gen(std::make_shared<std::atomic<unsigned int>>(0))
 {}
 
 HRESULT ECMAPITable::FlushDeferred(LPSRowSet *lppRowSet)
 {
-	auto hr = lpTableOps->HrOpenTable();
+	/* Every other operation depends on, or moves, the server's cursor */
+	auto hr = SettleReadAhead();
+	if (hr != hrSuccess)
+		return hr;
+	hr = lpTableOps->HrOpenTable();
 	if(hr != hrSuccess)
 		return hr;
 	// No deferred calls -> nothing to do
@@ -54,6 +102,7 @@ ECMAPITable::~ECMAPITable()
 	for (auto i = m_ulConnectionList.cbegin(); i != m_ulConnectionList.cend(); )
 		/* Unadvise modifies the list too, so advance before Unadvise */
 		Unadvise(*i++);
+	CollectReadAhead();
 	/* ~WSTableView closes the table on the server too */
 }
 
@@ -88,7 +137,10 @@ HRESULT ECMAPITable::Advise(ULONG ulEventMask, LPMAPIADVISESINK lpAdviseSink, UL
 	// FIXME: if a reconnection happens in another thread during the following call, the ulTableId sent here will be incorrect. The reconnection
 	// code will not yet know about this connection since we don't insert it until later, so you may end up getting an Advise() on completely the wrong
 	// table.
-	hr = lpNotifyClient->Advise(4, (BYTE *)&lpTableOps->ulTableId, ulEventMask, lpAdviseSink, lpulConnection);
+	object_ptr<ECTableAdviseSink> sink(new(std::nothrow) ECTableAdviseSink(lpAdviseSink, m_notif_gen));
+	if (sink == nullptr)
+		return MAPI_E_NOT_ENOUGH_MEMORY;
+	hr = lpNotifyClient->Advise(4, (BYTE *)&lpTableOps->ulTableId, ulEventMask, sink, lpulConnection);
 	if(hr != hrSuccess)
 		return hr;
 
@@ -371,12 +423,141 @@ HRESULT ECMAPITable::HrSetTableOps(WSTableView *ops, bool fLoad)
 HRESULT ECMAPITable::QueryRows(LONG lRowCount, ULONG ulFlags, LPSRowSet *lppRows)
 {
 	scoped_rlock lock(m_hLock);
-	if (!IsDeferred())
-		/* Send the request to the TableOps object, which will send the request to the server. */
-		return lpTableOps->HrQueryRows(lRowCount, ulFlags, lppRows);
-	m_ulRowCount = lRowCount;
-	m_ulFlags = ulFlags;
-	return FlushDeferred(lppRows);
+	if (IsDeferred()) {
+		m_ulRowCount = lRowCount;
+		m_ulFlags = ulFlags;
+		return FlushDeferred(lppRows);
+	}
+	if (lRowCount > 0 && ulFlags == 0 && readahead_max() > 0)
+		return QueryRowsAhead(lRowCount, lppRows);
+	auto hr = SettleReadAhead();
+	if (hr != hrSuccess)
+		return hr;
+	/* Send the request to the TableOps object, which will send the request to the server. */
+	return lpTableOps->HrQueryRows(lRowCount, ulFlags, lppRows);
+}
+
+/**
+ * Forward QueryRows with read-ahead. Once a caller has read two full
+ * batches in a row, the table fetches the following rows on a separate
+ * thread while the caller works on the current ones; the window starts
+ * at twice the batch size and doubles up to 16 batches (but no more than
+ * readahead_max() rows). Rows are served from that buffer until it runs
+ * dry. A notification on the table or a session reload throws the buffer
+ * away, as does any other table operation (SettleReadAhead).
+ */
+HRESULT ECMAPITable::QueryRowsAhead(ULONG ulRowCount, SRowSet **lppRows)
+{
+	CollectReadAhead();
+	if (m_ahead != nullptr && m_ahead_gen != *m_notif_gen) {
+		auto hr = SettleReadAhead();
+		if (hr != hrSuccess)
+			return hr;
+	}
+
+	rowset_ptr rows;
+	ULONG have = m_ahead == nullptr ? 0 : m_ahead.size() - m_ahead_pos;
+	if (have == 0) {
+		m_ahead.reset();
+		m_ahead_pos = 0;
+		auto hr = lpTableOps->HrQueryRows(ulRowCount, 0, &~rows);
+		if (hr != hrSuccess)
+			return hr;
+	} else {
+		rowset_ptr more;
+		if (have < ulRowCount) {
+			auto hr = lpTableOps->HrQueryRows(ulRowCount - have, 0, &~more);
+			if (hr != hrSuccess)
+				return hr;
+		}
+		ULONG take = std::min(have, ulRowCount);
+		ULONG extra = more == nullptr ? 0 : more.size();
+		auto hr = MAPIAllocateBuffer(CbNewSRowSet(take + extra), &~rows);
+		if (hr != hrSuccess)
+			return hr;
+		/* Rows own their lpProps, so they can simply change hands */
+		rows->cRows = 0;
+		for (ULONG i = 0; i < take; ++i) {
+			auto &row = m_ahead->aRow[m_ahead_pos++];
+			rows->aRow[rows->cRows++] = row;
+			row.cValues = 0;
+			row.lpProps = nullptr;
+		}
+		for (ULONG i = 0; i < extra; ++i) {
+			auto &row = more->aRow[i];
+			rows->aRow[rows->cRows++] = row;
+			row.cValues = 0;
+			row.lpProps = nullptr;
+		}
+		if (m_ahead_pos == m_ahead.size()) {
+			m_ahead.reset();
+			m_ahead_pos = 0;
+		}
+	}
+
+	if (rows.size() < ulRowCount)
+		/* End of table */
+		m_ahead_seq = 0;
+	else if (++m_ahead_seq >= 2 && m_ahead == nullptr)
+		StartReadAhead(ulRowCount);
+	*lppRows = rows.release();
+	return hrSuccess;
+}
+
+void ECMAPITable::StartReadAhead(ULONG ulRowCount)
+{
+	auto max = readahead_max();
+	if (ulRowCount > max)
+		return;
+	ULONG window = std::min(max, ulRowCount << std::min(m_ahead_seq - 1, 4U));
+	m_ahead_gen = *m_notif_gen;
+	/*
+	 * The task only touches the WSTableView. Everything else that uses
+	 * it waits for the task first (CollectReadAhead), with m_hLock held.
+	 */
+	object_ptr<WSTableView> ops(lpTableOps);
+	try {
+		m_ahead_task = std::async(std::launch::async, [ops, window, this]() {
+			return ops->HrQueryRows(window, 0, &m_ahead_fetch);
+		});
+	} catch (const std::system_error &) {
+		/* No thread, no read-ahead */
+	}
+}
+
+/* Wait for a running read-ahead and take its rows into m_ahead. */
+void ECMAPITable::CollectReadAhead()
+{
+	if (!m_ahead_task.valid())
+		return;
+	auto hr = m_ahead_task.get();
+	rowset_ptr rows(m_ahead_fetch);
+	m_ahead_fetch = nullptr;
+	if (hr != hrSuccess || rows == nullptr) {
+		/* The next call to the server reports the problem, if it persists */
+		m_ahead_seq = 0;
+		return;
+	}
+	m_ahead = std::move(rows);
+	m_ahead_pos = 0;
+}
+
+/**
+ * Drop the rows read ahead and move the server's cursor back to where the
+ * caller believes it is.
+ */
+HRESULT ECMAPITable::SettleReadAhead()
+{
+	CollectReadAhead();
+	m_ahead_seq = 0;
+	if (m_ahead == nullptr)
+		return hrSuccess;
+	LONG unread = m_ahead.size() - m_ahead_pos;
+	m_ahead.reset();
+	m_ahead_pos = 0;
+	if (unread == 0)
+		return hrSuccess;
+	return lpTableOps->HrSeekRow(BOOKMARK_CURRENT, -unread, nullptr);
 }
 
 HRESULT ECMAPITable::Reload(void *lpParam)
@@ -388,6 +569,8 @@ HRESULT ECMAPITable::Reload(void *lpParam)
 	// would be a lock-order violation causing deadlocks.
 
 	scoped_rlock lock(lpThis->m_hMutexConnectionList);
+	/* The table was reopened; rows read ahead refer to the old one */
+	++*lpThis->m_notif_gen;
 
 	// The underlying data has been reloaded, therefore we must re-register the advises. This is called
 	// after the transport has re-established its state
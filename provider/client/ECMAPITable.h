@@ -3,6 +3,9 @@
  * Copyright 2005 - 2016 Zarafa and its licensors
  */
 #pragma once
+#include <atomic>
+#include <future>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <kopano/ECUnknown.h>
@@ -54,6 +57,11 @@ public:
 	static HRESULT Reload(void *lpParam);
 
 private:
+	HRESULT QueryRowsAhead(ULONG count, SRowSet **);
+	void StartReadAhead(ULONG count);
+	void CollectReadAhead();
+	HRESULT SettleReadAhead();
+
 	std::recursive_mutex m_hLock;
 	KC::object_ptr<WSTableView> lpTableOps;
 	KC::object_ptr<ECNotifyClient> lpNotifyClient;
@@ -68,5 +76,14 @@ private:
 	ULONG m_ulDeferredFlags = 0, m_ulRowCount = 0;
 	ULONG m_ulFlags = 0; /* Flags from queryrows */
 	std::string			m_strName;
+
+	// Read-ahead
+	std::future<HRESULT> m_ahead_task;
+	SRowSet *m_ahead_fetch = nullptr; /* result of m_ahead_task */
+	KC::rowset_ptr m_ahead; /* fetched, not yet returned from m_ahead_pos on */
+	ULONG m_ahead_pos = 0, m_ahead_seq = 0;
+	unsigned int m_ahead_gen = 0;
+	/* Bumped for every notification on this table */
+	std::shared_ptr<std::atomic<unsigned int>> m_notif_gen;
 	ALLOC_WRAP_FRIEND;
 };
@@ -95,6 +95,7 @@ ECMsgStore::ECMsgStore(const char *lpszProfname, IMAPISupport *sup,
 	HrAddPropHandlers(PR_EC_STATSTABLE_USERS, GetPropHandler, DefaultSetPropComputed, this, false, true);
 	HrAddPropHandlers(PR_EC_STATSTABLE_COMPANY, GetPropHandler, DefaultSetPropComputed, this, false, true);
 	HrAddPropHandlers(PR_EC_STATSTABLE_SERVERS, GetPropHandler, DefaultSetPropComputed, this, false, true);
+	HrAddPropHandlers(PR_EC_STATSTABLE_LATENCY, GetPropHandler, DefaultSetPropComputed, this, false, true);
 	HrAddPropHandlers(PR_TEST_LINE_SPEED, GetPropHandler, DefaultSetPropComputed, this, false, true);
 	HrAddPropHandlers(PR_EMSMDB_SECTION_UID, GetPropHandler, DefaultSetPropComputed, this, false, true);
 	HrAddPropHandlers(PR_ACL_DATA, GetPropHandler, SetPropHandler, this, false, true);
@@ -249,6 +250,9 @@ HRESULT ECMsgStore::OpenProperty(ULONG ulPropTag, LPCIID lpiid, ULONG ulInterfac
 	} else if(ulPropTag == PR_EC_STATSTABLE_SERVERS) {
 		if (*lpiid == IID_IMAPITable)
 			hr = OpenStatsTable(TABLETYPE_STATS_SERVERS, reinterpret_cast<IMAPITable **>(lppUnk));
+	} else if (ulPropTag == PR_EC_STATSTABLE_LATENCY) {
+		if (*lpiid == IID_IMAPITable)
+			hr = OpenStatsTable(TABLETYPE_STATS_LATENCY, reinterpret_cast<IMAPITable **>(lppUnk));
 	} else if(ulPropTag == PR_ACL_TABLE) {
 		if(*lpiid == IID_IExchangeModifyTable)
 			hr = ECExchangeModifyTable::CreateACLTable(this,
@@ -950,6 +954,7 @@ HRESULT ECMsgStore::GetPropHandler(unsigned int ulPropTag, void *lpProvider,
 	case PROP_ID(PR_EC_STATSTABLE_SESSIONS):
 	case PROP_ID(PR_EC_STATSTABLE_USERS):
 	case PROP_ID(PR_EC_STATSTABLE_COMPANY):
+	case PROP_ID(PR_EC_STATSTABLE_LATENCY):
 		lpsPropValue->ulPropTag = ulPropTag;
 		lpsPropValue->Value.x = 1;
 		break;
@@ -2389,6 +2394,13 @@ HRESULT ECMsgStore::ResetFolderCount(ULONG cbEntryId, const ENTRYID *lpEntryId,
 	return lpTransport->HrResetFolderCount(cbEntryId, lpEntryId, lpulUpdates);
 }
 
+HRESULT ECMsgStore::DeliverCopies(ULONG cbEntryId, const ENTRYID *lpEntryId,
+    const ENTRYLIST *lpFolders, ULONG ulFlags, ENTRYLIST **lppNewEntryIds)
+{
+	return lpTransport->HrDeliverCopies(cbEntryId, lpEntryId, lpFolders,
+	       ulFlags, lppNewEntryIds);
+}
+
 // This is almost the same as getting a 'normal' outgoing table, except we pass NULL as PEID for the store
 HRESULT ECMsgStore::GetMasterOutgoingTable(ULONG ulFlags, IMAPITable ** lppOutgoingTable)
 {
@@ -124,6 +124,7 @@ public:
 	virtual HRESULT ResolvePseudoUrl(const char *url, char **pathp, bool *ispeer) override;
 	virtual HRESULT GetArchiveStoreEntryID(const TCHAR *user, const TCHAR *server, ULONG flags, ULONG *store_size, ENTRYID **store_eid) override;
 	virtual HRESULT ResetFolderCount(ULONG eid_size, const ENTRYID *eid, ULONG *nupdates) override;
+	virtual HRESULT DeliverCopies(ULONG eid_size, const ENTRYID *msg_eid, const ENTRYLIST *folders, ULONG flags, ENTRYLIST **new_eids) override;
 
     // ECTestProtocol
 	virtual HRESULT TestPerform(const char *cmd, unsigned int argc, char **argv) override;
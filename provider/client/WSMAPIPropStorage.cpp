@@ -24,6 +24,12 @@
 		hr = MAPI_E_NETWORK_ERROR; \
 		goto exit; \
 	}
+/* Same, for calls made through the soap_lease @spg */
+#define START_LEASED_SOAP_CALL retry: \
+	if (spg->m_lpCmd == nullptr) { \
+		hr = MAPI_E_NETWORK_ERROR; \
+		goto exit; \
+	}
 #define END_SOAP_CALL 	\
 	if (er == KCERR_END_OF_SESSION && m_lpTransport->HrReLogon() == hrSuccess) \
 		goto retry; \
@@ -85,12 +91,12 @@ HRESULT WSABPropStorage::HrLoadObject(MAPIOBJECT **lppsMapiObject)
 	memory_ptr<SPropValue> lpProp;
 	struct readPropsResponse sResponse;
 	convert_context	converter;
-	soap_lock_guard spg(*m_lpTransport);
+	soap_lease spg(*m_lpTransport);
 
-	START_SOAP_CALL
+	START_LEASED_SOAP_CALL
 	{
     	// Read the properties from the server
-		if (m_lpTransport->m_lpCmd->readABProps(ecSessionId, m_sEntryId, &sResponse) != SOAP_OK)
+		if (spg->m_lpCmd->readABProps(ecSessionId, m_sEntryId, &sResponse) != SOAP_OK)
 			er = KCERR_NETWORK_ERROR;
 		else
 			er = sResponse.er;
@@ -210,16 +216,16 @@ HRESULT WSMAPIPropStorage::HrLoadProp(ULONG ulObjId, ULONG ulPropTag, LPSPropVal
 	HRESULT			hr = hrSuccess;
 	memory_ptr<SPropValue> lpsPropValDst;
 	struct loadPropResponse	sResponse;
-	soap_lock_guard spg(*m_lpTransport);
+	soap_lease spg(*m_lpTransport);
 
 	if (ulObjId == 0 && (ulServerCapabilities & KOPANO_CAP_LOADPROP_ENTRYID) == 0) {
 		hr = MAPI_E_NO_SUPPORT;
 		goto exit;
 	}
 
-	START_SOAP_CALL
+	START_LEASED_SOAP_CALL
 	{
-		if (m_lpTransport->m_lpCmd->loadProp(ecSessionId, m_sEntryId,
+		if (spg->m_lpCmd->loadProp(ecSessionId, m_sEntryId,
 		    ulObjId, ulPropTag, &sResponse) != SOAP_OK)
 			er = KCERR_NETWORK_ERROR;
 		else
@@ -617,7 +623,7 @@ HRESULT WSMAPIPropStorage::HrLoadObject(MAPIOBJECT **lppsMapiObject)
 		sNotSubscribe.sKey.__ptr = m_sEntryId.__ptr;
 	}
 
-	soap_lock_guard spg(*m_lpTransport);
+	soap_lease spg(*m_lpTransport);
 	if (!lppsMapiObject) {
 		assert(false);
 		hr = MAPI_E_INVALID_PARAMETER;
@@ -630,9 +636,9 @@ HRESULT WSMAPIPropStorage::HrLoadObject(MAPIOBJECT **lppsMapiObject)
 		goto exit;
 	}
 
-	START_SOAP_CALL
+	START_LEASED_SOAP_CALL
 	{
-		if (m_lpTransport->m_lpCmd->loadObject(ecSessionId, m_sEntryId,
+		if (spg->m_lpCmd->loadObject(ecSessionId, m_sEntryId,
 		    (m_ulConnection == 0 || m_bSubscribed) ? nullptr : &sNotSubscribe,
 		    m_ulFlags | 0x80000000, &sResponse) != SOAP_OK)
 			er = KCERR_NETWORK_ERROR;
@@ -18,6 +18,12 @@
 		hr = MAPI_E_NETWORK_ERROR; \
 		goto exit; \
 	}
+/* Same, for calls made through the soap_lease @spg */
+#define START_LEASED_SOAP_CALL retry: \
+	if (spg->m_lpCmd == nullptr) { \
+		hr = MAPI_E_NETWORK_ERROR; \
+		goto exit; \
+	}
 #define END_SOAP_CALL 	\
 	if (er == KCERR_END_OF_SESSION && m_lpTransport->HrReLogon() == hrSuccess) \
 		goto retry; \
@@ -57,14 +63,14 @@ HRESULT WSTableView::HrQueryRows(ULONG ulRowCount, ULONG flags, SRowSet **lppRow
 {
 	ECRESULT er = erSuccess;
 	struct tableQueryRowsResponse sResponse;
-	soap_lock_guard spg(*m_lpTransport);
 	auto hr = HrOpenTable();
 	if(hr != erSuccess)
-	    goto exit;
+		return hr;
 
-	START_SOAP_CALL
+	soap_lease spg(*m_lpTransport);
+	START_LEASED_SOAP_CALL
 	{
-		if (m_lpTransport->m_lpCmd->tableQueryRows(ecSessionId,
+		if (spg->m_lpCmd->tableQueryRows(ecSessionId,
 		    ulTableId, ulRowCount, flags, &sResponse) != SOAP_OK)
 			er = KCERR_NETWORK_ERROR;
 		else
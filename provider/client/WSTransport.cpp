@@ -83,6 +83,21 @@ template<> size_t GetCacheAdditionalSize(const ResolveResult &v)
 
 }
 
+/*
+ * Maximum number of connections that soap_lease opens in addition to the
+ * main one, from $KOPANO_SESSION_CONNECTIONS. The server takes a session's
+ * requests from any number of connections, as it does for the cloned
+ * transport of the notification thread.
+ */
+static unsigned int pool_max()
+{
+	static const unsigned int max = []() {
+		auto s = getenv("KOPANO_SESSION_CONNECTIONS");
+		return s != nullptr ? atoui(s) : 0;
+	}();
+	return max;
+}
+
 WSTransport::WSTransport() :
 	m_ResolveResultCache("ResolveResult", 4096, 300), m_has_session(false)
 {
@@ -310,6 +325,12 @@ HRESULT WSTransport::PostAuth(KCmdProxy *lpCmd, std::unique_ptr<KCmdProxy2> &&ne
 	m_has_session = true;
 	if (new_cmd != nullptr)
 		m_lpCmd = std::move(new_cmd);
+	if (pool_max() > 0) {
+		/* pool_get cannot take the main lock to read these */
+		scoped_lock lk(m_pool_lock);
+		m_pool_props = make_unique_nt<sGlobalProfileProps>(sProfileProps);
+		m_pool_caps = ulServerCapabilities;
+	}
 	return hrSuccess;
 }
 
@@ -682,6 +703,12 @@ HRESULT WSTransport::HrGetStoreType(ULONG cbStoreID, const ENTRYID *lpStoreID,
 HRESULT WSTransport::HrLogOff()
 {
 	ECRESULT er = erSuccess;
+	ulock_normal pool_lk(m_pool_lock);
+	m_pool.clear();
+	m_pool_props.reset();
+	m_pool_conns = 0;
+	++m_pool_gen; /* leased ones are not returned */
+	pool_lk.unlock();
 	soap_lock_guard spg(*this);
 
 	{
@@ -714,6 +741,52 @@ HRESULT WSTransport::logoff_nd()
 	return er;
 }
 
+/**
+ * Hand out an idle pool connection, or open a new one if there is room.
+ * Returns nullptr otherwise, in which case the caller waits for the main
+ * connection. @gen identifies the pool generation for pool_put; a logoff
+ * starts a new one.
+ */
+std::unique_ptr<WSSoap> WSTransport::pool_get(unsigned int *gen)
+{
+	ulock_normal lk(m_pool_lock);
+	*gen = m_pool_gen;
+	if (!m_pool.empty()) {
+		auto soap = std::move(m_pool.back());
+		m_pool.pop_back();
+		return soap;
+	}
+	if (m_pool_props == nullptr || m_pool_conns >= pool_max())
+		return nullptr;
+	++m_pool_conns;
+	auto props = *m_pool_props;
+	auto caps = m_pool_caps;
+	lk.unlock();
+
+	auto soap = make_unique_nt<WSSoap>();
+	if (soap != nullptr &&
+	    CreateSoapTransport(props, &unique_tie(soap->m_lpCmd)) == hrSuccess) {
+#ifdef WITH_ZLIB
+		if (caps & KOPANO_CAP_COMPRESSION) {
+			soap_set_imode(soap->m_lpCmd->soap, SOAP_ENC_ZLIB);
+			soap_set_omode(soap->m_lpCmd->soap, SOAP_ENC_ZLIB | SOAP_IO_CHUNK);
+		}
+#endif
+		return soap;
+	}
+	lk.lock();
+	if (*gen == m_pool_gen)
+		--m_pool_conns;
+	return nullptr;
+}
+
+void WSTransport::pool_put(std::unique_ptr<WSSoap> &&soap, unsigned int gen)
+{
+	scoped_lock lk(m_pool_lock);
+	if (gen == m_pool_gen)
+		m_pool.emplace_back(std::move(soap));
+}
+
 HRESULT WSTransport::HrCheckExistObject(ULONG cbEntryID,
     const ENTRYID *lpEntryID, ULONG ulFlags)
 {
@@ -3700,7 +3773,8 @@ HRESULT WSTransport::HrOpenMiscTable(ULONG ulTableType, ULONG ulFlags,
 {
 	if (ulTableType != TABLETYPE_STATS_SYSTEM && ulTableType != TABLETYPE_STATS_SESSIONS &&
 	    ulTableType != TABLETYPE_STATS_USERS && ulTableType != TABLETYPE_STATS_COMPANY &&
-	    ulTableType != TABLETYPE_USERSTORES && ulTableType != TABLETYPE_STATS_SERVERS)
+	    ulTableType != TABLETYPE_USERSTORES && ulTableType != TABLETYPE_STATS_SERVERS &&
+	    ulTableType != TABLETYPE_STATS_LATENCY)
 		return MAPI_E_INVALID_PARAMETER;
 
 	object_ptr<WSTableMisc> lpMiscTable;
@@ -3985,3 +4059,46 @@ HRESULT WSTransport::HrResetFolderCount(ULONG cbEntryId,
  exitm:
 	return hr;
 }
+
+/**
+ * Have the server copy the message @eid into each folder of @folders.
+ * @new_eids receives one entryid per folder, in the same order; a copy
+ * that failed is represented by an empty entryid.
+ */
+HRESULT WSTransport::HrDeliverCopies(ULONG cbEntryId, const ENTRYID *lpEntryId,
+    const ENTRYLIST *lpFolders, ULONG ulFlags, ENTRYLIST **lppNewEntryIds)
+{
+	ECRESULT er = erSuccess;
+	entryId sEntryId;
+	struct entryList sFolders;
+	struct deliverCopiesResponse sResponse;
+
+	if (lpFolders == nullptr || lppNewEntryIds == nullptr)
+		return MAPI_E_INVALID_PARAMETER;
+	auto hr = CopyMAPIEntryIdToSOAPEntryId(cbEntryId, lpEntryId, &sEntryId, true);
+	if (hr != hrSuccess)
+		return hr;
+	hr = CopyMAPIEntryListToSOAPEntryList(lpFolders, &sFolders);
+	if (hr != hrSuccess)
+		return hr;
+	soap_lock_guard spg(*this);
+
+	START_SOAP_CALL
+	{
+		if (m_lpCmd->deliverCopies(m_ecSessionId, sEntryId, &sFolders, ulFlags, &sResponse) != SOAP_OK)
+			er = KCERR_NETWORK_ERROR;
+		else
+			er = sResponse.er;
+	}
+	END_SOAP_CALL
+
+	if (sResponse.lpEntryIds == nullptr ||
+	    sResponse.lpEntryIds->__size != static_cast<int>(lpFolders->cValues))
+		hr = MAPI_E_CALL_FAILED;
+	else
+		hr = CopySOAPEntryListToMAPIEntryList(sResponse.lpEntryIds, lppNewEntryIds);
+ exitm:
+	spg.unlock();
+	soap_del_entryList(&sFolders);
+	return hr;
+}
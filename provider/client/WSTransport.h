@@ -6,9 +6,11 @@
 #include <mapi.h>
 #include <mapispi.h>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <utility>
+#include <vector>
 #include "kcore.hpp"
 #include "ECMAPIProp.h"
 #include <kopano/kcodes.h>
@@ -241,6 +243,11 @@ public:
 	HRESULT HrCancelIO();
 
 	HRESULT HrResetFolderCount(unsigned int eid_size, const ENTRYID *eid, unsigned int *nupdates);
+	HRESULT HrDeliverCopies(unsigned int eid_size, const ENTRYID *eid, const ENTRYLIST *folders, unsigned int flags, ENTRYLIST **new_eids);
+
+	/* Extra connections on the session, for soap_lease */
+	std::unique_ptr<WSSoap> pool_get(unsigned int *gen);
+	void pool_put(std::unique_ptr<WSSoap> &&, unsigned int gen);
 
 	std::string m_server_version, m_licjson;
 
@@ -267,6 +274,10 @@ private:
 	std::recursive_mutex m_ResolveResultCacheMutex;
 	KC::ECCache<std::map<std::string, ResolveResult>> m_ResolveResultCache;
 	bool m_has_session;
+	std::mutex m_pool_lock;
+	std::vector<std::unique_ptr<WSSoap>> m_pool; /* idle ones */
+	unsigned int m_pool_conns = 0, m_pool_gen = 0, m_pool_caps = 0;
+	std::unique_ptr<sGlobalProfileProps> m_pool_props; /* set while logged on */
 
 friend class WSMessageStreamExporter;
 friend class WSMessageStreamImporter;
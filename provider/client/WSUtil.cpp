@@ -304,6 +304,35 @@ HRESULT CopyMAPIPropValToSOAPPropVal(propVal *dp, const SPropValue *sp,
 	return hrSuccess;
 }
 
+/**
+ * Store the UTF-8 string @src as a wide string in a MAPIAllocateMore block
+ * of @base. Well-formed input is decoded right into that block; only
+ * malformed input takes the iconv route (with its substitution rules).
+ */
+static HRESULT CopyUtf8ToWcs(const char *src, void *base,
+    convert_context *conv, wchar_t **dst)
+{
+	auto len = strlen(src);
+	auto hr = MAPIAllocateMore(sizeof(wchar_t) * (len + 1), base, reinterpret_cast<void **>(dst));
+	if (hr != hrSuccess)
+		return hr;
+	auto n = utf8_to_wcs(src, len, *dst);
+	if (n != SIZE_MAX) {
+		(*dst)[n] = L'\0';
+		return hrSuccess;
+	}
+	auto ws = CONVERT_TO(conv, std::wstring, src, len, "UTF-8");
+	if (ws.length() <= len) {
+		wcscpy(*dst, ws.c_str());
+		return hrSuccess;
+	}
+	hr = MAPIAllocateMore(sizeof(wchar_t) * (ws.length() + 1), base, reinterpret_cast<void **>(dst));
+	if (hr != hrSuccess)
+		return hr;
+	wcscpy(*dst, ws.c_str());
+	return hrSuccess;
+}
+
 HRESULT CopySOAPPropValToMAPIPropVal(SPropValue *dp, const struct propVal *sp,
     void *lpBase, convert_context *lpConverter)
 {
@@ -367,13 +396,7 @@ HRESULT CopySOAPPropValToMAPIPropVal(SPropValue *dp, const struct propVal *sp,
 			dp->Value.err = MAPI_E_NOT_FOUND;
 			break;
 		}
-		auto ws = CONVERT_TO(lpConverter, std::wstring, sp->Value.lpszA, rawsize(sp->Value.lpszA), "UTF-8");
-		auto hr = MAPIAllocateMore(sizeof(wchar_t) * (ws.length() + 1),
-		          lpBase, reinterpret_cast<void **>(&dp->Value.lpszW));
-		if (hr != hrSuccess)
-			return hr;
-		wcscpy(dp->Value.lpszW, ws.c_str());
-		break;
+		return CopyUtf8ToWcs(sp->Value.lpszA, lpBase, lpConverter, &dp->Value.lpszW);
 	}
 	case PT_SYSTIME:
 		if (sp->__union != SOAP_UNION_propValData_hilo || sp->Value.hilo == nullptr) {
@@ -601,12 +624,10 @@ HRESULT CopySOAPPropValToMAPIPropVal(SPropValue *dp, const struct propVal *sp,
 				dp->Value.MVszW.lppszW[i][0] = '\0';
 				continue;
 			}
-			auto ws = lpConverter->convert_to<std::wstring>(sp->Value.mvszA.__ptr[i], rawsize(sp->Value.mvszA.__ptr[i]), "UTF-8");
-			hr = MAPIAllocateMore(sizeof(std::wstring::value_type) * (ws.length() + 1), lpBase,
-			     reinterpret_cast<void **>(&dp->Value.MVszW.lppszW[i]));
+			hr = CopyUtf8ToWcs(sp->Value.mvszA.__ptr[i], lpBase,
+			     lpConverter, &dp->Value.MVszW.lppszW[i]);
 			if (hr != hrSuccess)
 				return hr;
-			wcscpy(dp->Value.MVszW.lppszW[i], ws.c_str());
 		}
 		break;
 	}
@@ -1351,9 +1372,11 @@ HRESULT Utf8ToTString(LPCSTR lpszUtf8, ULONG ulFlags, LPVOID lpBase, convert_con
 {
 	if (lpszUtf8 == nullptr || lppszTString == nullptr)
 		return MAPI_E_INVALID_PARAMETER;
+	if (ulFlags & MAPI_UNICODE)
+		return CopyUtf8ToWcs(lpszUtf8, lpBase, lpConverter, reinterpret_cast<wchar_t **>(lppszTString));
 
-	std::string strDest = CONVERT_TO(lpConverter, std::string, ((ulFlags & MAPI_UNICODE) ? CHARSET_WCHAR : CHARSET_CHAR), lpszUtf8, rawsize(lpszUtf8), "UTF-8");
-	size_t cbDest = strDest.length() + ((ulFlags & MAPI_UNICODE) ? sizeof(wchar_t) : sizeof(CHAR));
+	std::string strDest = CONVERT_TO(lpConverter, std::string, CHARSET_CHAR, lpszUtf8, rawsize(lpszUtf8), "UTF-8");
+	size_t cbDest = strDest.length() + sizeof(CHAR);
 	auto hr = MAPIAllocateMore(cbDest, lpBase, reinterpret_cast<void **>(lppszTString));
 	if (hr != hrSuccess)
 		return hr;
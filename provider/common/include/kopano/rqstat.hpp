@@ -5,6 +5,8 @@
 
 namespace KC {
 
+class latency_histogram;
+
 struct request_stat {
 	/* Walltime when socket event happened */
 	time_point sk_wall_start{}, sk_wall_end{};
@@ -27,6 +29,8 @@ struct request_stat {
 
 	std::string user, imp, agent;
 	const char *func = nullptr;
+	/* Latency histogram of func, if any */
+	latency_histogram *hist = nullptr;
 	int er = 0;
 };
 
@@ -915,6 +915,12 @@ struct ns:resetFolderCountResponse {
 	unsigned int er;
 };
 
+struct ns:deliverCopiesResponse {
+	struct entryList *lpEntryIds;
+	struct mv_long *lpErrors;
+	unsigned int er;
+};
+
 struct new_folder {
 	const char *name, *comment;
 	entryId *entryid;
@@ -945,6 +951,7 @@ struct ns:create_folders_response {
 #define TABLETYPE_USERSTORES		9	// UserStore tables
 #define TABLETYPE_MAILBOX			10	// Mailbox Table
 #define TABLETYPE_STATS_SERVERS		11	// Servers table
+#define TABLETYPE_STATS_LATENCY		12	// SOAP call latency
 
 // Flags for struct tableMultiRequest
 #define TABLE_MULTI_CLEAR_RESTRICTION	0x1	// Clear table restriction
@@ -972,6 +979,7 @@ int ns__createFolder(ULONG64 ulSessionId, entryId sParentId, entryId *lpsNewEntr
 int ns__create_folders(ULONG64 session_id, entryId parent_eid, struct new_folder_set batch, struct ns:create_folders_response *response);
 int ns__deleteObjects(ULONG64 ulSessionId, unsigned int ulFlags, struct entryList *aMessages, unsigned int ulSyncId, unsigned int *result);
 int ns__copyObjects(ULONG64 ulSessionId, struct entryList *aMessages, entryId sDestFolderId, unsigned int ulFlags, unsigned int ulSyncId, unsigned int *result);
+int ns__deliverCopies(ULONG64 ulSessionId, entryId sEntryId, struct entryList *lpFolders, unsigned int ulFlags, struct ns:deliverCopiesResponse *lpsResponse);
 int ns__emptyFolder(ULONG64 ulSessionId, entryId sEntryId,  unsigned int ulFlags, unsigned int ulSyncId, unsigned int *result);
 int ns__deleteFolder(ULONG64 ulSessionId, entryId sEntryId, unsigned int ulFlags, unsigned int ulSyncId, unsigned int *result);
 int ns__copyFolder(ULONG64 ulSessionId, entryId sEntryId, entryId sDestFolderId, const char *lpszNewFolderName, unsigned int ulFlags, unsigned int ulSyncId, unsigned int *result);
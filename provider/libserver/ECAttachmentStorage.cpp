@@ -37,6 +37,7 @@
 #include <openssl/sha.h>
 #include "StreamUtil.h"
 #include "ECS3Attachment.h"
+#include "StatsClient.h"
 
 using namespace std::string_literals;
 
@@ -562,6 +563,7 @@ ECRESULT ECAttachmentStorage::LoadAttachment(struct soap *soap, ULONG ulObjId, U
 	auto er = GetSingleInstanceId(ulObjId, ulPropId, &ulInstanceId);
 	if (er != erSuccess)
 		return er;
+	rq_phase_timer phase(RQP_ATTACH);
 	return LoadAttachmentInstance(soap, ulInstanceId, lpiSize, lppData);
 }
 
@@ -584,6 +586,7 @@ ECRESULT ECAttachmentStorage::LoadAttachment(ULONG ulObjId, ULONG ulPropId, size
 	auto er = GetSingleInstanceId(ulObjId, ulPropId, &ulInstanceId);
 	if (er != erSuccess)
 		return er;
+	rq_phase_timer phase(RQP_ATTACH);
 	return LoadAttachmentInstance(ulInstanceId, lpiSize, lpSink);
 }
 
@@ -623,7 +626,10 @@ ECRESULT ECAttachmentStorage::SaveAttachment(ULONG ulObjId, ULONG ulPropId, bool
 	auto er = m_lpDatabase->DoInsert(strQuery, &esid.siid);
 	if (er != erSuccess)
 		return ec_perror("ECAttachmentStorage::SaveAttachment(): DoInsert failed", er);
-	er = SaveAttachmentInstance(esid, ulPropId, iSize, lpData);
+	{
+		rq_phase_timer phase(RQP_ATTACH);
+		er = SaveAttachmentInstance(esid, ulPropId, iSize, lpData);
+	}
 	if (er != erSuccess)
 		return er;
 	strQuery = "UPDATE `singleinstances` SET `filename`='" + m_lpDatabase->Escape(esid.filename) + "' WHERE `instanceid`=" + stringify(esid.siid);
@@ -669,7 +675,10 @@ ECRESULT ECAttachmentStorage::SaveAttachment(ULONG ulObjId, ULONG ulPropId, bool
 	auto er = m_lpDatabase->DoInsert(strQuery, &esid.siid);
 	if (er != erSuccess)
 		return ec_perror("ECAttachmentStorage::SaveAttachment(): DoInsert failed", er);
-	er = SaveAttachmentInstance(esid, ulPropId, iSize, lpSource);
+	{
+		rq_phase_timer phase(RQP_ATTACH);
+		er = SaveAttachmentInstance(esid, ulPropId, iSize, lpSource);
+	}
 	if (er != erSuccess)
 		return er;
 	strQuery = "UPDATE `singleinstances` SET `filename`='" + m_lpDatabase->Escape(esid.filename) + "' WHERE `instanceid`=" + stringify(esid.siid);
@@ -89,6 +89,12 @@ template<> inline size_t GetCacheAdditionalSize(const objectdetails_t &v)
 	return v.GetObjectSize() - sizeof(v);
 }
 
+template<> inline size_t GetCacheAdditionalSize(const GroupClosure &v)
+{
+	return v.groups.capacity() * sizeof(v.groups[0]) +
+	       v.direct.capacity() * sizeof(v.direct[0]) + v.index_size;
+}
+
 template<> inline size_t GetCacheAdditionalSize(const serverdetails_t &v)
 {
 	return v.get_object_size() - sizeof(v);
@@ -104,6 +110,24 @@ template<> inline size_t GetCacheAdditionalSize(const ECsUserObjectDetails &v)
 	return GetCacheAdditionalSize(v.sDetails);
 }
 
+/*
+ * Group memberships can change in the user plugin without any object
+ * that ends up in the closure changing its signature (e.g. a user that is
+ * added to a group), so closures do expire even when user details do not.
+ */
+static long group_closure_lifetime(ECConfig &cfg)
+{
+	auto lt = atoi(cfg.GetSetting("cache_userdetails_lifetime"));
+	return lt != 0 ? lt * 60 : 5 * 60;
+}
+
+/*
+ * Size changes are applied to the cached store size as they are written,
+ * before the transaction commits. Should it roll back after all, the
+ * entry is off until it expires.
+ */
+static constexpr long STORE_SIZE_LIFETIME = 5 * 60;
+
 ECCacheManager::ECCacheManager(std::shared_ptr<ECConfig> lpConfig,
     ECDatabaseFactory *lpDatabaseFactory) :
 	m_lpDatabaseFactory(lpDatabaseFactory),
@@ -111,9 +135,12 @@ ECCacheManager::ECCacheManager(std::shared_ptr<ECConfig> lpConfig,
 , m_QuotaUserDefaultCache("uquota", atoi(lpConfig->GetSetting("cache_quota_size")), atoi(lpConfig->GetSetting("cache_quota_lifetime")) * 60)
 , m_ObjectsCache("obj", atoll(lpConfig->GetSetting("cache_object_size")), 0)
 , m_StoresCache("store", atoi(lpConfig->GetSetting("cache_store_size")), 0)
+, m_StoreSizeCache("storesize", atoi(lpConfig->GetSetting("cache_store_size")), STORE_SIZE_LIFETIME)
+, m_UserStoreCache("userstore", atoi(lpConfig->GetSetting("cache_store_size")), STORE_SIZE_LIFETIME)
 , m_UserObjectCache("userid", atoi(lpConfig->GetSetting("cache_user_size")), atoi(lpConfig->GetSetting("cache_userdetails_lifetime")) * 60)
 , m_UEIdObjectCache("extern", atoi(lpConfig->GetSetting("cache_user_size")), atoi(lpConfig->GetSetting("cache_userdetails_lifetime")) * 60)
 , m_UserObjectDetailsCache("abinfo", atoi(lpConfig->GetSetting("cache_userdetails_size")), atoi(lpConfig->GetSetting("cache_userdetails_lifetime")) * 60)
+, m_GroupClosureCache("groups", atoi(lpConfig->GetSetting("cache_userdetails_size")), group_closure_lifetime(*lpConfig))
 , m_AclCache("acl", atoi(lpConfig->GetSetting("cache_acl_size")), 0)
 , m_CellCache("cell", atoll(lpConfig->GetSetting("cache_cell_size")), 0)
 , m_ServerDetailsCache("server", atoi(lpConfig->GetSetting("cache_server_size")), atoi(lpConfig->GetSetting("cache_server_lifetime")) * 60)
@@ -157,9 +184,13 @@ ECCacheManager::ECCacheManager(std::shared_ptr<ECConfig> lpConfig,
 		m_UserObjectCache.SetMaxSize(std::min(static_cast<size_t>(25 << 20), cell_cache_size / 10));
 		m_UEIdObjectCache.SetMaxSize(std::min(static_cast<size_t>(25 << 20), cell_cache_size / 10));
 		m_UserObjectDetailsCache.SetMaxSize(std::min(static_cast<size_t>(25 << 20), cell_cache_size / 10));
+		m_GroupClosureCache.SetMaxSize(std::min(static_cast<size_t>(25 << 20), cell_cache_size / 10));
 		ec_log_info("Setting userdetails cache size: %zu", m_UserObjectCache.MaxSize());
 	}
 
+	m_GroupClosureCache.on_remove = [this](unsigned int user_id, const GroupClosure &c) {
+		unindex_closure(user_id, c);
+	};
 	/* Initial cleaning/initialization of cache */
 	PurgeCache(PURGE_CACHE_ALL);
 }
@@ -187,10 +218,16 @@ ECRESULT ECCacheManager::PurgeCache(unsigned int ulFlags)
 	if (ulFlags & PURGE_CACHE_OBJECTS)
 		m_ObjectsCache.ClearCache();
 	l_object.unlock();
+	if (ulFlags & (PURGE_CACHE_ACL | PURGE_CACHE_OBJECTS))
+		InvalidateRights();
 
 	ulock_rec l_store(m_hCacheStoreMutex);
-	if (ulFlags & PURGE_CACHE_STORES)
+	if (ulFlags & PURGE_CACHE_STORES) {
 		m_StoresCache.ClearCache();
+		m_StoreSizeCache.ClearCache();
+		++m_StoreSizeSeq;
+		m_UserStoreCache.ClearCache();
+	}
 	l_store.unlock();
 
 	// Cell cache mutex
@@ -213,8 +250,11 @@ ECRESULT ECCacheManager::PurgeCache(unsigned int ulFlags)
 	l_xp.unlock();
 
 	l_cache.lock();
-	if (ulFlags & PURGE_CACHE_USEROBJECT)
+	if (ulFlags & PURGE_CACHE_USEROBJECT) {
 		m_UserObjectCache.ClearCache();
+		m_GroupClosureCache.ClearCache();
+		m_GroupClosureIndex.clear();
+	}
 	if (ulFlags & PURGE_CACHE_EXTERNID)
 		m_UEIdObjectCache.ClearCache();
 	if (ulFlags & PURGE_CACHE_USERDETAILS)
@@ -251,6 +291,7 @@ ECRESULT ECCacheManager::Update(unsigned int ulType, unsigned int ulObjId)
 		I_DelStore(ulObjId);
 		I_DelObject(ulObjId);
 		I_DelCell(ulObjId);
+		InvalidateRights();
 		break;
 	default:
 		//Do nothing
@@ -271,6 +312,7 @@ ECRESULT ECCacheManager::UpdateUser(unsigned int ulUserId)
 		I_DelUEIdObject(strExternId, ulClass);
 	I_DelUserObject(ulUserId);
 	I_DelUserObjectDetails(ulUserId);
+	DelGroupClosure(ulUserId);
 	I_DelQuota(ulUserId, false);
 	I_DelQuota(ulUserId, true);
 	return erSuccess;
@@ -363,6 +405,88 @@ void ECCacheManager::I_DelStore(unsigned int ulObjId)
 	m_StoresCache.RemoveCacheItem(ulObjId);
 }
 
+ECRESULT ECCacheManager::GetStoreSize(unsigned int ulStore, long long *lpllSize)
+{
+	StoreSize *sSize = nullptr;
+	scoped_rlock lock(m_hCacheStoreMutex);
+	auto er = m_StoreSizeCache.GetCacheItem(ulStore, &sSize);
+	if (er != erSuccess)
+		return er;
+	*lpllSize = sSize->llSize;
+	return erSuccess;
+}
+
+ECRESULT ECCacheManager::SetStoreSize(unsigned int ulStore, long long llSize)
+{
+	StoreSize sSize;
+	sSize.llSize = llSize;
+	scoped_rlock lock(m_hCacheStoreMutex);
+	++m_StoreSizeSeq;
+	return m_StoreSizeCache.AddCacheItem(ulStore, std::move(sSize));
+}
+
+unsigned int ECCacheManager::StoreSizeSeq()
+{
+	scoped_rlock lock(m_hCacheStoreMutex);
+	return m_StoreSizeSeq;
+}
+
+void ECCacheManager::FillStoreSize(unsigned int ulStore, long long llSize,
+    unsigned int seq)
+{
+	scoped_rlock lock(m_hCacheStoreMutex);
+	if (seq != m_StoreSizeSeq) {
+		/* A delta may have landed between the read and now */
+		m_StoreSizeCache.RemoveCacheItem(ulStore);
+		return;
+	}
+	StoreSize sSize;
+	sSize.llSize = llSize;
+	m_StoreSizeCache.AddCacheItem(ulStore, std::move(sSize));
+}
+
+/* Only adjusts a size that is already cached; a missing one is read on demand. */
+void ECCacheManager::UpdateStoreSize(unsigned int ulStore, long long llDelta)
+{
+	StoreSize *sSize = nullptr;
+	scoped_rlock lock(m_hCacheStoreMutex);
+	++m_StoreSizeSeq;
+	if (m_StoreSizeCache.GetCacheItem(ulStore, &sSize) == erSuccess)
+		sSize->llSize += llDelta;
+}
+
+void ECCacheManager::DelStoreSize(unsigned int ulStore)
+{
+	scoped_rlock lock(m_hCacheStoreMutex);
+	++m_StoreSizeSeq;
+	m_StoreSizeCache.RemoveCacheItem(ulStore);
+}
+
+ECRESULT ECCacheManager::GetUserStore(unsigned int ulUserId, unsigned int *lpulStore)
+{
+	UserStore *sStore = nullptr;
+	scoped_rlock lock(m_hCacheStoreMutex);
+	auto er = m_UserStoreCache.GetCacheItem(ulUserId, &sStore);
+	if (er != erSuccess)
+		return er;
+	*lpulStore = sStore->ulStore;
+	return erSuccess;
+}
+
+ECRESULT ECCacheManager::SetUserStore(unsigned int ulUserId, unsigned int ulStore)
+{
+	UserStore sStore;
+	sStore.ulStore = ulStore;
+	scoped_rlock lock(m_hCacheStoreMutex);
+	return m_UserStoreCache.AddCacheItem(ulUserId, std::move(sStore));
+}
+
+void ECCacheManager::DelUserStore(unsigned int ulUserId)
+{
+	scoped_rlock lock(m_hCacheStoreMutex);
+	m_UserStoreCache.RemoveCacheItem(ulUserId);
+}
+
 ECRESULT ECCacheManager::GetOwner(unsigned int ulObjId, unsigned int *ulOwner)
 {
 	ECRESULT	er = erSuccess;
@@ -1010,6 +1134,110 @@ void ECCacheManager::I_DelUserObjectDetails(unsigned int ulUserId)
 	m_UserObjectDetailsCache.RemoveCacheItem(ulUserId);
 }
 
+ECRESULT ECCacheManager::GetGroupClosure(unsigned int ulUserId,
+    std::vector<std::pair<unsigned int, objectclass_t>> &groups)
+{
+	GroupClosure *closure = nullptr;
+	scoped_rlock lock(m_hCacheMutex);
+	auto er = m_GroupClosureCache.GetCacheItem(ulUserId, &closure);
+	if (er != erSuccess)
+		return er;
+	groups = closure->groups;
+	return erSuccess;
+}
+
+/**
+ * Store the closure of @ulUserId. @parents has the direct parent groups
+ * of the user and of the groups in the closure, as the build resolved
+ * them; CheckGroupParents() compares later lookups against these.
+ */
+ECRESULT ECCacheManager::SetGroupClosure(unsigned int ulUserId,
+    std::vector<std::pair<unsigned int, objectclass_t>> &&groups,
+    std::unordered_map<unsigned int, std::vector<unsigned int>> &&parents)
+{
+	GroupClosure closure;
+	closure.groups = std::move(groups);
+	auto iter = parents.find(ulUserId);
+	if (iter != parents.end()) {
+		closure.direct = std::move(iter->second);
+		std::sort(closure.direct.begin(), closure.direct.end());
+	}
+	scoped_rlock lock(m_hCacheMutex);
+	if (m_GroupClosureCache.MaxSize() == 0)
+		return erSuccess;
+	/* Unindexes the previous closure, if any */
+	m_GroupClosureCache.RemoveCacheItem(ulUserId);
+	LOG_USERCACHE_DEBUG("Add group closure for user %d: %zu groups", ulUserId, closure.groups.size());
+	for (const auto &g : closure.groups) {
+		auto &node = m_GroupClosureIndex[g.first];
+		node.members.emplace(ulUserId);
+		closure.index_size += sizeof(unsigned int) + 2 * sizeof(void *);
+		iter = parents.find(g.first);
+		if (iter == parents.end())
+			continue;
+		node.parents = std::move(iter->second);
+		std::sort(node.parents.begin(), node.parents.end());
+		node.have_parents = true;
+		closure.index_size += sizeof(node) + node.parents.capacity() * sizeof(unsigned int);
+	}
+	return m_GroupClosureCache.AddCacheItem(ulUserId, std::move(closure));
+}
+
+/* on_remove of m_GroupClosureCache; called with m_hCacheMutex held */
+void ECCacheManager::unindex_closure(unsigned int user_id, const GroupClosure &closure)
+{
+	for (const auto &g : closure.groups) {
+		auto iter = m_GroupClosureIndex.find(g.first);
+		if (iter == m_GroupClosureIndex.end())
+			continue;
+		iter->second.members.erase(user_id);
+		if (iter->second.members.empty())
+			m_GroupClosureIndex.erase(iter);
+	}
+}
+
+/**
+ * ECUserManagement reports the direct parent groups of @obj_id whenever
+ * it resolves them from the user plugin. When they differ from those
+ * the cached closures were built with, a membership was added or
+ * removed outside of this server, and every closure that depends on
+ * @obj_id is dropped.
+ */
+void ECCacheManager::CheckGroupParents(unsigned int obj_id,
+    std::vector<unsigned int> &&parents)
+{
+	std::sort(parents.begin(), parents.end());
+	scoped_rlock lock(m_hCacheMutex);
+	bool stale = false;
+	GroupClosure *closure = nullptr;
+	if (m_GroupClosureCache.GetCacheItem(obj_id, &closure) == erSuccess)
+		stale = closure->direct != parents;
+	auto iter = m_GroupClosureIndex.find(obj_id);
+	if (iter != m_GroupClosureIndex.end() && iter->second.have_parents)
+		stale = stale || iter->second.parents != parents;
+	if (stale)
+		DelGroupClosure(obj_id);
+}
+
+/**
+ * Drop the closure of @obj_id itself and, when it is a group, that of
+ * every user that is (indirectly) a member of it. The members are found
+ * through m_GroupClosureIndex, so this does not walk the whole cache.
+ */
+void ECCacheManager::DelGroupClosure(unsigned int obj_id)
+{
+	scoped_rlock lock(m_hCacheMutex);
+	m_GroupClosureCache.RemoveCacheItem(obj_id);
+	auto iter = m_GroupClosureIndex.find(obj_id);
+	if (iter == m_GroupClosureIndex.cend())
+		return;
+	/* Removing the closures unindexes them, so take the set out first */
+	auto members = std::move(iter->second.members);
+	m_GroupClosureIndex.erase(iter);
+	for (auto member : members)
+		m_GroupClosureCache.RemoveCacheItem(member);
+}
+
 ECRESULT ECCacheManager::I_AddUEIdObject(const std::string &strExternId,
     const objectclass_t &ulClass, unsigned int ulCompanyId,
     unsigned int ulUserId, const std::string &strSignature)
@@ -1235,11 +1463,14 @@ void ECCacheManager::update_extra_stats(ECStatsCollector &sc)
 	f(m_UEIdObjectCache.get_stats());
 	f(m_UserObjectCache.get_stats());
 	f(m_UserObjectDetailsCache.get_stats());
+	f(m_GroupClosureCache.get_stats());
 	f(m_ServerDetailsCache.get_stats());
 	l_cache.unlock();
 
 	ulock_rec l_store(m_hCacheStoreMutex);
 	f(m_StoresCache.get_stats());
+	f(m_StoreSizeCache.get_stats());
+	f(m_UserStoreCache.get_stats());
 	l_store.unlock();
 
 	ulock_rec l_object(m_hCacheObjectMutex);
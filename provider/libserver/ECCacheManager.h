@@ -4,6 +4,7 @@
  */
 #pragma once
 #include <kopano/zcdefs.h>
+#include <atomic>
 #include <list>
 #include <map>
 #include <memory>
@@ -26,6 +27,7 @@
 struct soap;
 
 #include <unordered_map>
+#include <unordered_set>
 
 namespace KC {
 
@@ -68,6 +70,28 @@ public:
 	objectdetails_t			sDetails;
 };
 
+/*
+ * Transitive group memberships of a user: {group id, class}, and the
+ * (sorted) ids of the groups it is directly in when this was built.
+ * index_size is its share of m_GroupClosureIndex.
+ */
+class GroupClosure final : public CacheEntry {
+public:
+	std::vector<std::pair<unsigned int, objectclass_t>> groups;
+	std::vector<unsigned int> direct;
+	size_t index_size = 0;
+};
+
+class StoreSize final : public CacheEntry {
+public:
+	long long llSize = 0;
+};
+
+class UserStore final : public CacheEntry {
+public:
+	unsigned int ulStore = 0;
+};
+
 class ServerDetails final : public CacheEntry {
 public:
 	serverdetails_t			sDetails;
@@ -258,6 +282,23 @@ public:
 	ECRESULT GetStoreAndType(unsigned int ulObjId, unsigned int *ulStore, GUID *lpGuid, unsigned int *ulType, unsigned int maxdepth = 100);
 	ECRESULT GetObjectFlags(unsigned int ulObjId, unsigned int *ulFlags);
 	ECRESULT SetStore(unsigned int ulObjId, unsigned int ulStore, const GUID *, unsigned int ulType);
+	/*
+	 * Store size (PR_MESSAGE_SIZE_EXTENDED of the store object), which
+	 * quota checks want for every delivery and every stats table row.
+	 * UpdateObjectSize() keeps it current. A size read from the database
+	 * on a miss goes in through FillStoreSize(), with the StoreSizeSeq()
+	 * taken before the read; if any size changed in between, the value
+	 * may predate that change and the entry is dropped instead.
+	 */
+	ECRESULT GetStoreSize(unsigned int ulStore, long long *lpllSize);
+	ECRESULT SetStoreSize(unsigned int ulStore, long long llSize);
+	unsigned int StoreSizeSeq();
+	void FillStoreSize(unsigned int ulStore, long long llSize, unsigned int seq);
+	void UpdateStoreSize(unsigned int ulStore, long long llDelta);
+	void DelStoreSize(unsigned int ulStore);
+	ECRESULT GetUserStore(unsigned int ulUserId, unsigned int *lpulStore);
+	ECRESULT SetUserStore(unsigned int ulUserId, unsigned int ulStore);
+	void DelUserStore(unsigned int ulUserId);
 	ECRESULT GetServerDetails(const std::string &strServerId, serverdetails_t *lpsDetails);
 	ECRESULT SetServerDetails(const std::string &strServerId, const serverdetails_t &sDetails);
 
@@ -271,6 +312,10 @@ public:
 	// Cache user information
 	ECRESULT GetUserDetails(unsigned int ulUserId, objectdetails_t *details);
 	ECRESULT SetUserDetails(unsigned int, const objectdetails_t &);
+	ECRESULT GetGroupClosure(unsigned int user_id, std::vector<std::pair<unsigned int, objectclass_t>> &groups);
+	ECRESULT SetGroupClosure(unsigned int user_id, std::vector<std::pair<unsigned int, objectclass_t>> &&groups, std::unordered_map<unsigned int, std::vector<unsigned int>> &&parents);
+	void CheckGroupParents(unsigned int obj_id, std::vector<unsigned int> &&parents);
+	void DelGroupClosure(unsigned int obj_id);
 	ECRESULT GetACLs(unsigned int ulObjId, struct rightsArray **lppRights);
 	ECRESULT SetACLs(unsigned int ulObjId, const struct rightsArray &);
 	ECRESULT GetQuota(unsigned int ulUserId, bool bIsDefaultQuota, quotadetails_t *quota);
@@ -278,6 +323,12 @@ public:
 
 	ECRESULT Update(unsigned int ulType, unsigned int ulObjId);
 	ECRESULT UpdateUser(unsigned int ulUserId);
+	/*
+	 * Generation of ACLs and folder hierarchy. It changes whenever
+	 * effective rights memoized from them may have become stale.
+	 */
+	unsigned int GetRightsGeneration() const { return m_rights_gen.load(std::memory_order_acquire); }
+	void InvalidateRights() { m_rights_gen.fetch_add(1, std::memory_order_acq_rel); }
 	ECRESULT GetEntryIdFromObject(unsigned int ulObjId, struct soap *soap, unsigned int ulFlags, entryId* lpEntrId);
 	ECRESULT GetEntryIdFromObject(unsigned int ulObjId, struct soap *soap, unsigned int ulFlags, entryId** lppEntryId);
 	ECRESULT GetObjectFromEntryId(const entryId *id, unsigned int *obj);
@@ -338,6 +389,7 @@ private:
 	ECRESULT I_AddUserObjectDetails(unsigned int, const objectdetails_t &);
 	ECRESULT I_GetUserObjectDetails(unsigned int user_id, objectdetails_t *);
 	void I_DelUserObjectDetails(unsigned int user_id);
+	void unindex_closure(unsigned int user_id, const GroupClosure &);
 	void I_DelCell(unsigned int obj_id);
 	ECRESULT I_GetQuota(unsigned int user_id, bool bIsDefaultQuota, quotadetails_t *quota);
 	void I_DelQuota(unsigned int user_id, bool is_dfl_quota);
@@ -351,6 +403,7 @@ private:
 	std::recursive_mutex m_hCacheObjectMutex;
 	std::recursive_mutex m_hCacheCellsMutex; /* Cell cache */
 	std::recursive_mutex m_hCacheIndPropMutex; /* Indexed properties cache */
+	std::atomic<unsigned int> m_rights_gen{0};
 	// Quota cache, to reduce the impact of the user plugin
 	// m_mapQuota contains user and company cache, except when it's the company user default quota
 	// m_mapQuotaUserDefault contains company user default quota
@@ -361,10 +414,27 @@ private:
 	ECCache<std::unordered_map<unsigned int, Objects>> m_ObjectsCache;
 	// Store cache (objid -> storeid/guid)
 	ECCache<std::unordered_map<unsigned int, Stores>> m_StoresCache;
+	// Store sizes (storeid -> size), and userid -> store for looking them up
+	ECCache<std::unordered_map<unsigned int, StoreSize>> m_StoreSizeCache;
+	unsigned int m_StoreSizeSeq = 0; /* bumped by every size change */
+	ECCache<std::unordered_map<unsigned int, UserStore>> m_UserStoreCache;
 	// User cache
 	ECCache<std::unordered_map<unsigned int, UserObject>> m_UserObjectCache; /* userid to user object */
 	ECCache<std::map<UEIdKey, UEIdObject>> m_UEIdObjectCache; /* user type + externid to user object */
 	ECCache<std::unordered_map<unsigned int, UserObjectDetails>>	m_UserObjectDetailsCache; /* userid to user object data */
+	ECCache<std::unordered_map<unsigned int, GroupClosure>> m_GroupClosureCache; /* userid to all groups it is in */
+	/*
+	 * Per group in any cached closure: the users whose closure has it
+	 * (the reverse of m_GroupClosureCache), and the groups it was
+	 * directly in when the closure was built. A node goes away with the
+	 * last closure that has the group.
+	 */
+	struct closure_node {
+		std::unordered_set<unsigned int> members;
+		std::vector<unsigned int> parents;
+		bool have_parents = false;
+	};
+	std::unordered_map<unsigned int, closure_node> m_GroupClosureIndex;
 	// ACL cache
 	ECCache<std::unordered_map<unsigned int, ACLs>> m_AclCache;
 	// properties and tproperties
@@ -463,6 +463,7 @@ static inline bool should_reconnect(int e)
  */
 ECRESULT ECDatabase::Query(const std::string &strQuery)
 {
+	rq_phase_timer phase(RQP_DB);
 	ECRESULT er = erSuccess;
 	int err = KDatabase::Query(strQuery);
 	auto sqlerr = mysql_errno(&m_lpMySQL);
@@ -489,6 +490,8 @@ ECRESULT ECDatabase::Query(const std::string &strQuery)
 ECRESULT ECDatabase::DoSelect(const std::string &strQuery,
     DB_RESULT *lppResult, bool fStreamResult)
 {
+	/* Also covers the transfer of the result set */
+	rq_phase_timer phase(RQP_DB);
 	auto er = KDatabase::DoSelect(strQuery, lppResult, fStreamResult);
 	m_stats->inc(SCN_DATABASE_SELECTS);
 	if (er != erSuccess) {
@@ -527,6 +530,7 @@ exit:
  */
 ECRESULT ECDatabase::GetNextResult(DB_RESULT *lppResult)
 {
+	rq_phase_timer phase(RQP_DB);
 	ECRESULT er = erSuccess;
 	DB_RESULT lpResult;
 	int ret = 0;
@@ -8,13 +8,16 @@
 #include <memory>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 #include "ECDatabaseUtils.h"
 #include "ECDatabase.h"
 #include "ECSessionManager.h"
 #include "ECSession.h"
 #include <kopano/ECDefs.h>
 #include "ECSecurity.h"
+#include <kopano/scope.hpp>
 #include <kopano/stringutil.h>
 #include "kcore.hpp"
 #include <mapidefs.h>
@@ -129,6 +132,10 @@ public:
  * member of. If a group contains a group, it will be appended to the
  * list. The list will be a unique list of groups in the end.
  *
+ * The flattened list is kept in the cache manager's group closure
+ * index, so that it is shared by all sessions of the user; user
+ * management drops entries there when memberships change.
+ *
  * @param[in]  ulUserId A user or group to query the grouplist for.
  * @param[out] lppGroups The unique list of group ids
  *
@@ -138,15 +145,41 @@ ECRESULT ECSecurity::GetGroupsForUser(unsigned int ulUserId,
     std::unique_ptr<std::list<localobjectdetails_t>> &group_out)
 {
 	std::list<localobjectdetails_t> groups;
+	std::vector<std::pair<unsigned int, objectclass_t>> closure;
 	cUniqueGroup cSeenGroups;
+	bool complete = true;
+	auto sesmgr = m_lpSession->GetSessionManager();
+	auto cache = sesmgr->GetCacheManager();
 
-	/* Gets the current user's membership information.
-	 * This means you will be in the same groups until you login again */
+	/*
+	 * Resolving the user's direct groups has ECUserManagement check them
+	 * against those the cached closure was built with (see
+	 * ECCacheManager::CheckGroupParents), so a shared closure is only
+	 * used while they are unchanged: one plugin lookup per logon instead
+	 * of one per nested group. Changes further up are noticed whenever
+	 * anything resolves the parents of those groups, when a group's
+	 * signature changes, or when the closure expires.
+	 */
 	auto usrmgt = m_lpSession->GetUserManagement();
 	auto er = usrmgt->GetParentObjectsOfObjectAndSync(OBJECTRELATION_GROUP_MEMBER,
 		ulUserId, groups, USERMANAGEMENT_IDS_ONLY);
 	if (er != erSuccess)
 		return er;
+	if (cache->GetGroupClosure(ulUserId, closure) == erSuccess) {
+		groups.clear();
+		for (const auto &grp : closure)
+			groups.emplace_back(grp.first, grp.second);
+		group_out = make_unique_nt<decltype(groups)>(std::move(groups));
+		if (group_out == nullptr)
+			return KCERR_NOT_ENOUGH_MEMORY;
+		return erSuccess;
+	}
+	sesmgr->m_stats->inc(SCN_GROUP_CLOSURE_BUILDS);
+	/* Direct parents of the user and of each group, for CheckGroupParents */
+	std::unordered_map<unsigned int, std::vector<unsigned int>> parents;
+	auto &direct = parents[ulUserId];
+	for (const auto &grp : groups)
+		direct.emplace_back(grp.ulId);
 
 	/* A user is only member of a group when he can also view the group */
 	for (auto iterGroups = groups.begin(); iterGroups != groups.cend(); ) {
@@ -165,12 +198,29 @@ ECRESULT ECSecurity::GetGroupsForUser(unsigned int ulUserId,
 		std::list<localobjectdetails_t> gig; /* groups in groups */
 		er = usrmgt->GetParentObjectsOfObjectAndSync(OBJECTRELATION_GROUP_MEMBER,
 		     iterGroups->ulId, gig, USERMANAGEMENT_IDS_ONLY);
-		if (er == erSuccess)
+		if (er == erSuccess) {
+			auto &gp = parents[iterGroups->ulId];
+			for (const auto &grp : gig)
+				gp.emplace_back(grp.ulId);
 			// Adds all groups from lpGroupInGroups to the main lpGroups list, except when already in cSeenGroups
 			std::remove_copy_if(gig.cbegin(), gig.cend(), std::back_inserter(groups), cSeenGroups);
-		// Ignore error (e.g. cannot use that function on group Everyone)
+		}
+		/*
+		 * Ignore error (e.g. cannot use that function on group
+		 * Everyone), but do not remember a list that a transient
+		 * plugin error left incomplete.
+		 */
+		else if (er != KCERR_NO_SUPPORT && er != KCERR_NOT_IMPLEMENTED &&
+		    er != KCERR_NOT_FOUND && iterGroups->ulId != KOPANO_UID_EVERYONE)
+			complete = false;
 		++iterGroups;
 	}
+	if (complete) {
+		closure.reserve(groups.size());
+		for (const auto &grp : groups)
+			closure.emplace_back(grp.ulId, grp.GetClass());
+		cache->SetGroupClosure(ulUserId, std::move(closure), std::move(parents));
+	}
 	group_out = make_unique_nt<decltype(groups)>(std::move(groups));
 	if (group_out == nullptr)
 		return KCERR_NOT_ENOUGH_MEMORY;
@@ -180,6 +230,9 @@ ECRESULT ECSecurity::GetGroupsForUser(unsigned int ulUserId,
 /**
  * Return the bitmask of permissions for an object
  *
+ * Results for folders and stores are kept in m_rights until the ACLs or
+ * the folder hierarchy change (ECCacheManager::GetRightsGeneration).
+ *
  * @param[in] ulObjId hierarchy object to get permission mask for
  * @param[out] lpulRights permission mask
  *
@@ -188,15 +241,29 @@ ECRESULT ECSecurity::GetGroupsForUser(unsigned int ulUserId,
 ECRESULT ECSecurity::GetObjectPermission(unsigned int ulObjId, unsigned int* lpulRights)
 {
 	struct rightsArray *lpRights = NULL;
-	unsigned int ulCurObj = ulObjId, ulDepth = 0;
-	bool 			bFoundACL = false;
+	unsigned int ulCurObj = ulObjId, ulDepth = 0, ulType = 0;
+	bool 			bFoundACL = false, bComplete = true;
 
 	*lpulRights = 0;
 
+	auto cache = m_lpSession->GetSessionManager()->GetCacheManager();
+	auto gen = cache->GetRightsGeneration();
+	{
+		scoped_lock lk(m_rights_lock);
+		if (m_rights_gen != gen) {
+			m_rights.clear();
+			m_rights_gen = gen;
+		}
+		auto i = m_rights.find(ulObjId);
+		if (i != m_rights.cend()) {
+			*lpulRights = i->second;
+			return erSuccess;
+		}
+	}
+
 	// Get the deepest GRANT ACL that applies to this user or groups that this user is in
 	// WARNING we totally ignore DENY ACLs here. This means that the deepest GRANT counts. In practice
 	// this doesn't matter because GRANTmask = ~DENYmask.
-	auto cache = m_lpSession->GetSessionManager()->GetCacheManager();
 	while(true)
 	{
 		if (cache->GetACLs(ulCurObj, &lpRights) == erSuccess) {
@@ -213,7 +280,9 @@ ECRESULT ECSecurity::GetObjectPermission(unsigned int ulObjId, unsigned int* lpu
 					bFoundACL = true;
 				}
 			// Also check for groups that we are in, and add those permissions
-			if (m_lpGroups != nullptr || GetGroupsForUser(m_ulUserID, m_lpGroups) == erSuccess)
+			if (m_lpGroups == nullptr && GetGroupsForUser(m_ulUserID, m_lpGroups) != erSuccess)
+				bComplete = false;
+			else
 				for (const auto &grp : *m_lpGroups)
 					for (gsoap_size_t i = 0; i < lpRights->__size; ++i)
 						if (lpRights->__ptr[i].ulType == ACCESS_TYPE_GRANT &&
@@ -232,7 +301,7 @@ ECRESULT ECSecurity::GetObjectPermission(unsigned int ulObjId, unsigned int* lpu
 		auto er = cache->GetParent(ulCurObj, &ulCurObj);
 		if (er != erSuccess)
 			// No more parents, break (with ulRights = 0)
-			return erSuccess;
+			break;
 		// This can really only happen if you have a broken tree in the database, eg a record which has
 		// parent == id. To break out of the loop we limit the depth to 64 which is very deep in practice. This means
 		// that you never have any rights for folders that are more than 64 levels of folders away from their ACL ..
@@ -240,7 +309,28 @@ ECRESULT ECSecurity::GetObjectPermission(unsigned int ulObjId, unsigned int* lpu
 			ec_log_err("Maximum depth reached for object %d, deepest object: %d", ulObjId, ulCurObj);
 			return erSuccess;
 		}
+		/* A parent that was resolved before ends the walk */
+		scoped_lock lk(m_rights_lock);
+		if (m_rights_gen != gen)
+			continue;
+		auto i = m_rights.find(ulCurObj);
+		if (i != m_rights.cend()) {
+			*lpulRights = i->second;
+			break;
+		}
 	}
+
+	/*
+	 * Only folders and stores are remembered. Messages are far more
+	 * numerous and move without a hierarchy notification; they resolve
+	 * through the memoized entry of their folder instead.
+	 */
+	if (!bComplete || cache->GetObject(ulObjId, nullptr, nullptr, nullptr, &ulType) != erSuccess ||
+	    (ulType != MAPI_FOLDER && ulType != MAPI_STORE))
+		return erSuccess;
+	scoped_lock lk(m_rights_lock);
+	if (m_rights_gen == gen)
+		m_rights.emplace(ulObjId, *lpulRights);
 	return erSuccess;
 }
 
@@ -594,7 +684,10 @@ ECRESULT ECSecurity::SetRights(unsigned int objid, struct rightsArray *lpsRights
 		return KCERR_INVALID_PARAMETER;
 
 	// Invalidate cache for this object
-	m_lpSession->GetSessionManager()->GetCacheManager()->Update(fnevObjectModified, objid);
+	auto cache = m_lpSession->GetSessionManager()->GetCacheManager();
+	cache->Update(fnevObjectModified, objid);
+	/* The statements below are autocommitted; drop memoized rights once they ran */
+	auto inval = make_scope_success([&]() { cache->InvalidateRights(); });
 	auto usrmgt = m_lpSession->GetUserManagement();
 
 	for (gsoap_size_t i = 0; i < lpsRightsArray->__size; ++i) {
@@ -1072,9 +1165,13 @@ ECRESULT ECSecurity::GetStoreSize(unsigned int ulObjId,
 	auto er = m_lpSession->GetDatabase(&lpDatabase);
 	if (er != erSuccess)
 		return er;
-	er = m_lpSession->GetSessionManager()->GetCacheManager()->GetStore(ulObjId, &ulStore, NULL);
+	auto cache = m_lpSession->GetSessionManager()->GetCacheManager();
+	er = cache->GetStore(ulObjId, &ulStore, NULL);
 	if(er != erSuccess)
 		return er;
+	if (cache->GetStoreSize(ulStore, lpllStoreSize) == erSuccess)
+		return erSuccess;
+	auto seq = cache->StoreSizeSeq();
 	auto strQuery = "SELECT val_longint FROM properties WHERE tag=" + stringify(PROP_ID(PR_MESSAGE_SIZE_EXTENDED)) + " AND type=" + stringify(PROP_TYPE(PR_MESSAGE_SIZE_EXTENDED)) + " AND hierarchyid=" + stringify(ulStore);
 	er = lpDatabase->DoSelect(strQuery, &lpDBResult);
 	if(er != erSuccess)
@@ -1091,6 +1188,7 @@ ECRESULT ECSecurity::GetStoreSize(unsigned int ulObjId,
 		return KCERR_DATABASE_ERROR;
 	}
 	*lpllStoreSize = atoll(lpDBRow[0]);
+	cache->FillStoreSize(ulStore, *lpllStoreSize, seq);
 	return erSuccess;
 }
 
@@ -1107,11 +1205,17 @@ ECRESULT ECSecurity::GetUserSize(unsigned int ulUserId,
 {
 	ECDatabase		*lpDatabase = NULL;
 	DB_RESULT lpDBResult;
+	unsigned int ulStore = 0;
+	auto cache = m_lpSession->GetSessionManager()->GetCacheManager();
+	if (cache->GetUserStore(ulUserId, &ulStore) == erSuccess &&
+	    cache->GetStoreSize(ulStore, lpllUserSize) == erSuccess)
+		return erSuccess;
 	auto er = m_lpSession->GetDatabase(&lpDatabase);
 	if (er != erSuccess)
 		return er;
+	auto seq = cache->StoreSizeSeq();
 	auto strQuery =
-		"SELECT p.val_longint "
+		"SELECT p.val_longint, s.hierarchy_id "
 		"FROM properties AS p "
 		"JOIN stores AS s "
 			"ON s.hierarchy_id = p.hierarchyid "
@@ -1132,6 +1236,11 @@ ECRESULT ECSecurity::GetUserSize(unsigned int ulUserId,
 		return KCERR_DATABASE_ERROR;
 	}
 	*lpllUserSize = (lpDBRow[0] == nullptr) ? 0 : atoll(lpDBRow[0]);
+	if (lpDBRow[0] != nullptr && lpDBRow[1] != nullptr) {
+		ulStore = atoui(lpDBRow[1]);
+		cache->SetUserStore(ulUserId, ulStore);
+		cache->FillStoreSize(ulStore, *lpllUserSize, seq);
+	}
 	return erSuccess;
 }
 
@@ -1190,19 +1299,31 @@ ECRESULT ECSecurity::CheckUserQuota(unsigned int ulUserId,
 	auto er = GetUserQuota(ulUserId, false, &quotadetails);
 	if (er != erSuccess)
 		return er;
-
-	// check the options
-	if(quotadetails.llHardSize > 0 && llStoreSize >= quotadetails.llHardSize)
-		*lpQuotaStatus = QUOTA_HARDLIMIT;
-	else if(quotadetails.llSoftSize > 0 && llStoreSize >= quotadetails.llSoftSize)
-		*lpQuotaStatus = QUOTA_SOFTLIMIT;
-	else if(quotadetails.llWarnSize > 0 && llStoreSize >= quotadetails.llWarnSize)
-		*lpQuotaStatus = QUOTA_WARN;
-	else
-		*lpQuotaStatus = QUOTA_OK;
+	*lpQuotaStatus = QuotaStatus(quotadetails, llStoreSize);
 	return erSuccess;
 }
 
+/**
+ * Gets the quota status value (ok, warn, soft, hard) for a store size
+ * against a set of quota limits
+ *
+ * @param[in] quotadetails quota limits; zero means unlimited
+ * @param[in] llStoreSize current store size of the store
+ *
+ * @return quota status
+ */
+eQuotaStatus ECSecurity::QuotaStatus(const quotadetails_t &quotadetails,
+    long long llStoreSize)
+{
+	if (quotadetails.llHardSize > 0 && llStoreSize >= quotadetails.llHardSize)
+		return QUOTA_HARDLIMIT;
+	else if (quotadetails.llSoftSize > 0 && llStoreSize >= quotadetails.llSoftSize)
+		return QUOTA_SOFTLIMIT;
+	else if (quotadetails.llWarnSize > 0 && llStoreSize >= quotadetails.llWarnSize)
+		return QUOTA_WARN;
+	return QUOTA_OK;
+}
+
 /**
  * Get the quota details of a user
  *
@@ -1339,6 +1460,8 @@ size_t ECSecurity::GetObjectSize() const
 		ulSize += MEMORY_USAGE_LIST(m_lpAdminCompanies->size(), std::list<localobjectdetails_t>);
 	}
 
+	scoped_lock lk(m_rights_lock);
+	ulSize += MEMORY_USAGE_HASHMAP(m_rights.size(), decltype(m_rights));
 	return ulSize;
 }
 
@@ -5,7 +5,9 @@
 #pragma once
 #include <list>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <kopano/memory.hpp>
 #include "ECUserManagement.h"
 #include "plugin.h"
@@ -60,6 +62,7 @@ public:
 	virtual ECRESULT GetStoreSize(unsigned int obj_id, long long *store_size) const;
 	virtual ECRESULT GetUserSize(unsigned int user_id, long long *user_size) const;
 	virtual ECRESULT GetUserQuota(unsigned int user_id, bool usr_dfl, quotadetails_t *) const;
+	static eQuotaStatus QuotaStatus(const quotadetails_t &, long long store_size);
 
 	// information for ECSessionStatsTable
 	virtual ECRESULT GetUsername(std::string *) const;
@@ -86,6 +89,13 @@ protected:
 	std::unique_ptr<std::list<localobjectdetails_t>> m_lpGroups; // current user groups
 	std::unique_ptr<std::list<localobjectdetails_t>> m_lpViewCompanies; // current visible companies
 	std::unique_ptr<std::list<localobjectdetails_t>> m_lpAdminCompanies; // Companies where the user has admin rights on
+	/*
+	 * Effective rights per folder/store, valid for as long as the
+	 * cache manager's rights generation equals m_rights_gen.
+	 */
+	mutable std::mutex m_rights_lock;
+	std::unordered_map<unsigned int, unsigned int> m_rights;
+	unsigned int m_rights_gen = 0;
 };
 
 } /* namespace */
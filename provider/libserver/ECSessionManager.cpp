@@ -963,6 +963,8 @@ void ECSessionManager::update_extra_stats()
 	auto cm = GetCacheManager();
 	if (cm != nullptr)
 		cm->update_extra_stats(s);
+	if (m_lpTPropsPurge != nullptr)
+		m_lpTPropsPurge->update_extra_stats(s);
 
 	/* It's not the same as the AUTO_INCREMENT value, but good enough. */
 	ECDatabase *db = nullptr;
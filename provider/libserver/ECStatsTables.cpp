@@ -6,11 +6,13 @@
 #	include "config.h"
 #endif
 #include <kopano/platform.h>
+#include <algorithm>
 #include <list>
 #include <memory>
 #include <string>
 #include <utility>
 #include <vector>
+#include <climits>
 #include <ctime>
 #include <libHX/misc.h>
 #include <kopano/tie.hpp>
@@ -571,11 +573,13 @@ ECRESULT ECUserStatsTable::QueryRowData(ECGenericObjectTable *lpThis,
 
 	gsoap_size_t i = 0;
 	for (const auto &row : *lpRowList) {
-		bool bNoObjectDetails = false;
+		bool bNoObjectDetails = false, bNoQuotaDetails = false;
 
 		if (lpUserManagement->GetObjectDetails(row.ulObjId, &objectDetails) != erSuccess)
 			// user gone missing since first list, all props should be set to ignore
 			bNoObjectDetails = true;
+		else if (lpSession->GetSecurity()->GetUserQuota(row.ulObjId, false, &quotaDetails) != erSuccess)
+			bNoQuotaDetails = true;
 		if (lpSession->GetSecurity()->GetUserSize(row.ulObjId, &llStoreSize) != erSuccess)
 			llStoreSize = 0;
 
@@ -658,20 +662,33 @@ ECRESULT ECUserStatsTable::QueryRowData(ECGenericObjectTable *lpThis,
 				m.Value.li = llStoreSize;
 				break;
 			case PROP_ID(PR_QUOTA_WARNING_THRESHOLD):
+				if (bNoQuotaDetails)
+					break;
 				m.__union = SOAP_UNION_propValData_ul;
 				m.ulPropTag = lpsPropTagArray->__ptr[k];
 				m.Value.ul = quotaDetails.llWarnSize / 1024;
 				break;
 			case PROP_ID(PR_QUOTA_SEND_THRESHOLD):
+				if (bNoQuotaDetails)
+					break;
 				m.__union = SOAP_UNION_propValData_ul;
 				m.ulPropTag = lpsPropTagArray->__ptr[k];
 				m.Value.ul = quotaDetails.llSoftSize / 1024;
 				break;
 			case PROP_ID(PR_QUOTA_RECEIVE_THRESHOLD):
+				if (bNoQuotaDetails)
+					break;
 				m.__union = SOAP_UNION_propValData_ul;
 				m.ulPropTag = lpsPropTagArray->__ptr[k];
 				m.Value.ul = quotaDetails.llHardSize / 1024;
 				break;
+			case PROP_ID(PR_EC_QUOTA_STATUS):
+				if (bNoQuotaDetails || llStoreSize <= 0)
+					break;
+				m.__union = SOAP_UNION_propValData_ul;
+				m.ulPropTag = lpsPropTagArray->__ptr[k];
+				m.Value.ul = ECSecurity::QuotaStatus(quotaDetails, llStoreSize);
+				break;
 			case PROP_ID(PR_LAST_LOGON_TIME):
 			case PROP_ID(PR_LAST_LOGOFF_TIME):
 			case PROP_ID(PR_EC_QUOTA_MAIL_TIME): {
@@ -1034,4 +1051,154 @@ ECRESULT ECServerStatsTable::QueryRowData(ECGenericObjectTable *lpThis,
 	return erSuccess;
 }
 
+/*
+  Latency stats
+  - one row per latency histogram of the stats collector (SOAP calls)
+  - count, average, quantiles and maximum, in milliseconds
+  - average time per call spent in the database, attachment storage and
+    sending the response
+*/
+
+ECLatencyStatsTable::ECLatencyStatsTable(ECSession *ses, unsigned int ulFlags,
+    const ECLocale &locale) :
+	ECGenericObjectTable(ses, MAPI_STATUS, ulFlags, locale)
+{
+	m_lpfnQueryRowData = QueryRowData;
+	m_lpObjectData = this;
+}
+
+ECRESULT ECLatencyStatsTable::Create(ECSession *lpSession, unsigned int ulFlags,
+    const ECLocale &locale, ECGenericObjectTable **lppTable)
+{
+	return alloc_wrap<ECLatencyStatsTable>(lpSession, ulFlags, locale).put(lppTable);
+}
+
+ECRESULT ECLatencyStatsTable::Load()
+{
+	g_lpSessionManager->m_stats->ForEachHistogram(GetHistogram, this);
+	for (const auto &h : m_mapHistograms)
+		UpdateRow(ECKeyTable::TABLE_ROW_ADD, h.first, 0);
+	return erSuccess;
+}
+
+void ECLatencyStatsTable::GetHistogram(const std::string &name,
+    const latency_histogram &h, void *obj)
+{
+	auto lpThis = static_cast<ECLatencyStatsTable *>(obj);
+	auto snap = h.get();
+	if (snap.count == 0)
+		return;
+	unsigned int id = lpThis->m_mapHistograms.size() + 1;
+	lpThis->m_mapHistograms.emplace(id, histo_row{name, h.part_names, std::move(snap)});
+}
+
+ECRESULT ECLatencyStatsTable::QueryRowData(ECGenericObjectTable *lpThis,
+    struct soap *soap, ECSession *lpSession, const ECObjectTableList *lpRowList,
+    const struct propTagArray *lpsPropTagArray, const void *lpObjectData,
+    struct rowSet **lppRowSet, bool bCacheTableData, bool bTableLimit)
+{
+	auto lpStats = static_cast<ECLatencyStatsTable *>(lpThis);
+	auto lpsRowSet = soap_new_rowSet(soap);
+	lpsRowSet->__size = 0;
+	lpsRowSet->__ptr = NULL;
+
+	if (lpRowList->empty()) {
+		*lppRowSet = lpsRowSet;
+		return erSuccess;
+	}
+
+	// We return a square array with all the values
+	lpsRowSet->__size = lpRowList->size();
+	lpsRowSet->__ptr  = soap_new_propValArray(soap, lpsRowSet->__size);
+
+	// Allocate memory for all rows
+	for (gsoap_size_t i = 0; i < lpsRowSet->__size; ++i) {
+		lpsRowSet->__ptr[i].__size = lpsPropTagArray->__size;
+		lpsRowSet->__ptr[i].__ptr  = soap_new_propVal(soap, lpsPropTagArray->__size);
+	}
+
+	gsoap_size_t i = 0;
+	for (const auto &row : *lpRowList) {
+		auto iterH = lpStats->m_mapHistograms.find(row.ulObjId);
+		for (gsoap_size_t k = 0; k < lpsPropTagArray->__size; ++k) {
+			// default is error prop
+			auto &m = lpsRowSet->__ptr[i].__ptr[k];
+			m.ulPropTag = CHANGE_PROP_TYPE(lpsPropTagArray->__ptr[k], PT_ERROR);
+			m.Value.ul = KCERR_NOT_FOUND;
+			m.__union = SOAP_UNION_propValData_ul;
+			if (iterH == lpStats->m_mapHistograms.cend())
+				continue;		// broken .. should never happen
+
+			const auto &h = iterH->second;
+			/* Average time of a part per call, in msec */
+			auto part = [&](const char *pname) {
+				for (size_t p = 0; p < h.part_names.size(); ++p) {
+					if (h.part_names[p] != pname)
+						continue;
+					m.__union = SOAP_UNION_propValData_dbl;
+					m.ulPropTag = lpsPropTagArray->__ptr[k];
+					m.Value.dbl = static_cast<double>(h.data.parts[p]) / h.data.count / 1000;
+				}
+			};
+			auto msec = [&](uint64_t usec) {
+				m.__union = SOAP_UNION_propValData_dbl;
+				m.ulPropTag = lpsPropTagArray->__ptr[k];
+				m.Value.dbl = usec / 1000.0;
+			};
+
+			switch (PROP_ID(lpsPropTagArray->__ptr[k])) {
+			case PROP_ID(PR_INSTANCE_KEY):
+				// generate key
+				m.__union = SOAP_UNION_propValData_bin;
+				m.ulPropTag = lpsPropTagArray->__ptr[k];
+				m.Value.bin = soap_new_xsd__base64Binary(soap);
+				m.Value.bin->__size = sizeof(sObjectTableKey);
+				m.Value.bin->__ptr  = soap_new_unsignedByte(soap, sizeof(sObjectTableKey));
+				memcpy(m.Value.bin->__ptr, &row, sizeof(sObjectTableKey));
+				break;
+			case PROP_ID(PR_DISPLAY_NAME):
+				m.__union = SOAP_UNION_propValData_lpszA;
+				m.ulPropTag = lpsPropTagArray->__ptr[k];
+				m.Value.lpszA = soap_strdup(soap, h.name.c_str());
+				break;
+			case PROP_ID(PR_EC_STATS_LATENCY_COUNT):
+				m.__union = SOAP_UNION_propValData_ul;
+				m.ulPropTag = lpsPropTagArray->__ptr[k];
+				m.Value.ul = std::min<uint64_t>(h.data.count, UINT_MAX);
+				break;
+			case PROP_ID(PR_EC_STATS_LATENCY_AVG):
+				m.__union = SOAP_UNION_propValData_dbl;
+				m.ulPropTag = lpsPropTagArray->__ptr[k];
+				m.Value.dbl = static_cast<double>(h.data.sum) / h.data.count / 1000;
+				break;
+			case PROP_ID(PR_EC_STATS_LATENCY_P50):
+				msec(h.data.quantile(0.5));
+				break;
+			case PROP_ID(PR_EC_STATS_LATENCY_P90):
+				msec(h.data.quantile(0.9));
+				break;
+			case PROP_ID(PR_EC_STATS_LATENCY_P99):
+				msec(h.data.quantile(0.99));
+				break;
+			case PROP_ID(PR_EC_STATS_LATENCY_MAX):
+				msec(h.data.max);
+				break;
+			case PROP_ID(PR_EC_STATS_LATENCY_DB):
+				part("db");
+				break;
+			case PROP_ID(PR_EC_STATS_LATENCY_ATTACH):
+				part("attachment");
+				break;
+			case PROP_ID(PR_EC_STATS_LATENCY_SEND):
+				part("send");
+				break;
+			}
+		}
+		++i;
+	}
+
+	*lppRowSet = lpsRowSet;
+	return erSuccess;
+}
+
 } /* namespace */
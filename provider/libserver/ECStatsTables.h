@@ -8,9 +8,11 @@
 #include <kopano/Util.h>
 #include "ECGenericObjectTable.h"
 #include "ECSession.h"
+#include "StatsClient.h"
 #include <string>
 #include <list>
 #include <map>
+#include <vector>
 
 namespace KC {
 
@@ -102,4 +104,25 @@ private:
 	ALLOC_WRAP_FRIEND;
 };
 
+class ECLatencyStatsTable final : public ECGenericObjectTable {
+protected:
+	ECLatencyStatsTable(ECSession *, unsigned int flags, const ECLocale &);
+
+public:
+	static ECRESULT Create(ECSession *, unsigned int flags, const ECLocale &, ECGenericObjectTable **);
+	virtual ECRESULT Load();
+	static ECRESULT QueryRowData(ECGenericObjectTable *, struct soap *, ECSession *, const ECObjectTableList *, const struct propTagArray *, const void *priv, struct rowSet **, bool cache_table_data, bool table_limit);
+
+private:
+	static void GetHistogram(const std::string &name, const latency_histogram &, void *obj);
+
+	struct histo_row {
+		std::string name;
+		std::vector<std::string> part_names;
+		latency_histogram::snapshot data;
+	};
+	std::map<unsigned int, histo_row> m_mapHistograms;
+	ALLOC_WRAP_FRIEND;
+};
+
 } /* namespace */
@@ -1142,6 +1142,8 @@ ECRESULT GetDeferredTableUpdates(ECDatabase *lpDatabase, unsigned int ulFolderId
 		return er;
 	while ((lpDBRow = lpDBResult.fetch_row()) != nullptr)
 		lpDeferred->emplace_back(atoui(lpDBRow[0]));
+	if (!lpDeferred->empty())
+		ECTPropsPurge::NoteDeferredRead(ulFolderId, lpDeferred->size());
 	return erSuccess;
 }
 
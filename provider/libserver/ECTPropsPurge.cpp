@@ -2,6 +2,7 @@
  * SPDX-License-Identifier: AGPL-3.0-only
  * Copyright 2005 - 2016 Zarafa and its licensors
  */
+#include <algorithm>
 #include <chrono>
 #include <cstring>
 #include <memory>
@@ -22,6 +23,15 @@ using namespace std::chrono_literals;
 
 namespace KC {
 
+/* Rows per transaction when compacting a folder in the background */
+static constexpr unsigned int COMPACT_BATCH = 1000;
+/* Upper bound on the number of folders whose reads are tracked */
+static constexpr size_t BACKLOG_MAX = 65536;
+/* Folders not read for this long are no longer tracked */
+static constexpr time_t BACKLOG_IDLE = 3600;
+
+ECTPropsPurge::backlog_shard ECTPropsPurge::m_backlog[BACKLOG_SHARDS];
+
 ECTPropsPurge::ECTPropsPurge(std::shared_ptr<ECConfig> c,
     ECDatabaseFactory *lpDatabaseFactory) :
 	m_lpConfig(std::move(c)), m_lpDatabaseFactory(lpDatabaseFactory)
@@ -34,19 +44,34 @@ ECTPropsPurge::ECTPropsPurge(std::shared_ptr<ECConfig> c,
 	}
 	m_thread_active = true;
     set_thread_name(m_hThread, "TPropsPurge");
+
+	auto nworkers = std::max(1U, atoui(m_lpConfig->GetSetting("deferred_purge_threads")));
+	for (unsigned int i = 0; i < nworkers; ++i) {
+		pthread_t tid;
+		ret = pthread_create(&tid, nullptr, Worker, this);
+		if (ret != 0) {
+			ec_log_err("Could not create TPropsPurge worker thread: %s", strerror(ret));
+			break;
+		}
+		set_thread_name(tid, "TPropsCompact");
+		m_workers.push_back(tid);
+	}
 }
 
 ECTPropsPurge::~ECTPropsPurge()
 {
-	// Signal thread to exit
+	// Signal threads to exit
 	ulock_normal l_exit(m_hMutexExit);
 	m_bExit = true;
 	m_hCondExit.notify_all();
+	m_hCondQueue.notify_all();
 	l_exit.unlock();
 
-	// Wait for the thread to exit
+	// Wait for the threads to exit
 	if (m_thread_active)
 		pthread_join(m_hThread, nullptr);
+	for (auto tid : m_workers)
+		pthread_join(tid, nullptr);
 }
 
 /**
@@ -62,6 +87,13 @@ void * ECTPropsPurge::Thread(void *param)
 	return NULL;
 }
 
+void *ECTPropsPurge::Worker(void *param)
+{
+	kcsrv_blocksigs();
+	static_cast<ECTPropsPurge *>(param)->PurgeWorker();
+	return nullptr;
+}
+
 /**
  * Main TProps purger loop
  *
@@ -70,6 +102,9 @@ void * ECTPropsPurge::Thread(void *param)
  * items are from the largest folder first; A folder with 20 deferredupdates will be purged
  * before a folder with only 10 deferred updates.
  *
+ * It also hands folders that are read a lot while they have deferred updates
+ * to the compaction workers (ScheduleHotFolders).
+ *
  * The loop (thread) will exit ASAP when m_bExit is set to TRUE.
  *
  * @return result
@@ -102,6 +137,7 @@ ECRESULT ECTPropsPurge::PurgeThread()
         }
 
         PurgeOverflowDeferred(lpDatabase); // Ignore error, just retry
+		ScheduleHotFolders();
     }
 
 	m_lpDatabaseFactory->thread_end();
@@ -146,6 +182,156 @@ ECRESULT ECTPropsPurge::PurgeOverflowDeferred(ECDatabase *lpDatabase)
 	return erSuccess;
 }
 
+/**
+ * Queue folders for compaction
+ *
+ * Every table load of a folder with deferred updates has to read those rows
+ * from "properties". A folder's cost is therefore its number of reads times
+ * its number of deferred rows. Folders whose cost since their last purge
+ * reached deferred_compact_threshold are queued for the compaction
+ * workers, costliest first. Folders that were not read for BACKLOG_IDLE
+ * seconds are forgotten.
+ */
+void ECTPropsPurge::ScheduleHotFolders()
+{
+	auto threshold = atoui(m_lpConfig->GetSetting("deferred_compact_threshold"));
+	auto now = time(nullptr);
+	std::vector<std::pair<unsigned long long, unsigned int>> hot;
+
+	for (auto &shard : m_backlog) {
+		std::lock_guard<std::mutex> l_backlog(shard.lock);
+		for (auto i = shard.folders.begin(); i != shard.folders.end(); ) {
+			if (now - i->second.last_read >= BACKLOG_IDLE) {
+				i = shard.folders.erase(i);
+				continue;
+			}
+			auto cost = static_cast<unsigned long long>(i->second.reads) * i->second.deferred;
+			if (threshold != 0 && cost >= threshold)
+				hot.emplace_back(cost, i->first);
+			++i;
+		}
+	}
+	if (hot.empty())
+		return;
+	std::sort(hot.rbegin(), hot.rend());
+
+	ulock_normal l_exit(m_hMutexExit);
+	for (const auto &h : hot)
+		if (m_queued.emplace(h.second).second)
+			m_queue.push_back(h.second);
+	m_hCondQueue.notify_all();
+}
+
+/**
+ * Compaction worker loop
+ *
+ * Takes folders from the queue filled by ScheduleHotFolders and purges their
+ * deferred updates, each on its own database connection.
+ */
+void ECTPropsPurge::PurgeWorker()
+{
+	ECDatabase *lpDatabase = nullptr;
+
+	while (true) {
+		ulock_normal l_exit(m_hMutexExit);
+		m_hCondQueue.wait(l_exit, [&]() { return m_bExit || !m_queue.empty(); });
+		if (m_bExit)
+			break;
+		auto folder = m_queue.front();
+		m_queue.pop_front();
+		l_exit.unlock();
+
+		if (lpDatabase == nullptr &&
+		    m_lpDatabaseFactory->get_tls_db(&lpDatabase) != erSuccess) {
+			ec_log_crit("Unable to get database connection for deferred update compaction");
+			lpDatabase = nullptr;
+		} else {
+			PurgeFolder(lpDatabase, folder); // Ignore error, the folder will come up again
+		}
+		l_exit.lock();
+		m_queued.erase(folder);
+	}
+	m_lpDatabaseFactory->thread_end();
+}
+
+/**
+ * Purge all deferred updates of a folder, COMPACT_BATCH records per
+ * transaction, so that concurrent writers to the folder do not wait for long.
+ */
+ECRESULT ECTPropsPurge::PurgeFolder(ECDatabase *lpDatabase, unsigned int ulFolderId)
+{
+	unsigned int ulPurged = 0;
+
+	do {
+		ECRESULT er = erSuccess;
+		auto dtx = lpDatabase->Begin(er);
+		if (er != erSuccess)
+			return er;
+		er = PurgeDeferredTableUpdates(lpDatabase, ulFolderId, COMPACT_BATCH, &ulPurged);
+		if (er != erSuccess)
+			return er;
+		er = dtx.commit();
+		if (er != erSuccess)
+			return er;
+	} while (ulPurged >= COMPACT_BATCH && !m_bExit);
+	return erSuccess;
+}
+
+/**
+ * Record a table load that had to read deferred rows
+ *
+ * @param[in] folder Hierarchy ID of the folder
+ * @param[in] deferred Number of deferred records of the folder
+ */
+void ECTPropsPurge::NoteDeferredRead(unsigned int folder, size_t deferred)
+{
+	auto &shard = backlog_for(folder);
+	auto now = time(nullptr);
+	std::lock_guard<std::mutex> l_backlog(shard.lock);
+	auto i = shard.folders.find(folder);
+	if (i == shard.folders.end()) {
+		if (shard.folders.size() >= BACKLOG_MAX / BACKLOG_SHARDS)
+			return;
+		i = shard.folders.emplace(folder, backlog{}).first;
+	}
+	++i->second.reads;
+	i->second.deferred = deferred;
+	i->second.last_read = now;
+}
+
+/**
+ * Publish the folders with the costliest deferred backlog (see
+ * ScheduleHotFolders) as deferred_hot_1..5.
+ */
+void ECTPropsPurge::update_extra_stats(ECStatsCollector &sc)
+{
+	static constexpr unsigned int NUM_HOT = 5;
+	std::vector<std::pair<unsigned long long, std::pair<unsigned int, backlog>>> hot;
+	size_t tracked = 0;
+	for (auto &shard : m_backlog) {
+		std::lock_guard<std::mutex> l_backlog(shard.lock);
+		tracked += shard.folders.size();
+		for (const auto &e : shard.folders)
+			hot.emplace_back(static_cast<unsigned long long>(e.second.reads) * e.second.deferred, e);
+	}
+	auto mid = hot.begin() + std::min<size_t>(NUM_HOT, hot.size());
+	std::partial_sort(hot.begin(), mid, hot.end(),
+		[](const auto &a, const auto &b) { return a.first > b.first; });
+
+	ulock_normal l_exit(m_hMutexExit);
+	sc.setg("deferred_folders", "Folders read while having deferred updates", tracked);
+	sc.setg("deferred_compact_queue", "Folders waiting for deferred update compaction", m_queue.size());
+	l_exit.unlock();
+	for (unsigned int i = 0; i < NUM_HOT; ++i) {
+		std::string v;
+		if (i < hot.size())
+			v = format("folder %u: %u deferred, %u reads", hot[i].second.first,
+			    hot[i].second.second.deferred, hot[i].second.second.reads);
+		sc.set("deferred_hot_" + stringify(i + 1),
+			"Folder with deferred updates, by reads times backlog", v);
+	}
+}
+
 /**
  * Get the deferred record count
  *
@@ -204,22 +390,36 @@ ECRESULT ECTPropsPurge::GetLargestFolderId(ECDatabase *lpDatabase, unsigned int
  *
  * @param[in] lpDatabase Database pointer
  * @param[in] Hierarchy ID of folder to purge
+ * @param[in] ulLimit Purge at most this many records (0: all)
+ * @param[out] lpulPurged Number of records purged (optional)
  * @return Result
  */
 // @todo, multiple threads call this function, which will cause problems
-ECRESULT ECTPropsPurge::PurgeDeferredTableUpdates(ECDatabase *lpDatabase, unsigned int ulFolderId)
+ECRESULT ECTPropsPurge::PurgeDeferredTableUpdates(ECDatabase *lpDatabase,
+    unsigned int ulFolderId, unsigned int ulLimit, unsigned int *lpulPurged)
 {
 	unsigned int ulAffected;
 	DB_RESULT lpDBResult;
 	DB_ROW lpDBRow = NULL;
 	std::string strIn;
 
+	if (lpulPurged != nullptr)
+		*lpulPurged = 0;
 	// This makes sure that we lock the record in the hierarchy *first*. This helps in serializing access and avoiding deadlocks.
 	std::string strQuery = "SELECT hierarchyid FROM deferredupdate WHERE folderid=" + stringify(ulFolderId);
+	if (ulLimit != 0)
+		strQuery += " LIMIT " + stringify(ulLimit);
 	auto er = lpDatabase->DoSelect(strQuery, &lpDBResult);
 	if(er != erSuccess)
 		return er;
-	if (lpDBResult.get_num_rows() == 0)
+	auto ulRows = lpDBResult.get_num_rows();
+	if (ulLimit == 0 || ulRows < ulLimit) {
+		/* Reads of this folder are cheap again */
+		auto &shard = backlog_for(ulFolderId);
+		std::lock_guard<std::mutex> l_backlog(shard.lock);
+		shard.folders.erase(ulFolderId);
+	}
+	if (ulRows == 0)
 		return erSuccess;
 	while ((lpDBRow = lpDBResult.fetch_row()) != nullptr) {
 		strIn += lpDBRow[0];
@@ -235,7 +435,7 @@ ECRESULT ECTPropsPurge::PurgeDeferredTableUpdates(ECDatabase *lpDatabase, unsign
 		return er;
 
 	strQuery = "REPLACE INTO tproperties (folderid, hierarchyid, tag, type, val_ulong, val_string, val_binary, val_double, val_longint, val_hi, val_lo) ";
-	strQuery += "SELECT " + stringify(ulFolderId) + ", p.hierarchyid, p.tag, p.type, val_ulong, LEFT(val_string, " + stringify(TABLE_CAP_STRING) + "), LEFT(val_binary, " + stringify(TABLE_CAP_BINARY) + "), val_double, val_longint, val_hi, val_lo FROM properties AS p JOIN deferredupdate ON deferredupdate.hierarchyid=p.hierarchyid WHERE tag NOT IN(4105, 4115) AND deferredupdate.folderid = " + stringify(ulFolderId);
+	strQuery += "SELECT " + stringify(ulFolderId) + ", p.hierarchyid, p.tag, p.type, val_ulong, LEFT(val_string, " + stringify(TABLE_CAP_STRING) + "), LEFT(val_binary, " + stringify(TABLE_CAP_BINARY) + "), val_double, val_longint, val_hi, val_lo FROM properties AS p WHERE tag NOT IN(4105, 4115) AND p.hierarchyid IN(" + strIn + ")";
 	er = lpDatabase->DoInsert(strQuery);
 	if(er != erSuccess)
 		return er;
@@ -246,6 +446,8 @@ ECRESULT ECTPropsPurge::PurgeDeferredTableUpdates(ECDatabase *lpDatabase, unsign
 		return er;
 	g_lpSessionManager->m_stats->inc(SCN_DATABASE_MERGES);
 	g_lpSessionManager->m_stats->inc(SCN_DATABASE_MERGED_RECORDS, static_cast<int>(ulAffected));
+	if (lpulPurged != nullptr)
+		*lpulPurged = ulRows;
 	return erSuccess;
 }
 
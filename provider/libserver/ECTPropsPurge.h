@@ -4,9 +4,15 @@
  */
 #pragma once
 #include <kopano/zcdefs.h>
+#include <atomic>
 #include <condition_variable>
+#include <ctime>
+#include <deque>
 #include <memory>
 #include <mutex>
+#include <set>
+#include <unordered_map>
+#include <vector>
 #include <pthread.h>
 
 namespace KC {
@@ -15,29 +21,60 @@ class ECDatabase;
 class Config;
 class ECDatabaseFactory;
 class ECSession;
+class ECStatsCollector;
 
 class ECTPropsPurge final {
 public:
 	ECTPropsPurge(std::shared_ptr<Config>, ECDatabaseFactory *lpDatabaseFactory);
     ~ECTPropsPurge();
 
-    static ECRESULT PurgeDeferredTableUpdates(ECDatabase *lpDatabase, unsigned int ulFolderId);
+    static ECRESULT PurgeDeferredTableUpdates(ECDatabase *lpDatabase, unsigned int ulFolderId, unsigned int ulLimit = 0, unsigned int *lpulPurged = nullptr);
     static ECRESULT GetDeferredCount(ECDatabase *lpDatabase, unsigned int *lpulCount);
     static ECRESULT GetLargestFolderId(ECDatabase *lpDatabase, unsigned int *lpulFolderId);
     static ECRESULT AddDeferredUpdate(ECSession *lpSession, ECDatabase *lpDatabase, unsigned int ulFolderId, unsigned int ulOldFolderId, unsigned int ulObjId);
     static ECRESULT AddDeferredUpdateNoPurge(ECDatabase *lpDatabase, unsigned int ulFolderId, unsigned int ulOldFolderId, unsigned int ulObjId);
     static ECRESULT NormalizeDeferredUpdates(ECSession *lpSession, ECDatabase *lpDatabase, unsigned int ulFolderId);
+	/* A table load of @folder had to read @deferred rows from "properties" */
+	static void NoteDeferredRead(unsigned int folder, size_t deferred);
+	void update_extra_stats(ECStatsCollector &);
 
 private:
+	struct backlog {
+		unsigned int reads = 0, deferred = 0;
+		time_t last_read = 0;
+	};
+	/*
+	 * Folders read while they had deferred updates, since their last
+	 * purge. Sharded by folder id, so that concurrent table loads
+	 * seldom wait for one another in NoteDeferredRead.
+	 */
+	struct backlog_shard {
+		std::mutex lock;
+		std::unordered_map<unsigned int, backlog> folders;
+	};
+	static constexpr unsigned int BACKLOG_SHARDS = 16;
+	static backlog_shard &backlog_for(unsigned int folder) { return m_backlog[folder % BACKLOG_SHARDS]; }
+
     ECRESULT PurgeThread();
     ECRESULT PurgeOverflowDeferred(ECDatabase *lpDatabase);
+	void ScheduleHotFolders();
+	void PurgeWorker();
+	ECRESULT PurgeFolder(ECDatabase *, unsigned int folder);
     static ECRESULT GetDeferredCount(ECDatabase *lpDatabase, unsigned int ulFolderId, unsigned int *lpulCount);
     static void *Thread(void *param);
+	static void *Worker(void *);
 
 	std::mutex m_hMutexExit;
-	std::condition_variable m_hCondExit;
+	std::condition_variable m_hCondExit, m_hCondQueue;
     pthread_t			m_hThread;
-	bool m_thread_active = false, m_bExit = false;
+	std::vector<pthread_t> m_workers;
+	/* Folders waiting for, or undergoing, compaction (m_hMutexExit) */
+	std::deque<unsigned int> m_queue;
+	std::set<unsigned int> m_queued;
+	bool m_thread_active = false;
+	/* Set under m_hMutexExit for the waits, but polled without it */
+	std::atomic<bool> m_bExit{false};
+	static backlog_shard m_backlog[BACKLOG_SHARDS];
 	std::shared_ptr<Config> m_lpConfig;
     ECDatabaseFactory *m_lpDatabaseFactory;
 };
@@ -146,6 +146,13 @@ static const unsigned int sServerStatsProps[] = {
 	PR_EC_STATS_SERVER_PROXYURL, PR_EC_STATS_SERVER_HTTPURL,
 	PR_EC_STATS_SERVER_HTTPSURL, PR_EC_STATS_SERVER_FILEURL,
 };
+static const unsigned int sLatencyStatsProps[] = {
+	PR_DISPLAY_NAME, PR_EC_STATS_LATENCY_COUNT, PR_EC_STATS_LATENCY_AVG,
+	PR_EC_STATS_LATENCY_P50, PR_EC_STATS_LATENCY_P90,
+	PR_EC_STATS_LATENCY_P99, PR_EC_STATS_LATENCY_MAX,
+	PR_EC_STATS_LATENCY_DB, PR_EC_STATS_LATENCY_ATTACH,
+	PR_EC_STATS_LATENCY_SEND,
+};
 
 static const struct propTagArray sPropTagArrayContents =
 	{const_cast<unsigned int *>(sContentsProps), ARRAY_SIZE(sContentsProps)};
@@ -168,6 +175,8 @@ static const struct propTagArray sPropTagArrayCompanyStats =
 	{const_cast<unsigned int *>(sCompanyStatsProps), ARRAY_SIZE(sCompanyStatsProps)};
 static const struct propTagArray sPropTagArrayServerStats =
 	{const_cast<unsigned int *>(sServerStatsProps), ARRAY_SIZE(sServerStatsProps)};
+static const struct propTagArray sPropTagArrayLatencyStats =
+	{const_cast<unsigned int *>(sLatencyStatsProps), ARRAY_SIZE(sLatencyStatsProps)};
 
 ECTableManager::~ECTableManager()
 {
@@ -386,6 +395,7 @@ ECRESULT ECTableManager::OpenStatsTable(unsigned int ulTableType, unsigned int u
 	// TABLETYPE_STATS_SYSTEM: only for (sys)admins
 	// TABLETYPE_STATS_SESSIONS: only for (sys)admins
 	// TABLETYPE_STATS_USERS: full list: only for (sys)admins, company list: only for admins
+	// TABLETYPE_STATS_LATENCY: only for (sys)admins
 
 	lpEntry.reset(new(std::nothrow) TABLE_ENTRY);
 	if (lpEntry == nullptr)
@@ -448,6 +458,17 @@ ECRESULT ECTableManager::OpenStatsTable(unsigned int ulTableType, unsigned int u
 		lpEntry->ulTableType = TABLE_ENTRY::TABLE_TYPE_SERVERSTATS;
 		er = lpTable->SetColumns(&sPropTagArrayServerStats, true);
 		break;
+	case TABLETYPE_STATS_LATENCY:
+		if ((hosted && adminlevel < ADMIN_LEVEL_SYSADMIN) || (!hosted && adminlevel < ADMIN_LEVEL_ADMIN)) {
+			AuditStatsAccess(lpSession, "denied", "latency");
+			return KCERR_NO_ACCESS;
+		}
+		er = ECLatencyStatsTable::Create(lpSession, ulFlags, createLocaleFromName(lpszLocaleId), &~lpTable);
+		if (er != erSuccess)
+			return er;
+		lpEntry->ulTableType = TABLE_ENTRY::TABLE_TYPE_LATENCYSTATS;
+		er = lpTable->SetColumns(&sPropTagArrayLatencyStats, true);
+		break;
 	default:
 		er = KCERR_UNKNOWN;
 		break;
@@ -35,7 +35,7 @@ struct TABLE_ENTRY {
 	enum TABLE_TYPE {
 		TABLE_TYPE_GENERIC, TABLE_TYPE_OUTGOINGQUEUE, TABLE_TYPE_USERSTORES,
 		TABLE_TYPE_SYSTEMSTATS, TABLE_TYPE_THREADSTATS, TABLE_TYPE_USERSTATS, TABLE_TYPE_SESSIONSTATS, TABLE_TYPE_COMPANYSTATS, TABLE_TYPE_SERVERSTATS,
-		TABLE_TYPE_MAILBOX,
+		TABLE_TYPE_MAILBOX, TABLE_TYPE_LATENCYSTATS,
 	};
 
     TABLE_TYPE ulTableType;
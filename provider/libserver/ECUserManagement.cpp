@@ -339,6 +339,38 @@ ECRESULT ECUserManagement::GetLocalObjectListFromSignatures(const signatures_t &
 	return erSuccess;
 }
 
+/**
+ * Fetch the details of the next objects in @sig that have no local
+ * counterpart yet, with one plugin call rather than one per object. On a
+ * first sync this is most of the list.
+ *
+ * @pos is advanced by at most 256 entries, so that an LDAP plugin keeps
+ * below its default ldap_filter_cutoff_elements. Returns the number of
+ * entries looked at. Failures are not fatal: CreateLocalObject() asks the
+ * plugin for whatever is missing from @out.
+ */
+static size_t prefetch_new_details(UserPlugin *plugin,
+    signatures_t::const_iterator &pos, signatures_t::const_iterator end,
+    const std::map<objectid_t, std::pair<unsigned int, std::string>> &local,
+    std::map<objectid_t, objectdetails_t> &out)
+{
+	std::list<objectid_t> ids;
+	size_t n = 0;
+
+	out.clear();
+	for (; pos != end && n < 256; ++pos, ++n)
+		if (local.find(pos->id) == local.cend())
+			ids.emplace_back(pos->id);
+	if (ids.size() < 2)
+		return n;
+	try {
+		out = plugin->getObjectDetails(ids);
+	} catch (const std::exception &e) {
+		ec_log_debug("Prefetching details of %zu new objects failed: %s", ids.size(), e.what());
+	}
+	return n;
+}
+
 /**
  * Get object list
  *
@@ -442,11 +474,20 @@ ECRESULT ECUserManagement::GetCompanyObjectListAndSync(objectclass_t objclass,
 		}
 
 		// Loop through all the external signatures, adding them to the lpUsers list which we're going to be returning
+		std::map<objectid_t, objectdetails_t> mapPrefetched;
+		auto prefetch_pos = lpExternSignatures.cbegin();
+		size_t pos = 0, prefetch_end = 0;
 		for (const auto &ext_sig : lpExternSignatures) {
 			auto iterSignatureIdToLocal = mapSignatureIdToLocal.find(ext_sig.id);
+			if (pos++ == prefetch_end)
+				prefetch_end += prefetch_new_details(lpPlugin, prefetch_pos,
+				                lpExternSignatures.cend(), mapSignatureIdToLocal,
+				                mapPrefetched);
 			if (iterSignatureIdToLocal == mapSignatureIdToLocal.cend()) {
 				// User is in external user database, but not in local, so add
-				er = MoveOrCreateLocalObject(ext_sig, &ulObjectId, &bMoved);
+				auto iterPrefetched = mapPrefetched.find(ext_sig.id);
+				er = MoveOrCreateLocalObject(ext_sig, &ulObjectId, &bMoved,
+				     iterPrefetched != mapPrefetched.cend() ? &iterPrefetched->second : nullptr);
 				if (er != erSuccess)
 					// Create failed, so skip this entry
 					continue;
@@ -735,6 +776,15 @@ ECRESULT ECUserManagement::GetParentObjectsOfObjectAndSync(userobject_relation_t
 	 */
 	objs.sort();
 	objs.unique();
+	/* Let cached group closures notice memberships changed in the plugin */
+	if (er == erSuccess && relation == OBJECTRELATION_GROUP_MEMBER &&
+	    ulFlags == USERMANAGEMENT_IDS_ONLY) {
+		std::vector<unsigned int> ids;
+		ids.reserve(objs.size());
+		for (const auto &obj : objs)
+			ids.emplace_back(obj.ulId);
+		m_lpSession->GetSessionManager()->GetCacheManager()->CheckGroupParents(ulChildId, std::move(ids));
+	}
 	return er;
 }
 
@@ -833,7 +883,14 @@ ECRESULT ECUserManagement::AddSubObjectToObjectAndSync(userobject_relation_t rel
 			return er;
 		AddABChange(m_lpSession, ICS_AB_CHANGE, std::move(sSourceKey), SOURCEKEY(sizeof(abcont_1), reinterpret_cast<const char *>(&abcont_1)));
 	}
-	m_lpSession->GetSessionManager()->GetCacheManager()->UpdateUser(ulParentId);
+	auto cache = m_lpSession->GetSessionManager()->GetCacheManager();
+	cache->UpdateUser(ulParentId);
+	/* The child (and its members) gained or lost groups */
+	if (relation == OBJECTRELATION_GROUP_MEMBER)
+		cache->DelGroupClosure(ulChildId);
+	/* Group visibility, and with it every closure, may have changed */
+	else if (relation == OBJECTRELATION_COMPANY_VIEW)
+		cache->PurgeCache(PURGE_CACHE_USEROBJECT);
 	return er;
 }
 
@@ -885,7 +942,14 @@ ECRESULT ECUserManagement::DeleteSubObjectFromObjectAndSync(userobject_relation_
 			return er;
 		AddABChange(m_lpSession, ICS_AB_CHANGE, std::move(sSourceKey), SOURCEKEY(sizeof(abcont_1), reinterpret_cast<const char *>(&abcont_1)));
 	}
-	m_lpSession->GetSessionManager()->GetCacheManager()->UpdateUser(ulParentId);
+	auto cache = m_lpSession->GetSessionManager()->GetCacheManager();
+	cache->UpdateUser(ulParentId);
+	/* The child (and its members) gained or lost groups */
+	if (relation == OBJECTRELATION_GROUP_MEMBER)
+		cache->DelGroupClosure(ulChildId);
+	/* Group visibility, and with it every closure, may have changed */
+	else if (relation == OBJECTRELATION_COMPANY_VIEW)
+		cache->PurgeCache(PURGE_CACHE_USEROBJECT);
 	return er;
 }
 
@@ -2140,7 +2204,9 @@ ECRESULT ECUserManagement::UpdateUserDetailsFromClient(objectdetails_t *lpDetail
 //
 // ******************************************************************************************************
 // Create a local user corresponding to the given userid on the external database
-ECRESULT ECUserManagement::CreateLocalObject(const objectsignature_t &signature, unsigned int *lpulObjectId) {
+ECRESULT ECUserManagement::CreateLocalObject(const objectsignature_t &signature,
+    unsigned int *lpulObjectId, const objectdetails_t *prefetched)
+{
 	if (local_license_check() != 0)
 		return hr_lerrf(MAPI_E_NO_ACCESS, "License daemon rejected the request");
 
@@ -2160,7 +2226,7 @@ ECRESULT ECUserManagement::CreateLocalObject(const objectsignature_t &signature,
 		return er;
 
 	try {
-		details = lpPlugin->getObjectDetails(signature.id);
+		details = prefetched != nullptr ? *prefetched : lpPlugin->getObjectDetails(signature.id);
 		/*
 		 * The property OB_PROP_S_LOGIN is mandatory, when that property is an empty string
 		 * somebody (aka: system administrator) has messed up its LDAP tree or messed around
@@ -2431,7 +2497,8 @@ ECRESULT ECUserManagement::UpdateObjectclassOrDelete(const objectid_t &sExternId
 }
 
 // Check if an object has moved to a new company, or if it was created as new
-ECRESULT ECUserManagement::MoveOrCreateLocalObject(const objectsignature_t &signature, unsigned int *lpulObjectId, bool *lpbMoved)
+ECRESULT ECUserManagement::MoveOrCreateLocalObject(const objectsignature_t &signature,
+    unsigned int *lpulObjectId, bool *lpbMoved, const objectdetails_t *prefetched)
 {
 	ECRESULT er;
 	objectdetails_t details;
@@ -2459,7 +2526,7 @@ ECRESULT ECUserManagement::MoveOrCreateLocalObject(const objectsignature_t &sign
 	 */
 	/* We don't support moving entire companies, create it. */
 	if (signature.id.objclass == CONTAINER_COMPANY) {
-		er = CreateLocalObject(signature, &ulObjectId);
+		er = CreateLocalObject(signature, &ulObjectId, prefetched);
 		if (er != erSuccess)
 			return er;
 		goto done;
@@ -2472,7 +2539,7 @@ ECRESULT ECUserManagement::MoveOrCreateLocalObject(const objectsignature_t &sign
 		// function returns not found if object is deleted or really not found (same thing)
 		er = UpdateObjectclassOrDelete(signature.id, &ulObjectId);
 		if (er == KCERR_NOT_FOUND) {
-			er = CreateLocalObject(signature, &ulObjectId);
+			er = CreateLocalObject(signature, &ulObjectId, prefetched);
 			if (er != erSuccess)
 				return er;
 		} else if (er == erSuccess)
@@ -144,9 +144,9 @@ private:
 	// Create GlobalAddressBook properties
 	KC_HIDDEN ECRESULT ConvertABContainerToProps(struct soap *, unsigned int id, const struct propTagArray *, struct propValArray *) const;
 
-	KC_HIDDEN ECRESULT MoveOrCreateLocalObject(const objectsignature_t &signature, unsigned int *obj_id, bool *moved);
+	KC_HIDDEN ECRESULT MoveOrCreateLocalObject(const objectsignature_t &signature, unsigned int *obj_id, bool *moved, const objectdetails_t *prefetched = nullptr);
 	KC_HIDDEN ECRESULT CreateLocalObjectSimple(const objectsignature_t &signature, unsigned int pref_id);
-	KC_HIDDEN ECRESULT CreateLocalObject(const objectsignature_t &signature, unsigned int *obj_id);
+	KC_HIDDEN ECRESULT CreateLocalObject(const objectsignature_t &signature, unsigned int *obj_id, const objectdetails_t *prefetched = nullptr);
 	KC_HIDDEN ECRESULT MoveOrDeleteLocalObject(unsigned int obj_id, objectclass_t);
 	KC_HIDDEN ECRESULT MoveLocalObject(unsigned int obj_id, objectclass_t, unsigned int company_id, const std::string &newusername);
 	KC_HIDDEN ECRESULT DeleteLocalObject(unsigned int obj_id, objectclass_t);
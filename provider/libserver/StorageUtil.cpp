@@ -149,6 +149,8 @@ ECRESULT UpdateObjectSize(ECDatabase* lpDatabase, unsigned int ulObjId, unsigned
 		auto er = lpDatabase->DoInsert(strQuery);
 		if(er != erSuccess)
 			return er;
+		if (ulObjType == MAPI_STORE)
+			gcache->SetStoreSize(ulObjId, llSize);
 		// Update cell cache for new size
 		sObjectTableKey key;
 		struct propVal sPropVal;
@@ -170,6 +172,11 @@ ECRESULT UpdateObjectSize(ECDatabase* lpDatabase, unsigned int ulObjId, unsigned
 	auto er = lpDatabase->DoUpdate(strQuery, &ulAffRows);
 	if (er != erSuccess)
 		return er;
+	if (ulObjType == MAPI_STORE && ulAffRows == 1)
+		gcache->UpdateStoreSize(ulObjId, updateAction == UPDATE_ADD ? llSize : -llSize);
+	else if (ulObjType == MAPI_STORE)
+		/* Row missing, or the subtraction would have gone below zero */
+		gcache->DelStoreSize(ulObjId);
 	er = gcache->UpdateCell(ulObjId, ulPropTag, (updateAction == UPDATE_ADD ? llSize : -llSize));
 	if (er != erSuccess)
 		ec_log_debug("Unable to update %d: %s (%x)", ulObjId, GetMAPIErrorMessage(kcerr_to_mapierr(er)), er);
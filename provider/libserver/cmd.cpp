@@ -14,6 +14,7 @@
 #include <memory>
 #include <new>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 #include <cstdint>
@@ -622,6 +623,16 @@ static ECRESULT ECLicense_Auth(const void *data, size_t dsize, std::string &rsp_
 	return licstream_enc(d.data(), d.size(), rsp_enc);
 }
 
+/*
+ * Latency histogram for a SOAP call. Callers keep the result in a static
+ * variable, so the registry is only searched for the first call.
+ */
+static latency_histogram *soap_histogram(const char *fname)
+{
+	return g_lpSessionManager->m_stats->histogram("soap_"s + fname,
+	       "Latency of "s + fname + " calls", {"db", "attachment", "send"});
+}
+
 /**
  * logon: log on and create a session with provided credentials
  */
@@ -635,6 +646,8 @@ int KCmdService::logon(const char *user, const char *pass,
 	soap_info(soap)->st.rh1_wall_start = time_point::clock::now();
 	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &soap_info(soap)->st.rh1_cpu[0]);
 	soap_info(soap)->st.func = __func__;
+	static auto hist = soap_histogram(__func__);
+	soap_info(soap)->st.hist = hist;
 	ECSession	*lpecSession = NULL;
 	ECSESSIONID	sessionID = 0;
 	GUID sServerGuid{};
@@ -747,6 +760,8 @@ int KCmdService::ssoLogon(ULONG64 ulSessionId, const char *szUsername,
 	soap_info(soap)->st.rh1_wall_start = time_point::clock::now();
 	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &soap_info(soap)->st.rh1_cpu[0]);
 	soap_info(soap)->st.func = __func__;
+	static auto hist = soap_histogram(__func__);
+	soap_info(soap)->st.hist = hist;
 	ECRESULT		er = KCERR_LOGON_FAILED;
 	ECAuthSession	*lpecAuthSession = NULL;
 	ECSession		*lpecSession = NULL;
@@ -900,6 +915,8 @@ int KCmdService::logoff(ULONG64 ulSessionId, unsigned int *result)
 	soap_info(soap)->st.rh1_wall_start = time_point::clock::now();
 	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &soap_info(soap)->st.rh1_cpu[0]);
 	soap_info(soap)->st.func = __func__;
+	static auto hist = soap_histogram(__func__);
+	soap_info(soap)->st.hist = hist;
 	auto er = g_lpSessionManager->ValidateSession(soap, ulSessionId, &lpecSession);
 	if(er != erSuccess)
 		goto exit;
@@ -935,6 +952,8 @@ int KCmdService::fname(ULONG64 ulSessionId, ##__VA_ARGS__) \
 	}); \
 	const char *szFname = #fname; \
 	soap_info(soap)->st.func = szFname; \
+	static auto xx_hist = soap_histogram(szFname); \
+	soap_info(soap)->st.hist = xx_hist; \
 	ECSession *lpecSession = nullptr; \
 	auto er = g_lpSessionManager->ValidateSession(soap, ulSessionId, &lpecSession); \
 	if (er != erSuccess) { \
@@ -980,17 +999,97 @@ int KCmdService::fname(ULONG64 ulSessionId, ##__VA_ARGS__) \
 /* Hold the status of the softdelete purge system */
 static std::atomic<bool> g_bPurgeSoftDeleteStatus{false};
 
+/*
+ * Hard-delete the objects selected by @strQuery (which must select h.id
+ * from "hierarchy AS h" and end in a WHERE clause) in batches of at most
+ * softdelete_batch_size objects. @what names them in the log ("stores",
+ * "folders", "messages"). Every batch commits on its own and
+ * objects are taken in id order, so user traffic only ever waits for one
+ * batch, and a purge that is interrupted leaves nothing half-done: the
+ * next run just finds fewer objects. After each batch, the purge sleeps
+ * for softdelete_batch_pause percent of the time the batch took.
+ */
+static ECRESULT PurgeSoftDeleteBatches(ECSession *lpecSession,
+    ECDatabase *lpDatabase, const char *what, const std::string &strQuery,
+    unsigned int ulDeleteFlags, enum SCName counter,
+    unsigned int *lpulCount, bool *lpbExit)
+{
+	auto sesmgr = lpecSession->GetSessionManager();
+	auto cfg = sesmgr->GetConfig();
+	auto batch_size = std::max(1U, atoui(cfg->GetSetting("softdelete_batch_size")));
+	auto pause_pct = atoui(cfg->GetSetting("softdelete_batch_pause"));
+	unsigned int last_id = 0;
+	DB_RESULT lpDBResult;
+	DB_ROW lpDBRow;
+
+	auto er = lpDatabase->DoSelect("SELECT COUNT(*) FROM (" + strQuery + ") AS c", &lpDBResult);
+	if (er != erSuccess)
+		return er;
+	lpDBRow = lpDBResult.fetch_row();
+	if (lpDBRow == nullptr || lpDBRow[0] == nullptr || atoui(lpDBRow[0]) == 0)
+		return erSuccess;
+	sesmgr->m_stats->set(SCN_SOFTDELETE_PENDING, atoui(lpDBRow[0]));
+	ec_log_info("Starting to purge %s %s", lpDBRow[0], what);
+	auto reset_pending = make_scope_success([&]() { sesmgr->m_stats->set(SCN_SOFTDELETE_PENDING, 0); });
+
+	while (!*lpbExit) {
+		ECListInt lObjectIds;
+		er = lpDatabase->DoSelect(strQuery + " AND h.id>" + stringify(last_id) +
+		     " ORDER BY h.id LIMIT " + stringify(batch_size), &lpDBResult);
+		if (er != erSuccess)
+			return er;
+		while ((lpDBRow = lpDBResult.fetch_row()) != nullptr)
+			if (lpDBRow[0] != nullptr)
+				lObjectIds.emplace_back(atoui(lpDBRow[0]));
+		// free before we call DeleteObjects()
+		lpDBResult = DB_RESULT();
+		if (lObjectIds.empty())
+			break;
+		last_id = lObjectIds.back();
+
+		auto start = std::chrono::steady_clock::now();
+		if (ulDeleteFlags & EC_DELETE_STORE) {
+			/* DeleteObjects handles one store at a time */
+			for (auto id : lObjectIds) {
+				ec_log_info(" purge store (%d)", id);
+				er = DeleteObjects(lpecSession, lpDatabase, id, ulDeleteFlags, 0, false, false);
+				if (er != erSuccess)
+					return er;
+			}
+		} else {
+			er = DeleteObjects(lpecSession, lpDatabase, &lObjectIds, ulDeleteFlags, 0, false, false);
+			if (er != erSuccess)
+				return er;
+		}
+		auto took = std::chrono::steady_clock::now() - start;
+		auto n = lObjectIds.size();
+		*lpulCount += n;
+		sesmgr->m_stats->inc(counter, static_cast<LONGLONG>(n));
+		sesmgr->m_stats->inc(SCN_SOFTDELETE_PENDING, -static_cast<LONGLONG>(n));
+		sesmgr->m_stats->inc(SCN_SOFTDELETE_BATCHES);
+		if (n < batch_size)
+			break;
+
+		/* Sleep in slices, so that a shutdown is not held up */
+		auto pause = took * pause_pct / 100;
+		while (pause > decltype(pause)::zero() && !*lpbExit) {
+			auto slice = std::min<decltype(pause)>(pause, std::chrono::milliseconds(100));
+			std::this_thread::sleep_for(slice);
+			pause -= slice;
+		}
+	}
+	return *lpbExit ? KCERR_USER_CANCEL : erSuccess;
+}
+
 static ECRESULT PurgeSoftDelete(ECSession *lpecSession,
     unsigned int ulLifetime, unsigned int *lpulMessages,
     unsigned int *lpulFolders, unsigned int *lpulStores, bool *lpbExit)
 {
 	ECRESULT 		er = erSuccess;
 	ECDatabase*		lpDatabase = NULL;
-	DB_RESULT lpDBResult;
-	DB_ROW			lpDBRow = NULL;
 	FILETIME		ft;
-	ECListInt		lObjectIds;
 	bool 			bExitDummy = false;
+	unsigned int ulStores = 0, ulFolders = 0, ulMessages = 0;
 
 	auto laters = make_scope_success([&]() {
 		if (er != KCERR_BUSY)
@@ -1005,6 +1104,9 @@ static ECRESULT PurgeSoftDelete(ECSession *lpecSession,
 	er = lpecSession->GetDatabase(&lpDatabase);
 	if (er != erSuccess)
 		return er;
+	auto stats = lpecSession->GetSessionManager()->m_stats;
+	stats->set(SCN_SOFTDELETE_RUNNING, 1);
+	auto not_running = make_scope_success([&]() { stats->set(SCN_SOFTDELETE_RUNNING, 0); });
 
 	// Although it doesn't make sense for the message deleter to include EC_DELETE_FOLDERS, it doesn't hurt either, since they shouldn't be there
 	// and we really want to delete all the softdeleted items anyway.
@@ -1013,95 +1115,29 @@ static ECRESULT PurgeSoftDelete(ECSession *lpecSession,
 	ft = UnixTimeToFileTime(FileTimeToUnixTime(ft) - ulLifetime);
 
 	// Select softdeleted stores (ignore softdelete_lifetime setting because a store can't be restored anyway)
-	auto strQuery = "SELECT id FROM hierarchy WHERE parent IS NULL AND (flags&" + stringify(MSGFLAG_DELETED) + ")=" + stringify(MSGFLAG_DELETED) + " AND type=" + stringify(MAPI_STORE);
-	er = lpDatabase->DoSelect(strQuery, &lpDBResult);
-	if(er != erSuccess)
-		return er;
-
-	auto ulStores = lpDBResult.get_num_rows();
-	if(ulStores > 0)
-	{
-		while ((lpDBRow = lpDBResult.fetch_row()) != nullptr) {
-			if(lpDBRow == NULL || lpDBRow[0] == NULL)
-				continue;
-			lObjectIds.emplace_back(atoui(lpDBRow[0]));
-		}
-		// free before we call DeleteObjects()
-		lpDBResult = DB_RESULT();
-		if (*lpbExit)
-			return er = KCERR_USER_CANCEL;
-
-		ec_log_info("Starting to purge %zu stores", lObjectIds.size());
-		for (auto iterObjectId = lObjectIds.cbegin();
-		     iterObjectId != lObjectIds.cend() && !*lpbExit;
-		     ++iterObjectId)
-		{
-			ec_log_info(" purge store (%d)", *iterObjectId);
-
-			er = DeleteObjects(lpecSession, lpDatabase, *iterObjectId, ulDeleteFlags|EC_DELETE_STORE, 0, false, false);
-			if (er != erSuccess)
-				return ec_perror("Error while removing softdelete store objects", er);
-		}
-		ec_log_info("Store purge done");
-	}
+	auto strQuery = "SELECT h.id FROM hierarchy AS h WHERE h.parent IS NULL AND (h.flags&" + stringify(MSGFLAG_DELETED) + ")=" + stringify(MSGFLAG_DELETED) + " AND h.type=" + stringify(MAPI_STORE);
+	er = PurgeSoftDeleteBatches(lpecSession, lpDatabase, "stores", strQuery,
+	     ulDeleteFlags | EC_DELETE_STORE, SCN_SOFTDELETE_STORES, &ulStores, lpbExit);
+	if (er != erSuccess && er != KCERR_USER_CANCEL)
+		return ec_perror("Error while removing softdelete store objects", er);
 	if (*lpbExit)
 		return er = KCERR_USER_CANCEL;
 
 	// Select softdeleted folders
 	strQuery = "SELECT h.id FROM hierarchy AS h JOIN properties AS p ON p.hierarchyid=h.id AND p.tag="+stringify(PROP_ID(PR_DELETED_ON))+" AND p.type="+stringify(PROP_TYPE(PR_DELETED_ON))+" WHERE (h.flags&"+stringify(MSGFLAG_DELETED)+")="+stringify(MSGFLAG_DELETED)+" AND p.val_hi<="+stringify(ft.dwHighDateTime)+" AND h.type="+stringify(MAPI_FOLDER);
-	er = lpDatabase->DoSelect(strQuery, &lpDBResult);
-	if(er != erSuccess)
-		return er;
-
-	auto ulFolders = lpDBResult.get_num_rows();
-	if(ulFolders > 0)
-	{
-		// Remove all items
-		lObjectIds.clear();
-		while ((lpDBRow = lpDBResult.fetch_row()) != nullptr) {
-			if(lpDBRow == NULL || lpDBRow[0] == NULL)
-				continue;
-			lObjectIds.emplace_back(atoui(lpDBRow[0]));
-		}
-		// free before we call DeleteObjects()
-		lpDBResult = DB_RESULT();
-		if (*lpbExit)
-			return er = KCERR_USER_CANCEL;
-		ec_log_info("Starting to purge %zu folders", lObjectIds.size());
-		er = DeleteObjects(lpecSession, lpDatabase, &lObjectIds, ulDeleteFlags, 0, false, false);
-		if (er != erSuccess)
-			return ec_perror("Error while removing softdelete folder objects", er);
-		ec_log_info("Folder purge done");
-	}
+	er = PurgeSoftDeleteBatches(lpecSession, lpDatabase, "folders", strQuery,
+	     ulDeleteFlags, SCN_SOFTDELETE_FOLDERS, &ulFolders, lpbExit);
+	if (er != erSuccess && er != KCERR_USER_CANCEL)
+		return ec_perror("Error while removing softdelete folder objects", er);
 	if (*lpbExit)
 		return er = KCERR_USER_CANCEL;
 
 	// Select softdeleted messages
 	strQuery = "SELECT h.id FROM hierarchy AS h JOIN properties AS p ON p.hierarchyid=h.id AND p.tag="+stringify(PROP_ID(PR_DELETED_ON))+" AND p.type="+stringify(PROP_TYPE(PR_DELETED_ON))+" WHERE (h.flags&"+stringify(MSGFLAG_DELETED)+")="+stringify(MSGFLAG_DELETED)+" AND h.type="+stringify(MAPI_MESSAGE)+" AND p.val_hi<="+stringify(ft.dwHighDateTime);
-	er = lpDatabase->DoSelect(strQuery, &lpDBResult);
-	if(er != erSuccess)
-		return er;
-
-	auto ulMessages = lpDBResult.get_num_rows();
-	if(ulMessages > 0)
-	{
-		// Remove all items
-		lObjectIds.clear();
-		while ((lpDBRow = lpDBResult.fetch_row()) != nullptr) {
-			if(lpDBRow == NULL || lpDBRow[0] == NULL)
-				continue;
-			lObjectIds.emplace_back(atoui(lpDBRow[0]));
-		}
-		// free before we call DeleteObjects()
-		lpDBResult = DB_RESULT();
-		if (*lpbExit)
-			return er = KCERR_USER_CANCEL;
-		ec_log_info("Starting to purge %zu messages", lObjectIds.size());
-		er = DeleteObjects(lpecSession, lpDatabase, &lObjectIds, ulDeleteFlags, 0, false, false);
-		if (er != erSuccess)
-			return ec_perror("Error while removing softdelete message objects", er);
-		ec_log_info("Message purge done");
-	}
+	er = PurgeSoftDeleteBatches(lpecSession, lpDatabase, "messages", strQuery,
+	     ulDeleteFlags, SCN_SOFTDELETE_MESSAGES, &ulMessages, lpbExit);
+	if (er != erSuccess && er != KCERR_USER_CANCEL)
+		return ec_perror("Error while removing softdelete message objects", er);
 
 	// these stats are only from toplevel objects
 	if(lpulFolders)
@@ -3329,6 +3365,7 @@ static ECRESULT OpenTable(ECSession *lpecSession, entryId sEntryId,
 	case TABLETYPE_STATS_USERS:
 	case TABLETYPE_STATS_COMPANY:
 	case TABLETYPE_STATS_SERVERS:
+	case TABLETYPE_STATS_LATENCY:
 		er = lpecSession->GetTableManager()->OpenStatsTable(ulTableType, ulFlags, &ulTableId);
 		if (er != erSuccess)
 			return er;
@@ -6541,6 +6578,7 @@ static ECRESULT MoveObjects(ECSession *lpSession, ECDatabase *lpDatabase,
  * @param[in] bDoNotification true if you want to send object notifications.
  * @param[in] bDoTableNotification true if you want to send table notifications.
  * @param[in] ulSyncId Client sync identify.
+ * @param[out] lpulNewObjectId Optional; receives the id of the new object.
  *
  * @FIXME It is possible to send notifications before a commit, this can give issues with the cache!
  * 			This function should be refactored
@@ -6548,7 +6586,8 @@ static ECRESULT MoveObjects(ECSession *lpSession, ECDatabase *lpDatabase,
 static ECRESULT CopyObject(ECSession *lpecSession,
     ECAttachmentStorage *lpAttachmentStorage, unsigned int ulObjId,
     unsigned int ulDestFolderId, bool bIsRoot, bool bDoNotification,
-    bool bDoTableNotification, unsigned int ulSyncId)
+    bool bDoTableNotification, unsigned int ulSyncId,
+    unsigned int *lpulNewObjectId = nullptr)
 {
 	ECDatabase		*lpDatabase = NULL;
 	DB_RESULT lpDBResult;
@@ -6782,6 +6821,8 @@ static ECRESULT CopyObject(ECSession *lpecSession,
 		}
 	}
 
+	if (lpulNewObjectId != nullptr)
+		*lpulNewObjectId = ulNewObjectId;
 	g_lpSessionManager->GetCacheManager()->Update(fnevObjectModified, ulDestFolderId);
 	if (!bDoNotification)
 		return erSuccess;
@@ -7049,6 +7090,68 @@ SOAP_ENTRY_START(copyObjects, *result, struct entryList *aMessages,
 }
 SOAP_ENTRY_END()
 
+/**
+ * Place a copy of one stored message into each of a set of folders. This
+ * is used for delivering the same mail to many recipients on one server:
+ * the properties are duplicated inside the database and the attachments
+ * are shared through the single-instance attachment storage, so the
+ * client has to upload the message only once.
+ *
+ * Every folder is processed in its own transaction. A copy that could not
+ * be made is reported in lpErrors and leaves an empty entryid at its
+ * position in lpEntryIds; the call itself still succeeds.
+ */
+SOAP_ENTRY_START(deliverCopies, lpsResponse->er, const entryId &sEntryId,
+    struct entryList *lpFolders, unsigned int ulFlags,
+    struct deliverCopiesResponse *lpsResponse)
+{
+	unsigned int ulObjId = 0;
+	USE_DATABASE_NORESULT();
+
+	if (lpFolders == nullptr || ulFlags != 0)
+		return KCERR_INVALID_PARAMETER;
+	er = lpecSession->GetObjectFromEntryId(&sEntryId, &ulObjId);
+	if (er != erSuccess)
+		return er_lerrf(er, "deliverCopies: cannot resolve source message");
+
+	auto gcache = g_lpSessionManager->GetCacheManager();
+	lpsResponse->lpEntryIds = soap_new_entryList(soap);
+	lpsResponse->lpEntryIds->__size = lpFolders->__size;
+	lpsResponse->lpEntryIds->__ptr  = soap_new_entryId(soap, lpFolders->__size);
+	lpsResponse->lpErrors = soap_new_mv_long(soap);
+	lpsResponse->lpErrors->__size = lpFolders->__size;
+	lpsResponse->lpErrors->__ptr  = soap_new_unsignedInt(soap, lpFolders->__size);
+
+	for (int i = 0; i < lpFolders->__size; ++i) {
+		unsigned int ulDestFolderId = 0, ulNewObjectId = 0, ulGrandParent = 0;
+		const auto &sFolder = lpFolders->__ptr[i];
+		auto &ferr = lpsResponse->lpErrors->__ptr[i];
+		kd_trans dtx;
+
+		ferr = BeginLockFolders(lpDatabase, std::set<EntryId>{EntryId(&sEntryId), EntryId(&sFolder)}, LOCK_EXCLUSIVE, dtx, ferr);
+		if (ferr == erSuccess)
+			ferr = lpecSession->GetObjectFromEntryId(&sFolder, &ulDestFolderId);
+		if (ferr == erSuccess)
+			ferr = lpecSession->GetSecurity()->CheckPermission(ulDestFolderId, ecSecurityCreate);
+		if (ferr == erSuccess)
+			ferr = CopyObject(lpecSession, nullptr, ulObjId,
+			       ulDestFolderId, true, true, true, 0, &ulNewObjectId);
+		if (ferr == erSuccess)
+			ferr = WriteLocalCommitTimeMax(nullptr, lpDatabase, ulDestFolderId, nullptr);
+		if (ferr == erSuccess)
+			ferr = dtx.commit();
+		if (ferr != erSuccess) {
+			er_lerrf(ferr, "deliverCopies: copy of message %u into folder #%d failed", ulObjId, i);
+			continue;
+		}
+		gcache->GetParent(ulDestFolderId, &ulGrandParent);
+		g_lpSessionManager->UpdateTables(ECKeyTable::TABLE_ROW_MODIFY, 0, ulGrandParent, ulDestFolderId, MAPI_FOLDER);
+		ferr = gcache->GetEntryIdFromObject(ulNewObjectId, soap, 0, &lpsResponse->lpEntryIds->__ptr[i]);
+	}
+	return erSuccess;
+}
+SOAP_ENTRY_END()
+
 SOAP_ENTRY_START(copyFolder, *result, const entryId &sEntryId,
     const entryId &sDestFolderId, const char *lpszNewFolderName,
     unsigned int ulFlags, unsigned int ulSyncId, unsigned int *result)
@@ -7432,7 +7535,11 @@ SOAP_ENTRY_START(unhookStore, *result, unsigned int ulStoreType,
 		ec_log_err("unhookStore(): more than expected");
 		return er = KCERR_COLLISION;
 	}
-	return dtx.commit();
+	er = dtx.commit();
+	if (er != erSuccess)
+		return er;
+	g_lpSessionManager->GetCacheManager()->DelUserStore(ulUserId);
+	return erSuccess;
 }
 SOAP_ENTRY_END()
 
@@ -7534,7 +7641,10 @@ SOAP_ENTRY_START(hookStore, *result, unsigned int ulStoreType,
 	if (er != erSuccess)
 		return er;
 	// remove store cache item
-	g_lpSessionManager->GetCacheManager()->Update(fnevObjectMoved, atoi(lpDBRow[3]));
+	auto cache = g_lpSessionManager->GetCacheManager();
+	cache->Update(fnevObjectMoved, atoi(lpDBRow[3]));
+	cache->DelUserStore(ulUserId);
+	cache->DelUserStore(atoui(lpDBRow[2]));
 	return erSuccess;
 }
 SOAP_ENTRY_END()
@@ -2,6 +2,7 @@
  * SPDX-License-Identifier: AGPL-3.0-only
  * Copyright 2005 - 2016 Zarafa and its licensors
  */
+#include <functional>
 #include <mutex>
 #include <utility>
 #include <string>
@@ -161,14 +162,25 @@ bool LDAPCache::isDNInList(const dn_list_t &lpList, const std::string &dn)
 	return false;
 }
 
+LDAPCache::shard &LDAPCache::shard_for(const objectid_t &id)
+{
+	return m_shards[(std::hash<std::string>()(id.id) + id.objclass) % NUM_SHARDS];
+}
+
+LDAPCache::shard &LDAPCache::shard_for(const std::string &key)
+{
+	return m_shards[std::hash<std::string>()(key) % NUM_SHARDS];
+}
+
 std::pair<bool, signatures_t> LDAPCache::get_parents(userobject_relation_t rel,
     const objectid_t &child)
 {
-	ulock_normal lock(m_parents_lock);
+	auto &sh = shard_for(child);
+	ulock_normal lock(sh.lock);
 	signatures_t sigstor;
 	timed_sglist_t *sigp = nullptr;
-	auto ci = m_parent_cache.find(rel);
-	if (ci == m_parent_cache.cend())
+	auto ci = sh.parents.find(rel);
+	if (ci == sh.parents.cend())
 		return {false, sigstor};
 	auto &cac = ci->second;
 	auto ret = cac.GetCacheItem(child, &sigp);
@@ -182,9 +194,10 @@ std::pair<bool, signatures_t> LDAPCache::get_parents(userobject_relation_t rel,
 void LDAPCache::set_parents(userobject_relation_t rel, const objectid_t &child,
     const signatures_t &sig, ECConfig *cfg)
 {
-	std::lock_guard<std::mutex> lock(m_parents_lock);
-	auto ci = m_parent_cache.find(rel);
-	if (ci == m_parent_cache.cend()) {
+	auto &sh = shard_for(child);
+	std::lock_guard<std::mutex> lock(sh.lock);
+	auto ci = sh.parents.find(rel);
+	if (ci == sh.parents.cend()) {
 		size_t size = 256 << 10;
 		unsigned int lft = 300;
 		if (cfg != nullptr) {
@@ -195,8 +208,30 @@ void LDAPCache::set_parents(userobject_relation_t rel, const objectid_t &child,
 			if (v != nullptr)
 				lft = strtoul(v, nullptr, 0) * 60;
 		}
-		ci = m_parent_cache.emplace(rel, parent_cache_t("ldapcache-parent", size, lft)).first;
+		ci = sh.parents.emplace(rel, parent_cache_t("ldapcache-parent", size / NUM_SHARDS, lft)).first;
 	}
 	auto &cac = ci->second;
 	cac.AddCacheItem(child, sig);
 }
+
+bool LDAPCache::is_unknown(const std::string &key)
+{
+	auto &sh = shard_for(key);
+	std::lock_guard<std::mutex> lock(sh.lock);
+	unknown_name_t *e = nullptr;
+	return sh.unknown != nullptr && sh.unknown->GetCacheItem(key, &e) == erSuccess;
+}
+
+void LDAPCache::set_unknown(const std::string &key, ECConfig *cfg)
+{
+	auto lft = atoui(cfg->GetSetting("ldap_negative_cache_lifetime"));
+	if (lft == 0)
+		return;
+	auto &sh = shard_for(key);
+	std::lock_guard<std::mutex> lock(sh.lock);
+	if (sh.unknown == nullptr) {
+		size_t size = strtoull(cfg->GetSetting("ldap_negative_cache_size"), nullptr, 0);
+		sh.unknown = std::make_unique<unknown_cache_t>("ldapcache-unknown", size / NUM_SHARDS, lft);
+	}
+	sh.unknown->AddCacheItem(key, unknown_name_t());
+}
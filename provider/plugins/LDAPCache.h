@@ -8,8 +8,10 @@
 #pragma once
 #include <list>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <kopano/ECDefs.h>
 #include <kopano/pcuser.hpp>
@@ -64,10 +66,30 @@ private:
 		timed_sglist_t(signatures_t &&a) : signatures_t(std::move(a)) {}
 	};
 
+	/* Marker for names that LDAP did not know about */
+	class unknown_name_t : public CacheEntry {};
+
 	private:
 	typedef ECCache<std::map<objectid_t, timed_sglist_t>> parent_cache_t;
-	std::mutex m_parents_lock;
-	std::map<userobject_relation_t, parent_cache_t> m_parent_cache;
+	typedef ECCache<std::unordered_map<std::string, unknown_name_t>> unknown_cache_t;
+
+	/*
+	 * The membership and unknown-name caches are shared by all plugin
+	 * instances, i.e. by all server threads. They are split over a
+	 * number of shards, each with its own lock, so that lookups for
+	 * different objects do not queue up behind one another. Each shard
+	 * gets an equal part of the configured cache size.
+	 */
+	static constexpr unsigned int NUM_SHARDS = 16;
+	struct shard {
+		std::mutex lock;
+		std::map<userobject_relation_t, parent_cache_t> parents;
+		std::unique_ptr<unknown_cache_t> unknown;
+	};
+	shard m_shards[NUM_SHARDS];
+
+	shard &shard_for(const objectid_t &);
+	shard &shard_for(const std::string &);
 
 public:
 	/**
@@ -148,6 +170,14 @@ public:
 
 	std::pair<bool, signatures_t> get_parents(userobject_relation_t, const objectid_t &);
 	void set_parents(userobject_relation_t, const objectid_t &, const signatures_t &, Config * = nullptr);
+
+	/**
+	 * Negative cache for name lookups: @key (made up by the caller from
+	 * the lookup parameters) recently produced no result. Entries expire
+	 * after ldap_negative_cache_lifetime seconds.
+	 */
+	bool is_unknown(const std::string &key);
+	void set_unknown(const std::string &key, Config *);
 };
 
 /** @} */
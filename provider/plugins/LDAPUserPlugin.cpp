@@ -7,6 +7,7 @@
 #endif
 #include <kopano/platform.h>
 #include <chrono>
+#include <deque>
 #include <exception>
 #include <memory>
 #include <string>
@@ -441,8 +442,11 @@ LDAPUserPlugin::LDAPUserPlugin(std::mutex &pluginlock,
 		{ "ldap_object_search_filter", "", CONFIGSETTING_RELOADABLE },
 		{ "ldap_filter_cutoff_elements", "1000", CONFIGSETTING_RELOADABLE },
 		{ "ldap_page_size", "1000", CONFIGSETTING_RELOADABLE }, // MaxPageSize in ADS defaults to 1000
+		{"ldap_search_window", "32", CONFIGSETTING_RELOADABLE},
 		{"ldap_membership_cache_size", "256k", CONFIGSETTING_SIZE},
 		{"ldap_membership_cache_lifetime", "5", 0},
+		{"ldap_negative_cache_size", "1M", CONFIGSETTING_SIZE},
+		{"ldap_negative_cache_lifetime", "60", 0},
 
 		/* Aliases, they should be loaded through the propmap directive */
 		{ "0x6788001E", "", 0, CONFIGGROUP_PROPMAP },								/* PR_EC_EXCHANGE_DN */
@@ -1251,21 +1255,129 @@ LDAPUserPlugin::objectDNtoObjectSignatures(objectclass_t objclass,
     const std::list<std::string> &dn)
 {
 	signatures_t signatures;
-
-	for (const auto &i : dn) {
+	auto resolve_one = [&](const std::string &i) {
 		try {
 			signatures.emplace_back(objectDNtoObjectSignature(objclass, i));
 		} catch (const objectnotfound &e) {
 			// resolve failed, drop entry
-			continue;
 		} catch (const ldap_error &e) {
-			if(LDAP_NAME_ERROR(e.GetLDAPError()))
-				continue;
-			throw;
+			if (!LDAP_NAME_ERROR(e.GetLDAPError()))
+				throw;
 		} catch (const std::exception &e) {
 			// query failed, drop entry
+		}
+	};
+
+	/*
+	 * Every DN is a base search of its own. Rather than waiting for each
+	 * round trip in turn, keep up to ldap_search_window of them
+	 * outstanding on the connection. libldap queues the replies, which
+	 * are collected in request order so that the result keeps the order
+	 * of @dn.
+	 */
+	size_t window = atoui(m_config->GetSetting("ldap_search_window"));
+	auto done = dn.cbegin();
+	if (window <= 1 || dn.size() <= 1) {
+		for (; done != dn.cend(); ++done)
+			resolve_one(*done);
+		return signatures;
+	}
+
+	auto ldap_filter = getSearchFilter(objclass);
+	auto request_attrs = std::make_unique<attrArray>(15);
+	/* Needed for GetObjectIdForEntry() */
+	CONFIG_TO_ATTR(request_attrs, class_attr, "ldap_object_type_attribute");
+	CONFIG_TO_ATTR(request_attrs, nonactive_attr, "ldap_nonactive_attribute");
+	CONFIG_TO_ATTR(request_attrs, resource_attr, "ldap_resource_type_attribute");
+	CONFIG_TO_ATTR(request_attrs, security_attr, "ldap_group_security_attribute");
+	CONFIG_TO_ATTR(request_attrs, user_unique_attr, "ldap_user_unique_attribute");
+	CONFIG_TO_ATTR(request_attrs, group_unique_attr, "ldap_group_unique_attribute");
+	CONFIG_TO_ATTR(request_attrs, company_unique_attr, "ldap_company_unique_attribute");
+	CONFIG_TO_ATTR(request_attrs, addresslist_unique_attr, "ldap_addresslist_unique_attribute");
+	CONFIG_TO_ATTR(request_attrs, dynamicgroup_unique_attr, "ldap_dynamicgroup_unique_attribute");
+	CONFIG_TO_ATTR(request_attrs, modify_attr, "ldap_last_modification_attribute");
+
+	if (m_ldap == nullptr)
+		m_ldap = ConnectLDAP(nullptr, nullptr);
+	std::deque<int> pending;
+	auto next = dn.cbegin();
+	/*
+	 * When the connection gives trouble, give up on the window and
+	 * leave the remainder to the one-at-a-time path, which knows how
+	 * to reconnect.
+	 */
+	auto bail = [&](const char *what, int rc) {
+		ec_log_err("K-1588: LDAP %s: %s. Resolving the remaining %zu DNs one by one.",
+			what, ldap_err2string(rc), static_cast<size_t>(std::distance(done, dn.cend())));
+		for (auto msgid : pending)
+			ldap_abandon_ext(m_ldap, msgid, nullptr, nullptr);
+		pending.clear();
+		for (; done != dn.cend(); ++done)
+			resolve_one(*done);
+	};
+
+	while (done != dn.cend()) {
+		for (; next != dn.cend() && pending.size() < window; ++next) {
+			int msgid = 0;
+			auto rc = ldap_search_ext(m_ldap, next->c_str(), LDAP_SCOPE_BASE,
+			          ldap_filter.empty() ? nullptr : ldap_filter.c_str(),
+			          const_cast<char **>(request_attrs->get()), FETCH_ATTR_VALS,
+			          nullptr, nullptr, &m_timeout, 0, &msgid);
+			if (rc != LDAP_SUCCESS) {
+				bail("ldap_search_ext", rc);
+				return signatures;
+			}
+			pending.emplace_back(msgid);
+		}
+
+		auto_free_ldap_message res;
+		auto tstart = std::chrono::steady_clock::now();
+		auto rc = ldap_result(m_ldap, pending.front(), LDAP_MSG_ALL, &m_timeout, &~res);
+		if (rc <= 0) {
+			m_lpStatsCollector->inc(SCN_LDAP_SEARCH_FAILED);
+			bail("ldap_result", rc == 0 ? LDAP_TIMEOUT : rc);
+			return signatures;
+		}
+		pending.pop_front();
+		auto llelapsedtime = dur2us(decltype(tstart)::clock::now() - tstart);
+		m_lpStatsCollector->inc(SCN_LDAP_SEARCH);
+		m_lpStatsCollector->inc(SCN_LDAP_SEARCH_TIME, llelapsedtime);
+		m_lpStatsCollector->Max(SCN_LDAP_SEARCH_TIME_MAX, llelapsedtime);
+
+		int err = LDAP_SUCCESS;
+		rc = ldap_parse_result(m_ldap, res, &err, nullptr, nullptr, nullptr, nullptr, 0);
+		if (rc != LDAP_SUCCESS ||
+		    (err != LDAP_SUCCESS && !LDAP_NAME_ERROR(err))) {
+			/*
+			 * Not a plain "no such object": retry this DN and the
+			 * rest one by one, so that a lasting error reaches the
+			 * caller as ldap_error instead of leaving out members.
+			 */
+			m_lpStatsCollector->inc(SCN_LDAP_SEARCH_FAILED);
+			bail("search", rc != LDAP_SUCCESS ? rc : err);
+			return signatures;
+		}
+		auto &cur = *done++;
+		if (err != LDAP_SUCCESS) {
+			/* Like objectDNtoObjectSignature failing: drop the entry */
+			LOG_PLUGIN_DEBUG("Unable to resolve DN \"%s\": %s", cur.c_str(),
+				ldap_err2string(err));
 			continue;
 		}
+		if (ldap_count_entries(m_ldap, res) != 1)
+			continue;
+		auto entry = ldap_first_entry(m_ldap, res);
+		try {
+			auto objectid = GetObjectIdForEntry(entry);
+			if (objectid.id.empty()) {
+				ec_log_warn("Unique id not found for DN: %s", cur.c_str());
+				continue;
+			}
+			signatures.emplace_back(std::move(objectid),
+				modify_attr != nullptr ? getLDAPAttributeValue(modify_attr, entry) : std::string());
+		} catch (const data_error &e) {
+			ec_log_warn("Unable to get object id: %s", e.what());
+		}
 	}
 	return signatures;
 }
@@ -1347,6 +1459,12 @@ objectsignature_t LDAPUserPlugin::resolveName(objectclass_t objclass,
 		LOG_PLUGIN_DEBUG("%s Class %x, Name %s, Company xid:\"%s\"", __FUNCTION__,
 			objclass, name.c_str(), bin2txt(company.id).c_str());
 
+	auto unknown_key = "resolve:" + stringify_hex(objclass) + ":" + bin2hex(company.id) + ":" + name;
+	if (m_lpCache->is_unknown(unknown_key)) {
+		m_lpStatsCollector->inc(SCN_LDAP_NEGATIVE_CACHE_HIT);
+		throw objectnotfound(name + " not found in LDAP (cached)");
+	}
+
 	switch (objclass) {
 	case OBJECTCLASS_UNKNOWN:
 		if (loginname_attr)
@@ -1410,14 +1528,18 @@ objectsignature_t LDAPUserPlugin::resolveName(objectclass_t objclass,
 	auto signatures = resolveObjectsFromAttributes(objclass,
 		std::list<std::string>{m_iconvrev->convert(name)},
 		attrs->get(), company);
-	if (signatures.empty())
+	if (signatures.empty()) {
+		m_lpCache->set_unknown(unknown_key, m_config);
 		throw objectnotfound(name+" not found in LDAP");
+	}
 
 	// we can only resolve one name. caller should be more specific
 	if (signatures.size() > 1)
 		throw collision_error(name + " found " + stringify(signatures.size()) + " times in LDAP");
-	if (!OBJECTCLASS_COMPARE(signatures.front().id.objclass, objclass))
+	if (!OBJECTCLASS_COMPARE(signatures.front().id.objclass, objclass)) {
+		m_lpCache->set_unknown(unknown_key, m_config);
 		throw objectnotfound("No object has been found with name " + name);
+	}
 	return signatures.front();
 }
 
@@ -2106,8 +2228,11 @@ LDAPUserPlugin::getParentObjectsForObject(userobject_relation_t relation,
 	const char *member_attr_type = nullptr, *member_attr_rel = nullptr;
 
 	auto cache_result = m_lpCache->get_parents(relation, childobject);
-	if (cache_result.first)
+	if (cache_result.first) {
+		m_lpStatsCollector->inc(SCN_LDAP_MEMBERSHIP_CACHE_HIT);
 		return cache_result.second;
+	}
+	m_lpStatsCollector->inc(SCN_LDAP_MEMBERSHIP_CACHE_MISS);
 
 	switch (childobject.objclass) {
 	case OBJECTCLASS_USER:
@@ -2393,6 +2518,18 @@ LDAPUserPlugin::searchObject(const std::string &match, unsigned int ulFlags)
 {
 	std::string search_filter;
 	LOG_PLUGIN_DEBUG("%s %s flags:%x", __FUNCTION__, match.c_str(), ulFlags);
+	/*
+	 * Exact address lookups for names that do not exist (think of mail
+	 * to made-up recipients) are answered from the negative cache.
+	 */
+	std::string unknown_key;
+	if (ulFlags & EMS_AB_ADDRESS_LOOKUP) {
+		unknown_key = "search:" + stringify_hex(ulFlags) + ":" + match;
+		if (m_lpCache->is_unknown(unknown_key)) {
+			m_lpStatsCollector->inc(SCN_LDAP_NEGATIVE_CACHE_HIT);
+			throw objectnotfound(match + " not found in LDAP (cached)");
+		}
+	}
 	auto ldap_basedn = getSearchBase();
 	auto ldap_filter = getSearchFilter();
 	auto escMatch = StringEscapeSequence(m_iconvrev->convert(match));
@@ -2429,8 +2566,11 @@ LDAPUserPlugin::searchObject(const std::string &match, unsigned int ulFlags)
 	ldap_filter = "(&" + ldap_filter + search_filter + ")";
 	auto signatures = getAllObjectsByFilter(ldap_basedn, LDAP_SCOPE_SUBTREE,
 	                  ldap_filter, std::string(), false);
-	if (signatures.empty())
+	if (signatures.empty()) {
+		if (!unknown_key.empty())
+			m_lpCache->set_unknown(unknown_key, m_config);
 		throw objectnotfound(ldap_filter);
+	}
 	return signatures;
 }
 
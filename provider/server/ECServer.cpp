@@ -209,6 +209,13 @@ server_stats::server_stats(std::shared_ptr<ECConfig> cfg) :
 
 	AddStat(SCN_SESSIONGROUPS_CREATED, SCT_INTEGER, "sess_grp_created", "Number of created sessiongroups");
 	AddStat(SCN_SESSIONGROUPS_DELETED, SCT_INTEGER, "sess_grp_deleted", "Number of deleted sessiongroups");
+	AddStat(SCN_GROUP_CLOSURE_BUILDS, SCT_INTEGER, "group_closure_builds", "Number of nested group memberships resolved through the user plugin");
+	AddStat(SCN_SOFTDELETE_RUNNING, SCT_INTGAUGE, "softdelete_running", "Whether a softdelete purge is running");
+	AddStat(SCN_SOFTDELETE_PENDING, SCT_INTGAUGE, "softdelete_pending", "Objects left in the current stage of the softdelete purge");
+	AddStat(SCN_SOFTDELETE_BATCHES, SCT_INTEGER, "softdelete_batches", "Number of batches committed by the softdelete purge");
+	AddStat(SCN_SOFTDELETE_STORES, SCT_INTEGER, "softdelete_stores", "Number of stores removed by the softdelete purge");
+	AddStat(SCN_SOFTDELETE_FOLDERS, SCT_INTEGER, "softdelete_folders", "Number of folders removed by the softdelete purge");
+	AddStat(SCN_SOFTDELETE_MESSAGES, SCT_INTEGER, "softdelete_messages", "Number of messages removed by the softdelete purge");
 
 	AddStat(SCN_LDAP_CONNECTS, SCT_INTEGER, "ldap_connect", "Number of connections made to LDAP server");
 	AddStat(SCN_LDAP_RECONNECTS, SCT_INTEGER, "ldap_reconnect", "Number of re-connections made to LDAP server");
@@ -227,6 +234,9 @@ server_stats::server_stats(std::shared_ptr<ECConfig> cfg) :
 	AddStat(SCN_LDAP_SEARCH_FAILED, SCT_INTEGER, "ldap_search_fail", "Number of failed searches made to LDAP server");
 	AddStat(SCN_LDAP_SEARCH_TIME, SCT_INTEGER, "ldap_search_time", "Total duration (µs) of LDAP searches");
 	AddStat(SCN_LDAP_SEARCH_TIME_MAX, SCT_INTGAUGE, "ldap_max_search", "Longest duration (µs) of LDAP search");
+	AddStat(SCN_LDAP_MEMBERSHIP_CACHE_HIT, SCT_INTEGER, "ldap_membership_cache_hit", "Number of group memberships served from the LDAP membership cache");
+	AddStat(SCN_LDAP_MEMBERSHIP_CACHE_MISS, SCT_INTEGER, "ldap_membership_cache_miss", "Number of group memberships that had to be searched in LDAP");
+	AddStat(SCN_LDAP_NEGATIVE_CACHE_HIT, SCT_INTEGER, "ldap_negative_cache_hit", "Number of name lookups answered from the LDAP negative cache");
 
 	AddStat(SCN_INDEXER_SEARCH_ERRORS, SCT_INTEGER, "index_search_errors", "Number of failed indexer queries");
 	AddStat(SCN_INDEXER_SEARCH_MAX, SCT_INTGAUGE, "index_search_max", "Maximum duration (in µs) of an indexed search query");
@@ -1099,6 +1109,8 @@ static int running_server(char *szName, const char *szConfig, bool exp_config,
 
 		// internal server controls
 		{ "softdelete_lifetime",		"30", CONFIGSETTING_RELOADABLE },	// time expressed in days, 0 == never delete anything
+		{"softdelete_batch_size", "1000", CONFIGSETTING_RELOADABLE},
+		{"softdelete_batch_pause", "100", CONFIGSETTING_RELOADABLE},
 		{ "cache_cell_size",			"0", CONFIGSETTING_SIZE },
 		{ "cache_object_size",		"0", CONFIGSETTING_SIZE },
 		{ "cache_indexedobject_size",	"0", CONFIGSETTING_SIZE },
@@ -1144,6 +1156,8 @@ static int running_server(char *szName, const char *szConfig, bool exp_config,
 		{ "sync_gab_realtime",			"yes", CONFIGSETTING_RELOADABLE },
 		{ "max_deferred_records",		"0", CONFIGSETTING_RELOADABLE },
 		{ "max_deferred_records_folder", "20", CONFIGSETTING_RELOADABLE },
+		{"deferred_compact_threshold", "1000", CONFIGSETTING_RELOADABLE},
+		{"deferred_purge_threads", "2"},
 		{ "enable_test_protocol",		"no", CONFIGSETTING_RELOADABLE },
 		{ "disabled_features", "imap pop3", CONFIGSETTING_RELOADABLE },
 		{ "mysql_group_concat_max_len", "21844", CONFIGSETTING_RELOADABLE },
@@ -1157,6 +1171,7 @@ static int running_server(char *szName, const char *szConfig, bool exp_config,
 		{"statsclient_url", "unix:/var/run/kopano/statsd.sock", CONFIGSETTING_RELOADABLE},
 		{"statsclient_interval", "0", CONFIGSETTING_RELOADABLE},
 		{"statsclient_ssl_verify", "yes", CONFIGSETTING_RELOADABLE},
+		{"metrics_listen", ""},
 		{"surveyclient_url", "https://stats.kopano.io/api/stats/v1/submit", CONFIGSETTING_RELOADABLE},
 		{"surveyclient_interval", "3600", CONFIGSETTING_RELOADABLE},
 		{"surveyclient_ssl_verify", "yes", CONFIGSETTING_RELOADABLE},
@@ -163,6 +163,7 @@ void WORKITEM::run()
 	auto info = soap_info(soap);
 	info->st.wi_wall_start = time_point::clock::now();
 	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &info->st.wi_cpu[0]);
+	rq_phase_tls = {};
 
 	kcsrv_blocksigs();
 	int err = 0;
@@ -189,6 +190,7 @@ void WORKITEM::run()
 		// Pass information on start time of the request into soap->user, so that it can be applied to the correct
 		// session after XML parsing
 		info->st.func = nullptr;
+		info->st.hist = nullptr;
 		info->fdone = NULL;
 
 		// Do processing of work item
@@ -255,6 +257,15 @@ done:
 	}
 
 	using namespace std::chrono;
+	if (info->st.hist != nullptr) {
+		/* Everything after the handler returned: serializing and sending the response */
+		if (info->st.rh1_wall_end > info->st.wi_wall_start)
+			rq_phase_tls.ns[RQP_SEND] = duration_cast<nanoseconds>(info->st.wi_wall_end - info->st.rh1_wall_end).count();
+		uint64_t parts[RQP_MAX];
+		for (unsigned int i = 0; i < RQP_MAX; ++i)
+			parts[i] = rq_phase_tls.ns[i] / 1000;
+		info->st.hist->record(duration_cast<microseconds>(info->st.wi_wall_dur).count(), parts);
+	}
 	g_lpSessionManager->m_stats->inc(SCN_PROCESSING_TIME, duration_cast<duration<double>>(info->st.wi_wall_dur).count());
 	g_lpSessionManager->m_stats->inc(SCN_RESPONSE_TIME, duration_cast<duration<double>>(info->st.sk_wall_dur).count());
 
@@ -40,9 +40,11 @@
 #include <chrono>
 #include <list>
 #include <memory>
+#include <mutex>
 #include <new>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 #include <climits>
@@ -232,6 +234,47 @@ class dagent_stats final : public StatsClient {
 	dagent_stats(std::shared_ptr<ECConfig>);
 };
 
+/**
+ * Process-wide cache of recipient resolutions (address -> user, entryid,
+ * home server) and of server name -> URL lookups, shared by all LMTP
+ * threads. Only positive results are remembered, so that newly created
+ * users are deliverable right away; entries expire after
+ * resolve_cache_ttl seconds, are dropped when a delivery to them fails,
+ * and the whole cache is flushed on SIGHUP.
+ */
+class resolve_cache final {
+	public:
+	bool get(ECRecipient *);
+	void put(const ECRecipient *);
+	bool get_path(const std::wstring &server, std::wstring &path);
+	void put_path(const std::wstring &server, const std::wstring &path);
+	void invalidate(const ECRecipient *);
+	void clear();
+
+	private:
+	typedef std::chrono::steady_clock::time_point time_point;
+	struct user_entry {
+		std::wstring username, fullname, company, email, server;
+		std::string addrtype, smtp, entryid, searchkey;
+		unsigned int display_type = 0, admin_level = 0;
+		bool has_imap = false;
+		time_point expiry;
+	};
+	struct path_entry {
+		std::wstring path;
+		time_point expiry;
+	};
+
+	static std::chrono::seconds ttl();
+	static std::string key(const std::string &addr) { return strToLower(addr); }
+	void expire(const time_point &now);
+
+	static constexpr size_t max_entries = 16384;
+	std::mutex m_lock;
+	std::unordered_map<std::string, user_entry> m_users;
+	std::map<std::wstring, path_entry, wcscasecmp_comparison> m_paths;
+};
+
 //Global variables
 static unsigned int g_process_model = GP_FORK;
 static bool g_bQuit = false, g_dump_config;
@@ -240,6 +283,7 @@ static pthread_t g_main_thread;
 static std::atomic<bool> g_sighup_flag{false};
 static std::atomic<unsigned int> g_nLMTPThreads{0};
 static std::shared_ptr<ECLogger> g_lpLogger;
+static resolve_cache g_resolve_cache;
 extern std::shared_ptr<ECConfig> g_lpConfig;
 std::shared_ptr<ECConfig> g_lpConfig;
 
@@ -284,6 +328,131 @@ static void da_sighup_sync()
 	}
 	g_lpLogger->Reset();
 	ec_log_warn("Log connection was reset");
+	g_resolve_cache.clear();
+}
+
+std::chrono::seconds resolve_cache::ttl()
+{
+	if (g_lpConfig == nullptr)
+		return std::chrono::seconds(0);
+	return std::chrono::seconds(atoui(g_lpConfig->GetSetting("resolve_cache_ttl")));
+}
+
+/* Called with m_lock held */
+void resolve_cache::expire(const time_point &now)
+{
+	if (m_users.size() < max_entries)
+		return;
+	for (auto i = m_users.begin(); i != m_users.end(); )
+		if (i->second.expiry <= now)
+			i = m_users.erase(i);
+		else
+			++i;
+	if (m_users.size() >= max_entries)
+		m_users.clear();
+}
+
+/**
+ * Fill in @r from the cache if its RCPT address was resolved recently.
+ */
+bool resolve_cache::get(ECRecipient *r)
+{
+	std::unique_lock<std::mutex> lk(m_lock);
+	auto i = m_users.find(key(r->wstrRCPT));
+	if (i == m_users.cend())
+		return false;
+	if (i->second.expiry <= std::chrono::steady_clock::now()) {
+		m_users.erase(i);
+		return false;
+	}
+	const auto e = i->second;
+	lk.unlock();
+
+	memory_ptr<BYTE> eid, skey;
+	if (KAllocCopy(e.entryid.data(), e.entryid.size(), &~eid) != hrSuccess ||
+	    KAllocCopy(e.searchkey.data(), e.searchkey.size(), &~skey) != hrSuccess)
+		return false;
+	r->sEntryId.cb   = e.entryid.size();
+	r->sEntryId.lpb  = eid.release();
+	r->sSearchKey.cb  = e.searchkey.size();
+	r->sSearchKey.lpb = skey.release();
+	r->ulResolveFlags = MAPI_RESOLVED;
+	r->wstrUsername  = e.username;
+	r->wstrFullname  = e.fullname;
+	r->wstrCompany   = e.company;
+	r->wstrEmail     = e.email;
+	r->wstrServerDisplayName = e.server;
+	r->strAddrType   = e.addrtype;
+	r->strSMTP       = e.smtp;
+	r->ulDisplayType = e.display_type;
+	r->ulAdminLevel  = e.admin_level;
+	r->bHasIMAP      = e.has_imap;
+	return true;
+}
+
+void resolve_cache::put(const ECRecipient *r)
+{
+	auto t = ttl();
+	if (t.count() == 0 || r->ulResolveFlags != MAPI_RESOLVED)
+		return;
+	user_entry e;
+	e.username     = r->wstrUsername;
+	e.fullname     = r->wstrFullname;
+	e.company      = r->wstrCompany;
+	e.email        = r->wstrEmail;
+	e.server       = r->wstrServerDisplayName;
+	e.addrtype     = r->strAddrType;
+	e.smtp         = r->strSMTP;
+	e.entryid.assign(reinterpret_cast<const char *>(r->sEntryId.lpb), r->sEntryId.cb);
+	e.searchkey.assign(reinterpret_cast<const char *>(r->sSearchKey.lpb), r->sSearchKey.cb);
+	e.display_type = r->ulDisplayType;
+	e.admin_level  = r->ulAdminLevel;
+	e.has_imap     = r->bHasIMAP;
+	auto now = std::chrono::steady_clock::now();
+	e.expiry = now + t;
+	std::lock_guard<std::mutex> lk(m_lock);
+	expire(now);
+	m_users[key(r->wstrRCPT)] = std::move(e);
+}
+
+bool resolve_cache::get_path(const std::wstring &server, std::wstring &path)
+{
+	std::lock_guard<std::mutex> lk(m_lock);
+	auto i = m_paths.find(server);
+	if (i == m_paths.cend())
+		return false;
+	if (i->second.expiry <= std::chrono::steady_clock::now()) {
+		m_paths.erase(i);
+		return false;
+	}
+	path = i->second.path;
+	return true;
+}
+
+void resolve_cache::put_path(const std::wstring &server, const std::wstring &path)
+{
+	auto t = ttl();
+	if (t.count() == 0)
+		return;
+	std::lock_guard<std::mutex> lk(m_lock);
+	m_paths[server] = {path, std::chrono::steady_clock::now() + t};
+}
+
+/**
+ * Forget @r and every address that was combined into it.
+ */
+void resolve_cache::invalidate(const ECRecipient *r)
+{
+	std::lock_guard<std::mutex> lk(m_lock);
+	for (const auto &addr : r->vwstrRecipients)
+		m_users.erase(key(addr));
+}
+
+void resolve_cache::clear()
+{
+	std::lock_guard<std::mutex> lk(m_lock);
+	m_users.clear();
+	m_paths.clear();
 }
 
 static void da_sigchld_async(int)
@@ -591,12 +760,17 @@ static HRESULT OpenResolveAddrFolder(IMAPISession *lpSession,
 /**
  * Resolve usernames/email addresses to Kopano users.
  *
+ * Addresses found in the resolve cache are filled in directly; all others
+ * are resolved with a single ResolveNames call, and the successful
+ * results are added to the cache.
+ *
  * @param[in] lpAddrFolder resolve users from this addressbook container
  * @param[in,out] lRCPT the list of recipients to resolve in Kopano
  *
  * @return MAPI Error code
  */
-static HRESULT ResolveUsers(IABContainer *lpAddrFolder, recipients_t *lRCPT)
+static HRESULT ResolveUsers(IABContainer *lpAddrFolder,
+    const std::vector<ECRecipient *> &lRCPT)
 {
 	adrlist_ptr lpAdrList;
 	memory_ptr<FlagList> lpFlagList;
@@ -606,8 +780,17 @@ static HRESULT ResolveUsers(IABContainer *lpAddrFolder, recipients_t *lRCPT)
 	  PR_EC_COMPANY_NAME_W,	PR_EC_HOMESERVER_NAME_W, PR_EC_ADMINISTRATOR,
 	  PR_EC_ENABLED_FEATURES_A, PR_OBJECT_TYPE }
 	};
-	ULONG ulRCPT = lRCPT->size();
+	std::vector<ECRecipient *> lMiss;
+
+	for (const auto &recip : lRCPT)
+		if (g_resolve_cache.get(recip))
+			ec_log_debug("Resolved recipient %s as user %ls (cached)", recip->wstrRCPT.c_str(), recip->wstrUsername.c_str());
+		else
+			lMiss.emplace_back(recip);
+	if (lMiss.empty())
+		return hrSuccess;
 
+	ULONG ulRCPT = lMiss.size();
 	auto hr = MAPIAllocateBuffer(CbNewADRLIST(ulRCPT), &~lpAdrList);
 	if (hr != hrSuccess)
 		return kc_perrorf("MAPIAllocateBuffer failed(1)", hr);
@@ -617,8 +800,7 @@ static HRESULT ResolveUsers(IABContainer *lpAddrFolder, recipients_t *lRCPT)
 		return kc_perrorf("MAPIAllocateBuffer failed(2)", hr);
 	lpFlagList->cFlags = ulRCPT;
 
-	ulRCPT = 0;
-	for (const auto &recip : *lRCPT) {
+	for (ulRCPT = 0; ulRCPT < lMiss.size(); ++ulRCPT) {
 		lpAdrList->aEntries[ulRCPT].cValues = 1;
 
 		hr = MAPIAllocateBuffer(sizeof(SPropValue), reinterpret_cast<void **>(&lpAdrList->aEntries[ulRCPT].rgPropVals));
@@ -627,9 +809,8 @@ static HRESULT ResolveUsers(IABContainer *lpAddrFolder, recipients_t *lRCPT)
 		++lpAdrList->cEntries;
 		/* szName can either be the email address or username, it doesn't really matter */
 		lpAdrList->aEntries[ulRCPT].rgPropVals[0].ulPropTag = PR_DISPLAY_NAME_A;
-		lpAdrList->aEntries[ulRCPT].rgPropVals[0].Value.lpszA = const_cast<char *>(recip->wstrRCPT.c_str());
+		lpAdrList->aEntries[ulRCPT].rgPropVals[0].Value.lpszA = const_cast<char *>(lMiss[ulRCPT]->wstrRCPT.c_str());
 		lpFlagList->ulFlag[ulRCPT] = MAPI_UNRESOLVED;
-		++ulRCPT;
 	}
 
 	// MAPI_UNICODE flag here doesn't have any effect, since we give all proptags ourself
@@ -638,8 +819,9 @@ static HRESULT ResolveUsers(IABContainer *lpAddrFolder, recipients_t *lRCPT)
 	if (hr != hrSuccess)
 		return hr;
 
-	ulRCPT = 0;
-	for (const auto &recip : *lRCPT) {
+	for (ulRCPT = 0; ulRCPT < lMiss.size(); ++ulRCPT) {
+		auto recip = lMiss[ulRCPT];
+		const auto &entry = lpAdrList->aEntries[ulRCPT];
 		recip->ulResolveFlags = lpFlagList->ulFlag[ulRCPT];
 
 		ULONG temp = lpFlagList->ulFlag[ulRCPT];
@@ -648,13 +830,13 @@ static HRESULT ResolveUsers(IABContainer *lpAddrFolder, recipients_t *lRCPT)
 			continue;
 		}
 		/* Yay, resolved the address, get it */
-		auto lpEntryIdProp  = lpAdrList->aEntries[ulRCPT].cfind(PR_ENTRYID);
-		auto lpFullNameProp = lpAdrList->aEntries[ulRCPT].cfind(PR_DISPLAY_NAME_W);
-		auto lpAccountProp  = lpAdrList->aEntries[ulRCPT].cfind(PR_ACCOUNT_W);
-		auto lpSMTPProp     = lpAdrList->aEntries[ulRCPT].cfind(PR_SMTP_ADDRESS_A);
-		auto lpObjectProp   = lpAdrList->aEntries[ulRCPT].cfind(PR_OBJECT_TYPE);
+		auto lpEntryIdProp  = entry.cfind(PR_ENTRYID);
+		auto lpFullNameProp = entry.cfind(PR_DISPLAY_NAME_W);
+		auto lpAccountProp  = entry.cfind(PR_ACCOUNT_W);
+		auto lpSMTPProp     = entry.cfind(PR_SMTP_ADDRESS_A);
+		auto lpObjectProp   = entry.cfind(PR_OBJECT_TYPE);
 		// the only property that is allowed NULL in this list
-		auto lpDisplayProp  = lpAdrList->aEntries[ulRCPT].cfind(PR_DISPLAY_TYPE);
+		auto lpDisplayProp  = entry.cfind(PR_DISPLAY_TYPE);
 		if(!lpEntryIdProp || !lpFullNameProp || !lpAccountProp || !lpSMTPProp || !lpObjectProp) {
 			ec_log_err("Not all properties found for %s", recip->wstrRCPT.c_str());
 			continue;
@@ -671,12 +853,12 @@ static HRESULT ResolveUsers(IABContainer *lpAddrFolder, recipients_t *lRCPT)
 
 		ec_log_notice("Resolved recipient %s as user %ls", recip->wstrRCPT.c_str(), lpAccountProp->Value.lpszW);
 		/* The following are allowed to be NULL */
-		auto lpCompanyProp   = lpAdrList->aEntries[ulRCPT].cfind(PR_EC_COMPANY_NAME_W);
-		auto lpServerProp    = lpAdrList->aEntries[ulRCPT].cfind(PR_EC_HOMESERVER_NAME_W);
-		auto lpAdminProp     = lpAdrList->aEntries[ulRCPT].cfind(PR_EC_ADMINISTRATOR);
-		auto lpAddrTypeProp  = lpAdrList->aEntries[ulRCPT].cfind(PR_ADDRTYPE_A);
-		auto lpEmailProp     = lpAdrList->aEntries[ulRCPT].cfind(PR_EMAIL_ADDRESS_W);
-		auto lpSearchKeyProp = lpAdrList->aEntries[ulRCPT].cfind(PR_SEARCH_KEY);
+		auto lpCompanyProp   = entry.cfind(PR_EC_COMPANY_NAME_W);
+		auto lpServerProp    = entry.cfind(PR_EC_HOMESERVER_NAME_W);
+		auto lpAdminProp     = entry.cfind(PR_EC_ADMINISTRATOR);
+		auto lpAddrTypeProp  = entry.cfind(PR_ADDRTYPE_A);
+		auto lpEmailProp     = entry.cfind(PR_EMAIL_ADDRESS_W);
+		auto lpSearchKeyProp = entry.cfind(PR_SEARCH_KEY);
 		recip->wstrUsername  = lpAccountProp->Value.lpszW;
 		recip->wstrFullname  = lpFullNameProp->Value.lpszW;
 		recip->strSMTP       = lpSMTPProp->Value.lpszA;
@@ -708,12 +890,12 @@ static HRESULT ResolveUsers(IABContainer *lpAddrFolder, recipients_t *lRCPT)
 			recip->sSearchKey.cb = key.size() + 1; // + terminating 0
 			if (KAllocCopy(key.c_str(), recip->sSearchKey.cb,
 			    reinterpret_cast<void **>(&recip->sSearchKey.lpb)) != hrSuccess)
-				++ulRCPT;
+				continue;
 		}
 
-		auto lpFeatureList = lpAdrList->aEntries[ulRCPT].cfind(PR_EC_ENABLED_FEATURES_A);
+		auto lpFeatureList = entry.cfind(PR_EC_ENABLED_FEATURES_A);
 		recip->bHasIMAP = lpFeatureList && hasFeature("imap", lpFeatureList) == hrSuccess;
-		++ulRCPT;
+		g_resolve_cache.put(recip);
 	}
 	return hrSuccess;
 }
@@ -728,8 +910,7 @@ static HRESULT ResolveUsers(IABContainer *lpAddrFolder, recipients_t *lRCPT)
  */
 static HRESULT ResolveUser(IABContainer *lpAddrFolder, ECRecipient *lpRecip)
 {
-	recipients_t list = {lpRecip};
-	auto hr = ResolveUsers(lpAddrFolder, &list);
+	auto hr = ResolveUsers(lpAddrFolder, {lpRecip});
 	if (hr != hrSuccess)
 		return kc_perrorf("ResolveUsers failed", hr);
 	else if (lpRecip->ulResolveFlags != MAPI_RESOLVED)
@@ -822,6 +1003,27 @@ static HRESULT ResolveServerToPath(IMAPISession *lpSession,
 		lpServerPathRecips->emplace(convert_to<std::wstring>(strDefaultPath), lpServerNameRecips->begin()->second);
 		return hrSuccess;
 	}
+
+	/* Take what we can from the cache; only ask the server about the rest */
+	std::vector<const std::wstring *> lMisses;
+	for (const auto &iter : *lpServerNameRecips) {
+		std::wstring path;
+		if (iter.first.empty())
+			// recipient doesn't have a home server.
+			// don't try to resolve since that will break the GetServerDetails call
+			// and thus fail all recipients, not just this one
+			continue;
+		if (!g_resolve_cache.get_path(iter.first, path)) {
+			lMisses.emplace_back(&iter.first);
+			continue;
+		}
+		ec_log_debug("%zu recipient(s) on server \"%ls\" (URL %ls, cached)",
+			iter.second.size(), iter.first.c_str(), path.c_str());
+		lpServerPathRecips->emplace(std::move(path), iter.second);
+	}
+	if (lMisses.empty())
+		return hrSuccess;
+
 	auto hr = HrOpenDefaultStore(lpSession, &~lpAdminStore);
 	if (hr != hrSuccess)
 		// HrLogon() failed .. try again later
@@ -832,23 +1034,17 @@ static HRESULT ResolveServerToPath(IMAPISession *lpSession,
 	hr = MAPIAllocateBuffer(sizeof(ECSVRNAMELIST), &~lpSrvNameList);
 	if (hr != hrSuccess)
 		return kc_perrorf("MAPIAllocateBuffer failed", hr);
-	hr = MAPIAllocateMore(sizeof(wchar_t *) * lpServerNameRecips->size(), lpSrvNameList, reinterpret_cast<void **>(&lpSrvNameList->lpszaServer));
+	hr = MAPIAllocateMore(sizeof(wchar_t *) * lMisses.size(), lpSrvNameList, reinterpret_cast<void **>(&lpSrvNameList->lpszaServer));
 	if (hr != hrSuccess)
 		return kc_perrorf("MAPIAllocateMore failed(1)", hr);
 
 	lpSrvNameList->cServers = 0;
-	for (const auto &iter : *lpServerNameRecips) {
-		if (iter.first.empty())
-			// recipient doesn't have a home server.
-			// don't try to resolve since that will break the GetServerDetails call
-			// and thus fail all recipients, not just this one
-			continue;
-
-		hr = MAPIAllocateMore((iter.first.size() + 1) * sizeof(wchar_t),
+	for (const auto name : lMisses) {
+		hr = MAPIAllocateMore((name->size() + 1) * sizeof(wchar_t),
 		     lpSrvNameList, reinterpret_cast<LPVOID *>(&lpSrvNameList->lpszaServer[lpSrvNameList->cServers]));
 		if (hr != hrSuccess)
 			return kc_perrorf("MAPIAllocateMore failed(2)", hr);
-		wcscpy(reinterpret_cast<wchar_t *>(lpSrvNameList->lpszaServer[lpSrvNameList->cServers]), iter.first.c_str());
+		wcscpy(reinterpret_cast<wchar_t *>(lpSrvNameList->lpszaServer[lpSrvNameList->cServers]), name->c_str());
 		++lpSrvNameList->cServers;
 	}
 
@@ -866,6 +1062,7 @@ static HRESULT ResolveServerToPath(IMAPISession *lpSession,
 			iter->second.size(), lpSrvList->lpsaServer[i].lpszName,
 			lpSrvList->lpsaServer[i].lpszPreferedPath);
 		lpServerPathRecips->emplace(reinterpret_cast<wchar_t *>(lpSrvList->lpsaServer[i].lpszPreferedPath), iter->second);
+		g_resolve_cache.put_path(iter->first, reinterpret_cast<wchar_t *>(lpSrvList->lpsaServer[i].lpszPreferedPath));
 	}
 	return hrSuccess;
 }
@@ -997,7 +1194,7 @@ static HRESULT HrGetDeliveryStoreAndFolder(IMAPISession *lpSession,
  * @return MAPI Error code
  */
 static HRESULT FallbackDelivery(StatsClient *sc, IMessage *lpMessage,
-    const std::string &msg)
+    FILE *fpMail)
 {
 	std::string newbody;
 	SPropValue pm[8], pa[4];
@@ -1031,9 +1228,18 @@ static HRESULT FallbackDelivery(StatsClient *sc, IMessage *lpMessage,
 	hr = lpAttach->OpenProperty(PR_ATTACH_DATA_BIN, &IID_IStream, STGM_WRITE | STGM_TRANSACTED, MAPI_CREATE | MAPI_MODIFY, &~lpStream);
 	if (hr != hrSuccess)
 		return kc_perrorf("lpAttach->OpenProperty failed", hr);
-	hr = lpStream->Write(msg.c_str(), msg.size(), NULL);
-	if (hr != hrSuccess)
-		return kc_perrorf("lpStream->Write failed", hr);
+	rewind(fpMail);
+	while (!feof(fpMail)) {
+		char buf[65536];
+		auto rd = fread(buf, 1, sizeof(buf), fpMail);
+		if (ferror(fpMail)) {
+			ec_log_err("FallbackDelivery/fread: %s", strerror(errno));
+			return MAPI_E_CORRUPT_DATA;
+		}
+		hr = lpStream->Write(buf, rd, nullptr);
+		if (hr != hrSuccess)
+			return kc_perrorf("lpStream->Write failed", hr);
+	}
 	hr = lpStream->Commit(0);
 	if (hr != hrSuccess)
 		return kc_perrorf("lpStream->Commit failed", hr);
@@ -1358,9 +1564,11 @@ static HRESULT HrCreateMessage(IMAPIFolder *lpFolder,
 }
 
 /**
- * Convert the received rfc2822 email into a MAPI message
+ * Convert the received rfc2822 email into a MAPI message. The email is
+ * parsed from the spool file, so attachments are streamed to the server
+ * rather than held in memory.
  *
- * @param[in] strMail the received email
+ * @param[in] fpMail the received email
  * @param[in] lpSession a MAPI Session
  * @param[in] lpMsgStore The store of the delivery
  * @param[in] lpAdrBook The Global Addressbook
@@ -1372,7 +1580,7 @@ static HRESULT HrCreateMessage(IMAPIFolder *lpFolder,
  *
  * @return MAPI Error code
  */
-static HRESULT HrStringToMAPIMessage(const std::string &strMail,
+static HRESULT HrFileToMAPIMessage(FILE *fpMail,
     IMAPISession *lpSession, IMsgStore *lpMsgStore, LPADRBOOK lpAdrBook,
     IMAPIFolder *lpDeliveryFolder, IMessage *lpMessage, ECRecipient *lpRecip,
     DeliveryArgs *lpArgs, IMessage **lppMessage, bool *lpbFallbackDelivery)
@@ -1383,7 +1591,7 @@ static HRESULT HrStringToMAPIMessage(const std::string &strMail,
 	lpArgs->sDeliveryOpts.add_imap_data = lpRecip->bHasIMAP;
 
 	// Set the properties on the object
-	auto hr = IMToMAPI(lpSession, lpMsgStore, lpAdrBook, lpMessage, strMail, lpArgs->sDeliveryOpts);
+	auto hr = IMToMAPI(lpSession, lpMsgStore, lpAdrBook, lpMessage, fpMail, lpArgs->sDeliveryOpts);
 	if (hr != hrSuccess) {
 		kc_pwarn("E-mail parsing failed; starting fallback delivery.", hr);
 
@@ -1393,7 +1601,7 @@ static HRESULT HrStringToMAPIMessage(const std::string &strMail,
 			kc_perror("Unable to create fallback message", hr);
 			goto exit;
 		}
-		hr = FallbackDelivery(lpArgs->sc.get(), lpFallbackMessage, strMail);
+		hr = FallbackDelivery(lpArgs->sc.get(), lpFallbackMessage, fpMail);
 		if (hr != hrSuccess) {
 			kc_perror("Unable to deliver fallback message", hr);
 			goto exit;
@@ -1697,6 +1905,46 @@ static HRESULT HrOverrideReceivedByProps(IMessage *lpMessage,
 	return hrSuccess;
 }
 
+/*
+ * Properties which are set per recipient, and must therefore not be carried
+ * over when a delivered message is copied to the next recipient.
+ */
+static constexpr SizedSPropTagArray(13, sptaReceivedBy) = {
+	13, {
+		/* Overridden by HrOverrideRecipProps() */
+		PR_MESSAGE_RECIP_ME,
+		PR_MESSAGE_TO_ME,
+		PR_MESSAGE_CC_ME,
+		/* HrOverrideReceivedByProps() */
+		PR_RECEIVED_BY_ADDRTYPE,
+		PR_RECEIVED_BY_EMAIL_ADDRESS,
+		PR_RECEIVED_BY_ENTRYID,
+		PR_RECEIVED_BY_NAME,
+		PR_RECEIVED_BY_SEARCH_KEY,
+		/* Written by rules */
+		PR_LAST_VERB_EXECUTED,
+		PR_LAST_VERB_EXECUTION_TIME,
+		PR_ICON_INDEX,
+	}
+};
+static constexpr SizedSPropTagArray(12, sptaFallback) = {
+	12, {
+		/* Overridden by HrOverrideFallbackProps() */
+		PR_SENDER_ADDRTYPE,
+		PR_SENDER_EMAIL_ADDRESS,
+		PR_SENDER_ENTRYID,
+		PR_SENDER_NAME,
+		PR_SENDER_SEARCH_KEY,
+		PR_SENT_REPRESENTING_ADDRTYPE,
+		PR_SENT_REPRESENTING_EMAIL_ADDRESS,
+		PR_SENT_REPRESENTING_ENTRYID,
+		PR_SENT_REPRESENTING_NAME,
+		PR_SENT_REPRESENTING_SEARCH_KEY,
+		PR_RCVD_REPRESENTING_ADDRTYPE,
+		PR_RCVD_REPRESENTING_EMAIL_ADDRESS,
+	}
+};
+
 /**
  * Copy a delivered message to another recipient
  *
@@ -1717,42 +1965,6 @@ static HRESULT HrCopyMessageForDelivery(IMessage *lpOrigMessage,
 {
 	object_ptr<IMessage> lpMessage;
 	object_ptr<IMAPIFolder> lpFolder;
-	static constexpr SizedSPropTagArray(13, sptaReceivedBy) = {
-		13, {
-			/* Overridden by HrOverrideRecipProps() */
-			PR_MESSAGE_RECIP_ME,
-			PR_MESSAGE_TO_ME,
-			PR_MESSAGE_CC_ME,
-			/* HrOverrideReceivedByProps() */
-			PR_RECEIVED_BY_ADDRTYPE,
-			PR_RECEIVED_BY_EMAIL_ADDRESS,
-			PR_RECEIVED_BY_ENTRYID,
-			PR_RECEIVED_BY_NAME,
-			PR_RECEIVED_BY_SEARCH_KEY,
-			/* Written by rules */
-			PR_LAST_VERB_EXECUTED,
-			PR_LAST_VERB_EXECUTION_TIME,
-			PR_ICON_INDEX,
-		}
-	};
-	static constexpr SizedSPropTagArray(12, sptaFallback) = {
-		12, {
-			/* Overridden by HrOverrideFallbackProps() */
-			PR_SENDER_ADDRTYPE,
-			PR_SENDER_EMAIL_ADDRESS,
-			PR_SENDER_ENTRYID,
-			PR_SENDER_NAME,
-			PR_SENDER_SEARCH_KEY,
-			PR_SENT_REPRESENTING_ADDRTYPE,
-			PR_SENT_REPRESENTING_EMAIL_ADDRESS,
-			PR_SENT_REPRESENTING_ENTRYID,
-			PR_SENT_REPRESENTING_NAME,
-			PR_SENT_REPRESENTING_SEARCH_KEY,
-			PR_RCVD_REPRESENTING_ADDRTYPE,
-			PR_RCVD_REPRESENTING_EMAIL_ADDRESS,
-		}
-	};
-
 	auto hr = HrCreateMessage(lpDeliverFolder, lpFallbackFolder, &~lpFolder, &~lpMessage);
 	if (hr != hrSuccess)
 		return kc_perrorf("HrCreateMessage failed", hr);
@@ -1787,6 +1999,85 @@ static HRESULT HrCopyMessageForDelivery(IMessage *lpOrigMessage,
 	return hrSuccess;
 }
 
+/**
+ * Copy a delivered message to another recipient on the same server,
+ * without transferring the message again.
+ *
+ * The storage server clones the stored message into the delivery folder;
+ * properties are duplicated in the database and attachments are shared
+ * through single instancing. Contrary to HrCopyMessageForDelivery(), the
+ * copy is already saved when this function returns, so the caller has to
+ * delete it again (through @lppNewEntryId) if delivery does not complete.
+ *
+ * @param[in] lpStore any store on the server holding lpOrigEntryId
+ * @param[in] sOrigEntryId entryid of the already delivered message
+ * @param[in] lpDeliverFolder The delivery folder of the new message
+ * @param[in] lpRecip recipient data to use
+ * @param[in] bFallbackDelivery the original message is a fallback delivery message
+ * @param[out] lppMessage the newly copied message
+ * @param[out] lppNewEntryId entryid of the newly copied message
+ *
+ * @return MAPI Error code
+ */
+static HRESULT HrServerCopyForDelivery(IMsgStore *lpStore,
+    const SBinary &sOrigEntryId, IMAPIFolder *lpDeliverFolder,
+    ECRecipient *lpRecip, bool bFallbackDelivery, IMessage **lppMessage,
+    ENTRYLIST **lppNewEntryId)
+{
+	object_ptr<IECServiceAdmin> lpServiceAdmin;
+	object_ptr<IMessage> lpMessage;
+	memory_ptr<SPropValue> lpFolderEntryId;
+	memory_ptr<ENTRYLIST> lpNewEntryIds;
+	ULONG ulObjType = 0;
+
+	auto hr = lpStore->QueryInterface(IID_IECServiceAdmin, &~lpServiceAdmin);
+	if (hr != hrSuccess)
+		return hr;
+	hr = HrGetOneProp(lpDeliverFolder, PR_ENTRYID, &~lpFolderEntryId);
+	if (hr != hrSuccess)
+		return hr;
+	ENTRYLIST folders = {1, &lpFolderEntryId->Value.bin};
+	hr = lpServiceAdmin->DeliverCopies(sOrigEntryId.cb,
+	     reinterpret_cast<const ENTRYID *>(sOrigEntryId.lpb), &folders, 0,
+	     &~lpNewEntryIds);
+	if (hr != hrSuccess)
+		return hr;
+	if (lpNewEntryIds->cValues != 1 || lpNewEntryIds->lpbin[0].cb == 0)
+		return MAPI_E_CALL_FAILED;
+
+	auto cleanup = make_scope_exit([&]() {
+		if (hr != hrSuccess)
+			lpDeliverFolder->DeleteMessages(lpNewEntryIds, 0, nullptr, DELETE_HARD_DELETE);
+	});
+	hr = lpDeliverFolder->OpenEntry(lpNewEntryIds->lpbin[0].cb,
+	     reinterpret_cast<ENTRYID *>(lpNewEntryIds->lpbin[0].lpb),
+	     &iid_of(lpMessage), MAPI_MODIFY, &ulObjType, &~lpMessage);
+	if (hr != hrSuccess)
+		return kc_perrorf("OpenEntry failed", hr);
+	/* The server copied everything; drop what is recipient dependent. */
+	hr = lpMessage->DeleteProps(sptaReceivedBy, nullptr);
+	if (hr == hrSuccess && bFallbackDelivery)
+		hr = lpMessage->DeleteProps(sptaFallback, nullptr);
+	if (hr != hrSuccess)
+		return kc_perrorf("DeleteProps failed", hr);
+
+	std::unique_ptr<helpers::MAPIPropHelper> ptrArchiveHelper;
+	hr = helpers::MAPIPropHelper::Create(object_ptr<IMAPIProp>(lpMessage), &ptrArchiveHelper);
+	if (hr != hrSuccess)
+		return kc_perrorf("helpers::MAPIPropHelper::Create failed", hr);
+	hr = ptrArchiveHelper->DetachFromArchives();
+	if (hr != hrSuccess)
+		return kc_perrorf("DetachFromArchives failed", hr);
+	if (!lpRecip->bHasIMAP) {
+		hr = Util::HrDeleteIMAPData(lpMessage);
+		if (hr != hrSuccess)
+			return kc_perrorf("IMAP handling failed", hr);
+	}
+	*lppMessage = lpMessage.release();
+	*lppNewEntryId = lpNewEntryIds.release();
+	return hrSuccess;
+}
+
 /**
  * Make a new MAPI session under a specific username
  *
@@ -1919,13 +2210,12 @@ static HRESULT HrPostDeliveryProcessing(pym_plugin_intf *lppyMapiPlugin,
  * Find spam header if needed, and mark delivery as spam delivery if
  * header found.
  *
- * @param[in] strMail rfc2822 email being delivered
+ * @param[in] fpMail rfc2822 email being delivered
  * @param[in,out] lpArgs delivery options
  *
  * @return MAPI Error code
  */
-static HRESULT FindSpamMarker(const std::string &strMail,
-    DeliveryArgs *lpArgs)
+static HRESULT FindSpamMarker(FILE *fpMail, DeliveryArgs *lpArgs)
 {
 	const char *szHeader = g_lpConfig->GetSetting("spam_header_name", "", NULL);
 	const char *szValue = g_lpConfig->GetSetting("spam_header_value", "", NULL);
@@ -1934,15 +2224,26 @@ static HRESULT FindSpamMarker(const std::string &strMail,
 
 	if (!szHeader || !szValue)
 		return hrSuccess;
-	// find end of headers
-	auto end = strMail.find("\r\n\r\n");
-	if (end == strMail.npos)
+	// read up to the end of headers only
+	auto end = strHeaders.npos;
+	rewind(fpMail);
+	while (end == strHeaders.npos && !feof(fpMail)) {
+		char buf[4096];
+		auto rd = fread(buf, 1, sizeof(buf), fpMail);
+		if (ferror(fpMail) || rd == 0)
+			break;
+		auto from = strHeaders.size() < 3 ? 0 : strHeaders.size() - 3;
+		strHeaders.append(buf, rd);
+		end = strHeaders.find("\r\n\r\n", from);
+	}
+	rewind(fpMail);
+	if (end == strHeaders.npos)
 		return hrSuccess;
 	end += 2;
 
-	// copy headers in upper case, need to resize destination first
+	// headers in upper case
 	strHeaders.resize(end);
-	transform(strMail.begin(), strMail.begin() +end, strHeaders.begin(), ::toupper);
+	transform(strHeaders.begin(), strHeaders.end(), strHeaders.begin(), ::toupper);
 	auto match = strToUpper("\r\n"s + szHeader + ":");
 
 	// find header
@@ -1973,8 +2274,10 @@ static HRESULT FindSpamMarker(const std::string &strMail,
  * @param[in] bIsAdmin indicates that lpSession and lpStore are an admin session and store (true in LMTP mode)
  * @param[in] lpAdrBook Global Addressbook
  * @param[in] lpOrigMessage a previously delivered message, if any
+ * @param[in] lpOrigEntryId entryid of lpOrigMessage if it is stored on the
+ * 			same server as lpStore, NULL otherwise
  * @param[in] bFallbackDelivery previously delivered message was a fallback message
- * @param[in] strMail original received rfc2822 email
+ * @param[in] fpMail original received rfc2822 email
  * @param[in] lpRecip recipient to deliver message to
  * @param[in] lpArgs delivery options
  * @param[out] lppMessage the newly delivered message
@@ -1984,9 +2287,10 @@ static HRESULT FindSpamMarker(const std::string &strMail,
  */
 static HRESULT ProcessDeliveryToRecipient(pym_plugin_intf *lppyMapiPlugin,
     IMAPISession *lpSession, IMsgStore *lpStore, bool bIsAdmin,
-    LPADRBOOK lpAdrBook, IMessage *lpOrigMessage, bool bFallbackDelivery,
-    const std::string &strMail, ECRecipient *lpRecip, DeliveryArgs *lpArgs,
-    IMessage **lppMessage, bool *lpbFallbackDelivery)
+    LPADRBOOK lpAdrBook, IMessage *lpOrigMessage,
+    const SBinary *lpOrigEntryId, bool bFallbackDelivery, FILE *fpMail,
+    ECRecipient *lpRecip, DeliveryArgs *lpArgs, IMessage **lppMessage,
+    bool *lpbFallbackDelivery)
 {
 	object_ptr<IMsgStore> lpTargetStore;
 	object_ptr<IMAPIFolder> lpTargetFolder, lpFolder, lpInbox;
@@ -1995,6 +2299,7 @@ static HRESULT ProcessDeliveryToRecipient(pym_plugin_intf *lppyMapiPlugin,
 	ULONG ulResult = 0;
 	object_ptr<IECServiceAdmin> lpServiceAdmin;
 	memory_ptr<ECQUOTASTATUS> lpsQuotaStatus;
+	memory_ptr<ENTRYLIST> lpServerCopy;
 	bool over_quota = false;
 	auto dblStart = std::chrono::steady_clock::now();
 
@@ -2020,9 +2325,9 @@ static HRESULT ProcessDeliveryToRecipient(pym_plugin_intf *lppyMapiPlugin,
 		hr = HrCreateMessage(lpTargetFolder, lpInbox, &~lpFolder, &~lpMessageTmp);
 		if (hr != hrSuccess)
 			return kc_perrorf("HrCreateMessage failed", hr);
-		hr = HrStringToMAPIMessage(strMail, lpSession, lpTargetStore, lpAdrBook, lpFolder, lpMessageTmp, lpRecip, lpArgs, &~lpDeliveryMessage, &bFallbackDelivery);
+		hr = HrFileToMAPIMessage(fpMail, lpSession, lpTargetStore, lpAdrBook, lpFolder, lpMessageTmp, lpRecip, lpArgs, &~lpDeliveryMessage, &bFallbackDelivery);
 		if (hr != hrSuccess)
-			return kc_perrorf("HrStringToMAPIMessage failed", hr);
+			return kc_perrorf("HrFileToMAPIMessage failed", hr);
 
 		/*
 		 * Check if the message has expired.
@@ -2040,10 +2345,28 @@ static HRESULT ProcessDeliveryToRecipient(pym_plugin_intf *lppyMapiPlugin,
 		// TODO do something with ulResult
 	} else {
 		/* Copy message to prepare for new delivery */
-		hr = HrCopyMessageForDelivery(lpOrigMessage, lpTargetFolder, lpRecip, lpInbox, bFallbackDelivery, &~lpFolder, &~lpDeliveryMessage);
-		if (hr != hrSuccess)
-			return kc_perrorf("HrCopyMessageForDelivery failed", hr);
+		if (lpOrigEntryId != nullptr) {
+			hr = HrServerCopyForDelivery(lpTargetStore, *lpOrigEntryId, lpTargetFolder, lpRecip, bFallbackDelivery, &~lpDeliveryMessage, &~lpServerCopy);
+			if (hr == hrSuccess)
+				lpFolder = lpTargetFolder;
+			else
+				hr_ldebug(hr, "Server-side copy not possible, copying through client");
+		}
+		if (lpServerCopy == nullptr) {
+			hr = HrCopyMessageForDelivery(lpOrigMessage, lpTargetFolder, lpRecip, lpInbox, bFallbackDelivery, &~lpFolder, &~lpDeliveryMessage);
+			if (hr != hrSuccess)
+				return kc_perrorf("HrCopyMessageForDelivery failed", hr);
+		}
 	}
+	/*
+	 * A server-side copy is visible already; take it away again if this
+	 * delivery is not going to be completed.
+	 */
+	bool keep_copy = false;
+	auto server_copy_cleanup = make_scope_exit([&]() {
+		if (lpServerCopy != nullptr && !keep_copy)
+			lpFolder->DeleteMessages(lpServerCopy, 0, nullptr, DELETE_HARD_DELETE);
+	});
 
 	hr = HrOverrideRecipProps(lpAdrBook, lpDeliveryMessage, lpRecip);
 	if (hr != hrSuccess)
@@ -2094,6 +2417,7 @@ static HRESULT ProcessDeliveryToRecipient(pym_plugin_intf *lppyMapiPlugin,
 			// ignore other errors for rules, still want to save the delivered message
 			// Save message changes, message becomes visible for the user
 			hr = lpDeliveryMessage->SaveChanges(KEEP_OPEN_READWRITE);
+		keep_copy = hr == hrSuccess;
 
 		if (hr != hrSuccess) {
 			if (hr == MAPI_E_STORE_FULL)
@@ -2192,7 +2516,7 @@ static void RespondMessageExpired(recipients_t::const_iterator iter,
  * @param[in] lpUserSession optional session of one user the message is being delivered to (cmdline dagent, NULL on LMTP mode)
  * @param[in] lpMessage an already delivered message
  * @param[in] bFallbackDelivery already delivered message is a fallback message
- * @param[in] strMail the rfc2822 received email
+ * @param[in] fpMail the rfc2822 received email
  * @param[in] strServer uri of the storage server to connect to
  * @param[in] listRecipients list of recipients present on the server connecting to
  * @param[in] lpAdrBook Global addressbook
@@ -2204,7 +2528,7 @@ static void RespondMessageExpired(recipients_t::const_iterator iter,
  */
 static HRESULT ProcessDeliveryToServer(pym_plugin_intf *lppyMapiPlugin,
     IMAPISession *lpUserSession, IMessage *lpMessage, bool bFallbackDelivery,
-    const std::string &strMail, const std::string &strServer,
+    FILE *fpMail, const std::string &strServer,
     const recipients_t &listRecipients, LPADRBOOK lpAdrBook,
     DeliveryArgs *lpArgs, IMessage **lppMessage, bool *lpbFallbackDelivery)
 {
@@ -2212,8 +2536,11 @@ static HRESULT ProcessDeliveryToServer(pym_plugin_intf *lppyMapiPlugin,
 	object_ptr<IMAPISession> lpSession;
 	object_ptr<IMsgStore> lpStore;
 	object_ptr<IMessage> lpOrigMessage;
+	memory_ptr<SPropValue> lpOrigEntryId;
 	bool bFallbackDeliveryTmp = false;
 	convert_context converter;
+	struct stat sb;
+	size_t mail_size = fstat(fileno(fpMail), &sb) == 0 ? sb.st_size : 0;
 
 	lpArgs->sc->inc(SCN_DAGENT_TO_SERVER);
 	// if we already had a message, we can create a copy.
@@ -2230,9 +2557,11 @@ static HRESULT ProcessDeliveryToServer(pym_plugin_intf *lppyMapiPlugin,
 		     g_lpConfig->GetSetting("sslkey_pass", "", NULL));
 	if (hr != hrSuccess || (hr = HrOpenDefaultStore(lpSession, &~lpStore)) != hrSuccess) {
 		// notify LMTP client soft error to try again later
-		for (const auto &recip : listRecipients)
+		for (const auto &recip : listRecipients) {
 			// error will be shown in postqueue status in postfix, probably too in other serves and mail syslog service
 			recip->wstrDeliveryStatus = "450 4.5.0 %s network or permissions error to storage server: " + stringify_hex(hr);
+			g_resolve_cache.invalidate(recip);
+		}
 		return kc_perror("Unable to open default store for system account", hr);
 	}
 
@@ -2247,8 +2576,10 @@ static HRESULT ProcessDeliveryToServer(pym_plugin_intf *lppyMapiPlugin,
 		 */
 		hr = ProcessDeliveryToRecipient(lppyMapiPlugin, lpSession,
 		     lpStore, lpUserSession == NULL, lpAdrBook, lpOrigMessage,
-		     bFallbackDelivery, strMail, recip, lpArgs, &~lpMessageTmp,
+		     lpOrigEntryId != nullptr ? &lpOrigEntryId->Value.bin : nullptr,
+		     bFallbackDelivery, fpMail, recip, lpArgs, &~lpMessageTmp,
 		     &bFallbackDeliveryTmp);
+		bool saved = hr == hrSuccess;
 		if (hr == hrSuccess || hr == MAPI_E_CANCEL) {
 			if (hr == hrSuccess) {
 				memory_ptr<SPropValue> lpMessageId, lpSubject;
@@ -2260,7 +2591,7 @@ static HRESULT ProcessDeliveryToServer(pym_plugin_intf *lppyMapiPlugin,
 				ec_log_info("Delivered message to \"%ls\", Subject: \"%ls\", Message-Id: %ls, size %zu",
 					recip->wstrUsername.c_str(),
 					(lpSubject != NULL) ? lpSubject->Value.lpszW : L"<none>",
-					wMessageId.c_str(), strMail.size());
+					wMessageId.c_str(), mail_size);
 			}
 			// cancel already logged.
 			hr = hrSuccess;
@@ -2271,6 +2602,9 @@ static HRESULT ProcessDeliveryToServer(pym_plugin_intf *lppyMapiPlugin,
 			return MAPI_W_CANCEL_MESSAGE;
 		} else {
 			hr_lerr(hr, "Unable to deliver message to \"%ls\"", recip->wstrUsername.c_str());
+			/* The user may have been moved or deleted; look it up afresh next time. */
+			if (hr != MAPI_E_STORE_FULL)
+				g_resolve_cache.invalidate(recip);
 			/* LMTP requires different notification when Quota for user was exceeded */
 			if (hr == MAPI_E_STORE_FULL)
 				recip->wstrDeliveryStatus = "552 5.2.2 %s Quota exceeded";
@@ -2278,8 +2612,19 @@ static HRESULT ProcessDeliveryToServer(pym_plugin_intf *lppyMapiPlugin,
 				recip->wstrDeliveryStatus = "450 4.2.0 %s Mailbox temporarily unavailable";
 		}
 
-		if (lpMessageTmp != nullptr)
-			bFallbackDelivery = bFallbackDeliveryTmp;
+		if (lpMessageTmp == nullptr)
+			continue;
+		bFallbackDelivery = bFallbackDeliveryTmp;
+		/*
+		 * The first message stored on this server becomes the source
+		 * for all further recipients here; the server copies it
+		 * without the mail being converted or uploaded again.
+		 */
+		if (lpOrigEntryId == nullptr && saved &&
+		    HrGetOneProp(lpMessageTmp, PR_ENTRYID, &~lpOrigEntryId) == hrSuccess)
+			lpOrigMessage = std::move(lpMessageTmp);
+		else if (lpOrigMessage == nullptr)
+			lpOrigMessage = std::move(lpMessageTmp);
 	}
 	if (lppMessage != nullptr && lpOrigMessage)
 		lpOrigMessage->QueryInterface(IID_IMessage, reinterpret_cast<void **>(lppMessage));
@@ -2308,18 +2653,9 @@ static HRESULT ProcessDeliveryToSingleRecipient(pym_plugin_intf *lppyMapiPlugin,
     IMAPISession *lpSession, LPADRBOOK lpAdrBook, FILE *fp,
     recipients_t &lstSingleRecip, DeliveryArgs *lpArgs)
 {
-	std::string strMail;
 	lpArgs->sc->inc(SCN_DAGENT_TO_SINGLE_RECIP);
-
-	/* Always start at the beginning of the file */
-	rewind(fp);
-	/* Read file into string */
-	auto hr = HrMapFileToString(fp, &strMail);
-	if (hr != hrSuccess)
-		return kc_perror("Unable to map input to memory", hr);
-
-	FindSpamMarker(strMail, lpArgs);
-	hr = ProcessDeliveryToServer(lppyMapiPlugin, lpSession, NULL, false, strMail, lpArgs->strPath, lstSingleRecip, lpAdrBook, lpArgs, NULL, NULL);
+	FindSpamMarker(fp, lpArgs);
+	auto hr = ProcessDeliveryToServer(lppyMapiPlugin, lpSession, nullptr, false, fp, lpArgs->strPath, lstSingleRecip, lpAdrBook, lpArgs, nullptr, nullptr);
 	if (hr != hrSuccess)
 		return kc_perrorf("ProcessDeliveryToServer failed", hr);
 	return hrSuccess;
@@ -2342,7 +2678,6 @@ static HRESULT ProcessDeliveryToCompany(pym_plugin_intf *lppyMapiPlugin,
     const serverrecipients_t *lpServerNameRecips, DeliveryArgs *lpArgs)
 {
 	object_ptr<IMessage> lpMasterMessage;
-	std::string strMail;
 	serverrecipients_t listServerPathRecips;
 	bool bFallbackDelivery = false, bExpired = false;
 
@@ -2350,15 +2685,8 @@ static HRESULT ProcessDeliveryToCompany(pym_plugin_intf *lppyMapiPlugin,
 	if (lpServerNameRecips == nullptr)
 		return MAPI_E_INVALID_PARAMETER;
 
-	/* Always start at the beginning of the file */
-	rewind(fp);
-	/* Read file into string */
-	auto hr = HrMapFileToString(fp, &strMail);
-	if (hr != hrSuccess)
-		return kc_perror("Unable to map input to memory", hr);
-
-	FindSpamMarker(strMail, lpArgs);
-	hr = ResolveServerToPath(lpSession, lpServerNameRecips, lpArgs->strPath, &listServerPathRecips);
+	FindSpamMarker(fp, lpArgs);
+	auto hr = ResolveServerToPath(lpSession, lpServerNameRecips, lpArgs->strPath, &listServerPathRecips);
 	if (hr != hrSuccess)
 		return kc_perrorf("ResolveServerToPath failed", hr);
 
@@ -2372,7 +2700,7 @@ static HRESULT ProcessDeliveryToCompany(pym_plugin_intf *lppyMapiPlugin,
 			continue;
 		}
 		hr = ProcessDeliveryToServer(lppyMapiPlugin, NULL,
-		     lpMasterMessage, bFallbackDelivery, strMail,
+		     lpMasterMessage, bFallbackDelivery, fp,
 		     convert_to<std::string>(iter.first), iter.second,
 		     lpAdrBook, lpArgs, &~lpMessageTmp, &bFallbackDeliveryTmp);
 		if (hr == MAPI_W_CANCEL_MESSAGE)
@@ -3224,6 +3552,7 @@ int main(int argc, char **argv)
 		{"coredump_enabled", "systemdefault"},
 		{"lmtp_listen", "*%lo:2003"},
 		{ "lmtp_max_threads", "20" },
+		{"resolve_cache_ttl", "60", CONFIGSETTING_RELOADABLE},
 		{"process_model", "thread", CONFIGSETTING_NONEMPTY},
 		{"log_method", "auto", CONFIGSETTING_NONEMPTY},
 		{"log_file", ""},
@@ -3251,6 +3580,7 @@ int main(int argc, char **argv)
 		{"statsclient_url", "unix:/var/run/kopano/statsd.sock", CONFIGSETTING_RELOADABLE},
 		{"statsclient_interval", "0", CONFIGSETTING_RELOADABLE},
 		{"statsclient_ssl_verify", "yes", CONFIGSETTING_RELOADABLE},
+		{"metrics_listen", ""},
 		{ "tmp_path", "/tmp" },
 		{"forward_whitelist_domains", "*", CONFIGSETTING_RELOADABLE},
 		{"forward_whitelist_domains_file", "", CONFIGSETTING_RELOADABLE},
@@ -3562,6 +3892,8 @@ dagent_stats::dagent_stats(std::shared_ptr<ECConfig> cfg) :
 	AddStat(SCN_LMTP_UNKNOWN_COMMAND, SCT_INTEGER, "lmtp_unknown_command", "Unknown commands issued");
 	AddStat(SCN_RULES_TIME, SCT_INTEGER, "rules_time", "Time taken to execute rules in milliseconds");
 	AddStat(SCN_RULES_BOUNCE, SCT_INTEGER, "rules_bounce", "OP_BOUNCE actions processed");
+	AddStat(SCN_RULES_CACHE_HIT, SCT_INTEGER, "rules_cache_hit", "Compiled rule sets reused");
+	AddStat(SCN_RULES_CACHE_MISS, SCT_INTEGER, "rules_cache_miss", "Rule sets (re)compiled");
 	AddStat(SCN_RULES_COPYMOVE, SCT_INTEGER, "rules_copymove", "OP_COPY/OP_MOVE actions processed");
 	AddStat(SCN_RULES_DEFER, SCT_INTEGER, "rules_defer", "OP_DEFERs processed");
 	AddStat(SCN_RULES_DELEGATE, SCT_INTEGER, "rules_delegate", "OP_DELEGATE actions processed");
@@ -3573,5 +3905,6 @@ dagent_stats::dagent_stats(std::shared_ptr<ECConfig> cfg) :
 	AddStat(SCN_RULES_NACTIONS, SCT_INTEGER, "rules_nactions", "Actions evaluated");
 	AddStat(SCN_RULES_NRULES, SCT_INTEGER, "rules_nrules", "Rules evaluated");
 	AddStat(SCN_RULES_REPLY_AND_OOF, SCT_INTEGER, "rules_reply_oof", "OP_REPLY/OP_REPLY_OOF actions processed");
+	AddStat(SCN_RULES_SHARED_PRED, SCT_INTEGER, "rules_shared_pred", "Rule predicates answered from an earlier evaluation");
 	AddStat(SCN_RULES_TAG, SCT_INTEGER, "rules_tag", "OP_TAG actions processed");
 }
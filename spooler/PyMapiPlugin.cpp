@@ -50,6 +50,7 @@ class PyMapiPlugin final : public pym_plugin_intf {
 	virtual HRESULT MessageProcessing(const char *func, IMAPISession *, IAddrBook *, IMsgStore *, IMAPIFolder *, IMessage *, ULONG *result);
 	virtual HRESULT RulesProcessing(const char *func, IMAPISession *, IAddrBook *, IMsgStore *, IExchangeModifyTable *emt_rules, ULONG *result);
 	virtual HRESULT RequestCallExecution(const char *func, IMAPISession *, IAddrBook *, IMsgStore *, IMAPIFolder *, IMessage *, ULONG *do_callexe, ULONG *result);
+	virtual bool may_edit_rules() const { return true; }
 
 	private:
 	pyobj_ptr m_module{nullptr}, m_ptrMapiPluginManager{nullptr};
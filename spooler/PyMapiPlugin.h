@@ -27,6 +27,8 @@ class pym_plugin_intf {
 	virtual HRESULT MessageProcessing(const char *func, IMAPISession *, IAddrBook *, IMsgStore *, IMAPIFolder *, IMessage *, ULONG *result) { return hrSuccess; }
 	virtual HRESULT RulesProcessing(const char *func, IMAPISession *, IAddrBook *, IMsgStore *, IExchangeModifyTable *emt_rules, ULONG *result) { return hrSuccess; }
 	virtual HRESULT RequestCallExecution(const char *func, IMAPISession *, IAddrBook *, IMsgStore *, IMAPIFolder *, IMessage *, ULONG *do_callexe, ULONG *result) { return hrSuccess; }
+	/* Whether RulesProcessing may change the rules table */
+	virtual bool may_edit_rules() const { return false; }
 };
 
 extern HRESULT create_pym_plugin(KC::ECConfig *, const char *mgr_class, pym_plugin_intf **);
@@ -16,6 +16,7 @@
  * This advise sink unblocks the main (waiting) thread.
  */
 #include <kopano/platform.h>
+#include <algorithm>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
@@ -24,6 +25,7 @@
 #include <memory>
 #include <mutex>
 #include <new>
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
@@ -142,8 +144,10 @@ struct sp_handlerargs {
 
 static std::map<pid_t, SendData> mapSendData; /* data for subprocesses */
 static std::list<SendData> g_senddata_thr; /* data for subthreads */
+static std::set<std::string> g_senddata_busy; /* messages being sent by subthreads */
+static std::condition_variable g_senddata_cv; /* signalled when a subthread finishes */
 static std::map<pid_t, int> mapFinished; /* exit status of finished processes */
-static std::mutex g_senddata_mtx; /* protect g_senddata_thr */
+static std::mutex g_senddata_mtx; /* protect g_senddata_thr and g_senddata_busy */
 static std::mutex hMutexFinished; /* mutex for mapFinished */
 
 static HRESULT running_server(const char *szSMTP, int port, const char *szPath);
@@ -188,6 +192,18 @@ static void sp_sighup_async(int)
 	hCondMessagesWaiting.notify_one();
 }
 
+/**
+ * Keep SMTP connections open between messages, unless each message is
+ * sent from its own process anyway.
+ */
+static void sp_smtp_pool_configure()
+{
+	if (g_process_model == GP_FORK)
+		return;
+	smtp_pool_configure(atoui(g_lpConfig->GetSetting("smtp_idle_connections")),
+		atoui(g_lpConfig->GetSetting("smtp_idle_timeout")));
+}
+
 static void sp_sighup_sync()
 {
 	bool expect_one = true;
@@ -202,11 +218,36 @@ static void sp_sighup_sync()
 		const char *ll = g_lpConfig->GetSetting("log_level");
 		int new_ll = ll ? atoi(ll) : EC_LOGLEVEL_WARNING;
 		g_lpLogger->SetLoglevel(new_ll);
+		sp_smtp_pool_configure();
 	}
 	g_lpLogger->Reset();
 	ec_log_warn("Log connection was reset");
 }
 
+/**
+ * Number of messages currently being sent by subprocesses/subthreads.
+ */
+static size_t sp_inflight()
+{
+	if (g_process_model == GP_FORK)
+		return mapSendData.size();
+	std::lock_guard<std::mutex> lk(g_senddata_mtx);
+	return g_senddata_busy.size();
+}
+
+static bool sp_is_inflight(const SBinary &eid)
+{
+	if (g_process_model != GP_FORK) {
+		std::lock_guard<std::mutex> lk(g_senddata_mtx);
+		return g_senddata_busy.find(std::string(reinterpret_cast<const char *>(eid.lpb), eid.cb)) != g_senddata_busy.cend();
+	}
+	for (const auto &i : mapSendData)
+		if (i.second.msg_eid.size() == eid.cb &&
+		    memcmp(i.second.msg_eid.data(), eid.lpb, eid.cb) == 0)
+			return true;
+	return false;
+}
+
 static void sp_sigusr2_async(int)
 {
 	g_sigusr2_flag = true;
@@ -219,7 +260,7 @@ static void sp_sigusr2_sync()
 	if (!g_sigusr2_flag.compare_exchange_strong(expect_one, false))
 		return;
 	ec_log_debug("Spooler stats:");
-	ec_log_debug("Running threads: %zu", mapSendData.size());
+	ec_log_debug("Running threads: %zu", sp_inflight());
 	std::lock_guard<std::mutex> l(hMutexFinished);
 	ec_log_debug("Finished threads: %zu", mapFinished.size());
 	ec_log_debug("Disconnects: %d", disconnects);
@@ -265,6 +306,7 @@ static void *HandlerSP_Thread(void *varg)
 	std::unique_lock<std::mutex> lk(g_senddata_mtx);
 	g_senddata_thr.emplace_back(std::move(a->sd));
 	lk.unlock();
+	g_senddata_cv.notify_one();
 	hCondMessagesWaiting.notify_one();
 	return nullptr;
 }
@@ -280,6 +322,15 @@ static HRESULT StartSpoolerThread(SendData &&sd, const char *smtp_host,
 	th_arg->smtp_port = smtp_port;
 	th_arg->path = path;
 	th_arg->do_sentmail = flags & EC_SUBMIT_DOSENTMAIL;
+	std::unique_lock<std::mutex> lk(g_senddata_mtx);
+	g_senddata_busy.emplace(th_arg->sd.msg_eid);
+	lk.unlock();
+	auto busy_clean = make_scope_exit([&]() {
+		if (th_arg == nullptr)
+			return;
+		lk.lock();
+		g_senddata_busy.erase(th_arg->sd.msg_eid);
+	});
 
 	if (g_process_model == GP_SINGLE) {
 		HandlerSP_Thread(th_arg.release());
@@ -466,8 +517,12 @@ static void CleanFinishedMessagesThreaded(IMAPISession *ses, IECSpooler *spooler
 	g_senddata_thr.clear();
 	lk.unlock();
 	ec_log_debug("Cleaning %zu subthreads from queue", finished.size());
-	for (const auto &sd : finished)
+	for (const auto &sd : finished) {
 		handle_child_exit(ses, spooler, sc.get(), 0, SPC_EXITED, sd.status, sd);
+		lk.lock();
+		g_senddata_busy.erase(sd.msg_eid);
+		lk.unlock();
+	}
 }
 
 /**
@@ -613,42 +668,67 @@ static HRESULT ProcessAllEntries2(IMAPISession *lpAdminSession,
 	if (ulMaxThreads == 0)
 		ulMaxThreads = 1;
 
-	while(!bQuit) {
-		auto ulFreeThreads = ulMaxThreads - mapSendData.size();
-		if (ulFreeThreads == 0) {
-			Sleep(100);
-			// remove enties from mapSendData which are finished
-			CleanFinishedMessages(lpAdminSession, lpSpooler);
-			continue;	/* Continue looping until threads become available */
-		}
-
+	/*
+	 * The table is in submission order. Urgent messages are moved to the
+	 * front (and non-urgent ones to the back), keeping the order within
+	 * each class.
+	 */
+	std::vector<rowset_ptr> batches;
+	std::vector<const SRow *> queue;
+	while (true) {
 		rowset_ptr lpsRowSet;
-		hr = lpTable->QueryRows(1, 0, &~lpsRowSet);
+		hr = lpTable->QueryRows(256, 0, &~lpsRowSet);
 		if (hr != hrSuccess)
 			return kc_perror("Unable to fetch data from table", hr);
 		if (lpsRowSet->cRows == 0)		// All rows done
 			break;
-		if (lpsRowSet[0].lpProps[4].ulPropTag == PR_DEFERRED_SEND_TIME &&
-		    time(nullptr) < FileTimeToUnixTime(lpsRowSet[0].lpProps[4].Value.ft)) {
+		for (unsigned int i = 0; i < lpsRowSet->cRows; ++i)
+			queue.emplace_back(&lpsRowSet[i]);
+		batches.emplace_back(std::move(lpsRowSet));
+	}
+	auto prio = [](const SRow *r) {
+		return r->lpProps[5].ulPropTag == PR_PRIORITY ? r->lpProps[5].Value.l : PRIO_NORMAL;
+	};
+	std::stable_sort(queue.begin(), queue.end(),
+		[&](const SRow *a, const SRow *b) { return prio(a) > prio(b); });
+
+	for (auto row : queue) {
+		if (bQuit)
+			break;
+		while (!bQuit && sp_inflight() >= static_cast<size_t>(ulMaxThreads)) {
+			if (g_process_model == GP_FORK) {
+				Sleep(100);
+			} else {
+				std::unique_lock<std::mutex> lk(g_senddata_mtx);
+				g_senddata_cv.wait_for(lk, 100ms, []() { return !g_senddata_thr.empty(); });
+			}
+			// remove enties which are finished
+			CleanFinishedMessages(lpAdminSession, lpSpooler);
+		}
+		if (bQuit)
+			break;
+
+		if (row->lpProps[4].ulPropTag == PR_DEFERRED_SEND_TIME &&
+		    time(nullptr) < FileTimeToUnixTime(row->lpProps[4].Value.ft)) {
 			// if we ever add logging here, it should trigger just once for this mail
 			++later_mails;
 			continue;
 		}
 
 		// Check whether the row contains the entryid and store id
-		if (lpsRowSet[0].lpProps[0].ulPropTag != PR_EC_MAILBOX_OWNER_ACCOUNT_W ||
-		    lpsRowSet[0].lpProps[1].ulPropTag != PR_STORE_ENTRYID ||
-		    lpsRowSet[0].lpProps[2].ulPropTag != PR_ENTRYID ||
-		    lpsRowSet[0].lpProps[3].ulPropTag != PR_EC_OUTGOING_FLAGS)
+		if (row->lpProps[0].ulPropTag != PR_EC_MAILBOX_OWNER_ACCOUNT_W ||
+		    row->lpProps[1].ulPropTag != PR_STORE_ENTRYID ||
+		    row->lpProps[2].ulPropTag != PR_ENTRYID ||
+		    row->lpProps[3].ulPropTag != PR_EC_OUTGOING_FLAGS)
 		{
 			// Client was quick enough to remove message from queue before we could read it
 			ec_log_notice("Empty row in OutgoingQueue");
 
-			if (lpsRowSet[0].lpProps[2].ulPropTag == PR_ENTRYID &&
-			    lpsRowSet[0].lpProps[3].ulPropTag == PR_EC_OUTGOING_FLAGS) {
+			if (row->lpProps[2].ulPropTag == PR_ENTRYID &&
+			    row->lpProps[3].ulPropTag == PR_EC_OUTGOING_FLAGS) {
 				// we can remove this message
 				ec_log_warn("Removing invalid entry from OutgoingQueue");
-				hr = lpSpooler->DeleteFromMasterOutgoingTable(lpsRowSet[0].lpProps[2].Value.bin.cb, reinterpret_cast<ENTRYID *>(lpsRowSet[0].lpProps[2].Value.bin.lpb), lpsRowSet[0].lpProps[3].Value.ul);
+				hr = lpSpooler->DeleteFromMasterOutgoingTable(row->lpProps[2].Value.bin.cb, reinterpret_cast<ENTRYID *>(row->lpProps[2].Value.bin.lpb), row->lpProps[3].Value.ul);
 				if (hr != hrSuccess)
 					// since we have an error, we will reconnect to the server to fully reload the table
 					return kc_pwarn("Could not remove invalid message from queue", hr);
@@ -661,22 +741,15 @@ static HRESULT ProcessAllEntries2(IMAPISession *lpAdminSession,
 			continue;
 		}
 
-		std::wstring strUsername = lpsRowSet[0].lpProps[0].Value.lpszW;
+		std::wstring strUsername = row->lpProps[0].Value.lpszW;
 		// Check if there is already an active process for this message
-		bool bMatch = false;
-		for (const auto &i : mapSendData)
-			if (i.second.msg_eid.size() == lpsRowSet[0].lpProps[2].Value.bin.cb &&
-			    memcmp(i.second.msg_eid.data(), lpsRowSet[0].lpProps[2].Value.bin.lpb, i.second.msg_eid.size()) == 0) {
-				bMatch = true;
-				break;
-			}
-		if (bMatch)
+		if (sp_is_inflight(row->lpProps[2].Value.bin))
 			continue;
 
 		// Start new process to send the mail
 		hr = StartSpoolerFork(strUsername.c_str(), szSMTP, ulPort, szPath,
-		     lpsRowSet[0].lpProps[1].Value.bin, lpsRowSet[0].lpProps[2].Value.bin,
-		     lpsRowSet[0].lpProps[3].Value.ul);
+		     row->lpProps[1].Value.bin, row->lpProps[2].Value.bin,
+		     row->lpProps[3].Value.ul);
 		if (hr != hrSuccess)
 			return kc_pwarn("ProcessAllEntries(): Failed starting spooler", hr);
 	}
@@ -729,9 +802,10 @@ static HRESULT ProcessQueue2(IMAPISession *lpAdminSession,
 	object_ptr<IMAPITable> lpTable;
 	object_ptr<IMAPIAdviseSink> lpAdviseSink;
 	ULONG				ulConnection	= 0;
-	static constexpr SizedSPropTagArray(5, sOutgoingCols) =
-		{5, {PR_EC_MAILBOX_OWNER_ACCOUNT_W, PR_STORE_ENTRYID,
-		PR_ENTRYID, PR_EC_OUTGOING_FLAGS, PR_DEFERRED_SEND_TIME}};
+	static constexpr SizedSPropTagArray(6, sOutgoingCols) =
+		{6, {PR_EC_MAILBOX_OWNER_ACCOUNT_W, PR_STORE_ENTRYID,
+		PR_ENTRYID, PR_EC_OUTGOING_FLAGS, PR_DEFERRED_SEND_TIME,
+		PR_PRIORITY}};
 	static constexpr SizedSSortOrderSet(1, sSort) =
 		{1, 0, 0, {{PR_EC_HIERARCHYID, TABLE_SORT_ASCEND}}};
 
@@ -827,7 +901,7 @@ static HRESULT ProcessQueue(const char *smtp, int port, const char *path)
 	if (bQuit) {
 		size_t ulCount = 0;
 		while (ulCount < 60) {
-			size_t ulThreads = mapSendData.size();
+			size_t ulThreads = sp_inflight();
 			if (ulThreads == 0)
 				break;
 			if ((ulCount % 5) == 0)
@@ -838,7 +912,7 @@ static HRESULT ProcessQueue(const char *smtp, int port, const char *path)
 			++ulCount;
 		}
 		if (ulCount == 60)
-			ec_log_debug("%zu threads did not yet exit, closing anyway.", mapSendData.size());
+			ec_log_debug("%zu threads did not yet exit, closing anyway.", sp_inflight());
 	}
 	else if (nReload) {
 		ec_log_warn("Table reload requested, breaking server connection");
@@ -931,6 +1005,8 @@ static int main2(int argc, char **argv)
 		{ "sslkey_file", "" },
 		{ "sslkey_pass", "", CONFIGSETTING_EXACT },
 		{ "max_threads", "5", CONFIGSETTING_RELOADABLE },
+		{"smtp_idle_connections", "5", CONFIGSETTING_RELOADABLE},
+		{"smtp_idle_timeout", "30", CONFIGSETTING_RELOADABLE},
 		{ "fax_domain", "", CONFIGSETTING_RELOADABLE },
 		{ "fax_international", "+", CONFIGSETTING_RELOADABLE },
 		{ "always_send_delegates", "no", CONFIGSETTING_RELOADABLE },
@@ -949,6 +1025,7 @@ static int main2(int argc, char **argv)
 		{"statsclient_url", "unix:/var/run/kopano/statsd.sock", CONFIGSETTING_RELOADABLE},
 		{"statsclient_interval", "0", CONFIGSETTING_RELOADABLE},
 		{"statsclient_ssl_verify", "yes", CONFIGSETTING_RELOADABLE},
+		{"metrics_listen", ""},
 		{ "tmp_path", "/tmp" },
 		{"log_raw_message_path", "/var/lib/kopano", CONFIGSETTING_RELOADABLE},
 		{"log_raw_message_stage1", "no", CONFIGSETTING_RELOADABLE},
@@ -1156,7 +1233,9 @@ static int main2(int argc, char **argv)
 		     g_lpLogger, bDoSentMail);
 	} else {
 		sc->start();
+		sp_smtp_pool_configure();
 		hr = running_server(szSMTP, ulPort, szPath);
+		smtp_pool_flush();
 	}
 	if (!bForked)
 		ec_log_info("Spooler shutdown complete");
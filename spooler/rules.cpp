@@ -3,11 +3,19 @@
  * Copyright 2005 - 2016 Zarafa and its licensors
  */
 #include <kopano/platform.h>
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
 #include <chrono>
 #include <cstring>
+#include <deque>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <list>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 #include "rules.h"
@@ -34,6 +42,7 @@
 
 using namespace KC;
 using namespace std::string_literals;
+using U_ICU_NAMESPACE::UnicodeString;
 extern std::shared_ptr<ECConfig> g_lpConfig;
 
 enum actstatus {
@@ -1157,14 +1166,619 @@ static HRESULT proc_op_act(rulexec &rei, const ACTION &action)
 	return hrSuccess;
 }
 
-// lpMessage: gets EntryID, maybe pass this and close message in DAgent.cpp
-HRESULT HrProcessRules(const std::string &recip, pym_plugin_intf *pyMapiPlugin,
-    IMAPISession *lpSession, IAddrBook *lpAdrBook, IMsgStore *lpOrigStore,
-    IMAPIFolder *lpOrigInbox, IMessage *lppMessage, StatsClient *const sc)
+/*
+ * Compiled rule programs
+ *
+ * Every delivery used to deserialize PR_RULES_DATA into a table and walk
+ * the condition of each rule against the message from scratch. The rules
+ * of an inbox are now compiled once into a rule_program: conditions
+ * become trees of AND/OR/NOT nodes over interned leaf predicates, so that
+ * a predicate shared by several rules is only tested once per message,
+ * and substring needles are normalized in advance. Programs are cached per
+ * inbox and reused for as long as PR_RULES_DATA is unchanged.
+ */
+#define RULE_MAX_RECURSE_LEVEL 16 /* same as TestRestriction */
+#define RULE_CACHE_MAX 4096
+
+namespace {
+
+struct rule_leaf {
+	const SRestriction *res = nullptr;
+	unsigned int level = 0;
+	std::vector<unsigned int> tags; /* properties read by the predicate */
+	unsigned int subobj = ~0U; /* RES_SUBRESTRICTION: index into rule_program::subobjs */
+	bool prepared = false, icase = false; /* FL_SUBSTRING string search */
+	UnicodeString needle;
+};
+
+struct rule_node {
+	unsigned int rt = 0, leaf = 0;
+	HRESULT error = hrSuccess; /* fixed outcome, e.g. nesting too deep */
+	std::vector<rule_node> child;
+};
+
+struct rule_subobj {
+	unsigned int tag = 0;
+	std::set<unsigned int> colset;
+	memory_ptr<SPropTagArray> cols;
+};
+
+struct compiled_rule {
+	std::string name;
+	const SPropValue *state = nullptr;
+	const SRestriction *condition = nullptr;
+	const ACTIONS *actions = nullptr;
+	rule_node cond;
+	mutable std::atomic<unsigned int> evaluated{0}, matched{0};
+	mutable std::atomic<uint64_t> eval_usec{0};
+};
+
+struct rule_program {
+	std::string data; /* PR_RULES_DATA the program was compiled from */
+	rowset_ptr rows; /* owns the conditions and actions */
+	std::vector<rule_leaf> leaves;
+	std::vector<rule_subobj> subobjs;
+	std::deque<compiled_rule> rules;
+	unsigned int nrefs = 0; /* leaf references before interning */
+};
+
+class rule_compiler final {
+	public:
+	rule_compiler(rule_program &p) : m_prog(p) {}
+	void compile(const SRestriction *, rule_node &, unsigned int level = 0);
+	HRESULT finish();
+
+	private:
+	unsigned int add_leaf(const SRestriction *, unsigned int level, HRESULT &);
+	HRESULT subobj_tags(const SRestriction *, std::set<unsigned int> &, unsigned int level);
+
+	rule_program &m_prog;
+	std::map<std::string, unsigned int> m_keys;
+};
+
+/* The state of one message while the rules are being evaluated against it */
+class rule_msg_view final {
+	public:
+	rule_msg_view(const rule_program &, IMessage *, const ECLocale &);
+	HRESULT eval(const rule_node &);
+	void reset();
+	unsigned int reused = 0;
+
+	private:
+	struct prop_entry {
+		HRESULT ret = hrSuccess;
+		memory_ptr<SPropValue> pv;
+	};
+	struct form_entry {
+		bool ok = false;
+		UnicodeString str;
+	};
+	struct sub_entry {
+		bool loaded = false;
+		HRESULT ret = hrSuccess;
+		rowset_ptr rows;
+	};
+
+	HRESULT leaf(const rule_leaf &);
+	HRESULT leaf_substring(const rule_leaf &);
+	HRESULT leaf_subobj(const rule_leaf &);
+	HRESULT prop(unsigned int tag, const SPropValue **, bool full = true);
+
+	const rule_program &m_prog;
+	IMessage *m_msg;
+	const ECLocale &m_locale;
+	std::vector<HRESULT> m_leafret;
+	std::vector<bool> m_leafdone;
+	std::map<unsigned int, prop_entry> m_props, m_brief;
+	std::map<std::pair<unsigned int, bool>, form_entry> m_forms;
+	std::vector<sub_entry> m_sub;
+};
+
+}
+
+/**
+ * Build a key that is equal for two leaf restrictions if and only if they
+ * test the same thing. Returns false for restrictions that are not worth
+ * interning (or that cannot be keyed), which then get a leaf of their own.
+ */
+static bool rule_leaf_key(const SRestriction &r, std::string &key)
+{
+	auto app = [&](const void *p, size_t z) { key.append(static_cast<const char *>(p), z); };
+	auto app_prop = [&](const SPropValue *pv) {
+		if (pv == nullptr)
+			return false;
+		app(&pv->ulPropTag, sizeof(pv->ulPropTag));
+		switch (PROP_TYPE(pv->ulPropTag)) {
+		case PT_I2: app(&pv->Value.i, sizeof(pv->Value.i)); return true;
+		case PT_LONG: app(&pv->Value.ul, sizeof(pv->Value.ul)); return true;
+		case PT_BOOLEAN: app(&pv->Value.b, sizeof(pv->Value.b)); return true;
+		case PT_R4: app(&pv->Value.flt, sizeof(pv->Value.flt)); return true;
+		case PT_DOUBLE:
+		case PT_APPTIME: app(&pv->Value.dbl, sizeof(pv->Value.dbl)); return true;
+		case PT_CURRENCY: app(&pv->Value.cur, sizeof(pv->Value.cur)); return true;
+		case PT_SYSTIME: app(&pv->Value.ft, sizeof(pv->Value.ft)); return true;
+		case PT_I8: app(&pv->Value.li, sizeof(pv->Value.li)); return true;
+		case PT_STRING8:
+			if (pv->Value.lpszA == nullptr)
+				return false;
+			key += pv->Value.lpszA;
+			return true;
+		case PT_UNICODE:
+			if (pv->Value.lpszW == nullptr)
+				return false;
+			app(pv->Value.lpszW, wcslen(pv->Value.lpszW) * sizeof(wchar_t));
+			return true;
+		case PT_BINARY:
+			app(&pv->Value.bin.cb, sizeof(pv->Value.bin.cb));
+			app(pv->Value.bin.lpb, pv->Value.bin.cb);
+			return true;
+		case PT_CLSID:
+			if (pv->Value.lpguid == nullptr)
+				return false;
+			app(pv->Value.lpguid, sizeof(GUID));
+			return true;
+		}
+		return false;
+	};
+
+	key.assign(reinterpret_cast<const char *>(&r.rt), sizeof(r.rt));
+	switch (r.rt) {
+	case RES_CONTENT:
+		app(&r.res.resContent.ulFuzzyLevel, sizeof(r.res.resContent.ulFuzzyLevel));
+		app(&r.res.resContent.ulPropTag, sizeof(r.res.resContent.ulPropTag));
+		return app_prop(r.res.resContent.lpProp);
+	case RES_PROPERTY:
+		app(&r.res.resProperty.relop, sizeof(r.res.resProperty.relop));
+		app(&r.res.resProperty.ulPropTag, sizeof(r.res.resProperty.ulPropTag));
+		return app_prop(r.res.resProperty.lpProp);
+	case RES_COMPAREPROPS:
+		app(&r.res.resCompareProps.relop, sizeof(r.res.resCompareProps.relop));
+		app(&r.res.resCompareProps.ulPropTag1, sizeof(r.res.resCompareProps.ulPropTag1));
+		app(&r.res.resCompareProps.ulPropTag2, sizeof(r.res.resCompareProps.ulPropTag2));
+		return true;
+	case RES_BITMASK:
+		app(&r.res.resBitMask.relBMR, sizeof(r.res.resBitMask.relBMR));
+		app(&r.res.resBitMask.ulPropTag, sizeof(r.res.resBitMask.ulPropTag));
+		app(&r.res.resBitMask.ulMask, sizeof(r.res.resBitMask.ulMask));
+		return true;
+	case RES_SIZE:
+		app(&r.res.resSize.relop, sizeof(r.res.resSize.relop));
+		app(&r.res.resSize.ulPropTag, sizeof(r.res.resSize.ulPropTag));
+		app(&r.res.resSize.cb, sizeof(r.res.resSize.cb));
+		return true;
+	case RES_EXIST:
+		app(&r.res.resExist.ulPropTag, sizeof(r.res.resExist.ulPropTag));
+		return true;
+	}
+	return false;
+}
+
+/* Collect the columns needed to test @r on the rows of a subobject table. */
+HRESULT rule_compiler::subobj_tags(const SRestriction *r,
+    std::set<unsigned int> &tags, unsigned int level)
+{
+	if (level > RULE_MAX_RECURSE_LEVEL)
+		return MAPI_E_TOO_COMPLEX;
+	if (r == nullptr)
+		return MAPI_E_INVALID_PARAMETER;
+	switch (r->rt) {
+	case RES_AND:
+	case RES_OR:
+		for (unsigned int i = 0; i < r->res.resAnd.cRes; ++i) {
+			auto ret = subobj_tags(&r->res.resAnd.lpRes[i], tags, level + 1);
+			if (ret != hrSuccess)
+				return ret;
+		}
+		break;
+	case RES_NOT:
+		return subobj_tags(r->res.resNot.lpRes, tags, level + 1);
+	case RES_COMMENT:
+		return subobj_tags(r->res.resComment.lpRes, tags, level + 1);
+	case RES_SUBRESTRICTION:
+		tags.emplace(r->res.resSub.ulSubObject);
+		return subobj_tags(r->res.resSub.lpRes, tags, level + 1);
+	case RES_CONTENT:
+		tags.emplace(r->res.resContent.ulPropTag);
+		break;
+	case RES_PROPERTY:
+		tags.emplace(r->res.resProperty.ulPropTag);
+		break;
+	case RES_COMPAREPROPS:
+		tags.emplace(r->res.resCompareProps.ulPropTag1);
+		tags.emplace(r->res.resCompareProps.ulPropTag2);
+		break;
+	case RES_BITMASK:
+		tags.emplace(r->res.resBitMask.ulPropTag);
+		break;
+	case RES_SIZE:
+		tags.emplace(r->res.resSize.ulPropTag);
+		break;
+	case RES_EXIST:
+		tags.emplace(r->res.resExist.ulPropTag);
+		break;
+	}
+	return hrSuccess;
+}
+
+unsigned int rule_compiler::add_leaf(const SRestriction *r, unsigned int level,
+    HRESULT &error)
+{
+	std::string key;
+	bool keyed = rule_leaf_key(*r, key);
+	++m_prog.nrefs;
+	if (keyed) {
+		auto i = m_keys.find(key);
+		if (i != m_keys.cend())
+			return i->second;
+	}
+
+	rule_leaf leaf;
+	leaf.res = r;
+	leaf.level = level;
+	switch (r->rt) {
+	case RES_CONTENT: {
+		leaf.tags.emplace_back(r->res.resContent.ulPropTag);
+		auto type = PROP_TYPE(r->res.resContent.ulPropTag);
+		auto fuzzy = r->res.resContent.ulFuzzyLevel;
+		auto pv = r->res.resContent.lpProp;
+		if ((fuzzy & 0xFFFF) != FL_SUBSTRING || pv == nullptr)
+			break;
+		leaf.icase = fuzzy & FL_IGNORECASE;
+		if (type == PT_STRING8 && pv->Value.lpszA != nullptr)
+			leaf.prepared = str_search_form(pv->Value.lpszA, leaf.icase, leaf.needle);
+		else if (type == PT_UNICODE && pv->Value.lpszW != nullptr)
+			leaf.prepared = wcs_search_form(pv->Value.lpszW, leaf.icase, leaf.needle);
+		break;
+	}
+	case RES_PROPERTY:
+		leaf.tags.emplace_back(r->res.resProperty.ulPropTag);
+		break;
+	case RES_COMPAREPROPS:
+		leaf.tags.emplace_back(r->res.resCompareProps.ulPropTag1);
+		leaf.tags.emplace_back(r->res.resCompareProps.ulPropTag2);
+		break;
+	case RES_BITMASK:
+		leaf.tags.emplace_back(r->res.resBitMask.ulPropTag);
+		break;
+	case RES_SIZE:
+		leaf.tags.emplace_back(r->res.resSize.ulPropTag);
+		break;
+	case RES_EXIST:
+		leaf.tags.emplace_back(r->res.resExist.ulPropTag);
+		break;
+	case RES_SUBRESTRICTION: {
+		auto tag = r->res.resSub.ulSubObject;
+		auto i = std::find_if(m_prog.subobjs.begin(), m_prog.subobjs.end(),
+		         [=](const rule_subobj &s) { return s.tag == tag; });
+		if (i == m_prog.subobjs.end()) {
+			m_prog.subobjs.emplace_back();
+			i = std::prev(m_prog.subobjs.end());
+			i->tag = tag;
+		}
+		leaf.subobj = std::distance(m_prog.subobjs.begin(), i);
+		error = subobj_tags(r->res.resSub.lpRes, i->colset, level + 1);
+		break;
+	}
+	}
+	m_prog.leaves.emplace_back(std::move(leaf));
+	unsigned int idx = m_prog.leaves.size() - 1;
+	if (keyed)
+		m_keys.emplace(std::move(key), idx);
+	return idx;
+}
+
+void rule_compiler::compile(const SRestriction *r, rule_node &node,
+    unsigned int level)
+{
+	if (level > RULE_MAX_RECURSE_LEVEL) {
+		node.error = MAPI_E_TOO_COMPLEX;
+		return;
+	}
+	if (r == nullptr) {
+		node.error = MAPI_E_INVALID_PARAMETER;
+		return;
+	}
+	switch (r->rt) {
+	case RES_AND:
+	case RES_OR:
+		node.rt = r->rt;
+		node.child.resize(r->res.resAnd.cRes);
+		for (unsigned int i = 0; i < r->res.resAnd.cRes; ++i)
+			compile(&r->res.resAnd.lpRes[i], node.child[i], level + 1);
+		return;
+	case RES_NOT:
+		node.rt = r->rt;
+		node.child.resize(1);
+		compile(r->res.resNot.lpRes, node.child[0], level + 1);
+		return;
+	case RES_COMMENT:
+		/* A comment matches exactly when its inner restriction does. */
+		compile(r->res.resComment.lpRes, node, level + 1);
+		return;
+	}
+	node.rt = r->rt;
+	node.leaf = add_leaf(r, level, node.error);
+}
+
+HRESULT rule_compiler::finish()
+{
+	for (auto &s : m_prog.subobjs) {
+		auto ret = MAPIAllocateBuffer(CbNewSPropTagArray(s.colset.size()), &~s.cols);
+		if (ret != hrSuccess)
+			return ret;
+		s.cols->cValues = 0;
+		for (auto tag : s.colset)
+			s.cols->aulPropTag[s.cols->cValues++] = tag;
+	}
+	return hrSuccess;
+}
+
+rule_msg_view::rule_msg_view(const rule_program &p, IMessage *msg,
+    const ECLocale &locale) :
+	m_prog(p), m_msg(msg), m_locale(locale),
+	m_leafret(p.leaves.size()), m_leafdone(p.leaves.size()),
+	m_sub(p.subobjs.size())
+{}
+
+/**
+ * Forget everything learned about the message. Needs to be called when
+ * rule actions may have modified it.
+ */
+void rule_msg_view::reset()
+{
+	std::fill(m_leafdone.begin(), m_leafdone.end(), false);
+	m_props.clear();
+	m_brief.clear();
+	m_forms.clear();
+	for (auto &s : m_sub) {
+		s.loaded = false;
+		s.rows.reset();
+	}
+}
+
+/*
+ * With @full unset, the property is only read with GetProps, so that testing
+ * for a large property like PR_BODY does not stream it. A value that is too
+ * large to be returned inline is then represented by a zeroed placeholder,
+ * which is all RES_EXIST needs.
+ */
+HRESULT rule_msg_view::prop(unsigned int tag, const SPropValue **pv, bool full)
+{
+	auto i = m_props.find(tag);
+	if (i == m_props.end() && !full) {
+		i = m_brief.find(tag);
+		if (i != m_brief.end()) {
+			*pv = i->second.pv;
+			return i->second.ret;
+		}
+		i = m_brief.emplace(tag, prop_entry()).first;
+		auto &e = i->second;
+		const SizedSPropTagArray(1, spta) = {1, {tag}};
+		unsigned int nvals = 0;
+		e.ret = m_msg->GetProps(spta, 0, &nvals, &~e.pv);
+		if (HR_FAILED(e.ret)) {
+			e.pv.reset();
+		} else if (PROP_TYPE(e.pv->ulPropTag) != PT_ERROR) {
+			e.ret = hrSuccess;
+		} else if (e.pv->Value.err == MAPI_E_NOT_ENOUGH_MEMORY) {
+			e.pv->ulPropTag = tag;
+			memset(&e.pv->Value, 0, sizeof(e.pv->Value));
+			e.ret = hrSuccess;
+		} else {
+			e.ret = e.pv->Value.err;
+			e.pv.reset();
+		}
+		*pv = e.pv;
+		return e.ret;
+	}
+	if (i == m_props.end()) {
+		i = m_props.emplace(tag, prop_entry()).first;
+		i->second.ret = HrGetFullProp(m_msg, tag, &~i->second.pv);
+	}
+	*pv = i->second.pv;
+	return i->second.ret;
+}
+
+/*
+ * The composite nodes reproduce the result codes of TestRestriction
+ * exactly, including how errors of subexpressions propagate.
+ */
+HRESULT rule_msg_view::eval(const rule_node &node)
+{
+	if (node.error != hrSuccess)
+		return node.error;
+	switch (node.rt) {
+	case RES_AND:
+		if (node.child.empty())
+			return MAPI_E_NOT_FOUND;
+		for (const auto &c : node.child) {
+			auto ret = eval(c);
+			if (ret != hrSuccess)
+				return ret;
+		}
+		return hrSuccess;
+	case RES_OR: {
+		HRESULT ret = MAPI_E_NOT_FOUND;
+		for (const auto &c : node.child) {
+			ret = eval(c);
+			if (ret == hrSuccess || ret == MAPI_E_TOO_COMPLEX)
+				return ret;
+		}
+		return ret;
+	}
+	case RES_NOT: {
+		auto ret = eval(node.child[0]);
+		if (ret == MAPI_E_TOO_COMPLEX)
+			return ret;
+		return ret != hrSuccess ? hrSuccess : MAPI_E_NOT_FOUND;
+	}
+	}
+	if (m_leafdone[node.leaf]) {
+		++reused;
+		return m_leafret[node.leaf];
+	}
+	auto ret = leaf(m_prog.leaves[node.leaf]);
+	m_leafret[node.leaf] = ret;
+	m_leafdone[node.leaf] = true;
+	return ret;
+}
+
+HRESULT rule_msg_view::leaf(const rule_leaf &l)
+{
+	if (l.prepared)
+		return leaf_substring(l);
+	if (l.subobj != ~0U)
+		return leaf_subobj(l);
+
+	/*
+	 * Hand TestRestriction a row with the (memoized) properties the
+	 * predicate reads, so that the comparison semantics stay its own.
+	 */
+	std::vector<SPropValue> row;
+	bool full = l.res->rt != RES_EXIST && l.res->rt != RES_BITMASK;
+	for (auto tag : l.tags) {
+		const SPropValue *pv = nullptr;
+		auto ret = prop(tag, &pv, full);
+		if (ret == hrSuccess)
+			row.emplace_back(*pv);
+		else if (ret != MAPI_E_NOT_FOUND && l.res->rt != RES_EXIST)
+			return ret;
+	}
+	return TestRestriction(l.res, row.size(), row.data(), m_locale, l.level);
+}
+
+HRESULT rule_msg_view::leaf_substring(const rule_leaf &l)
+{
+	auto tag = l.res->res.resContent.ulPropTag;
+	const SPropValue *pv = nullptr;
+	auto ret = prop(tag, &pv);
+	if (ret != hrSuccess)
+		return ret;
+	auto i = m_forms.find({tag, l.icase});
+	if (i == m_forms.end()) {
+		i = m_forms.emplace(std::make_pair(tag, l.icase), form_entry()).first;
+		auto &f = i->second;
+		if (PROP_TYPE(tag) == PT_STRING8 && pv->Value.lpszA != nullptr)
+			f.ok = str_search_form(pv->Value.lpszA, l.icase, f.str);
+		else if (PROP_TYPE(tag) == PT_UNICODE && pv->Value.lpszW != nullptr)
+			f.ok = wcs_search_form(pv->Value.lpszW, l.icase, f.str);
+	}
+	if (i->second.ok && search_form_contains(i->second.str, l.needle))
+		return hrSuccess;
+	return MAPI_E_NOT_FOUND;
+}
+
+/*
+ * A subrestriction matches if any row of the subobject table does. The
+ * table is read only once per message, with the columns of all rules.
+ */
+HRESULT rule_msg_view::leaf_subobj(const rule_leaf &l)
+{
+	auto &s = m_sub[l.subobj];
+	if (!s.loaded) {
+		const auto &so = m_prog.subobjs[l.subobj];
+		object_ptr<IMAPITable> table;
+		s.loaded = true;
+		s.ret = m_msg->OpenProperty(so.tag, &IID_IMAPITable, 0, 0, &~table);
+		if (s.ret != hrSuccess)
+			s.ret = MAPI_E_TOO_COMPLEX;
+		else
+			s.ret = HrQueryAllRows(table, so.cols, nullptr, nullptr, 0, &~s.rows);
+	}
+	if (s.ret != hrSuccess)
+		return s.ret;
+	for (unsigned int i = 0; i < s.rows.size(); ++i)
+		if (TestRestriction(l.res->res.resSub.lpRes, s.rows[i].cValues,
+		    s.rows[i].lpProps, m_locale, l.level + 1) == hrSuccess)
+			return hrSuccess;
+	return MAPI_E_NOT_FOUND;
+}
+
+/* Least recently used inboxes are at the back of rule_cache_lru */
+struct rule_cache_entry {
+	std::shared_ptr<const rule_program> prog;
+	std::list<std::string>::iterator lru;
+};
+
+static std::mutex rule_cache_lock;
+static std::unordered_map<std::string, rule_cache_entry> rule_cache;
+static std::list<std::string> rule_cache_lru;
+
+/**
+ * Read the serialized rules of @inbox. The exact bytes serve to tell
+ * whether a cached program is still current.
+ */
+static HRESULT rules_data_read(IMAPIFolder *inbox, std::string &data)
+{
+	object_ptr<IStream> stream;
+	char buf[4096];
+	unsigned int rd = 0;
+
+	data.clear();
+	if (inbox->OpenProperty(PR_RULES_DATA, &IID_IStream, 0, 0, &~stream) != hrSuccess)
+		/* No rules, same as ECExchangeModifyTable */
+		return hrSuccess;
+	do {
+		auto ret = stream->Read(buf, sizeof(buf), &rd);
+		if (ret != hrSuccess)
+			return ret;
+		data.append(buf, rd);
+	} while (rd > 0);
+	return hrSuccess;
+}
+
+static HRESULT rule_program_compile(rule_program &prog)
+{
+	rule_compiler comp(prog);
+
+	for (unsigned int i = 0; i < prog.rows.size(); ++i) {
+		const auto &row = prog.rows[i];
+		prog.rules.emplace_back();
+		auto &rule = prog.rules.back();
+		auto name = row.cfind(CHANGE_PROP_TYPE(PR_RULE_NAME, PT_STRING8));
+		rule.name = name != nullptr ? name->Value.lpszA : "(no name)";
+		rule.state = row.cfind(PR_RULE_STATE);
+		// NOTE: objects are placed in Value.lpszA, not Value.x
+		auto prop = row.cfind(PR_RULE_CONDITION);
+		if (prop != nullptr)
+			rule.condition = reinterpret_cast<const SRestriction *>(prop->Value.lpszA);
+		prop = row.cfind(PR_RULE_ACTIONS);
+		if (prop != nullptr)
+			rule.actions = reinterpret_cast<const ACTIONS *>(prop->Value.lpszA);
+		if (rule.condition != nullptr)
+			comp.compile(rule.condition, rule.cond);
+	}
+	return comp.finish();
+}
+
+/*
+ * Evaluate a single condition the way it would be as part of a compiled
+ * rule. Used by the tests to compare against TestRestriction.
+ */
+HRESULT rule_test_condition(const SRestriction *cond, IMessage *msg,
+    const ECLocale &locale)
+{
+	rule_program prog;
+	rule_compiler comp(prog);
+	rule_node node;
+	comp.compile(cond, node);
+	auto ret = comp.finish();
+	if (ret != hrSuccess)
+		return ret;
+	rule_msg_view view(prog, msg, locale);
+	return view.eval(node);
+}
+
+/**
+ * Get the compiled rules of @inbox, from the cache if PR_RULES_DATA has
+ * not changed since they were compiled. When a Python plugin is active,
+ * its PreRuleProcess hook gets to see (and may edit) the rules table, so
+ * the cache is not used then.
+ */
+static HRESULT rule_program_get(pym_plugin_intf *plugin, IMAPISession *ses,
+    IAddrBook *abook, IMsgStore *store, IMAPIFolder *inbox, StatsClient *sc,
+    std::shared_ptr<const rule_program> &out)
 {
-	object_ptr<IExchangeModifyTable> lpTable;
-	object_ptr<IMAPITable> lpView;
-	bool bOOFactive = false;
 	static constexpr SizedSPropTagArray(11, sptaRules) =
 		{11, {PR_RULE_ID, PR_RULE_IDS, PR_RULE_SEQUENCE, PR_RULE_STATE,
 		PR_RULE_USER_FLAGS, PR_RULE_CONDITION, PR_RULE_ACTIONS,
@@ -1172,35 +1786,92 @@ HRESULT HrProcessRules(const std::string &recip, pym_plugin_intf *pyMapiPlugin,
 		PR_RULE_LEVEL, PR_RULE_PROVIDER_DATA}};
 	static constexpr SizedSSortOrderSet(1, sosRules) =
 		{1, 0, 0, {{PR_RULE_SEQUENCE, TABLE_SORT_ASCEND}}};
-	std::string strRule;
-	const SRestriction *lpCondition = nullptr;
-	const ACTIONS *lpActions = nullptr;
-	memory_ptr<SPropValue> OOFProps;
-	unsigned int cValues, ulResult = 0;
-	SPropValue sForwardProps[4];
+	object_ptr<IExchangeModifyTable> lpTable;
 	object_ptr<IECExchangeModifyTable> lpECModifyTable;
-	auto dblStart = std::chrono::steady_clock::now();
+	object_ptr<IMAPITable> lpView;
+	memory_ptr<SPropValue> eid;
+	std::string key;
+	auto prog = std::make_shared<rule_program>();
+	unsigned int ulResult = 0;
+	bool use_cache = !plugin->may_edit_rules();
+
+	if (use_cache && HrGetOneProp(inbox, PR_ENTRYID, &~eid) == hrSuccess &&
+	    rules_data_read(inbox, prog->data) == hrSuccess) {
+		key.assign(reinterpret_cast<const char *>(eid->Value.bin.lpb), eid->Value.bin.cb);
+		std::lock_guard<std::mutex> lk(rule_cache_lock);
+		auto i = rule_cache.find(key);
+		if (i != rule_cache.cend() && i->second.prog->data == prog->data) {
+			sc->inc(SCN_RULES_CACHE_HIT);
+			rule_cache_lru.splice(rule_cache_lru.begin(), rule_cache_lru, i->second.lru);
+			out = i->second.prog;
+			return hrSuccess;
+		}
+	} else {
+		use_cache = false;
+	}
 
-	sc->inc(SCN_RULES_INVOKES);
-	auto hr = lpOrigInbox->OpenProperty(PR_RULES_TABLE, &IID_IExchangeModifyTable, 0, 0, &~lpTable);
-	if (hr != hrSuccess) {
-		sc->inc(SCN_RULES_INVOKES_FAIL);
+	sc->inc(SCN_RULES_CACHE_MISS);
+	auto hr = inbox->OpenProperty(PR_RULES_TABLE, &IID_IExchangeModifyTable, 0, 0, &~lpTable);
+	if (hr != hrSuccess)
 		return hr_lerrf(hr, "OpenProperty failed");
-	}
 	hr = lpTable->QueryInterface(IID_IECExchangeModifyTable, &~lpECModifyTable);
-	if(hr != hrSuccess) {
-		sc->inc(SCN_RULES_INVOKES_FAIL);
+	if (hr != hrSuccess)
 		return hr_lerrf(hr, "QueryInterface failed");
-	}
 	hr = lpECModifyTable->DisablePushToServer();
-	if(hr != hrSuccess) {
-		sc->inc(SCN_RULES_INVOKES_FAIL);
+	if (hr != hrSuccess)
 		return hr_lerrf(hr, "DisablePushToServer failed");
+	hr = plugin->RulesProcessing("PreRuleProcess", ses, abook, store, lpTable, &ulResult);
+	if (hr != hrSuccess)
+		return hr_lerrf(hr, "RulesProcessing failed");
+	//TODO do something with ulResults
+	hr = lpTable->GetTable(0, &~lpView);
+	if (hr != hrSuccess)
+		return hr_lerrf(hr, "GetTable failed");
+	hr = HrQueryAllRows(lpView, sptaRules, nullptr, sosRules, 0, &~prog->rows);
+	if (hr != hrSuccess)
+		return hr_lerrf(hr, "QueryRows failed");
+	hr = rule_program_compile(*prog);
+	if (hr != hrSuccess)
+		return hr_lerrf(hr, "Compiling rules failed");
+	ec_log_debug("Compiled %zu rules: %u predicates, %zu distinct",
+		prog->rules.size(), prog->nrefs, prog->leaves.size());
+	out = prog;
+	if (!use_cache)
+		return hrSuccess;
+	std::lock_guard<std::mutex> lk(rule_cache_lock);
+	auto i = rule_cache.find(key);
+	if (i != rule_cache.end()) {
+		i->second.prog = std::move(prog);
+		rule_cache_lru.splice(rule_cache_lru.begin(), rule_cache_lru, i->second.lru);
+		return hrSuccess;
 	}
-	hr = pyMapiPlugin->RulesProcessing("PreRuleProcess", lpSession, lpAdrBook, lpOrigStore, lpTable, &ulResult);
-	if(hr != hrSuccess) {
+	if (rule_cache.size() >= RULE_CACHE_MAX) {
+		rule_cache.erase(rule_cache_lru.back());
+		rule_cache_lru.pop_back();
+	}
+	rule_cache_lru.emplace_front(key);
+	rule_cache.emplace(std::move(key), rule_cache_entry{std::move(prog), rule_cache_lru.begin()});
+	return hrSuccess;
+}
+
+// lpMessage: gets EntryID, maybe pass this and close message in DAgent.cpp
+HRESULT HrProcessRules(const std::string &recip, pym_plugin_intf *pyMapiPlugin,
+    IMAPISession *lpSession, IAddrBook *lpAdrBook, IMsgStore *lpOrigStore,
+    IMAPIFolder *lpOrigInbox, IMessage *lppMessage, StatsClient *const sc)
+{
+	bool bOOFactive = false;
+	memory_ptr<SPropValue> OOFProps, locprop;
+	unsigned int cValues;
+	SPropValue sForwardProps[4];
+	std::shared_ptr<const rule_program> prog;
+	auto dblStart = std::chrono::steady_clock::now();
+
+	sc->inc(SCN_RULES_INVOKES);
+	auto hr = rule_program_get(pyMapiPlugin, lpSession, lpAdrBook,
+	          lpOrigStore, lpOrigInbox, sc, prog);
+	if (hr != hrSuccess) {
 		sc->inc(SCN_RULES_INVOKES_FAIL);
-		return hr_lerrf(hr, "RulesProcessing failed");
+		return hr;
 	}
 
 	// get OOF-state for recipient-store
@@ -1224,43 +1895,20 @@ HRESULT HrProcessRules(const std::string &recip, pym_plugin_intf *pyMapiPlugin,
 		}
 	}
 
-	//TODO do something with ulResults
-	hr = lpTable->GetTable(0, &~lpView);
-	if(hr != hrSuccess) {
-		sc->inc(SCN_RULES_INVOKES_FAIL);
-		return hr_lerrf(hr, "GetTable failed");
-	}
-	hr = lpView->SetColumns(sptaRules, 0);
-	if (hr != hrSuccess) {
-		sc->inc(SCN_RULES_INVOKES_FAIL);
-		return hr_lerrf(hr, "SetColumns failed");
-	}
-	hr = lpView->SortTable(sosRules, 0);
-	if (hr != hrSuccess) {
-		sc->inc(SCN_RULES_INVOKES_FAIL);
-		return hr_lerrf(hr, "SortTable failed");
+	auto loc = createLocaleFromName("");
+	if (HrGetOneProp(lpOrigStore, PR_SORT_LOCALE_ID, &~locprop) == hrSuccess) {
+		const char *localestring = nullptr;
+		if (LCIDToLocaleId(locprop->Value.ul, &localestring) == hrSuccess)
+			loc = createLocaleFromName(localestring);
 	}
 
-	while (1) {
-		rowset_ptr lpRowSet;
-	        hr = lpView->QueryRows(1, 0, &~lpRowSet);
-		if (hr != hrSuccess) {
-			sc->inc(SCN_RULES_INVOKES_FAIL);
-			return hr_lerrf(hr, "QueryRows failed");
-		}
-	        if (lpRowSet->cRows == 0)
-			break;
-
-		sc->inc(SCN_RULES_NRULES, static_cast<int64_t>(lpRowSet->cRows));
-		auto lpRuleName = lpRowSet[0].cfind(CHANGE_PROP_TYPE(PR_RULE_NAME, PT_STRING8));
-		if (lpRuleName)
-			strRule = lpRuleName->Value.lpszA;
-		else
-			strRule = "(no name)";
-
-		rei.name = strRule.c_str();
+	rule_msg_view view(*prog, lppMessage, loc);
+	hr = hrSuccess;
+	for (const auto &rule : prog->rules) {
+		sc->inc(SCN_RULES_NRULES);
+		rei.name = rule.name.c_str();
 		ec_log_debug("Processing rule \"%s\" for \"%s\"", rei.name, rei.recip);
-		auto lpRuleState = lpRowSet[0].cfind(PR_RULE_STATE);
+		auto lpRuleState = rule.state;
 		if (lpRuleState == nullptr) {
 			ec_log_warn("Rule \"%s\" for \"%s\" skipped, having no PR_RULE_STATE property.", rei.name, rei.recip);
 			continue;
@@ -1273,58 +1921,47 @@ HRESULT HrProcessRules(const std::string &recip, pym_plugin_intf *pyMapiPlugin,
 			ec_log_debug("Rule \"%s\" marked for OOF, but OOF not active, skipping.", rei.name);
 			continue;
 		}
-
-		lpCondition = NULL;
-		lpActions = NULL;
-		auto lpProp = lpRowSet[0].cfind(PR_RULE_CONDITION);
-		if (lpProp)
-			// NOTE: object is placed in Value.lpszA, not Value.x
-			lpCondition = reinterpret_cast<const SRestriction *>(lpProp->Value.lpszA);
-		if (!lpCondition) {
+		if (rule.condition == nullptr) {
 			ec_log_debug("Rule \"%s\" has no condition, skipping.", rei.name);
 			continue;
 		}
-		lpProp = lpRowSet[0].cfind(PR_RULE_ACTIONS);
-		if (lpProp)
-			// NOTE: object is placed in Value.lpszA, not Value.x
-			lpActions = reinterpret_cast<const ACTIONS *>(lpProp->Value.lpszA);
-		if (!lpActions) {
+		if (rule.actions == nullptr) {
 			ec_log_debug("Rule \"%s\" has no action, skipping.", rei.name);
 			continue;
 		}
 
 		// test if action should be done...
-		memory_ptr<SPropValue> locprop;
-		hr = HrGetOneProp(lpOrigStore, PR_SORT_LOCALE_ID, &~locprop);
-		auto loc = createLocaleFromName("");
-		if (hr == hrSuccess) {
-			const char *localestring = nullptr;
-			hr = LCIDToLocaleId(locprop->Value.ul, &localestring);
-			if (hr == hrSuccess)
-				loc = createLocaleFromName(localestring);
-		}
-		hr = TestRestriction(lpCondition, lppMessage, loc);
-		if (hr == MAPI_E_NOT_FOUND) {
+		auto t_eval = std::chrono::steady_clock::now();
+		auto ret = view.eval(rule.cond);
+		auto usec = std::chrono::duration_cast<std::chrono::microseconds>(decltype(t_eval)::clock::now() - t_eval).count();
+		unsigned int nevals = ++rule.evaluated, nmatches = rule.matched;
+		if (ret == hrSuccess)
+			nmatches = ++rule.matched;
+		rule.eval_usec += usec;
+		ec_log_debug("Rule \"%s\": evaluated in %lld us; %u of %u evaluations matched",
+			rei.name, static_cast<long long>(usec), nmatches, nevals);
+		if (ret == MAPI_E_NOT_FOUND) {
 			ec_log_info("Rule \"%s\" does not match", rei.name);
 			continue;
-		} else if (hr != hrSuccess) {
-			hr_lerr(hr, "Rule \"%s\"", rei.name);
+		} else if (ret != hrSuccess) {
+			hr_lerr(ret, "Rule \"%s\"", rei.name);
 			continue;
 		}
 		ec_log_info("Rule \"%s\" matches", rei.name);
-		rei.sc->inc(SCN_RULES_NACTIONS, static_cast<int64_t>(lpActions->cActions));
+		rei.sc->inc(SCN_RULES_NACTIONS, static_cast<int64_t>(rule.actions->cActions));
 
-		for (ULONG n = 0; n < lpActions->cActions; ++n) {
-			const auto &action = lpActions->lpAction[n];
+		for (ULONG n = 0; n < rule.actions->cActions; ++n) {
+			const auto &action = rule.actions->lpAction[n];
 			hr = proc_op_act(rei, action);
 			if (FAILED(hr))
 				goto exit;
 		} // end action loop
+		/* The actions may have changed the message */
+		view.reset();
 
-		if (lpRuleState && (lpRuleState->Value.ul & ST_EXIT_LEVEL))
+		if (lpRuleState->Value.ul & ST_EXIT_LEVEL)
 			break;
 	}
-
 	if (rei.was_forwarded) {
 		sForwardProps[0].ulPropTag = PR_ICON_INDEX;
 		sForwardProps[0].Value.ul = ICON_MAIL_FORWARDED;
@@ -1344,6 +1981,7 @@ HRESULT HrProcessRules(const std::string &recip, pym_plugin_intf *pyMapiPlugin,
 	if (hr != hrSuccess)
 		rei.sc->inc(SCN_RULES_INVOKES_FAIL);
 
+	rei.sc->inc(SCN_RULES_SHARED_PRED, static_cast<int64_t>(view.reused));
 	auto dblEnd = decltype(dblStart)::clock::now();
 	rei.sc->inc(SCN_RULES_TIME, std::chrono::duration_cast<std::chrono::milliseconds>(dblEnd - dblStart).count());
 	return hr;
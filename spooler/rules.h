@@ -7,10 +7,12 @@
 #include <mapix.h>
 #include <string>
 #include <vector>
+#include <kopano/ustringutil.h>
 #include "PyMapiPlugin.h"
 #include "StatsClient.h"
 
 class PyMapiPlugin;
 
 extern HRESULT HrProcessRules(const std::string &recip, pym_plugin_intf *, IMAPISession *, IAddrBook *, IMsgStore *, IMAPIFolder *inbox, IMessage *, KC::StatsClient *);
+extern HRESULT rule_test_condition(const SRestriction *, IMessage *, const KC::ECLocale &);
 extern bool dagent_avoid_autoreply(const std::vector<std::string> &headers);
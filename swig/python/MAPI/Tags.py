@@ -1414,6 +1414,7 @@ PR_EC_COMPANYID             = PROP_TAG(PT_LONG,               PR_EC_BASE+0x13)
 PR_EC_STORETYPE             = PROP_TAG(PT_LONG,               PR_EC_BASE+0x14)
 PR_EC_PARENT_HIERARCHYID    = PROP_TAG(PT_LONG,               PR_EC_BASE+0x15)
 PR_EC_QUOTA_MAIL_TIME       = PROP_TAG(PT_SYSTIME,            PR_EC_BASE+0x20)
+PR_EC_QUOTA_STATUS          = PROP_TAG(PT_LONG,               PR_EC_BASE+0x26)
 
 PR_ZC_CONTACT_STORE_ENTRYIDS =	PROP_TAG(PT_MV_BINARY,  PR_EC_BASE + 0x11)
 PR_ZC_CONTACT_FOLDER_ENTRYIDS =	PROP_TAG(PT_MV_BINARY,  PR_EC_BASE + 0x12)
@@ -1435,6 +1436,7 @@ PR_EC_STATSTABLE_SESSIONS	= PROP_TAG(PT_OBJECT,		PR_EC_BASE+0x31)
 PR_EC_STATSTABLE_USERS		= PROP_TAG(PT_OBJECT,		PR_EC_BASE+0x32)
 PR_EC_STATSTABLE_COMPANY	= PROP_TAG(PT_OBJECT,		PR_EC_BASE+0x33)
 PR_EC_STATSTABLE_SERVERS	= PROP_TAG(PT_OBJECT,		PR_EC_BASE+0x34)
+PR_EC_STATSTABLE_LATENCY	= PROP_TAG(PT_OBJECT,		PR_EC_BASE+0x35)
 
 # system stats
 PR_EC_STATS_SYSTEM_DESCRIPTION	= PROP_TAG(PT_TSTRING,		PR_EC_BASE+0x40)
@@ -1469,6 +1471,17 @@ PR_EC_COMPANY_ADMIN_W =         PROP_TAG(PT_UNICODE,    PR_EC_BASE+0x49)
 PR_EC_STATS_SESSION_CLIENT_APPLICATION_VERSION = PROP_TAG(PT_STRING8, PR_EC_BASE+0x54)
 PR_EC_STATS_SESSION_CLIENT_APPLICATION_MISC    = PROP_TAG(PT_STRING8, PR_EC_BASE+0x55)
 
+# latency stats
+PR_EC_STATS_LATENCY_COUNT	= PROP_TAG(PT_LONG,	PR_EC_BASE+0x56)
+PR_EC_STATS_LATENCY_AVG		= PROP_TAG(PT_DOUBLE,	PR_EC_BASE+0x57)
+PR_EC_STATS_LATENCY_P50		= PROP_TAG(PT_DOUBLE,	PR_EC_BASE+0x58)
+PR_EC_STATS_LATENCY_P90		= PROP_TAG(PT_DOUBLE,	PR_EC_BASE+0x59)
+PR_EC_STATS_LATENCY_P99		= PROP_TAG(PT_DOUBLE,	PR_EC_BASE+0x5A)
+PR_EC_STATS_LATENCY_MAX		= PROP_TAG(PT_DOUBLE,	PR_EC_BASE+0x5B)
+PR_EC_STATS_LATENCY_DB		= PROP_TAG(PT_DOUBLE,	PR_EC_BASE+0x5C)
+PR_EC_STATS_LATENCY_ATTACH	= PROP_TAG(PT_DOUBLE,	PR_EC_BASE+0x5D)
+PR_EC_STATS_LATENCY_SEND	= PROP_TAG(PT_DOUBLE,	PR_EC_BASE+0x5E)
+
 PR_EC_OUTOFOFFICE                   = PROP_TAG(PT_BOOLEAN,    PR_EC_BASE+0x60)
 PR_EC_OUTOFOFFICE_MSG               = PROP_TAG(PT_TSTRING,    PR_EC_BASE+0x61)
 PR_EC_OUTOFOFFICE_MSG_W             = PROP_TAG(PT_UNICODE,    PR_EC_BASE+0x61)
@@ -0,0 +1,336 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/*
+ * Checks the body format converters: plain->HTML->plain, plain->RTF->HTML
+ * and \fromhtml RTF->HTML round trips, and the bounded preview (max_out)
+ * of HrTextToHtml, HrTextToRtf and HrHtmlToText.
+ *
+ * Given a directory of messages (tests/mails), it additionally measures
+ * the converters over the text/plain and text/html parts of those
+ * messages, and over the same bodies blown up by repetition, to show how
+ * the converters scale.
+ *
+ * Usage: bodyconv [maildir [rounds]]
+ */
+#include <kopano/platform.h>
+#include <algorithm>
+#include <chrono>
+#include <clocale>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cwctype>
+#include <dirent.h>
+#include <fstream>
+#include <iterator>
+#include <mapiutil.h>
+#include <vmime/vmime.hpp>
+#include <kopano/MAPIErrors.h>
+#include <kopano/Util.h>
+#include <kopano/memory.hpp>
+#include <kopano/stringutil.h>
+#include <kopano/charset/convert.h>
+#include "../common/rtfutil.h"
+
+using namespace KC;
+using namespace std::chrono;
+using namespace std::string_literals;
+
+static constexpr unsigned int cp_utf8 = 65001;
+
+struct corpus {
+	std::vector<std::wstring> text;
+	std::vector<std::string> html, rtf;
+};
+
+static object_ptr<IStream> mkstream(const void *data, size_t len)
+{
+	object_ptr<IStream> s;
+	if (CreateStreamOnHGlobal(nullptr, true, &~s) != hrSuccess ||
+	    s->Write(data, len, nullptr) != hrSuccess ||
+	    s->Seek(large_int_zero, STREAM_SEEK_SET, nullptr) != hrSuccess)
+		abort();
+	return s;
+}
+
+template<typename T> static object_ptr<IStream> mkstream(const T &s)
+{
+	return mkstream(s.data(), s.size() * sizeof(s[0]));
+}
+
+/* Runs one stream conversion on @in and returns what it wrote. */
+template<typename R, typename T, typename F> static R convert(const T &in, F &&conv)
+{
+	auto src = mkstream(in);
+	object_ptr<IStream> dst;
+	if (CreateStreamOnHGlobal(nullptr, true, &~dst) != hrSuccess)
+		abort();
+	R out;
+	auto hr = conv(src.get(), dst.get());
+	if (hr == hrSuccess)
+		hr = Util::HrStreamToString(dst, out);
+	if (hr != hrSuccess) {
+		fprintf(stderr, "conversion failed: %s\n", GetMAPIErrorMessage(hr));
+		exit(EXIT_FAILURE);
+	}
+	/* HrHtmlToText writes a terminator */
+	while (!out.empty() && out.back() == 0)
+		out.pop_back();
+	return out;
+}
+
+static std::string text_to_html(const std::wstring &t, size_t max_out = 0)
+{
+	return convert<std::string>(t, [=](IStream *i, IStream *o) {
+		return Util::HrTextToHtml(i, o, cp_utf8, max_out);
+	});
+}
+
+static std::string text_to_rtf(const std::wstring &t, size_t max_out = 0)
+{
+	return convert<std::string>(t, [=](IStream *i, IStream *o) {
+		return Util::HrTextToRtf(i, o, max_out);
+	});
+}
+
+static std::wstring html_to_text(const std::string &h, size_t max_out = 0)
+{
+	return convert<std::wstring>(h, [=](IStream *i, IStream *o) {
+		return Util::HrHtmlToText(i, o, cp_utf8, max_out);
+	});
+}
+
+/* Collapses whitespace runs (line breaks included) and trims the ends. */
+static std::wstring squash(const std::wstring &s)
+{
+	std::wstring out;
+	for (auto c : s) {
+		if (!iswspace(c))
+			out += c;
+		else if (!out.empty() && out.back() != L' ')
+			out += L' ';
+	}
+	if (!out.empty() && out.back() == L' ')
+		out.pop_back();
+	return out;
+}
+
+static int fail(const char *what)
+{
+	fprintf(stderr, "FAIL: %s\n", what);
+	return 1;
+}
+
+static int check_text_html()
+{
+	static const wchar_t text[] = L"Hello <world> & \"friends\"\nsecond line";
+	auto html = text_to_html(text);
+	if (html.find("Hello &lt;world&gt; &amp; &quot;friends&quot;<br>\nsecond line") == std::string::npos)
+		return fail("text->html: escaped body missing");
+	if (html.find("charset=utf-8") == std::string::npos ||
+	    html.compare(html.size() - 7, 7, "</HTML>") != 0)
+		return fail("text->html: header or footer missing");
+	if (squash(html_to_text(html)) != L"Hello <world> & \"friends\" second line")
+		return fail("text->html->text: text differs");
+	return 0;
+}
+
+static int check_text_rtf()
+{
+	static const wchar_t text[] = L"curly {brace} and back\\slash\nnext\tline";
+	auto rtf = text_to_rtf(text);
+	if (rtf.find("\\fs20 curly \\{brace\\} and back\\\\slash\\line\nnext\\tab line}") == std::string::npos)
+		return fail("text->rtf: escaped body missing");
+	std::string html;
+	if (HrExtractHTMLFromTextRTF(rtf, html, cp_utf8) != hrSuccess)
+		return fail("text->rtf->html: extraction failed");
+	if (squash(html_to_text(html)).find(L"curly {brace} and back\\slash next") == std::wstring::npos)
+		return fail("text->rtf->html->text: text differs");
+	return 0;
+}
+
+static int check_rtf_html()
+{
+	static const char rtf[] =
+		"{\\rtf1\\ansi\\ansicpg1252\\fromhtml1 \\deff0{\\fonttbl\n"
+		"{\\f0\\fswiss Arial;}}\n"
+		"{\\*\\htmltag19 <html>}{\\*\\htmltag34 <body>}\n"
+		"{\\*\\htmltag64 <p>}Hello {\\*\\htmltag84 <b>}world{\\*\\htmltag92 </b>}\n"
+		"{\\*\\htmltag72 </p>}{\\*\\htmltag42 </body>}{\\*\\htmltag27 </html>}}";
+	std::string html;
+	if (!isrtfhtml(rtf, sizeof(rtf) - 1))
+		return fail("rtf: not recognized as \\fromhtml");
+	if (HrExtractHTMLFromRTF(rtf, html, cp_utf8) != hrSuccess)
+		return fail("rtf->html: extraction failed");
+	if (html.find("<p>Hello <b>world</b>") == std::string::npos)
+		return fail("rtf->html: tags or text missing");
+	if (squash(html_to_text(html)) != L"Hello world")
+		return fail("rtf->html->text: text differs");
+	return 0;
+}
+
+static int check_preview()
+{
+	std::wstring text(10000, L'a');
+	auto full_html = text_to_html(text);
+	auto html = text_to_html(text, 100);
+	auto body = html.find("SIZE=2>\n");
+	auto footer = html.find("</FONT>");
+	if (body == std::string::npos || footer == std::string::npos ||
+	    footer - body - 8 != 100)
+		return fail("text->html preview: body not cut at 100 characters");
+	if (html.compare(footer, std::string::npos, full_html, full_html.find("</FONT>"), std::string::npos) != 0)
+		return fail("text->html preview: footer missing");
+
+	/* Escapes are not split: "x\line\n" is 7 bytes, the next one no longer fits */
+	std::wstring lines;
+	for (unsigned int i = 0; i < 1000; ++i)
+		lines += L"x\n";
+	auto rtf = text_to_rtf(lines, 10);
+	body = rtf.find("\\fs20 ");
+	if (body == std::string::npos || rtf.substr(body + 6) != "x\\line\nx}")
+		return fail("text->rtf preview: not cut at a whole escape");
+
+	std::string page = "<html><body><p>";
+	for (unsigned int i = 0; i < 20000; ++i)
+		page += "word" + std::to_string(i) + " ";
+	page += "</p></body></html>";
+	auto full_text = html_to_text(page);
+	auto preview = html_to_text(page, 50);
+	if (preview.size() != 50 || full_text.compare(0, 50, preview) != 0)
+		return fail("html->text preview: not the first 50 characters");
+	return 0;
+}
+
+/* Bodies of the text/plain and text/html parts, decoded to wide text / UTF-8 */
+static void add_file(const std::string &file, corpus &c)
+{
+	std::ifstream fp(file);
+	std::string raw(std::istreambuf_iterator<char>(fp), {});
+	auto msg = vmime::make_shared<vmime::message>();
+	msg->parse(raw);
+	vmime::messageParser mp(msg);
+
+	for (const auto &part : mp.getTextPartList()) {
+		std::string data;
+		vmime::utility::outputStreamStringAdapter os(data);
+		part->getText()->extract(os);
+		auto cset = part->getCharset().getName();
+		std::wstring wide;
+		try {
+			wide = convert_to<std::wstring>(data, data.size(), cset.c_str());
+		} catch (const convert_exception &) {
+			continue;
+		}
+		if (part->getType().getSubType() == vmime::mediaTypes::TEXT_HTML)
+			c.html.emplace_back(convert_to<std::string>("utf-8", wide, rawsize(wide), CHARSET_WCHAR));
+		else
+			c.text.emplace_back(std::move(wide));
+	}
+}
+
+/* Realistic RTF bodies are what HrTextToRtf makes of the text bodies. */
+static void add_rtf(corpus &c)
+{
+	for (const auto &t : c.text)
+		c.rtf.emplace_back(text_to_rtf(t));
+}
+
+template<typename T, typename F> static void
+measure(const char *label, const std::vector<T> &in, unsigned int rounds, F &&conv)
+{
+	size_t bytes_in = 0, bytes_out = 0;
+	auto start = steady_clock::now();
+	for (unsigned int i = 0; i < rounds; ++i) {
+		for (const auto &body : in) {
+			bytes_in += body.size() * sizeof(body[0]);
+			bytes_out += conv(body);
+		}
+	}
+	auto ms = duration_cast<milliseconds>(steady_clock::now() - start).count();
+	printf("%-22s %6ld ms  %10zu bytes in  %10zu bytes out\n", label,
+	       static_cast<long>(ms), bytes_in, bytes_out);
+}
+
+static void run(const char *name, const corpus &c, unsigned int rounds)
+{
+	printf("== %s: %zu text, %zu HTML bodies ==\n", name, c.text.size(), c.html.size());
+	measure("text->rtf", c.text, rounds, [](const std::wstring &b) {
+		return text_to_rtf(b).size();
+	});
+	measure("text->html", c.text, rounds, [](const std::wstring &b) {
+		return text_to_html(b).size();
+	});
+	measure("text->html (4K)", c.text, rounds, [](const std::wstring &b) {
+		return text_to_html(b, 4096).size();
+	});
+	measure("html->text", c.html, rounds, [](const std::string &b) {
+		return html_to_text(b).size() * sizeof(wchar_t);
+	});
+	measure("html->text (4K)", c.html, rounds, [](const std::string &b) {
+		return html_to_text(b, 4096).size() * sizeof(wchar_t);
+	});
+	measure("html->rtf", c.html, rounds, [](const std::string &b) {
+		return convert<std::string>(b, [](IStream *i, IStream *o) {
+			return Util::HrHtmlToRtf(i, o, cp_utf8);
+		}).size();
+	});
+	measure("rtf->html", c.rtf, rounds, [](const std::string &b) {
+		std::string html;
+		if (HrExtractHTMLFromTextRTF(b, html, cp_utf8) != hrSuccess)
+			abort();
+		return html.size();
+	});
+}
+
+static int bench(const char *dir, unsigned int rounds)
+{
+	corpus c, large;
+	auto dh = opendir(dir);
+	if (dh == nullptr) {
+		fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	for (auto de = readdir(dh); de != nullptr; de = readdir(dh))
+		if (strstr(de->d_name, ".eml") != nullptr)
+			add_file(dir + "/"s + de->d_name, c);
+	closedir(dh);
+
+	for (const auto &t : c.text) {
+		std::wstring s;
+		for (unsigned int i = 0; i < 100; ++i)
+			s += t;
+		large.text.emplace_back(std::move(s));
+	}
+	/* Repeat the inside of the HTML document */
+	for (const auto &h : c.html) {
+		auto body = h;
+		auto end = strcasestr(body.c_str(), "</body");
+		if (end != nullptr)
+			body.resize(end - body.c_str());
+		std::string s = body;
+		for (unsigned int i = 1; i < 100; ++i)
+			s += body;
+		large.html.emplace_back(std::move(s));
+	}
+	add_rtf(c);
+	add_rtf(large);
+
+	run("mails", c, rounds);
+	run("mails x100", large, std::max(rounds / 100, 1U));
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, const char **argv)
+{
+	setlocale(LC_ALL, "");
+	int err = check_text_html() | check_text_rtf() | check_rtf_html() | check_preview();
+	fprintf(stderr, err == 0 ? "Overall success\n" : "Overall FAILURE\n");
+	if (err != 0)
+		return EXIT_FAILURE;
+	if (argc < 2)
+		return EXIT_SUCCESS;
+	return bench(argv[1], argc > 2 ? strtoul(argv[2], nullptr, 0) : 100);
+}
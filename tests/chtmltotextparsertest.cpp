@@ -1,9 +1,11 @@
 /* SPDX-License-Identifier: LGPL-3.0-or-later */
 /* Copyright 2016, Kopano and its licensors */
+#include <chrono>
 #include <fstream>
 #include <iostream>
 #include <string>
 #include <utility>
+#include <vector>
 #include <clocale>
 #include <cstdio>
 #include <cstdlib>
@@ -11,6 +13,7 @@
 #include <dirent.h>
 #include <unistd.h>
 #include <glob.h>
+#include <langinfo.h>
 #include <kopano/charset/convert.h>
 #include <kopano/stringutil.h>
 #include "HtmlToTextParser.h"
@@ -18,6 +21,7 @@
 #define TEST_FILES "tests/testdata/htmltoplain/*.test"
 
 using namespace KC;
+using namespace std::chrono;
 
 static int testhtml(std::string file)
 {
@@ -52,10 +56,70 @@ static int testhtml(std::string file)
 	if (ret != 0) {
 		std::cout << "Expected:\n\"\"\"" << convert_to<utf8string>(expectedhtml).m_str << "\"\"\"\n";
 		std::cout << "Observed:\n\"\"\"" << convert_to<utf8string>(parsed).m_str << "\"\"\"\n";
+		return ret;
 	}
+	if (strcmp(nl_langinfo(CODESET), "UTF-8") != 0)
+		return ret;
+
+	/* The UTF-8 entry point must give the same text */
+	CHtmlToTextParser u8parser;
+	std::ifstream rawfile(file.replace(file.find(".result"), sizeof(".result")-1, ".test"));
+	std::string raw{std::istreambuf_iterator<char>(rawfile), std::istreambuf_iterator<char>()};
+	if (!u8parser.Parse(raw)) {
+		std::cerr << "Unable to parse UTF-8 HTML\n";
+		return EXIT_FAILURE;
+	}
+	ret = expectedhtml.compare(StringCRLFtoLF(std::wstring(u8parser.GetText())));
+	if (ret != 0)
+		std::cout << "UTF-8 input gives different text\n";
 	return ret;
 }
 
+template<typename F> static void bench(const char *label, size_t bytes,
+    unsigned int rounds, F &&parse)
+{
+	auto start = steady_clock::now();
+	for (unsigned int i = 0; i < rounds; ++i)
+		parse();
+	auto us = duration_cast<microseconds>(steady_clock::now() - start).count();
+	printf("%-26s %8.1f MB/s\n", label,
+	       us == 0 ? 0 : static_cast<double>(bytes) * rounds / us);
+}
+
+/*
+ * Throughput of the parser over all test files: from wchar_t input, from
+ * UTF-8 input, and from UTF-8 input going through a conversion to wchar_t
+ * first (what callers used to do).
+ */
+static int benchmark(const glob_t &files, unsigned int rounds)
+{
+	std::vector<std::string> docs;
+	std::vector<std::wstring> wdocs;
+	size_t bytes = 0;
+	for (size_t i = 0; i < files.gl_pathc; ++i) {
+		std::ifstream fp(files.gl_pathv[i]);
+		std::string doc{std::istreambuf_iterator<char>(fp), std::istreambuf_iterator<char>()};
+		bytes += doc.size();
+		wdocs.emplace_back(convert_to<std::wstring>(doc, doc.size(), "UTF-8"));
+		docs.emplace_back(std::move(doc));
+	}
+
+	printf("%zu files, %zu bytes of HTML, %u rounds\n", docs.size(), bytes, rounds);
+	bench("wchar_t input", bytes, rounds, [&]() {
+		for (const auto &doc : wdocs)
+			CHtmlToTextParser().Parse(doc.c_str());
+	});
+	bench("UTF-8 input", bytes, rounds, [&]() {
+		for (const auto &doc : docs)
+			CHtmlToTextParser().Parse(doc);
+	});
+	bench("UTF-8 via wchar_t", bytes, rounds, [&]() {
+		for (const auto &doc : docs)
+			CHtmlToTextParser().Parse(convert_to<std::wstring>(doc, doc.size(), "UTF-8").c_str());
+	});
+	return EXIT_SUCCESS;
+}
+
 int main(int argc, char **argv) {
 	glob_t glob_result;
 
@@ -70,6 +134,12 @@ int main(int argc, char **argv) {
 		return EXIT_FAILURE;
 	}
 
+	if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+		ret = benchmark(glob_result, argc > 2 ? strtoul(argv[2], nullptr, 0) : 500);
+		globfree(&glob_result);
+		return ret;
+	}
+
 	for (size_t i = 0; i < glob_result.gl_pathc; ++i) {
 		std::string file = glob_result.gl_pathv[i];
 		ret = testhtml(file);
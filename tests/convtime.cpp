@@ -0,0 +1,122 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+#include <chrono>
+#include <string>
+#include <vector>
+#include <clocale>
+#include <cstdio>
+#include <cstdlib>
+#include <iconv.h>
+#include <kopano/charset/convert.h>
+/*
+ * Measures charset conversion of property-like strings (subjects, display
+ * names, addresses, body snippets) through convert_context, which takes the
+ * non-iconv path for the Unicode pairs, against plain iconv(3) for the same
+ * pair. The results of both are compared as well.
+ */
+
+using namespace KC;
+using namespace std::chrono;
+
+static const char *const samples[] = {
+	"Re: Weekly status meeting",
+	"john.doe@example.com",
+	"Doe, John (Sales)",
+	"FW: Quarterly figures Q3 - final version.xlsx",
+	"Stra\xc3\x9f" "e 12, M\xc3\xbcnchen",
+	"R\xc3\xa9sum\xc3\xa9 \xe2\x80\x93 na\xc3\xafve caf\xc3\xa9",
+	"\xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82, \xd0\xbc\xd0\xb8\xd1\x80",
+	"\xe4\xbc\x9a\xe8\xad\xb0\xe3\x81\xae\xe3\x81\x8a\xe7\x9f\xa5\xe3\x82\x89\xe3\x81\x9b",
+	"Party \xf0\x9f\x8e\x89 at 5pm",
+	"Hello,\n\nplease find attached the documents we discussed yesterday. "
+	"Let me know if anything is missing.\n\nKind regards,\nJohn\n",
+};
+
+/* Same as iconv_context_base::doconvert does for //IGNORE: skip a byte, go on */
+static std::string plain_iconv(iconv_t cd, const std::string &in)
+{
+	std::string out(in.size() * 4 + 4, '\0');
+	auto src = const_cast<char *>(in.data());
+	auto dst = &out[0];
+	size_t srclen = in.size(), dstlen = out.size();
+	while (srclen > 0 && iconv(cd, &src, &srclen, &dst, &dstlen) == static_cast<size_t>(-1)) {
+		++src;
+		--srclen;
+	}
+	out.resize(out.size() - dstlen);
+	return out;
+}
+
+static std::string plain_iconv(const char *to, const char *from,
+    const std::string &in)
+{
+	auto cd = iconv_open(to, from);
+	if (cd == reinterpret_cast<iconv_t>(-1))
+		abort();
+	auto out = plain_iconv(cd, in);
+	iconv_close(cd);
+	return out;
+}
+
+static size_t elapsed(const steady_clock::time_point &start)
+{
+	return duration_cast<nanoseconds>(steady_clock::now() - start).count();
+}
+
+static bool run(const char *to, const char *from,
+    const std::vector<std::string> &input, unsigned int rounds)
+{
+	convert_context ctx;
+	bool ok = true;
+	for (const auto &s : input)
+		if (ctx.convert_to<std::string>(to, s, s.size(), from) != plain_iconv(to, from, s)) {
+			fprintf(stderr, "%s -> %s: mismatch\n", from, to);
+			ok = false;
+			break;
+		}
+
+	size_t bytes = 0;
+	auto start = steady_clock::now();
+	for (unsigned int i = 0; i < rounds; ++i)
+		for (const auto &s : input)
+			bytes += ctx.convert_to<std::string>(to, s, s.size(), from).size();
+	auto t_ctx = elapsed(start);
+
+	auto cd = iconv_open(to, from);
+	start = steady_clock::now();
+	for (unsigned int i = 0; i < rounds; ++i)
+		for (const auto &s : input)
+			plain_iconv(cd, s);
+	auto t_iconv = elapsed(start);
+	iconv_close(cd);
+	printf("%-9s -> %-9s: convert_context %6zu ms, iconv %6zu ms (%zu bytes out)\n",
+	       from, to, t_ctx / 1000000, t_iconv / 1000000, bytes);
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	setlocale(LC_ALL, "");
+	unsigned int rounds = argc > 1 ? strtoul(argv[1], nullptr, 0) : 20000;
+	std::vector<std::string> u8, u16, u32;
+	std::string body;
+	for (unsigned int i = 0; i < 20; ++i)
+		for (auto s : samples)
+			body += s;
+	for (auto s : samples)
+		u8.emplace_back(s);
+	u8.emplace_back(std::move(body));
+	for (const auto &s : u8) {
+		u16.emplace_back(plain_iconv(iconv_charset<std::u16string>::name(), "UTF-8", s));
+		u32.emplace_back(plain_iconv(CHARSET_WCHAR, "UTF-8", s));
+	}
+	/* Malformed input goes the iconv way from the broken byte onwards */
+	u8.emplace_back("broken \xc3 sequence \xe2\x82 and \xff more");
+
+	auto u16cs = iconv_charset<std::u16string>::name();
+	bool ok = run(CHARSET_WCHAR, "UTF-8", u8, rounds);
+	ok &= run("UTF-8", CHARSET_WCHAR, u32, rounds);
+	ok &= run(u16cs, "UTF-8", u8, rounds);
+	ok &= run("UTF-8", u16cs, u16, rounds);
+	ok &= run("UTF-8", "UTF-8", u8, rounds);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -4,16 +4,24 @@
 #include <utility>
 #include <cstdio>
 #include <cstdlib>
-#include <ctime>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <mapix.h>
 /*
  * This program simulates MAPIAllocateMore allocations to measure allocation
- * time. Some preparatory work is needed:
+ * time, once with the arena allocator and once with one malloc per
+ * allocation (MAPI_NO_ARENA). Each mode runs in its own process, so that
+ * the peak RSS can be compared as well.
  *
- * == Grab an allocation historgram ==
- * 1. Stick the following line into the MAPIFreeBuffer function:
- * 	fprintf(stderr, "!! %zu\n", head->children.size());
- *    This tell us the size of each allocation list at the end of its lifetime.
+ * Workloads:
+ *
+ * "testsuite" replays the number of MAPIAllocateMore calls per buffer as
+ * they occurred in a testsuite run (dist[] below). To refresh it:
+ *
+ * 1. Stick a counter into MAPIAllocateMore and print it in
+ *    MAPIFreeBuffer, e.g. fprintf(stderr, "!! %zu\n", count). This tells
+ *    us the size of each allocation list at the end of its lifetime.
  *
  * 2. Build KC and run the testsuite, then collect the "!!" lines from stderr
  *    into a file.
@@ -21,13 +29,11 @@
  * 3. Make a histogram {bangbangvalue, #occurrences} of the data, and rewrite
  *    dist[] accordingly.
  *
- * == Run ==
- * 4. This program then runs as many allocations as they occurred in the TS,
- *    and prints the walltime.
- *
- * 5. Now go, hack on MAPIAllocateMore, and bring down that walltime.
+ * "getprops" is a GetProps result: one SPropValue array and a string or
+ * binary for most of its properties.
  *
- * The allocation sizes do not matter, so that is fixed.
+ * "queryrows" is a QueryRows result of 50 rows: the SRowSet, and per row
+ * a property array with its strings and entryids.
  */
 
 /* MAPIAllocateBuffer size distribution */
@@ -51,44 +57,158 @@ static constexpr std::pair<unsigned int, unsigned int> dist[] = {
 	{1164, 1}, {1178, 1}, {1216, 1}, {1466, 1}, {1504, 1}, {1526, 1},
 	{1714, 1}, {2120, 1}, {2212, 1}, {2226, 1}, {2700, 1}, {3106, 1},
 };
-static constexpr size_t alloc_size = 32;
 
-int main()
+static size_t cnt_alloc, cnt_more;
+
+/* Cheap LCG, for sizes that vary the same way in every run */
+static unsigned int rnd(unsigned int &seed, unsigned int lo, unsigned int hi)
 {
-	struct timespec gstart, gstop, start, stop;
-	size_t cnt_alloc = 0, cnt_more = 0;
-	clock_gettime(CLOCK_MONOTONIC, &gstart);
+	seed = seed * 1103515245 + 12345;
+	return lo + (seed >> 16) % (hi - lo + 1);
+}
 
-	for (const auto &p : dist) {
-		decltype(p.first) nchildren = p.first;
-		decltype(p.second) noccr = p.second;
+static void *alloc(size_t size)
+{
+	void *buf = nullptr;
+	if (MAPIAllocateBuffer(size, &buf) != hrSuccess)
+		abort();
+	++cnt_alloc;
+	return buf;
+}
+
+static void *more(size_t size, void *base)
+{
+	void *buf = nullptr;
+	if (MAPIAllocateMore(size, base, &buf) != hrSuccess)
+		abort();
+	/* Touch it, as the caller would */
+	static_cast<char *>(buf)[0] = static_cast<char *>(buf)[size - 1] = 1;
+	++cnt_more;
+	return buf;
+}
 
-		cnt_alloc += noccr;
-		cnt_more += noccr * nchildren;
-		clock_gettime(CLOCK_MONOTONIC, &start);
-		for (decltype(noccr) i = 0; i < noccr; ++i) {
-			void *ibuf = nullptr;
-			auto ret = MAPIAllocateBuffer(alloc_size, &ibuf);
-			if (ret != hrSuccess)
-				abort();
-			for (decltype(nchildren) j = 0; j < nchildren; ++j) {
-				void *jbuf = nullptr;
-				if (MAPIAllocateMore(alloc_size, ibuf, &jbuf) != hrSuccess)
-					/* nothing */;
-			}
+static void testsuite()
+{
+	unsigned int seed = 1;
+	for (const auto &p : dist) {
+		for (unsigned int i = 0; i < p.second; ++i) {
+			auto ibuf = alloc(32);
+			for (unsigned int j = 0; j < p.first; ++j)
+				more(rnd(seed, 8, 128), ibuf);
 			MAPIFreeBuffer(ibuf);
 		}
-		clock_gettime(CLOCK_MONOTONIC, &stop);
-		auto delta = std::chrono::seconds(stop.tv_sec) + std::chrono::nanoseconds(stop.tv_nsec) -
-		             (std::chrono::seconds(start.tv_sec) + std::chrono::nanoseconds(start.tv_nsec));
-		printf("O-%u× C-%u: %zu ns\n", noccr, nchildren, static_cast<size_t>(delta.count()));
 	}
-	clock_gettime(CLOCK_MONOTONIC, &gstop);
-	auto delta = std::chrono::seconds(gstop.tv_sec) + std::chrono::nanoseconds(gstop.tv_nsec) -
-	             (std::chrono::seconds(gstart.tv_sec) + std::chrono::nanoseconds(gstart.tv_nsec));
-	printf("all %zu ns\n", static_cast<size_t>(delta.count()));
+}
+
+static void fill_props(void *base, unsigned int nprops, unsigned int &seed)
+{
+	for (unsigned int j = 0; j < nprops; ++j) {
+		auto kind = rnd(seed, 0, 3);
+		if (kind == 0)
+			continue; /* PT_LONG and such */
+		else if (kind == 1)
+			more(rnd(seed, 22, 70), base); /* entryid */
+		else
+			more(sizeof(wchar_t) * rnd(seed, 4, 80), base); /* string */
+	}
+}
 
-	printf("MAPIAllocateBuffer calls: %zu\n", cnt_alloc);
-	printf("MAPIAllocateMore calls: %zu\n", cnt_more);
+static void getprops()
+{
+	unsigned int seed = 2;
+	for (unsigned int i = 0; i < 100000; ++i) {
+		auto nprops = rnd(seed, 5, 60);
+		auto props = alloc(sizeof(SPropValue) * nprops);
+		fill_props(props, nprops, seed);
+		MAPIFreeBuffer(props);
+	}
+}
+
+static void queryrows()
+{
+	static constexpr unsigned int nrows = 50;
+	unsigned int seed = 3;
+	void *rowprops[nrows];
+	for (unsigned int i = 0; i < 10000; ++i) {
+		auto rows = alloc(CbNewSRowSet(nrows));
+		for (unsigned int r = 0; r < nrows; ++r) {
+			rowprops[r] = alloc(sizeof(SPropValue) * 12);
+			fill_props(rowprops[r], 12, seed);
+		}
+		for (unsigned int r = 0; r < nrows; ++r)
+			MAPIFreeBuffer(rowprops[r]);
+		MAPIFreeBuffer(rows);
+	}
+}
+
+/* Zero-size pieces must still be distinct and non-null */
+static bool zero_size()
+{
+	void *base = alloc(32), *a = nullptr, *b = nullptr;
+	bool ok = MAPIAllocateMore(0, base, &a) == hrSuccess &&
+	          MAPIAllocateMore(0, base, &b) == hrSuccess &&
+	          a != nullptr && b != nullptr && a != b;
+	MAPIFreeBuffer(base);
+	return ok;
+}
+
+static void measure(const char *label, void (*func)(), unsigned int rounds)
+{
+	cnt_alloc = cnt_more = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i < rounds; ++i)
+		func();
+	auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	printf("%-10s %8.2f ms  %6.1f ns/call  (%zu Buffer, %zu More)\n",
+	       label, ns / 1e6, static_cast<double>(ns) / (cnt_alloc + cnt_more),
+	       cnt_alloc, cnt_more);
+}
+
+static void run(const char *mode, unsigned int rounds)
+{
+	printf("== %s ==\n", mode);
+	if (!zero_size()) {
+		printf("MAPIAllocateMore(0) returned no unique pointer\n");
+		fflush(stdout);
+		_exit(EXIT_FAILURE);
+	}
+	measure("testsuite", testsuite, rounds);
+	measure("getprops", getprops, rounds);
+	measure("queryrows", queryrows, rounds);
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	printf("peak RSS   %8ld KiB\n", ru.ru_maxrss);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int rounds = argc > 1 ? strtoul(argv[1], nullptr, 0) : 1;
+	if (rounds == 0)
+		rounds = 1;
+	/*
+	 * The allocator mode is fixed at the first allocation in a process,
+	 * hence the fork per mode.
+	 */
+	for (bool arena : {false, true}) {
+		fflush(stdout);
+		auto pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return EXIT_FAILURE;
+		}
+		if (pid == 0) {
+			if (arena)
+				unsetenv("MAPI_NO_ARENA");
+			else
+				setenv("MAPI_NO_ARENA", "1", true);
+			run(arena ? "arena" : "malloc per allocation (MAPI_NO_ARENA)", rounds);
+			fflush(stdout);
+			_exit(EXIT_SUCCESS);
+		}
+		int status = 0;
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != EXIT_SUCCESS)
+			return EXIT_FAILURE;
+	}
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,159 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/*
+ * Checks that conditions evaluated by the compiled rule evaluator of the
+ * dagent give the same result as TestRestriction, on a message with a
+ * large body, flags and a recipient. Needs a running server.
+ */
+#include <memory>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <kopano/platform.h>
+#include <kopano/ECConfig.h>
+#include <kopano/ECRestriction.h>
+#include <kopano/MAPIErrors.h>
+#include <kopano/memory.hpp>
+#include <kopano/ustringutil.h>
+#include <mapi.h>
+#include <mapitags.h>
+#include <mapiutil.h>
+#include "tbi.hpp"
+#include "../spooler/rules.h"
+
+using namespace KC;
+
+std::shared_ptr<ECConfig> g_lpConfig; /* referenced by rules.cpp */
+
+static SPropValue sprop(unsigned int tag, const wchar_t *s)
+{
+	SPropValue p;
+	p.ulPropTag = tag;
+	p.Value.lpszW = const_cast<wchar_t *>(s);
+	return p;
+}
+
+static SPropValue lprop(unsigned int tag, unsigned int v)
+{
+	SPropValue p;
+	p.ulPropTag = tag;
+	p.Value.ul = v;
+	return p;
+}
+
+static void fill_message(IMessage *msg, const std::wstring &body)
+{
+	SPropValue props[] = {
+		sprop(PR_SUBJECT_W, L"Quarterly report"),
+		sprop(PR_BODY_W, body.c_str()),
+		lprop(PR_MESSAGE_FLAGS, MSGFLAG_READ),
+		lprop(PR_IMPORTANCE, IMPORTANCE_HIGH),
+	};
+	auto hr = msg->SetProps(ARRAY_SIZE(props), props, nullptr);
+	if (hr != hrSuccess)
+		throw KMAPIError(hr);
+
+	SPropValue rprops[] = {
+		lprop(PR_RECIPIENT_TYPE, MAPI_TO),
+		sprop(PR_DISPLAY_NAME_W, L"Bob"),
+		sprop(PR_EMAIL_ADDRESS_W, L"bob@example.com"),
+		sprop(PR_ADDRTYPE_W, L"SMTP"),
+	};
+	memory_ptr<ADRLIST> al;
+	hr = MAPIAllocateBuffer(CbNewADRLIST(1), &~al);
+	if (hr != hrSuccess)
+		throw KMAPIError(hr);
+	al->cEntries = 1;
+	al->aEntries[0].cValues = ARRAY_SIZE(rprops);
+	al->aEntries[0].rgPropVals = rprops;
+	hr = msg->ModifyRecipients(MODRECIP_ADD, al);
+	if (hr != hrSuccess)
+		throw KMAPIError(hr);
+}
+
+static int check(const char *name, const ECRestriction &res, IMessage *msg,
+    const ECLocale &locale, bool expect)
+{
+	memory_ptr<SRestriction> r;
+	auto hr = res.CreateMAPIRestriction(&~r, ECRestriction::Cheap);
+	if (hr != hrSuccess)
+		throw KMAPIError(hr);
+	auto want = TestRestriction(r, msg, locale);
+	auto got = rule_test_condition(r, msg, locale);
+	if (got != want) {
+		fprintf(stderr, "%s: compiled %s, TestRestriction %s\n", name,
+			GetMAPIErrorMessage(got), GetMAPIErrorMessage(want));
+		return 1;
+	}
+	if ((got == hrSuccess) != expect) {
+		fprintf(stderr, "%s: expected %s, got %s\n", name,
+			expect ? "match" : "no match", GetMAPIErrorMessage(got));
+		return 1;
+	}
+	return 0;
+}
+
+static int run()
+{
+	auto locale = createLocaleFromName("");
+	auto msg = KSession().open_default_store().open_root(MAPI_MODIFY).create_message();
+	/* Large enough not to be returned inline by GetProps */
+	std::wstring body(100000, L'x');
+	body.replace(70000, 6, L"needle");
+	fill_message(msg, body);
+
+	auto subj = sprop(PR_SUBJECT_W, L"QUARTERLY");
+	auto needle = sprop(PR_BODY_W, L"needle");
+	auto hay = sprop(PR_BODY_W, L"haystack");
+	auto high = lprop(PR_IMPORTANCE, IMPORTANCE_HIGH);
+	auto bob = sprop(PR_EMAIL_ADDRESS_W, L"bob@");
+	ECContentRestriction c_subj(FL_SUBSTRING | FL_IGNORECASE, PR_SUBJECT_W, &subj, ECRestriction::Cheap);
+	ECContentRestriction c_subj_case(FL_SUBSTRING, PR_SUBJECT_W, &subj, ECRestriction::Cheap);
+	ECContentRestriction c_needle(FL_SUBSTRING, PR_BODY_W, &needle, ECRestriction::Cheap);
+	ECContentRestriction c_hay(FL_SUBSTRING, PR_BODY_W, &hay, ECRestriction::Cheap);
+	ECPropertyRestriction p_high(RELOP_EQ, PR_IMPORTANCE, &high, ECRestriction::Cheap);
+	ECBitMaskRestriction b_read(BMR_NEZ, PR_MESSAGE_FLAGS, MSGFLAG_READ);
+	ECBitMaskRestriction b_unsent(BMR_NEZ, PR_MESSAGE_FLAGS, MSGFLAG_UNSENT);
+	ECExistRestriction e_body(PR_BODY_W), e_sens(PR_SENSITIVITY);
+
+	int err = 0;
+	err += check("subject, ignorecase", c_subj, msg, locale, true);
+	err += check("subject, case", c_subj_case, msg, locale, false);
+	err += check("body substring", c_needle, msg, locale, true);
+	err += check("body substring, absent", c_hay, msg, locale, false);
+	err += check("importance", p_high, msg, locale, true);
+	err += check("bitmask set", b_read, msg, locale, true);
+	err += check("bitmask unset", b_unsent, msg, locale, false);
+	err += check("exist, large", e_body, msg, locale, true);
+	err += check("exist, absent", e_sens, msg, locale, false);
+	err += check("and", ECAndRestriction(c_subj + c_needle + p_high), msg, locale, true);
+	err += check("and, shared leaf false", ECAndRestriction(c_needle + c_hay), msg, locale, false);
+	err += check("or", ECOrRestriction(b_unsent + e_sens + c_needle), msg, locale, true);
+	err += check("not", ECNotRestriction(c_hay), msg, locale, true);
+
+	/* RES_SUBRESTRICTION has no ECRestriction class */
+	memory_ptr<SRestriction> inner;
+	auto hr = ECContentRestriction(FL_SUBSTRING | FL_IGNORECASE, PR_EMAIL_ADDRESS_W, &bob,
+	          ECRestriction::Cheap).CreateMAPIRestriction(&~inner, ECRestriction::Cheap);
+	if (hr != hrSuccess)
+		throw KMAPIError(hr);
+	SRestriction sub;
+	sub.rt = RES_SUBRESTRICTION;
+	sub.res.resSub.ulSubObject = PR_MESSAGE_RECIPIENTS;
+	sub.res.resSub.lpRes = inner;
+	err += check("recipient", ECRawRestriction(&sub, ECRestriction::Cheap), msg, locale, true);
+	err += check("recipient, negated", ECNotRestriction(ECRawRestriction(&sub, ECRestriction::Cheap)), msg, locale, false);
+	return err;
+}
+
+int main()
+{
+	int err = 0;
+	try {
+		err = run();
+	} catch (const KMAPIError &e) {
+		fprintf(stderr, "Aborted because of exception: %s\n", e.what());
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, err == 0 ? "Overall success\n" : "Overall FAILURE\n");
+	return err == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,102 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/*
+ * Soft-deletes a folder that holds a message and checks that
+ * "kopano-dbadm store-size-check" agrees with the server's store size,
+ * i.e. does not count the contents of the deleted folder.
+ * Needs a running server, and kopano-dbadm with access to its database.
+ *
+ * Usage: storesize [path-to-kopano-dbadm [dbadm options...]]
+ */
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <kopano/platform.h>
+#include <kopano/ECTags.h>
+#include <kopano/MAPIErrors.h>
+#include <kopano/memory.hpp>
+#include <mapitags.h>
+#include <mapiutil.h>
+#include "tbi.hpp"
+
+using namespace KC;
+using namespace std::string_literals;
+
+static void fill_folder(IMAPIFolder *root, SBinary *eid, memory_ptr<SPropValue> &eid_prop)
+{
+	object_ptr<IMAPIFolder> folder;
+	auto hr = root->CreateFolder(FOLDER_GENERIC, reinterpret_cast<const TCHAR *>(L"storesize test"),
+	          nullptr, nullptr, MAPI_UNICODE | OPEN_IF_EXISTS, &~folder);
+	if (hr != hrSuccess)
+		throw KMAPIError(hr);
+	object_ptr<IMessage> msg;
+	hr = folder->CreateMessage(nullptr, 0, &~msg);
+	if (hr != hrSuccess)
+		throw KMAPIError(hr);
+	std::wstring body(20000, L'x');
+	SPropValue prop;
+	prop.ulPropTag = PR_BODY_W;
+	prop.Value.lpszW = const_cast<wchar_t *>(body.c_str());
+	hr = msg->SetProps(1, &prop, nullptr);
+	if (hr == hrSuccess)
+		hr = msg->SaveChanges(0);
+	if (hr == hrSuccess)
+		hr = HrGetOneProp(folder, PR_ENTRYID, &~eid_prop);
+	if (hr != hrSuccess)
+		throw KMAPIError(hr);
+	*eid = eid_prop->Value.bin;
+}
+
+static int run(int argc, char **argv)
+{
+	auto store = KSession().open_default_store();
+	memory_ptr<SPropValue> store_id, eid_prop;
+	auto hr = HrGetOneProp(store, PR_EC_HIERARCHYID, &~store_id);
+	if (hr != hrSuccess)
+		throw KMAPIError(hr);
+	auto root = store.open_root(MAPI_MODIFY);
+	SBinary eid;
+	fill_folder(root, &eid, eid_prop);
+	/* No DELETE_HARD_DELETE: the folder stays in the database, flagged */
+	hr = root->DeleteFolder(eid.cb, reinterpret_cast<const ENTRYID *>(eid.lpb),
+	     0, nullptr, DEL_FOLDERS | DEL_MESSAGES);
+	if (hr != hrSuccess)
+		throw KMAPIError(hr);
+
+	std::string cmd = argc > 1 ? argv[1] : "kopano-dbadm";
+	for (int i = 2; i < argc; ++i)
+		cmd += " "s + argv[i];
+	cmd += " store-size-check 2>&1";
+	auto fp = popen(cmd.c_str(), "r");
+	if (fp == nullptr) {
+		perror("popen");
+		return 1;
+	}
+	auto wrong = "store-size: store " + std::to_string(store_id->Value.ul) + " ";
+	char line[4096];
+	int err = 0;
+	while (fgets(line, sizeof(line), fp) != nullptr) {
+		if (strstr(line, wrong.c_str()) == nullptr)
+			continue;
+		fprintf(stderr, "kopano-dbadm disagrees with the server: %s", line);
+		err = 1;
+	}
+	if (pclose(fp) != 0) {
+		fprintf(stderr, "\"%s\" failed\n", cmd.c_str());
+		return 1;
+	}
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	int err = 0;
+	try {
+		err = run(argc, argv);
+	} catch (const KMAPIError &e) {
+		fprintf(stderr, "Aborted because of exception: %s\n", e.what());
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, err == 0 ? "Overall success\n" : "Overall FAILURE\n");
+	return err == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
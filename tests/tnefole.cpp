@@ -0,0 +1,146 @@
+/* SPDX-License-Identifier: AGPL-3.0-only */
+/*
+ * Decodes a TNEF stream with an OLE attachment that carries both
+ * attAttachData and a PR_ATTACH_DATA_OBJ property, and checks that the
+ * object survives (the two share a property id). Needs a running server.
+ */
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <kopano/platform.h>
+#include <kopano/MAPIErrors.h>
+#include <kopano/memory.hpp>
+#include <mapiguid.h>
+#include <mapitags.h>
+#include <mapiutil.h>
+#include "tbi.hpp"
+#include "../inetmapi/tnef.h"
+
+using namespace KC;
+
+static const char ole_payload[] = "OLE object payload";
+static const char rendering[] = "plain attachment data";
+
+static void put32(std::string &s, uint32_t v)
+{
+	v = cpu_to_le32(v);
+	s.append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+static void put16(std::string &s, uint16_t v)
+{
+	v = cpu_to_le16(v);
+	s.append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+static void block(std::string &s, unsigned char level, uint32_t id,
+    const std::string &data)
+{
+	uint16_t sum = 0;
+	s += level;
+	put32(s, id);
+	put32(s, data.size());
+	s += data;
+	for (auto c : data)
+		sum += static_cast<unsigned char>(c);
+	put16(s, sum);
+}
+
+static std::string ole_tnef()
+{
+	std::string tnef, rend, props;
+	put32(tnef, TNEF_SIGNATURE);
+	put16(tnef, 0);
+
+	AttachRendData rd{};
+	rd.usType = AttachTypeOle;
+	rd.ulPosition = 0xFFFFFFFF;
+	rend.assign(reinterpret_cast<const char *>(&rd), sizeof(rd));
+	block(tnef, 2, 0x00069002 /* attAttachRendData */, rend);
+	block(tnef, 2, 0x0006800F /* attAttachData */, rendering);
+
+	size_t len = strlen(ole_payload);
+	put32(props, 1);
+	put32(props, PR_ATTACH_DATA_OBJ);
+	put32(props, 1);
+	put32(props, sizeof(GUID) + len);
+	props.append(reinterpret_cast<const char *>(&IID_IStorage), sizeof(GUID));
+	props.append(ole_payload, len);
+	props.append((4 - (len & 3)) & 3, '\0');
+	block(tnef, 2, 0x00069005 /* attAttachment */, props);
+	return tnef;
+}
+
+static int run()
+{
+	auto msg = KSession().open_default_store().open_root(MAPI_MODIFY).create_message();
+	auto data = ole_tnef();
+	object_ptr<IStream> stream;
+	auto hr = CreateStreamOnHGlobal(nullptr, true, &~stream);
+	if (hr == hrSuccess)
+		hr = stream->Write(data.data(), data.size(), nullptr);
+	if (hr == hrSuccess)
+		hr = stream->Seek(large_int_zero, STREAM_SEEK_SET, nullptr);
+	if (hr != hrSuccess)
+		throw KMAPIError(hr);
+
+	ECTNEF tnef(TNEF_DECODE, msg, stream);
+	hr = tnef.ExtractProps(TNEF_PROP_EXCLUDE, nullptr);
+	if (hr == hrSuccess)
+		hr = tnef.Finish();
+	if (hr != hrSuccess)
+		throw KMAPIError(hr);
+
+	object_ptr<IMAPITable> table;
+	rowset_ptr rows;
+	static constexpr SizedSPropTagArray(2, cols) = {2, {PR_ATTACH_NUM, PR_ATTACH_METHOD}};
+	hr = msg->GetAttachmentTable(0, &~table);
+	if (hr == hrSuccess)
+		hr = HrQueryAllRows(table, cols, nullptr, nullptr, 0, &~rows);
+	if (hr != hrSuccess)
+		throw KMAPIError(hr);
+	if (rows->cRows != 1) {
+		fprintf(stderr, "expected 1 attachment, got %u\n", rows->cRows);
+		return 1;
+	}
+	if (rows[0].lpProps[1].ulPropTag != PR_ATTACH_METHOD ||
+	    rows[0].lpProps[1].Value.ul != ATTACH_OLE) {
+		fprintf(stderr, "attachment is not ATTACH_OLE\n");
+		return 1;
+	}
+
+	object_ptr<IAttach> att;
+	object_ptr<IStream> obj;
+	hr = msg->OpenAttach(rows[0].lpProps[0].Value.ul, &IID_IAttachment, 0, &~att);
+	if (hr != hrSuccess)
+		throw KMAPIError(hr);
+	hr = att->OpenProperty(PR_ATTACH_DATA_OBJ, &IID_IStream, 0, 0, &~obj);
+	if (hr != hrSuccess) {
+		fprintf(stderr, "PR_ATTACH_DATA_OBJ: %s\n", GetMAPIErrorMessage(hr));
+		return 1;
+	}
+	char buf[64];
+	ULONG read = 0;
+	hr = obj->Read(buf, sizeof(buf), &read);
+	if (hr != hrSuccess)
+		throw KMAPIError(hr);
+	if (read != strlen(ole_payload) || memcmp(buf, ole_payload, read) != 0) {
+		fprintf(stderr, "PR_ATTACH_DATA_OBJ has %u bytes of other data\n", read);
+		return 1;
+	}
+	return 0;
+}
+
+int main()
+{
+	int err = 0;
+	try {
+		err = run();
+	} catch (const KMAPIError &e) {
+		fprintf(stderr, "Aborted because of exception: %s\n", e.what());
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, err == 0 ? "Overall success\n" : "Overall FAILURE\n");
+	return err == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}